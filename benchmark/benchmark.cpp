@@ -0,0 +1,245 @@
+// Microbenchmarks of the CPU-side hot paths on synthetic inputs. Runs without a GPU.
+// Heap allocations per iteration are reported next to the timings; the resize and upscale
+// cases write into preallocated outputs and are expected to allocate nothing.
+//
+// Usage: benchmark [output.json] [iterations]
+
+#include "../nanosam/allocation_counter.h"
+#include "../nanosam/bitmask.h"
+#include "../nanosam/contours.h"
+#include "../nanosam/image_ops.h"
+#include "../utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+struct Resolution
+{
+    string name;
+    int width;
+    int height;
+};
+
+struct BenchmarkResult
+{
+    string name;
+    string resolution;
+    int width;
+    int height;
+    int iterations;
+    double mean;                        //!< Milliseconds
+    double median;
+    double min;
+    double p90;
+    double allocations;                 //!< Heap allocations per iteration
+};
+
+static const Resolution RESOLUTIONS[] = {
+    { "720p", 1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "4k", 3840, 2160 },
+    { "12mp", 4000, 3000 },
+};
+
+static const int MODEL_INPUT_SIZE = 1024;
+static const int MASK_SIZE = 256;
+
+// Synthetic decoder output: an elliptic blob with a hole, as logits
+static Mat makeLowResLogits(int imageWidth, int imageHeight)
+{
+    Mat logits(MASK_SIZE, MASK_SIZE, CV_32FC1, Scalar(-10.0f));
+    Rect crop = letterboxMaskRect(MASK_SIZE, MASK_SIZE, imageWidth, imageHeight);
+
+    const float cx = crop.width * 0.5f, cy = crop.height * 0.5f;
+    const float rx = crop.width * 0.35f, ry = crop.height * 0.3f;
+    for (int y = 0; y < crop.height; y++)
+    {
+        float* row = logits.ptr<float>(y);
+        for (int x = 0; x < crop.width; x++)
+        {
+            float dx = (x - cx) / rx, dy = (y - cy) / ry;
+            float r = sqrt(dx * dx + dy * dy);
+            row[x] = 10.0f * (1.0f - r);
+            if (r < 0.2f) row[x] = -5.0f;
+        }
+    }
+    return logits;
+}
+
+static BenchmarkResult run(const string& name, const Resolution& resolution, int iterations, const function<void()>& body)
+{
+    // Warm up caches and lazily allocated buffers
+    body();
+
+    vector<double> times;
+    times.reserve(iterations);
+    uint64_t allocations = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        uint64_t allocationsBefore = getThreadAllocations();
+        auto start = chrono::steady_clock::now();
+        body();
+        auto end = chrono::steady_clock::now();
+        allocations += getThreadAllocations() - allocationsBefore;
+        times.push_back(chrono::duration<double, milli>(end - start).count());
+    }
+    sort(times.begin(), times.end());
+
+    BenchmarkResult result;
+    result.name = name;
+    result.resolution = resolution.name;
+    result.width = resolution.width;
+    result.height = resolution.height;
+    result.iterations = iterations;
+    result.mean = 0;
+    for (double t : times) result.mean += t;
+    result.mean /= times.size();
+    result.median = times[times.size() / 2];
+    result.min = times.front();
+    result.p90 = times[min(times.size() - 1, (size_t)(times.size() * 0.9))];
+    result.allocations = (double)allocations / iterations;
+
+    cout << name << " @ " << resolution.name << ": mean " << result.mean << " ms, median " << result.median << " ms, "
+        << result.allocations << " allocations" << endl;
+    return result;
+}
+
+static string toJson(const vector<BenchmarkResult>& results)
+{
+    ostringstream out;
+    out << "{\"benchmarks\":[";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        auto& r = results[i];
+        out << (i ? "," : "") << "\n  {\"name\":\"" << r.name << "\",\"resolution\":\"" << r.resolution
+            << "\",\"width\":" << r.width << ",\"height\":" << r.height << ",\"iterations\":" << r.iterations
+            << ",\"mean_ms\":" << r.mean << ",\"median_ms\":" << r.median << ",\"min_ms\":" << r.min
+            << ",\"p90_ms\":" << r.p90 << ",\"allocations\":" << r.allocations << "}";
+    }
+    out << "\n]}\n";
+    return out.str();
+}
+
+int main(int argc, char** argv)
+{
+    string outputPath = argc > 1 ? argv[1] : "benchmark.json";
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+
+    installMatAllocationCounter();
+
+    vector<BenchmarkResult> results;
+    vector<float> normalized(3 * MODEL_INPUT_SIZE * MODEL_INPUT_SIZE);
+    vector<uchar> letterboxedBytes(3 * MODEL_INPUT_SIZE * MODEL_INPUT_SIZE);
+    vector<float> pointData(2 * 2);
+    vector<Point> points = { Point(100, 100), Point(750, 759) };
+
+    for (auto& resolution : RESOLUTIONS)
+    {
+        Mat image(resolution.height, resolution.width, CV_8UC3);
+        randu(image, Scalar::all(0), Scalar::all(255));
+
+        Mat lowResLogits = makeLowResLogits(resolution.width, resolution.height);
+        Mat mask = lowResLogits.clone();
+        upscaleMask(mask, resolution.width, resolution.height);
+        Mat letterboxed = resizeImage(image, MODEL_INPUT_SIZE, MODEL_INPUT_SIZE);
+        Mat resized, upscaled, converted;
+
+        // Camera frame with the Y plane followed by the interleaved UV plane
+        Mat nv12(resolution.height * 3 / 2, resolution.width, CV_8UC1);
+        randu(nv12, Scalar::all(0), Scalar::all(255));
+        ImageFrame nv12Frame = ImageFrame::nv12(nv12.data, nv12.step, nv12.ptr<uchar>(resolution.height), nv12.step,
+            resolution.width, resolution.height);
+
+        results.push_back(run("resize_image", resolution, iterations, [&]()
+        {
+            resizeImage(image, resized, MODEL_INPUT_SIZE, MODEL_INPUT_SIZE);
+        }));
+
+        results.push_back(run("normalize_image", resolution, iterations, [&]()
+        {
+            normalizeImage(letterboxed, normalized.data());
+        }));
+
+        results.push_back(run("letterbox_normalize_bgr", resolution, iterations, [&]()
+        {
+            letterboxNormalize(ImageFrame::fromMat(image), normalized.data(), MODEL_INPUT_SIZE, MODEL_INPUT_SIZE);
+        }));
+
+        // The path before fused color conversion: full-frame cvtColor, resize, normalize
+        results.push_back(run("convert_resize_normalize_nv12", resolution, iterations, [&]()
+        {
+            cvtColor(nv12, converted, COLOR_YUV2BGR_NV12);
+            resizeImage(converted, resized, MODEL_INPUT_SIZE, MODEL_INPUT_SIZE);
+            normalizeImage(resized, normalized.data());
+        }));
+
+        results.push_back(run("letterbox_normalize_nv12", resolution, iterations, [&]()
+        {
+            letterboxNormalize(nv12Frame, normalized.data(), MODEL_INPUT_SIZE, MODEL_INPUT_SIZE);
+        }));
+
+        // Input of encoders that normalize in the model
+        results.push_back(run("letterbox_image_bgr", resolution, iterations, [&]()
+        {
+            letterboxImage(ImageFrame::fromMat(image), letterboxedBytes.data(), MODEL_INPUT_SIZE, MODEL_INPUT_SIZE);
+        }));
+
+        results.push_back(run("letterbox_image_nv12", resolution, iterations, [&]()
+        {
+            letterboxImage(nv12Frame, letterboxedBytes.data(), MODEL_INPUT_SIZE, MODEL_INPUT_SIZE);
+        }));
+
+        results.push_back(run("prepare_decoder_input", resolution, iterations, [&]()
+        {
+            scalePoints(points, pointData.data(), resolution.width, resolution.height, MODEL_INPUT_SIZE, MODEL_INPUT_SIZE);
+        }));
+
+        results.push_back(run("upscale_mask", resolution, iterations, [&]()
+        {
+            upscaleMask(lowResLogits, upscaled, resolution.width, resolution.height);
+        }));
+
+        results.push_back(run("upscale_mask_nearest", resolution, iterations, [&]()
+        {
+            upscaleMaskNearest(lowResLogits, upscaled, resolution.width, resolution.height);
+        }));
+
+        results.push_back(run("overlay", resolution, iterations, [&]()
+        {
+            Mat canvas = image.clone();
+            overlay(canvas, mask);
+        }));
+
+        results.push_back(run("threshold_mask", resolution, iterations, [&]()
+        {
+            Mat binary = mask <= 0;
+        }));
+
+        results.push_back(run("bitmask_from_mask", resolution, iterations, [&]()
+        {
+            BitMask bits = BitMask::fromLogits(mask);
+        }));
+
+        results.push_back(run("find_contours_full_res", resolution, iterations, [&]()
+        {
+            vector<vector<Point>> contours;
+            vector<Vec4i> hierarchy;
+            findContours(mask <= 0, contours, hierarchy, RETR_TREE, CHAIN_APPROX_NONE);
+        }));
+
+        results.push_back(run("extract_contours_low_res", resolution, iterations, [&]()
+        {
+            auto contours = extractContours(lowResLogits, resolution.width, resolution.height, 1.0);
+        }));
+    }
+
+    ofstream file(outputPath);
+    file << toJson(results);
+    cout << "Results written to " << outputPath << endl;
+
+    return 0;
+}
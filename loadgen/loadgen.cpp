@@ -0,0 +1,750 @@
+// Open-loop load generator for sizing deployments.
+//
+// Requests arrive as a Poisson process at the target rate regardless of how fast they complete.
+// Latency is measured from the scheduled arrival time rather than from when a worker picks the
+// request up, so time spent queueing behind slow requests is counted (coordinated omission
+// correction). Service time, measured from the start of processing, is reported alongside.
+//
+// Each worker owns a NanoSam instance and one image session. A request either prompts a new
+// image or re-prompts the session's current image, which hits the embedding cache.
+// With --sessions the workers share a pool of image sessions instead, and requests are sent to a
+// random worker or routed by image with a RequestRouter, whose locality hit rate is reported
+// together with the re-prompts that had to encode their image again.
+// In scheduler mode the instances serve a priority scheduler instead, and interactive requests
+// compete with batch jobs; latencies are then reported per class, together with shed requests.
+//
+// Usage: loadgen [options]
+//   --rate <requests/s>          Target arrival rate (default 20)
+//   --duration <s>               Measured duration (default 30)
+//   --warmup <s>                 Excluded from the results (default 2)
+//   --reprompt <ratio>           Share of same-image re-prompts (default 0.8)
+//   --workers <n>                NanoSam instances serving requests (default 1, one per core in CPU throughput mode)
+//   --width <px> --height <px>   Image size (default 1920 x 1080)
+//   --format <fmt>               Pixel format of the frames: bgr, gray, nv12 or yuyv (default bgr)
+//   --encoder <path> --decoder <path>   Engines or ONNX models, otherwise the simulated backend is used
+//   --encoder-latency <dist>     Simulated encoder latency in ms (default lognormal:12,3)
+//   --decoder-latency <dist>     Simulated decoder latency in ms (default lognormal:3,0.5)
+//   --shared-device              Simulated workers share one device, like a single GPU
+//   --cache <n>                  Embedding cache capacity per worker (default 4)
+//   --seed <n>                   Random seed (default 1)
+//   --output <path>              Write the results as JSON
+//   --check-allocations          Fail if a request after the warm-up allocates on the heap; not with
+//                                --scheduler, whose queued requests allocate, or --record
+//   --scheduler                  Serve through a RequestScheduler shared by all workers instead of per-worker queues
+//   --batch <ratio>              Share of requests sent as batch jobs on new images in scheduler mode (default 0)
+//   --deadline <ms>              Deadline of interactive requests from their arrival in scheduler mode (default none)
+//   --record <path>              Log the calls of all workers as a session for the replay tool; logging
+//                                allocates, so it does not go with --check-allocations
+//   --memory-budget <MB>         Host plus device memory budget per worker, see NanoSam::setMemoryBudget
+//   --sessions <n>               Image sessions shared by all workers instead of one per worker
+//   --route <policy>             Worker of a request with --sessions: random or hash (default random)
+//   --load-factor <f>            Requests in flight a worker takes relative to the mean when routing by hash (default 1.25)
+//   --kernel-profile <path>      CPU kernel profile to load, autotuned for the image size and saved there first if missing
+//   --byte-input                 Encoders take 8-bit input and normalize in the model, built so from ONNX models
+//   --cpu <mode>                 Run the ONNX models on the CPU backend: latency runs one request at a time on all
+//                                cores, throughput runs single-threaded workers pinned to one core each
+//
+// Distributions: const:<ms>, uniform:<min>,<max>, normal:<mean>,<stddev>, lognormal:<mean>,<stddev>
+
+#include "../nanosam/allocation_counter.h"
+#include "../nanosam/autotuner.h"
+#include "../nanosam/cpu_backend.h"
+#include "../nanosam/nanosam.h"
+#include "../nanosam/metrics.h"
+#include "../nanosam/request_router.h"
+#include "../nanosam/request_scheduler.h"
+#include "../nanosam/session_log.h"
+#include "../nanosam/simulated_backend.h"
+#include "../nanosam/trt_backend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+struct LoadOptions
+{
+    double rate = 20;
+    double duration = 30;
+    double warmup = 2;
+    double repromptRatio = 0.8;
+    int workers = 0;                    //!< 0 for the default of the backend
+    int width = 1920;
+    int height = 1080;
+    PixelFormat format = PixelFormat::BGR;
+    string encoderPath;
+    string decoderPath;
+    LatencyDistribution encoderLatency = LatencyDistribution(LatencyDistribution::LogNormal, 12, 3);
+    LatencyDistribution decoderLatency = LatencyDistribution(LatencyDistribution::LogNormal, 3, 0.5);
+    bool sharedDevice = false;
+    int cacheCapacity = 4;
+    uint64_t seed = 1;
+    string outputPath;
+    bool checkAllocations = false;
+    bool useScheduler = false;
+    double batchRatio = 0;
+    double deadline = 0;                //!< Milliseconds, 0 for none
+    string recordPath;
+    shared_ptr<SessionRecorder> recorder;
+    double memoryBudget = 0;            //!< Megabytes, 0 for none
+    int sessions = 0;                   //!< Shared image sessions, 0 for one per worker
+    bool routeByHash = false;
+    double loadFactor = 1.25;
+    shared_ptr<RequestRouter> router;
+    string kernelProfilePath;
+    bool byteInput = false;
+    bool useCpu = false;
+    CpuExecutionMode cpuMode = CpuExecutionMode::Latency;
+    vector<CpuPlacement> cpuPlacements; //!< Per worker
+};
+
+struct LoadRequest
+{
+    uint64_t id;
+    uint64_t imageId;                   //!< Stamped into the pixels to make the image
+    bool isReprompt;
+    Priority priority;
+    Point point;
+    int64_t scheduled;                  //!< Nanoseconds on the steady clock
+};
+
+struct LoadResult
+{
+    bool isReprompt;
+    bool isEncoded;                     //!< The embeddings were not cached on the worker
+    Priority priority;
+    RequestStatus status;
+    int64_t scheduled;
+    int64_t started;
+    int64_t completed;
+    uint64_t allocations;               //!< Heap allocations inside predict
+};
+
+struct LatencySummary
+{
+    size_t count;
+    double mean;                        //!< Milliseconds
+    double p50;
+    double p95;
+    double p99;
+    double p999;
+    double max;
+};
+
+// Unbounded queue, so the arrival process never waits for the workers
+class RequestQueue
+{
+
+public:
+
+    void push(const LoadRequest& request)
+    {
+        {
+            lock_guard<mutex> lock(mMutex);
+            mRequests.push_back(request);
+            mMaxDepth = max(mMaxDepth, mRequests.size());
+        }
+        mCondition.notify_one();
+    }
+
+    bool pop(LoadRequest& request)
+    {
+        unique_lock<mutex> lock(mMutex);
+        mCondition.wait(lock, [this]() { return !mRequests.empty() || mIsClosed; });
+        if (mRequests.empty()) return false;
+
+        request = mRequests.front();
+        mRequests.pop_front();
+        return true;
+    }
+
+    void close()
+    {
+        {
+            lock_guard<mutex> lock(mMutex);
+            mIsClosed = true;
+        }
+        mCondition.notify_all();
+    }
+
+    size_t getMaxDepth()
+    {
+        lock_guard<mutex> lock(mMutex);
+        return mMaxDepth;
+    }
+
+private:
+
+    mutex mMutex;
+    condition_variable mCondition;
+    deque<LoadRequest> mRequests;
+    size_t mMaxDepth = 0;
+    bool mIsClosed = false;
+};
+
+static bool parseFormat(const string& text, PixelFormat& format)
+{
+    if (text == "bgr") format = PixelFormat::BGR;
+    else if (text == "gray") format = PixelFormat::Gray;
+    else if (text == "nv12") format = PixelFormat::NV12;
+    else if (text == "yuyv") format = PixelFormat::YUYV;
+    else return false;
+    return true;
+}
+
+static bool parseArguments(int argc, char** argv, LoadOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        auto value = [&]() { return string(argv[++i]); };
+
+        if (arg == "--shared-device") options.sharedDevice = true;
+        else if (arg == "--check-allocations") options.checkAllocations = true;
+        else if (arg == "--scheduler") options.useScheduler = true;
+        else if (arg == "--byte-input") options.byteInput = true;
+        else if (!hasValue) return false;
+        else if (arg == "--rate") options.rate = stod(value());
+        else if (arg == "--duration") options.duration = stod(value());
+        else if (arg == "--warmup") options.warmup = stod(value());
+        else if (arg == "--reprompt") options.repromptRatio = stod(value());
+        else if (arg == "--workers") options.workers = stoi(value());
+        else if (arg == "--width") options.width = stoi(value());
+        else if (arg == "--height") options.height = stoi(value());
+        else if (arg == "--format") { if (!parseFormat(value(), options.format)) return false; }
+        else if (arg == "--encoder") options.encoderPath = value();
+        else if (arg == "--decoder") options.decoderPath = value();
+        else if (arg == "--encoder-latency") { if (!LatencyDistribution::parse(value(), options.encoderLatency)) return false; }
+        else if (arg == "--decoder-latency") { if (!LatencyDistribution::parse(value(), options.decoderLatency)) return false; }
+        else if (arg == "--cache") options.cacheCapacity = stoi(value());
+        else if (arg == "--seed") options.seed = stoull(value());
+        else if (arg == "--output") options.outputPath = value();
+        else if (arg == "--batch") options.batchRatio = stod(value());
+        else if (arg == "--deadline") options.deadline = stod(value());
+        else if (arg == "--record") options.recordPath = value();
+        else if (arg == "--memory-budget") options.memoryBudget = stod(value());
+        else if (arg == "--sessions") options.sessions = stoi(value());
+        else if (arg == "--route")
+        {
+            string policy = value();
+            if (policy != "random" && policy != "hash") return false;
+            options.routeByHash = policy == "hash";
+        }
+        else if (arg == "--load-factor") options.loadFactor = stod(value());
+        else if (arg == "--kernel-profile") options.kernelProfilePath = value();
+        else if (arg == "--cpu")
+        {
+            if (!parseCpuExecutionMode(value(), options.cpuMode)) return false;
+            options.useCpu = true;
+        }
+        else return false;
+    }
+
+    bool isYuv = options.format == PixelFormat::NV12 || options.format == PixelFormat::YUYV;
+    if (isYuv && (options.width % 2 || options.height % 2)) return false;
+
+    return options.rate > 0 && options.duration > 0 && options.workers >= 0 && !(options.useCpu && options.encoderPath.empty()) &&
+        options.repromptRatio >= 0 && options.repromptRatio <= 1 && options.batchRatio >= 0 && options.batchRatio <= 1 &&
+        options.sessions >= 0 && !(options.sessions > 0 && options.useScheduler) && options.loadFactor >= 1 &&
+        !(options.checkAllocations && (options.useScheduler || !options.recordPath.empty())) &&
+        options.encoderPath.empty() == options.decoderPath.empty();
+}
+
+static LatencySummary summarize(vector<double> latencies)
+{
+    LatencySummary summary = {};
+    summary.count = latencies.size();
+    if (latencies.empty()) return summary;
+
+    sort(latencies.begin(), latencies.end());
+    for (double latency : latencies) summary.mean += latency;
+    summary.mean /= latencies.size();
+
+    // Nearest rank
+    auto quantile = [&](double q)
+    {
+        size_t rank = (size_t)ceil(q * latencies.size());
+        return latencies[min(latencies.size(), max<size_t>(rank, 1)) - 1];
+    };
+    summary.p50 = quantile(0.5);
+    summary.p95 = quantile(0.95);
+    summary.p99 = quantile(0.99);
+    summary.p999 = quantile(0.999);
+    summary.max = latencies.back();
+    return summary;
+}
+
+static string toJson(const LatencySummary& s)
+{
+    ostringstream out;
+    out << "{\"count\":" << s.count << ",\"mean_ms\":" << s.mean << ",\"p50_ms\":" << s.p50 << ",\"p95_ms\":" << s.p95
+        << ",\"p99_ms\":" << s.p99 << ",\"p999_ms\":" << s.p999 << ",\"max_ms\":" << s.max << "}";
+    return out.str();
+}
+
+static void printSummary(const string& name, const LatencySummary& s)
+{
+    cout << "  " << name << ": n=" << s.count << " mean " << s.mean << " ms, p50 " << s.p50 << " ms, p95 " << s.p95
+        << " ms, p99 " << s.p99 << " ms, p99.9 " << s.p999 << " ms, max " << s.max << " ms" << endl;
+}
+
+static shared_ptr<NanoSam> makeNanoSam(int index, const LoadOptions& options, shared_ptr<mutex> device)
+{
+    shared_ptr<NanoSam> nanosam;
+    if (options.encoderPath.empty())
+    {
+        SimulatedBackendOptions backendOptions;
+        backendOptions.encoderLatency = options.encoderLatency;
+        backendOptions.decoderLatency = options.decoderLatency;
+        backendOptions.device = device;
+        backendOptions.seed = options.seed + index;
+        backendOptions.geometry.isByteInput = options.byteInput;
+        nanosam = make_shared<NanoSam>(make_shared<SimulatedBackend>(backendOptions));
+    }
+    else if (options.useCpu)
+    {
+        CPUBackendOptions backendOptions;
+        backendOptions.placement = options.cpuPlacements[index];
+        auto backend = make_shared<CPUBackend>(vector<string>{ options.encoderPath }, options.decoderPath, backendOptions);
+        nanosam = make_shared<NanoSam>(backend);
+        if (!backend->isPinned()) cerr << "The CPU backend of worker " << index << " could not be pinned to its cores" << endl;
+    }
+    else
+    {
+        nanosam = make_shared<NanoSam>(make_shared<TRTBackend>(vector<string>{ options.encoderPath }, options.decoderPath, 1, options.byteInput));
+    }
+    nanosam->setEmbeddingCacheCapacity(options.cacheCapacity);
+    nanosam->setRecorder(options.recorder, index);
+    try
+    {
+        nanosam->waitUntilReady();
+    }
+    catch (const exception& e)
+    {
+        cerr << "Cannot load the models: " << e.what() << endl;
+        exit(1);
+    }
+    if (index == 0 && !options.encoderPath.empty()) printLoadReports(nanosam->getLoadReports(), cout);
+
+    if (options.memoryBudget > 0)
+    {
+        const bool isMet = nanosam->setMemoryBudget((size_t)(options.memoryBudget * 1e6));
+        if (index == 0)
+        {
+            cout << "Memory budget " << options.memoryBudget << " MB " << (isMet ? "met" : "exceeded")
+                << ", embedding cache capacity " << nanosam->getEmbeddingCacheCapacity() << endl;
+            for (auto& usage : nanosam->getMemoryUsage())
+                cout << "  " << usage.component << ": host " << usage.hostBytes / 1e6 << " MB, device " << usage.deviceBytes / 1e6 << " MB" << endl;
+        }
+    }
+    return nanosam;
+}
+
+static void runWorker(int index, const LoadOptions& options, shared_ptr<mutex> device, RequestQueue& queue,
+    vector<LoadResult>& results, atomic<int>& readyWorkers)
+{
+    Tracer::setThreadName("loadgen worker " + to_string(index));
+
+    // On the cores of the CPU backend, so the embeddings are allocated on its node
+    if (options.useCpu && !pinCurrentThread(options.cpuPlacements[index].cores))
+        cerr << "Worker " << index << " could not be pinned to its cores" << endl;
+
+    shared_ptr<NanoSam> nanosam = makeNanoSam(index, options, device);
+
+    // The session frame; a new image is made by stamping the request id into its pixels
+    const int w = options.width, h = options.height;
+    Mat image;
+    ImageFrame frame;
+    switch (options.format)
+    {
+    case PixelFormat::BGR:
+        image.create(h, w, CV_8UC3);
+        frame = ImageFrame::fromMat(image);
+        break;
+    case PixelFormat::Gray:
+        image.create(h, w, CV_8UC1);
+        frame = ImageFrame::fromMat(image);
+        break;
+    case PixelFormat::NV12:
+        image.create(h * 3 / 2, w, CV_8UC1);
+        frame = ImageFrame::nv12(image.data, image.step, image.ptr<uchar>(h), image.step, w, h);
+        break;
+    case PixelFormat::YUYV:
+        image.create(h, w, CV_8UC2);
+        frame = ImageFrame::yuyv(image.data, w, h, image.step);
+        break;
+    }
+    randu(image, Scalar::all(0), Scalar::all(255));
+    uint64_t imageId = 0;
+
+    // Prompt and output buffers are reused, so a steady-state predict does not allocate
+    vector<Point> points(1);
+    vector<float> labels = { 1.0f };
+    Mat mask;
+    results.reserve(1 << 16);
+
+    readyWorkers++;
+
+    LoadRequest request;
+    while (queue.pop(request))
+    {
+        LoadResult result;
+        result.isReprompt = request.isReprompt && (options.sessions > 0 || imageId != 0);
+        result.priority = request.priority;
+        result.status = RequestStatus::Completed;
+        result.scheduled = request.scheduled;
+        result.started = Tracer::now();
+
+        // Shared sessions re-prompt images other workers may have seen last
+        if ((options.sessions > 0 || !result.isReprompt) && request.imageId != imageId)
+        {
+            imageId = request.imageId;
+            memcpy(image.ptr<uchar>(0), &imageId, sizeof(imageId));
+        }
+        points[0] = request.point;
+        uint64_t allocationsBefore = getThreadAllocations();
+        nanosam->predict(frame, points, labels, mask);
+        result.isEncoded = nanosam->wasImageEncoded();
+        result.allocations = getThreadAllocations() - allocationsBefore;
+        METRICS_COUNT(Counter::Allocations, result.allocations);
+
+        result.completed = Tracer::now();
+        if (options.router) options.router->complete(index);
+        results.push_back(result);
+    }
+}
+
+// Scheduler mode: all instances serve one RequestScheduler and requests carry their images
+class ScheduledLoad
+{
+
+public:
+
+    ScheduledLoad(const LoadOptions& options, shared_ptr<mutex> device) : mOptions(options)
+    {
+        vector<shared_ptr<NanoSam>> instances;
+        for (int i = 0; i < options.workers; i++)
+            instances.push_back(makeNanoSam(i, options, device));
+        mScheduler.reset(new RequestScheduler(instances));
+
+        mBaseImage.create(options.height, options.width, CV_8UC3);
+        randu(mBaseImage, Scalar::all(0), Scalar::all(255));
+    }
+
+    void submit(const LoadRequest& request)
+    {
+        // Each class has its own image session, batch jobs always bring a new image
+        Mat& session = mSessionImages[(int)request.priority];
+        const bool isReprompt = request.isReprompt && !session.empty();
+        if (!isReprompt)
+        {
+            session = mBaseImage.clone();
+            memcpy(session.ptr<uchar>(0), &request.imageId, sizeof(request.imageId));
+        }
+
+        SchedulerRequest scheduled;
+        scheduled.image = session;
+        scheduled.points = { request.point };
+        scheduled.labels = { 1.0f };
+        scheduled.priority = request.priority;
+        if (request.priority == Priority::Interactive && mOptions.deadline > 0)
+            scheduled.deadline = chrono::steady_clock::time_point(chrono::duration_cast<chrono::steady_clock::duration>(
+                chrono::nanoseconds(request.scheduled + (int64_t)(mOptions.deadline * 1e6))));
+
+        {
+            lock_guard<mutex> lock(mMutex);
+            mSubmitted++;
+        }
+
+        LoadResult result = {};
+        result.isReprompt = isReprompt;
+        result.isEncoded = !isReprompt;
+        result.priority = request.priority;
+        result.scheduled = request.scheduled;
+        mScheduler->submit(scheduled, [this, result](const SchedulerResult& scheduledResult) mutable
+        {
+            result.completed = Tracer::now();
+            result.started = result.completed - (int64_t)(scheduledResult.serviceTime * 1e6);
+            result.status = scheduledResult.status;
+            {
+                lock_guard<mutex> lock(mMutex);
+                mResults.push_back(result);
+            }
+            mCondition.notify_all();
+        });
+    }
+
+    // Wait for every submitted request to complete
+    vector<LoadResult> finish()
+    {
+        unique_lock<mutex> lock(mMutex);
+        mCondition.wait(lock, [this]() { return mResults.size() == mSubmitted; });
+        return mResults;
+    }
+
+    string statsToJson() const { return mScheduler->statsToJson(); }
+
+private:
+
+    const LoadOptions& mOptions;
+    unique_ptr<RequestScheduler> mScheduler;
+    Mat mBaseImage;
+    Mat mSessionImages[NUM_PRIORITIES];
+
+    mutex mMutex;
+    condition_variable mCondition;
+    vector<LoadResult> mResults;
+    size_t mSubmitted = 0;
+};
+
+int main(int argc, char** argv)
+{
+    LoadOptions options;
+    if (!parseArguments(argc, argv, options))
+    {
+        cerr << "Invalid arguments, see the usage at the top of loadgen.cpp" << endl;
+        return 1;
+    }
+
+    installMatAllocationCounter();
+
+    if (options.useCpu)
+    {
+        options.cpuPlacements = planCpuWorkers(CpuTopology::detect(), options.cpuMode,
+            options.cpuMode == CpuExecutionMode::Throughput ? options.workers : 1);
+        options.workers = (int)options.cpuPlacements.size();
+    }
+    if (options.workers == 0) options.workers = 1;
+
+    bool isSimulated = options.encoderPath.empty();
+    cout << "Backend: " << (isSimulated ? "simulated, encoder " + options.encoderLatency.toString() +
+        " ms, decoder " + options.decoderLatency.toString() + " ms" : options.encoderPath + ", " + options.decoderPath) << endl;
+    if (options.useCpu)
+    {
+        if (options.cpuMode == CpuExecutionMode::Latency)
+            cout << "CPU execution: latency mode, 1 worker of " << options.cpuPlacements[0].threads << " threads" << endl;
+        else
+            cout << "CPU execution: throughput mode, " << options.workers << " single-threaded workers pinned to one core each" << endl;
+    }
+    cout << "Offered load: " << options.rate << " requests/s for " << options.duration << " s, "
+        << options.repromptRatio * 100 << "% re-prompts, " << options.workers << " workers" << endl;
+    if (options.sessions > 0)
+        cout << "Sessions: " << options.sessions << " shared, routed " << (options.routeByHash ? "by image hash" : "at random") << endl;
+    if (options.useScheduler)
+        cout << "Scheduler: " << options.batchRatio * 100 << "% batch jobs, interactive deadline "
+            << (options.deadline > 0 ? to_string(options.deadline) + " ms" : string("none")) << endl;
+
+    if (!options.kernelProfilePath.empty())
+    {
+        AutotuneOptions tuneOptions;
+        tuneOptions.imageSizes = { Size(options.width, options.height) };
+        KernelConfig config = Autotuner::loadOrTune(options.kernelProfilePath, tuneOptions);
+        cout << "CPU kernels: resize " << resizeKernelName(config.resize) << ", letterbox " << resizeKernelName(config.letterbox)
+            << ", upscale " << upscaleKernelName(config.upscale) << ", " << config.threads << " threads" << endl;
+    }
+
+    if (!options.recordPath.empty())
+    {
+        options.recorder = make_shared<SessionRecorder>(options.recordPath);
+        if (!options.recorder->isOpen())
+        {
+            cerr << "Cannot write session log " << options.recordPath << endl;
+            return 1;
+        }
+        cout << "Recording the session to " << options.recordPath << endl;
+    }
+
+    if (options.routeByHash && options.sessions > 0)
+    {
+        options.router = make_shared<RequestRouter>(options.loadFactor);
+        for (int i = 0; i < options.workers; i++) options.router->addInstance(i);
+    }
+
+    shared_ptr<mutex> device = options.sharedDevice ? make_shared<mutex>() : nullptr;
+    vector<RequestQueue> queues(options.workers);
+    vector<vector<LoadResult>> results(options.workers);
+    atomic<int> readyWorkers(0);
+
+    vector<thread> workers;
+    unique_ptr<ScheduledLoad> scheduledLoad;
+    if (options.useScheduler)
+    {
+        scheduledLoad.reset(new ScheduledLoad(options, device));
+    }
+    else
+    {
+        for (int i = 0; i < options.workers; i++)
+            workers.emplace_back(runWorker, i, cref(options), device, ref(queues[i]), ref(results[i]), ref(readyWorkers));
+
+        while (readyWorkers < options.workers)
+            this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    // Poisson arrivals on a fixed schedule; the generator never waits for completions
+    mt19937_64 generator(options.seed);
+    exponential_distribution<double> interarrival(options.rate);
+    uniform_real_distribution<double> uniform(0, 1);
+    // Worker picks draw from a generator of their own, so the workload is the same for every --route
+    mt19937_64 workerGenerator(options.seed ^ 0x9E3779B97F4A7C15ull);
+    uniform_int_distribution<int> pickWorker(0, options.workers - 1);
+    uniform_int_distribution<int> pickSession(0, max(options.sessions, 1) - 1);
+    vector<uint64_t> sessionImages(options.sessions, 0);
+
+    const int64_t start = Tracer::now();
+    const int64_t measureStart = start + (int64_t)(options.warmup * 1e9);
+    const int64_t end = measureStart + (int64_t)(options.duration * 1e9);
+
+    double offset = 0;
+    for (uint64_t id = 1;; id++)
+    {
+        offset += interarrival(generator);
+        int64_t scheduled = start + (int64_t)(offset * 1e9);
+        if (scheduled >= end) break;
+
+        LoadRequest request;
+        request.id = id;
+        request.isReprompt = uniform(generator) < options.repromptRatio;
+        request.priority = Priority::Interactive;
+        if (options.useScheduler && uniform(generator) < options.batchRatio)
+        {
+            request.priority = Priority::Batch;
+            request.isReprompt = false;
+        }
+        request.point = Point((int)(uniform(generator) * options.width), (int)(uniform(generator) * options.height));
+        request.scheduled = scheduled;
+        request.imageId = id;
+        if (options.sessions > 0)
+        {
+            uint64_t& session = sessionImages[pickSession(generator)];
+            if (request.isReprompt && session != 0) request.imageId = session;
+            else request.isReprompt = false;
+            session = request.imageId;
+        }
+
+        this_thread::sleep_until(chrono::steady_clock::time_point(chrono::duration_cast<chrono::steady_clock::duration>(chrono::nanoseconds(scheduled))));
+        if (scheduledLoad)
+            scheduledLoad->submit(request);
+        else if (options.router)
+            queues[options.router->route(request.imageId)].push(request);
+        else
+            queues[pickWorker(workerGenerator)].push(request);
+    }
+
+    if (scheduledLoad) results[0] = scheduledLoad->finish();
+    for (auto& queue : queues) queue.close();
+    for (auto& worker : workers) worker.join();
+
+    // Results within the measurement window
+    vector<double> response, service, newImageResponse, repromptResponse;
+    vector<double> classResponse[NUM_PRIORITIES];
+    size_t classDropped[NUM_PRIORITIES] = {};
+    int64_t lastCompleted = measureStart;
+    uint64_t allocations = 0;
+    size_t allocatingRequests = 0;
+    size_t reprompts = 0, repromptsEncoded = 0;
+    for (auto& workerResults : results)
+    {
+        for (auto& result : workerResults)
+        {
+            if (result.scheduled < measureStart) continue;
+            if (result.status != RequestStatus::Completed)
+            {
+                classDropped[(int)result.priority]++;
+                continue;
+            }
+
+            double responseMs = (result.completed - result.scheduled) * 1e-6;
+            response.push_back(responseMs);
+            service.push_back((result.completed - result.started) * 1e-6);
+            (result.isReprompt ? repromptResponse : newImageResponse).push_back(responseMs);
+            classResponse[(int)result.priority].push_back(responseMs);
+            lastCompleted = max(lastCompleted, result.completed);
+            allocations += result.allocations;
+            allocatingRequests += result.allocations > 0;
+            reprompts += result.isReprompt;
+            repromptsEncoded += result.isReprompt && result.isEncoded;
+        }
+    }
+
+    size_t maxQueueDepth = 0;
+    for (auto& queue : queues) maxQueueDepth = max(maxQueueDepth, queue.getMaxDepth());
+
+    double throughput = response.size() / max((lastCompleted - measureStart) * 1e-9, 1e-9);
+    LatencySummary responseSummary = summarize(response);
+    LatencySummary serviceSummary = summarize(service);
+    LatencySummary newImageSummary = summarize(newImageResponse);
+    LatencySummary repromptSummary = summarize(repromptResponse);
+
+    cout << "Completed " << response.size() << " requests, throughput " << throughput << " requests/s, max queue depth "
+        << maxQueueDepth << endl;
+    cout << "Response time (from scheduled arrival, corrected for coordinated omission):" << endl;
+    printSummary("all", responseSummary);
+    printSummary("new image", newImageSummary);
+    printSummary("re-prompt", repromptSummary);
+    if (scheduledLoad)
+    {
+        for (int i = 0; i < NUM_PRIORITIES; i++)
+        {
+            if (classResponse[i].empty() && classDropped[i] == 0) continue;
+            printSummary(RequestScheduler::priorityName((Priority)i), summarize(classResponse[i]));
+            cout << "    rejected or shed: " << classDropped[i] << endl;
+        }
+    }
+    cout << "Service time (from start of processing, uncorrected):" << endl;
+    printSummary("all", serviceSummary);
+    cout << "Re-prompts encoded again: " << repromptsEncoded << " of " << reprompts << endl;
+    if (options.router)
+    {
+        RouterStats routerStats = options.router->getStats();
+        cout << "Router: locality hit rate " << routerStats.hitRate * 100 << "%, " << routerStats.overflows << " of "
+            << routerStats.routed << " requests passed on from a full worker" << endl;
+    }
+    if (options.useScheduler) cout << "Heap allocations: not measured in scheduler mode" << endl;
+    else cout << "Heap allocations after warm-up: " << allocations << " in " << allocatingRequests << " requests" << endl;
+
+    if (!options.outputPath.empty())
+    {
+        ofstream file(options.outputPath);
+        file << "{\"offered_rate\":" << options.rate << ",\"duration_s\":" << options.duration
+            << ",\"reprompt_ratio\":" << options.repromptRatio << ",\"workers\":" << options.workers
+            << ",\"simulated\":" << (isSimulated ? "true" : "false")
+            << ",\"cpu_mode\":" << (options.useCpu ? "\"" + string(cpuExecutionModeName(options.cpuMode)) + "\"" : string("null"))
+            << ",\"throughput\":" << throughput << ",\"max_queue_depth\":" << maxQueueDepth
+            << ",\"allocations\":" << (options.useScheduler ? string("null") : to_string(allocations))
+            << ",\"allocating_requests\":" << (options.useScheduler ? string("null") : to_string(allocatingRequests))
+            << ",\"sessions\":" << options.sessions << ",\"reprompts\":" << reprompts << ",\"reprompts_encoded\":" << repromptsEncoded
+            << ",\n \"response\":" << toJson(responseSummary)
+            << ",\n \"response_new_image\":" << toJson(newImageSummary)
+            << ",\n \"response_reprompt\":" << toJson(repromptSummary)
+            << ",\n \"service\":" << toJson(serviceSummary);
+        if (options.router) file << ",\n \"router\":" << options.router->statsToJson();
+        if (scheduledLoad)
+        {
+            file << ",\n \"scheduler\":" << scheduledLoad->statsToJson();
+            for (int i = 0; i < NUM_PRIORITIES; i++)
+                file << ",\n \"response_" << RequestScheduler::priorityName((Priority)i) << "\":" << toJson(summarize(classResponse[i]));
+        }
+        file
+#ifdef ENABLE_METRICS
+            << ",\n \"metrics\":" << Metrics::toJson()
+#endif
+            << "}\n";
+        cout << "Results written to " << options.outputPath << endl;
+    }
+
+    if (options.checkAllocations && allocatingRequests > 0)
+    {
+        cerr << "Steady-state requests allocated on the heap" << endl;
+        return 2;
+    }
+
+    return 0;
+}
@@ -1,10 +1,15 @@
 #include "nanosam/nanosam.h"
+#include "nanosam/interactive_segmenter.h"
 #include "utils.h"
 
 void segmentClickedPoint(NanoSam& nanosam, string imagePath) {
 
     auto image = imread(imagePath);
 
+    // Inference runs on a worker thread, encoding starts right away
+    InteractiveSegmenter segmenter(nanosam);
+    segmenter.setImage(image);
+
     // Create a window to display the image
     cv::namedWindow("Image");
 
@@ -14,6 +19,9 @@ void segmentClickedPoint(NanoSam& nanosam, string imagePath) {
     cv::Mat clonedImage = image.clone();
     int clickCount = 0;
 
+    // Set the callback function for mouse events on the displayed cloned image
+    cv::setMouseCallback("Image", onMouse, &pointData);
+
     // Loop until Esc key is pressed
     while (true)
     {
@@ -24,18 +32,20 @@ void segmentClickedPoint(NanoSam& nanosam, string imagePath) {
         {
             pointData.clicked = false; // Reset clicked flag            
 
-            auto mask = nanosam.predict(image, { pointData.point }, { 1.0f });
+            // Only the newest click is decoded, older pending clicks are dropped
+            segmenter.prompt({ pointData.point }, { 1.0f });
 
             cv::circle(clonedImage, pointData.point, 5, cv::Scalar(0, 0, 255), -1);
+        }
 
+        SegmentationResult result;
+        if (segmenter.poll(result))
+        {
             if (clickCount >= CITYSCAPES_COLORS.size()) clickCount = 0;
-            overlay(image, mask, CITYSCAPES_COLORS[clickCount * 9]);
+            overlay(image, result.mask, CITYSCAPES_COLORS[clickCount * 9]);
             clickCount++;
         }
 
-        // Set the callback function for mouse events on the displayed cloned image
-        cv::setMouseCallback("Image", onMouse, &pointData);
-
         // Check for Esc key press
         char key = cv::waitKey(1);
         if (key == 27) // ASCII code for Esc key
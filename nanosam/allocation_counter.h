@@ -0,0 +1,141 @@
+#pragma once
+
+// Counts the heap allocations of the calling thread, made through the global operator new or
+// the default cv::Mat allocator, to check that steady-state paths do not allocate.
+// Replaces the global allocation functions: include it from exactly one translation unit of a
+// tool, never from the library.
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <opencv2/opencv.hpp>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+static thread_local uint64_t tHeapAllocations = 0;
+
+void* operator new(size_t size)
+{
+    tHeapAllocations++;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    free(p);
+}
+
+// Aligned allocations, e.g. the blocks of the scratch arenas
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    tHeapAllocations++;
+#ifdef _WIN32
+    if (void* p = _aligned_malloc(size ? size : 1, (size_t)alignment)) return p;
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, (size_t)alignment, size ? size : 1) == 0) return p;
+#endif
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+void operator delete[](void* p, std::align_val_t alignment) noexcept
+{
+    operator delete(p, alignment);
+}
+
+void operator delete(void* p, size_t, std::align_val_t alignment) noexcept
+{
+    operator delete(p, alignment);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t alignment) noexcept
+{
+    operator delete(p, alignment);
+}
+
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 2)
+typedef cv::AccessFlag MatAccessFlag;
+#else
+typedef int MatAccessFlag;
+#endif
+
+// OpenCV allocates Mat data with its own allocator, which a DLL build does not route through
+// the replaced operator new
+class CountingMatAllocator : public cv::MatAllocator
+{
+
+public:
+
+    CountingMatAllocator() : mBase(cv::Mat::getStdAllocator()) {}
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+        MatAccessFlag flags, cv::UMatUsageFlags usageFlags) const override
+    {
+        if (!data) tHeapAllocations++;
+        return mBase->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+
+    bool allocate(cv::UMatData* data, MatAccessFlag flags, cv::UMatUsageFlags usageFlags) const override
+    {
+        return mBase->allocate(data, flags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData* data) const override
+    {
+        mBase->deallocate(data);
+    }
+
+private:
+
+    cv::MatAllocator* mBase;
+};
+
+// Heap allocations of the calling thread so far
+uint64_t getThreadAllocations()
+{
+    return tHeapAllocations;
+}
+
+// Count cv::Mat allocations as well, call before any Mat is created
+void installMatAllocationCounter()
+{
+    static CountingMatAllocator allocator;
+    cv::Mat::setDefaultAllocator(&allocator);
+}
@@ -0,0 +1,107 @@
+#include "arena.h"
+#include "metrics.h"
+
+#include <atomic>
+#include <cassert>
+#include <new>
+
+static const size_t MAX_OVERFLOW_BLOCKS = 64;
+
+static atomic<size_t> gTotalBytes(0);
+static atomic<size_t> gCapacityLimit(SIZE_MAX);
+
+// Through the aligned global operator new, so the allocation counter of a tool sees the blocks
+static void* allocateBlock(size_t bytes)
+{
+    return ::operator new(max<size_t>(bytes, 1), align_val_t(64));
+}
+
+static void freeBlock(void* block)
+{
+    ::operator delete(block, align_val_t(64));
+}
+
+ScratchArena::ScratchArena()
+    : mBuffer(nullptr), mCapacity(0), mOffset(0), mPeak(0), mOverflowBytes(0)
+{
+    mOverflow.reserve(MAX_OVERFLOW_BLOCKS);
+}
+
+ScratchArena::~ScratchArena()
+{
+    for (auto& block : mOverflow)
+        freeBlock(block.first);
+    if (mBuffer) freeBlock(mBuffer);
+    gTotalBytes -= mCapacity + mOverflowBytes;
+}
+
+size_t ScratchArena::getTotalBytes()
+{
+    return gTotalBytes.load(memory_order_relaxed);
+}
+
+void ScratchArena::setCapacityLimit(size_t bytes)
+{
+    gCapacityLimit = bytes;
+}
+
+size_t ScratchArena::getCapacityLimit()
+{
+    return gCapacityLimit.load(memory_order_relaxed);
+}
+
+ScratchArena& ScratchArena::local()
+{
+    static thread_local ScratchArena arena;
+    return arena;
+}
+
+void* ScratchArena::allocate(size_t bytes, size_t alignment)
+{
+    assert(alignment <= 64 && (alignment & (alignment - 1)) == 0);
+
+    size_t start = (mOffset + alignment - 1) & ~(alignment - 1);
+    if (start + bytes <= mCapacity)
+    {
+        mOffset = start + bytes;
+        mPeak = max(mPeak, mOffset + mOverflowBytes);
+        return mBuffer + start;
+    }
+
+    void* block = allocateBlock(bytes);
+    // Counted with the alignment padding it needs once it moves into the buffer
+    mOverflow.push_back({ block, bytes + alignment });
+    mOverflowBytes += bytes + alignment;
+    gTotalBytes += bytes + alignment;
+    mPeak = max(mPeak, mOffset + mOverflowBytes);
+    return block;
+}
+
+Mat ScratchArena::mat(int rows, int cols, int type)
+{
+    return Mat(rows, cols, type, allocate(rows * cols * CV_ELEM_SIZE(type)));
+}
+
+void ScratchArena::reset(const ArenaMark& mark)
+{
+    while (mOverflow.size() > mark.numOverflow)
+    {
+        freeBlock(mOverflow.back().first);
+        mOverflowBytes -= mOverflow.back().second;
+        gTotalBytes -= mOverflow.back().second;
+        mOverflow.pop_back();
+    }
+    mOffset = mark.offset;
+
+    // Grow once empty, so the next request of the same size fits without overflow blocks,
+    // or shrink to a lowered limit
+    const size_t limit = getCapacityLimit() & ~(size_t)4095;
+    if (mOffset == 0 && mOverflow.empty() && ((mPeak > mCapacity && mCapacity < limit) || mCapacity > limit))
+    {
+        if (mBuffer) freeBlock(mBuffer);
+        gTotalBytes -= mCapacity;
+        mCapacity = min((mPeak + 4095) & ~(size_t)4095, limit);
+        mBuffer = mCapacity ? (uchar*)allocateBlock(mCapacity) : nullptr;
+        gTotalBytes += mCapacity;
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+struct ArenaMark
+{
+    size_t offset;
+    size_t numOverflow;
+};
+
+// Per-thread bump allocator for request scratch memory. Allocations are released together when
+// the enclosing ArenaScope ends, so steady-state requests reuse the same memory without touching
+// the heap. Requests that do not fit are served from separate blocks until the arena is empty
+// again, at which point it grows to the peak usage, up to the capacity limit.
+class ScratchArena
+{
+
+public:
+
+    ScratchArena();
+
+    ~ScratchArena();
+
+    // The arena of the calling thread
+    static ScratchArena& local();
+
+    // Alignment up to 64 bytes
+    void* allocate(size_t bytes, size_t alignment = 64);
+
+    template <typename T>
+    T* allocate(size_t count) { return (T*)allocate(count * sizeof(T)); }
+
+    // Mat header over arena memory, valid until the enclosing scope ends
+    Mat mat(int rows, int cols, int type);
+
+    ArenaMark mark() const { return { mOffset, mOverflow.size() }; }
+
+    void reset(const ArenaMark& mark);
+
+    size_t getCapacity() const { return mCapacity; }
+
+    // Bytes held by the arenas of all threads, including overflow blocks in use
+    static size_t getTotalBytes();
+
+    // Arenas keep at most this many bytes between requests. Requests needing more are served
+    // from overflow blocks, released when their scope ends. Unlimited by default. The limit is
+    // process-wide, like the arenas, which serve every instance that runs on their thread.
+    static void setCapacityLimit(size_t bytes);
+
+    static size_t getCapacityLimit();
+
+private:
+
+    uchar* mBuffer;
+    size_t mCapacity;
+    size_t mOffset;
+    size_t mPeak;                       //!< Highest usage including overflow blocks
+    size_t mOverflowBytes;
+    vector<pair<void*, size_t>> mOverflow;
+};
+
+// Releases everything allocated from the arena during its lifetime
+class ArenaScope
+{
+
+public:
+
+    ArenaScope(ScratchArena& arena = ScratchArena::local()) : mArena(arena), mMark(arena.mark()) {}
+
+    ~ArenaScope() { mArena.reset(mMark); }
+
+    ScratchArena& arena() { return mArena; }
+
+private:
+
+    ScratchArena& mArena;
+    ArenaMark mMark;
+};
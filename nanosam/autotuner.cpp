@@ -0,0 +1,304 @@
+#include "autotuner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <sstream>
+#include <thread>
+
+// ImageNet std of the R, G and B planes, to turn normalized differences back into pixel levels
+static const float kPlaneStd[3] = { 0.229f, 0.224f, 0.225f };
+
+struct TuningCase
+{
+    Mat image;
+    Mat logits;
+    Mat resized;                        //!< Reference outputs
+    vector<float> input;
+    Mat mask;
+};
+
+// Median of the timed runs in milliseconds, after one warm-up run
+static double timeKernel(int iterations, const function<void()>& body)
+{
+    body();
+
+    vector<double> times;
+    for (int i = 0; i < iterations; i++)
+    {
+        auto start = chrono::steady_clock::now();
+        body();
+        times.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    }
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static double maxLevelError(const Mat& a, const Mat& b)
+{
+    double error = 0;
+    for (int y = 0; y < a.rows; y++)
+    {
+        const uchar* rowA = a.ptr<uchar>(y);
+        const uchar* rowB = b.ptr<uchar>(y);
+        for (int x = 0; x < a.cols * a.channels(); x++)
+            error = max(error, (double)abs(rowA[x] - rowB[x]));
+    }
+    return error;
+}
+
+static double maxLevelError(const vector<float>& a, const vector<float>& b)
+{
+    const size_t planeSize = a.size() / 3;
+    double error = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        error = max(error, (double)abs(a[i] - b[i]) * 255 * kPlaneStd[i / planeSize]);
+    return error;
+}
+
+static double maskDisagreement(const Mat& a, const Mat& b)
+{
+    size_t differing = 0;
+    for (int y = 0; y < a.rows; y++)
+    {
+        const float* rowA = a.ptr<float>(y);
+        const float* rowB = b.ptr<float>(y);
+        for (int x = 0; x < a.cols; x++)
+            differing += (rowA[x] > 0) != (rowB[x] > 0);
+    }
+    return (double)differing / max((size_t)a.total(), (size_t)1);
+}
+
+// Smooth synthetic inputs, like photos and decoder logits rather than noise
+static TuningCase makeCase(Size imageSize, const AutotuneOptions& options)
+{
+    TuningCase tuningCase;
+    RNG rng((uint64)imageSize.area());
+
+    Mat coarse(max(imageSize.height / 16, 2), max(imageSize.width / 16, 2), CV_8UC3);
+    rng.fill(coarse, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+    resize(coarse, tuningCase.image, imageSize, 0, 0, INTER_LINEAR);
+
+    Mat coarseLogits(16, 16, CV_32FC1);
+    rng.fill(coarseLogits, RNG::UNIFORM, Scalar::all(-10), Scalar::all(10));
+    resize(coarseLogits, tuningCase.logits, options.maskSize, 0, 0, INTER_LINEAR);
+    return tuningCase;
+}
+
+AutotuneResult Autotuner::run(const AutotuneOptions& options)
+{
+    const KernelConfig previous = getKernelConfig();
+
+    AutotuneResult result;
+    result.host = hostSignature();
+    result.imageSizes = options.imageSizes;
+
+    vector<int> threadCounts = options.threadCounts;
+    if (threadCounts.empty())
+    {
+        const int hardwareThreads = max((int)thread::hardware_concurrency(), 1);
+        for (int threads = 1; threads < hardwareThreads; threads *= 2) threadCounts.push_back(threads);
+        threadCounts.push_back(hardwareThreads);
+    }
+
+    const int inputWidth = options.inputSize.width, inputHeight = options.inputSize.height;
+    const size_t inputFloats = 3 * (size_t)inputWidth * inputHeight;
+
+    // Reference outputs of the default kernels
+    setKernelConfig(KernelConfig());
+    vector<TuningCase> cases;
+    for (Size imageSize : options.imageSizes)
+    {
+        TuningCase tuningCase = makeCase(imageSize, options);
+        resizeImage(tuningCase.image, tuningCase.resized, inputWidth, inputHeight);
+        tuningCase.input.resize(inputFloats);
+        letterboxNormalize(ImageFrame::fromMat(tuningCase.image), tuningCase.input.data(), inputWidth, inputHeight);
+        upscaleMask(tuningCase.logits, tuningCase.mask, imageSize.width, imageSize.height);
+        cases.push_back(std::move(tuningCase));
+    }
+
+    const ResizeKernel resizeKernels[] = { ResizeKernel::Separable, ResizeKernel::OpenCV, ResizeKernel::OpenCVArea };
+    const UpscaleKernel upscaleKernels[] = { UpscaleKernel::Separable, UpscaleKernel::OpenCV, UpscaleKernel::Nearest };
+
+    Mat resized, mask;
+    vector<float> input(inputFloats);
+
+    // Times one variant on all sizes; check returns its error on one size
+    auto measure = [&](const string& kernel, const char* variant, const KernelConfig& config, double tolerance,
+        const function<void(TuningCase&)>& body, const function<double(TuningCase&)>& check)
+    {
+        setKernelConfig(config);
+        KernelTiming timing = { kernel, variant, config.threads, 0, 0, true };
+        for (auto& tuningCase : cases)
+        {
+            timing.milliseconds += timeKernel(options.iterations, [&]() { body(tuningCase); });
+            timing.error = max(timing.error, check(tuningCase));
+        }
+        timing.isAccepted = timing.error <= tolerance;
+        result.timings.push_back(timing);
+        return timing;
+    };
+
+    // The kernels run one after another in a request, so the thread count is shared and the
+    // one with the fastest sum of the best accepted variants wins
+    double bestTotal = numeric_limits<double>::max();
+    for (int threads : threadCounts)
+    {
+        KernelConfig best;
+        best.threads = threads;
+        double bestResize = numeric_limits<double>::max();
+        double bestLetterbox = numeric_limits<double>::max();
+        double bestUpscale = numeric_limits<double>::max();
+
+        for (ResizeKernel variant : resizeKernels)
+        {
+            KernelConfig config;
+            config.threads = threads;
+            config.resize = variant;
+            KernelTiming timing = measure("resize", resizeKernelName(variant), config, options.maxPixelError,
+                [&](TuningCase& c) { resizeImage(c.image, resized, inputWidth, inputHeight); },
+                [&](TuningCase& c) { resizeImage(c.image, resized, inputWidth, inputHeight); return maxLevelError(resized, c.resized); });
+            if (timing.isAccepted && timing.milliseconds < bestResize)
+            {
+                bestResize = timing.milliseconds;
+                best.resize = variant;
+            }
+
+            KernelConfig letterboxConfig;
+            letterboxConfig.threads = threads;
+            letterboxConfig.letterbox = variant;
+            timing = measure("letterbox", resizeKernelName(variant), letterboxConfig, options.maxPixelError,
+                [&](TuningCase& c) { letterboxNormalize(ImageFrame::fromMat(c.image), input.data(), inputWidth, inputHeight); },
+                [&](TuningCase& c)
+                {
+                    letterboxNormalize(ImageFrame::fromMat(c.image), input.data(), inputWidth, inputHeight);
+                    return maxLevelError(input, c.input);
+                });
+            if (timing.isAccepted && timing.milliseconds < bestLetterbox)
+            {
+                bestLetterbox = timing.milliseconds;
+                best.letterbox = variant;
+            }
+        }
+
+        for (UpscaleKernel variant : upscaleKernels)
+        {
+            KernelConfig config;
+            config.threads = threads;
+            config.upscale = variant;
+            KernelTiming timing = measure("upscale", upscaleKernelName(variant), config, options.maxMaskDisagreement,
+                [&](TuningCase& c) { upscaleMask(c.logits, mask, c.image.cols, c.image.rows); },
+                [&](TuningCase& c) { upscaleMask(c.logits, mask, c.image.cols, c.image.rows); return maskDisagreement(mask, c.mask); });
+            if (timing.isAccepted && timing.milliseconds < bestUpscale)
+            {
+                bestUpscale = timing.milliseconds;
+                best.upscale = variant;
+            }
+        }
+
+        // The reference variants always pass, so every kernel has an accepted one
+        const double total = bestResize + bestLetterbox + bestUpscale;
+        if (total < bestTotal)
+        {
+            bestTotal = total;
+            result.config = best;
+        }
+    }
+
+    setKernelConfig(previous);
+    return result;
+}
+
+static string sizesToString(const vector<Size>& sizes)
+{
+    ostringstream text;
+    for (size_t i = 0; i < sizes.size(); i++)
+        text << (i ? "," : "") << sizes[i].width << "x" << sizes[i].height;
+    return text.str();
+}
+
+bool Autotuner::save(const string& path, const AutotuneResult& result)
+{
+    FileStorage file(path, FileStorage::WRITE);
+    if (!file.isOpened()) return false;
+
+    file << "host" << result.host;
+    file << "image_sizes" << sizesToString(result.imageSizes);
+    file << "resize" << resizeKernelName(result.config.resize);
+    file << "letterbox" << resizeKernelName(result.config.letterbox);
+    file << "upscale" << upscaleKernelName(result.config.upscale);
+    file << "threads" << result.config.threads;
+
+    file << "timings" << "[";
+    for (auto& timing : result.timings)
+    {
+        file << "{" << "kernel" << timing.kernel << "variant" << timing.variant << "threads" << timing.threads
+            << "milliseconds" << timing.milliseconds << "error" << timing.error << "accepted" << (int)timing.isAccepted << "}";
+    }
+    file << "]";
+    file.release();
+    return true;
+}
+
+template <typename Kernel, size_t N>
+static bool parseKernel(const string& name, const Kernel (&kernels)[N], const char* (*kernelName)(Kernel), Kernel& kernel)
+{
+    for (Kernel candidate : kernels)
+    {
+        if (name == kernelName(candidate))
+        {
+            kernel = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Autotuner::load(const string& path, KernelConfig& config, const vector<Size>& imageSizes)
+{
+    static const ResizeKernel resizeKernels[] = { ResizeKernel::Separable, ResizeKernel::OpenCV, ResizeKernel::OpenCVArea };
+    static const UpscaleKernel upscaleKernels[] = { UpscaleKernel::Separable, UpscaleKernel::OpenCV, UpscaleKernel::Nearest };
+
+    try
+    {
+        FileStorage file(path, FileStorage::READ);
+        if (!file.isOpened() || (string)file["host"] != hostSignature()) return false;
+        if (!imageSizes.empty() && (string)file["image_sizes"] != sizesToString(imageSizes)) return false;
+
+        KernelConfig loaded;
+        loaded.threads = (int)file["threads"];
+        if (!parseKernel((string)file["resize"], resizeKernels, resizeKernelName, loaded.resize) ||
+            !parseKernel((string)file["letterbox"], resizeKernels, resizeKernelName, loaded.letterbox) ||
+            !parseKernel((string)file["upscale"], upscaleKernels, upscaleKernelName, loaded.upscale) || loaded.threads < 1)
+            return false;
+
+        config = loaded;
+        return true;
+    }
+    catch (const cv::Exception&)
+    {
+        // Malformed file
+        return false;
+    }
+}
+
+KernelConfig Autotuner::loadOrTune(const string& path, const AutotuneOptions& options)
+{
+    KernelConfig config;
+    if (!load(path, config, options.imageSizes))
+    {
+        AutotuneResult result = run(options);
+        config = result.config;
+        save(path, result);
+    }
+    setKernelConfig(config);
+    return config;
+}
+
+string Autotuner::hostSignature()
+{
+    ostringstream signature;
+    signature << getCPUFeaturesLine() << "; " << thread::hardware_concurrency() << " threads; OpenCV " << CV_VERSION;
+    return signature.str();
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "image_ops.h"
+
+using namespace std;
+
+struct AutotuneOptions
+{
+    vector<Size> imageSizes = { Size(1920, 1080) };     //!< Frame sizes the host will see
+    Size inputSize = Size(1024, 1024);  //!< Encoder input
+    Size maskSize = Size(256, 256);     //!< Decoder output
+    vector<int> threadCounts;           //!< Empty for 1, 2, 4, ... up to the hardware threads
+    int iterations = 10;                //!< Timed runs per variant and size, the median counts
+    double maxPixelError = 1.0;         //!< Resized and encoder input pixels, in 8-bit levels from the reference
+    double maxMaskDisagreement = 0.001; //!< Share of upscaled mask pixels on the other side of 0 than the reference
+};
+
+struct KernelTiming
+{
+    string kernel;                      //!< resize, letterbox or upscale
+    string variant;
+    int threads;
+    double milliseconds;                //!< Sum over the image sizes of the median times
+    double error;                       //!< Pixel levels, or the mask disagreement for upscale
+    bool isAccepted;                    //!< Within the tolerance of the reference
+};
+
+struct AutotuneResult
+{
+    KernelConfig config;
+    string host;
+    vector<Size> imageSizes;
+    vector<KernelTiming> timings;
+};
+
+// Picks the CPU kernel variants and thread count that are fastest on this host for the
+// resizeImage, letterboxNormalize and upscaleMask hot paths, by timing each variant on
+// synthetic inputs of the configured sizes. Variants whose output strays further from the
+// reference kernels than the tolerances are never picked.
+//
+// Tuning takes seconds, so the result is meant to be saved to a profile on the first start
+// and loaded on later ones. Profiles are cv::FileStorage files, YAML or JSON by extension,
+// and are ignored on hosts other than the one that wrote them.
+class Autotuner
+{
+
+public:
+
+    // Leaves the process wide kernel configuration as it was
+    static AutotuneResult run(const AutotuneOptions& options = AutotuneOptions());
+
+    static bool save(const string& path, const AutotuneResult& result);
+
+    // Fails if the file is missing or unreadable, was written on another host, or was tuned
+    // for other image sizes if any are given
+    static bool load(const string& path, KernelConfig& config, const vector<Size>& imageSizes = {});
+
+    // Applies the profile at path, tuning and saving it first if there is no valid one
+    static KernelConfig loadOrTune(const string& path, const AutotuneOptions& options = AutotuneOptions());
+
+    // CPU model features, hardware threads and OpenCV version
+    static string hostSignature();
+};
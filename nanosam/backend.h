@@ -0,0 +1,109 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+// Model dimensions read from the engine bindings
+struct ModelGeometry
+{
+    int inputWidth;                     //!< Encoder input width
+    int inputHeight;                    //!< Encoder input height
+    int embeddingDim;                   //!< Channels of the image embeddings
+    int featureWidth;                   //!< Width of the image embeddings
+    int featureHeight;                  //!< Height of the image embeddings
+    int maskWidth;                      //!< Width of the low resolution masks and the mask input
+    int maskHeight;                     //!< Height of the low resolution masks and the mask input
+    int numMasks;                       //!< Number of masks predicted by the decoder
+    bool isByteInput;                   //!< Encoder takes packed 8-bit BGR and normalizes it in the model
+
+    int embeddingSize() const { return embeddingDim * featureWidth * featureHeight; }
+};
+
+// Per-model load phase timings, in milliseconds
+struct ModelLoadReport
+{
+    string path;
+    double loadTime;                    //!< Engine build or deserialization
+    double initializeTime;              //!< Buffer and stream allocation
+    double warmupTime;                  //!< Warm-up inferences
+};
+
+inline double milliseconds(chrono::steady_clock::duration duration)
+{
+    return chrono::duration<double, milli>(duration).count();
+}
+
+// Milliseconds since start, for the load phase timings
+inline double elapsedMs(const chrono::steady_clock::time_point& start)
+{
+    return milliseconds(chrono::steady_clock::now() - start);
+}
+
+// One line per model, as the tools print them after loading
+inline void printLoadReports(const vector<ModelLoadReport>& reports, ostream& out)
+{
+    for (auto& report : reports)
+    {
+        out << "Loaded " << report.path << ": load " << report.loadTime << " ms, initialize "
+            << report.initializeTime << " ms, warm-up " << report.warmupTime << " ms" << endl;
+    }
+}
+
+// Bytes held by one component
+struct MemoryUsage
+{
+    string component;
+    size_t hostBytes;
+    size_t deviceBytes;
+};
+
+// Runs the encoder and decoder networks. NanoSam does the pre- and postprocessing
+// around it, so a backend only moves tensors in and out of the models.
+// A backend is used by one thread at a time.
+class InferenceBackend
+{
+
+public:
+
+    virtual ~InferenceBackend() {}
+
+    virtual int getNumEncoders() const = 0;
+
+    // Blocks until the backend is ready
+    virtual const ModelGeometry& getGeometry(int encoder) const = 0;
+
+    // Becomes ready when the models are loaded and warmed up, and holds the error if loading failed
+    virtual shared_future<void> getReadyFuture() const = 0;
+
+    virtual vector<ModelLoadReport> getLoadReports() const = 0;
+
+    // Host buffer of the encoder input, normalized planar RGB floats of the encoder input size.
+    // The preprocessing writes into it directly, so no intermediate image is copied.
+    // nullptr for encoders with isByteInput.
+    virtual float* getEncoderInput(int encoder) = 0;
+
+    // Host buffer of an encoder with isByteInput, letterboxed packed 8-bit BGR of the input size,
+    // nullptr for float encoders
+    virtual uchar* getEncoderByteInput(int encoder) = 0;
+
+    // Encode the contents of getEncoderInput(encoder) into embeddingSize() floats
+    virtual void encode(int encoder, float* features) = 0;
+
+    // Decode prompts in the PROMPT_COORD_SPACE against image embeddings
+    virtual void decode(const float* features, const float* pointCoords, const float* pointLabels, int numPoints,
+        const float* maskInput, const float* hasMaskInput, float* iouPredictions, float* lowResMasks) = 0;
+
+    // Host and device buffers of the models, blocks until the backend is ready
+    virtual vector<MemoryUsage> getMemoryUsage() const = 0;
+
+    // Drop host buffers that are not strictly needed, e.g. by sharing one encoder input between
+    // the encoder variants and copying outputs straight into caller memory
+    virtual void setLowMemory() = 0;
+};
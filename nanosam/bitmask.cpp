@@ -0,0 +1,388 @@
+#include "bitmask.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static inline int popcount64(uint64_t v)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    return (int)__popcnt64(v);
+#elif defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Index of the lowest set bit, v must be non-zero
+static inline int lowestBit(uint64_t v)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, v);
+    return (int)index;
+#elif defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    int index = 0;
+    while (!(v & 1)) { v >>= 1; index++; }
+    return index;
+#endif
+}
+
+// Index of the highest set bit, v must be non-zero
+static inline int highestBit(uint64_t v)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, v);
+    return (int)index;
+#elif defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(v);
+#else
+    int index = 0;
+    while (v >>= 1) index++;
+    return index;
+#endif
+}
+
+static inline int wordsForWidth(int width)
+{
+    return (width + 63) / 64;
+}
+
+BitMask::BitMask()
+    : mWidth(0), mHeight(0), mFirstRow(0), mNumRows(0), mFirstWord(0), mWordsPerRow(0)
+{
+}
+
+BitMask::BitMask(int width, int height)
+    : mWidth(width), mHeight(height), mFirstRow(0), mNumRows(0), mFirstWord(0), mWordsPerRow(0)
+{
+    allocate(0, height, 0, wordsForWidth(width));
+}
+
+void BitMask::allocate(int firstRow, int lastRow, int firstWord, int lastWord)
+{
+    mFirstRow = firstRow;
+    mNumRows = max(0, lastRow - firstRow);
+    mFirstWord = firstWord;
+    mWordsPerRow = max(0, lastWord - firstWord);
+    mWords.assign((size_t)mNumRows * mWordsPerRow, 0);
+}
+
+BitMask BitMask::fromLogits(const Mat& logits, float threshold, bool boundToContent)
+{
+    CV_Assert(logits.type() == CV_32FC1 || logits.type() == CV_8UC1);
+
+    const bool isFloat = logits.type() == CV_32FC1;
+    auto isSet = [&](int x, int y)
+    {
+        return isFloat ? logits.ptr<float>(y)[x] > threshold : logits.ptr<uchar>(y)[x] > threshold;
+    };
+
+    BitMask mask;
+    mask.mWidth = logits.cols;
+    mask.mHeight = logits.rows;
+
+    int minX = 0, maxX = logits.cols - 1, minY = 0, maxY = logits.rows - 1;
+    if (boundToContent)
+    {
+        minX = logits.cols; maxX = -1; minY = logits.rows; maxY = -1;
+        for (int y = 0; y < logits.rows; y++)
+        {
+            for (int x = 0; x < logits.cols; x++)
+            {
+                if (!isSet(x, y)) continue;
+                minX = min(minX, x); maxX = max(maxX, x);
+                minY = min(minY, y); maxY = max(maxY, y);
+            }
+        }
+        if (maxX < 0) return mask;
+    }
+
+    mask.allocate(minY, maxY + 1, minX / 64, maxX / 64 + 1);
+
+    for (int y = minY; y <= maxY; y++)
+    {
+        uint64_t* words = mask.row(y);
+        for (int x = minX; x <= maxX; x++)
+        {
+            if (isSet(x, y))
+                words[x / 64 - mask.mFirstWord] |= 1ULL << (x % 64);
+        }
+    }
+
+    return mask;
+}
+
+Mat BitMask::toMat() const
+{
+    Mat mask;
+    toMat(mask);
+    return mask;
+}
+
+void BitMask::toMat(Mat& mask) const
+{
+    mask.create(mHeight, mWidth, CV_8UC1);
+    mask.setTo(Scalar(0));
+
+    for (int y = mFirstRow; y < mFirstRow + mNumRows; y++)
+    {
+        const uint64_t* words = row(y);
+        uchar* pixels = mask.ptr<uchar>(y);
+        for (int w = 0; w < mWordsPerRow; w++)
+        {
+            uint64_t bits = words[w];
+            while (bits)
+            {
+                int x = (mFirstWord + w) * 64 + lowestBit(bits);
+                pixels[x] = 255;
+                bits &= bits - 1;
+            }
+        }
+    }
+}
+
+void BitMask::toRunLengths(vector<uint32_t>& runs) const
+{
+    runs.clear();
+
+    // Runs end where a pixel differs from its predecessor in row-major order
+    uint64_t runStart = 0;
+    bool value = false;
+    auto toggle = [&](uint64_t position)
+    {
+        runs.push_back((uint32_t)(position - runStart));
+        runStart = position;
+        value = !value;
+    };
+
+    const int endX = min(mWidth, (mFirstWord + mWordsPerRow) * 64);
+    for (int y = mFirstRow; y < mFirstRow + mNumRows; y++)
+    {
+        const uint64_t rowStart = (uint64_t)y * mWidth;
+        if (mFirstWord > 0 && value) toggle(rowStart);
+
+        const uint64_t* words = row(y);
+        for (int w = 0; w < mWordsPerRow; w++)
+        {
+            const int x0 = (mFirstWord + w) * 64;
+            const int n = min(64, mWidth - x0);
+            const uint64_t valid = n == 64 ? ~0ULL : (1ULL << n) - 1;
+            const uint64_t bits = words[w];
+
+            uint64_t changes = (bits ^ ((bits << 1) | (value ? 1 : 0))) & valid;
+            while (changes)
+            {
+                toggle(rowStart + x0 + lowestBit(changes));
+                changes &= changes - 1;
+            }
+        }
+
+        if (endX < mWidth && value) toggle(rowStart + endX);
+    }
+    const uint64_t end = (uint64_t)mWidth * mHeight;
+    const uint64_t storedEnd = (uint64_t)(mFirstRow + mNumRows) * mWidth;
+    if (value && storedEnd < end) toggle(storedEnd);
+
+    runs.push_back((uint32_t)(end - runStart));
+}
+
+Rect BitMask::extent() const
+{
+    int x0 = mFirstWord * 64;
+    int x1 = min(mWidth, (mFirstWord + mWordsPerRow) * 64);
+    return Rect(x0, mFirstRow, max(0, x1 - x0), mNumRows);
+}
+
+Rect BitMask::boundingBox() const
+{
+    int minX = mWidth, maxX = -1, minY = mHeight, maxY = -1;
+    for (int y = mFirstRow; y < mFirstRow + mNumRows; y++)
+    {
+        const uint64_t* words = row(y);
+        for (int w = 0; w < mWordsPerRow; w++)
+        {
+            if (!words[w]) continue;
+            minX = min(minX, (mFirstWord + w) * 64 + lowestBit(words[w]));
+            maxX = max(maxX, (mFirstWord + w) * 64 + highestBit(words[w]));
+            minY = min(minY, y);
+            maxY = y;
+        }
+    }
+
+    if (maxX < 0) return Rect();
+    return Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+}
+
+bool BitMask::get(int x, int y) const
+{
+    int w = x / 64 - mFirstWord;
+    if (y < mFirstRow || y >= mFirstRow + mNumRows || x < 0 || w < 0 || w >= mWordsPerRow) return false;
+    return (row(y)[w] >> (x % 64)) & 1;
+}
+
+void BitMask::set(int x, int y, bool value)
+{
+    CV_Assert(x >= 0 && y >= 0 && x < mWidth && y < mHeight);
+
+    int w = x / 64;
+    bool isStored = y >= mFirstRow && y < mFirstRow + mNumRows && w >= mFirstWord && w < mFirstWord + mWordsPerRow;
+    if (!isStored)
+    {
+        if (!value) return;
+
+        // Grow the stored extent to cover the pixel
+        BitMask grown;
+        grown.mWidth = mWidth;
+        grown.mHeight = mHeight;
+        if (mNumRows == 0 || mWordsPerRow == 0)
+            grown.allocate(y, y + 1, w, w + 1);
+        else
+            grown.allocate(min(y, mFirstRow), max(y + 1, mFirstRow + mNumRows),
+                min(w, mFirstWord), max(w + 1, mFirstWord + mWordsPerRow));
+
+        for (int r = mFirstRow; r < mFirstRow + mNumRows; r++)
+            memcpy(grown.row(r) + (mFirstWord - grown.mFirstWord), row(r), mWordsPerRow * sizeof(uint64_t));
+
+        *this = std::move(grown);
+    }
+
+    uint64_t& word = row(y)[w - mFirstWord];
+    if (value)
+        word |= 1ULL << (x % 64);
+    else
+        word &= ~(1ULL << (x % 64));
+}
+
+size_t BitMask::area() const
+{
+    size_t count = 0;
+    for (size_t i = 0; i < mWords.size(); i++)
+        count += popcount64(mWords[i]);
+    return count;
+}
+
+size_t BitMask::intersectionArea(const BitMask& a, const BitMask& b)
+{
+    CV_Assert(a.mWidth == b.mWidth && a.mHeight == b.mHeight);
+
+    int firstRow = max(a.mFirstRow, b.mFirstRow);
+    int lastRow = min(a.mFirstRow + a.mNumRows, b.mFirstRow + b.mNumRows);
+    int firstWord = max(a.mFirstWord, b.mFirstWord);
+    int lastWord = min(a.mFirstWord + a.mWordsPerRow, b.mFirstWord + b.mWordsPerRow);
+
+    size_t count = 0;
+    for (int y = firstRow; y < lastRow; y++)
+    {
+        const uint64_t* wa = a.row(y) + (firstWord - a.mFirstWord);
+        const uint64_t* wb = b.row(y) + (firstWord - b.mFirstWord);
+        for (int w = 0; w < lastWord - firstWord; w++)
+            count += popcount64(wa[w] & wb[w]);
+    }
+
+    return count;
+}
+
+size_t BitMask::unionArea(const BitMask& a, const BitMask& b)
+{
+    return a.area() + b.area() - intersectionArea(a, b);
+}
+
+float BitMask::iou(const BitMask& a, const BitMask& b)
+{
+    size_t intersection = intersectionArea(a, b);
+    size_t total = a.area() + b.area() - intersection;
+    return total > 0 ? (float)intersection / total : 0.0f;
+}
+
+// OR the row shifted by s pixels in both directions into dst
+static void shiftOrRow(const uint64_t* src, uint64_t* dst, int numWords, int s)
+{
+    const int q = s / 64;
+    const int t = s % 64;
+
+    for (int i = 0; i < numWords; i++)
+    {
+        uint64_t towardsHigher = 0, towardsLower = 0;
+
+        if (i - q >= 0)
+        {
+            towardsHigher = src[i - q] << t;
+            if (t && i - q - 1 >= 0) towardsHigher |= src[i - q - 1] >> (64 - t);
+        }
+        if (i + q < numWords)
+        {
+            towardsLower = src[i + q] >> t;
+            if (t && i + q + 1 < numWords) towardsLower |= src[i + q + 1] << (64 - t);
+        }
+
+        dst[i] = src[i] | towardsHigher | towardsLower;
+    }
+}
+
+BitMask BitMask::dilate(int radius) const
+{
+    if (radius <= 0 || mNumRows == 0 || mWordsPerRow == 0) return *this;
+
+    const int totalWords = wordsForWidth(mWidth);
+
+    BitMask result;
+    result.mWidth = mWidth;
+    result.mHeight = mHeight;
+    result.allocate(max(0, mFirstRow - radius), min(mHeight, mFirstRow + mNumRows + radius),
+        max(0, (mFirstWord * 64 - radius) / 64), min(totalWords, wordsForWidth((mFirstWord + mWordsPerRow) * 64 + radius)));
+
+    for (int y = mFirstRow; y < mFirstRow + mNumRows; y++)
+        memcpy(result.row(y) + (mFirstWord - result.mFirstWord), row(y), mWordsPerRow * sizeof(uint64_t));
+
+    // Pixels beyond the mask width in the last word column
+    const bool clipsLastWord = result.mFirstWord + result.mWordsPerRow == totalWords && mWidth % 64;
+    const uint64_t lastWordMask = clipsLastWord ? (1ULL << (mWidth % 64)) - 1 : ~0ULL;
+
+    // Horizontal pass, doubling the covered radius each step
+    vector<uint64_t> rowCopy(result.mWordsPerRow);
+    for (int y = result.mFirstRow; y < result.mFirstRow + result.mNumRows; y++)
+    {
+        uint64_t* words = result.row(y);
+        for (int covered = 0; covered < radius;)
+        {
+            int s = min(covered + 1, radius - covered);
+            rowCopy.assign(words, words + result.mWordsPerRow);
+            shiftOrRow(rowCopy.data(), words, result.mWordsPerRow, s);
+            covered += s;
+        }
+        words[result.mWordsPerRow - 1] &= lastWordMask;
+    }
+
+    // Vertical pass
+    vector<uint64_t> copy;
+    for (int covered = 0; covered < radius;)
+    {
+        int s = min(covered + 1, radius - covered);
+        copy = result.mWords;
+        for (int r = 0; r < result.mNumRows; r++)
+        {
+            uint64_t* dst = result.mWords.data() + (size_t)r * result.mWordsPerRow;
+            if (r - s >= 0)
+            {
+                const uint64_t* above = copy.data() + (size_t)(r - s) * result.mWordsPerRow;
+                for (int w = 0; w < result.mWordsPerRow; w++) dst[w] |= above[w];
+            }
+            if (r + s < result.mNumRows)
+            {
+                const uint64_t* below = copy.data() + (size_t)(r + s) * result.mWordsPerRow;
+                for (int w = 0; w < result.mWordsPerRow; w++) dst[w] |= below[w];
+            }
+        }
+        covered += s;
+    }
+
+    return result;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+// Binary mask packed into 64-bit words, one bit per pixel.
+// Only the rows and word columns of the bounding box are stored. Word columns are aligned
+// to the full mask width, so set operations between masks of the same size are plain word ANDs/ORs.
+class BitMask
+{
+
+public:
+
+    BitMask();
+
+    BitMask(int width, int height);
+
+    // Threshold a float mask (logits or upscaled mask) or a CV_8UC1 mask
+    static BitMask fromLogits(const Mat& logits, float threshold = 0.0f, bool boundToContent = true);
+
+    // Convert to a CV_8UC1 mask with 255 for foreground pixels
+    Mat toMat() const;
+
+    void toMat(Mat& mask) const;
+
+    // Lengths of alternating background and foreground runs in row-major order,
+    // starting with background, so the first run may be 0
+    void toRunLengths(vector<uint32_t>& runs) const;
+
+    int width() const { return mWidth; }
+
+    int height() const { return mHeight; }
+
+    // Stored region in pixels, word-aligned horizontally
+    Rect extent() const;
+
+    // Tight bounding box of the foreground pixels
+    Rect boundingBox() const;
+
+    bool empty() const { return area() == 0; }
+
+    bool get(int x, int y) const;
+
+    void set(int x, int y, bool value);
+
+    size_t area() const;
+
+    size_t memoryBytes() const { return mWords.size() * sizeof(uint64_t); }
+
+    // Square dilation by the given radius in pixels
+    BitMask dilate(int radius) const;
+
+    static size_t intersectionArea(const BitMask& a, const BitMask& b);
+
+    static size_t unionArea(const BitMask& a, const BitMask& b);
+
+    static float iou(const BitMask& a, const BitMask& b);
+
+private:
+
+    void allocate(int firstRow, int lastRow, int firstWord, int lastWord);
+
+    uint64_t* row(int y) { return mWords.data() + (size_t)(y - mFirstRow) * mWordsPerRow; }
+
+    const uint64_t* row(int y) const { return mWords.data() + (size_t)(y - mFirstRow) * mWordsPerRow; }
+
+    int mWidth;
+    int mHeight;
+    int mFirstRow;                      //!< First stored row
+    int mNumRows;                       //!< Number of stored rows
+    int mFirstWord;                     //!< First stored word column
+    int mWordsPerRow;                   //!< Number of stored word columns
+    vector<uint64_t> mWords;
+};
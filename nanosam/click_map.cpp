@@ -0,0 +1,81 @@
+#include "click_map.h"
+
+#include <algorithm>
+
+void ClickMap::reset(int gridSize, Size imageSize)
+{
+    mGridSize = gridSize;
+    mImageSize = imageSize;
+    mEntries.assign((size_t)gridSize * gridSize, ClickMapEntry());
+    mOrder.resize(mEntries.size());
+
+    for (int gy = 0; gy < gridSize; gy++)
+    {
+        for (int gx = 0; gx < gridSize; gx++)
+        {
+            ClickMapEntry& entry = mEntries[gy * gridSize + gx];
+            entry.point = Point((2 * gx + 1) * imageSize.width / (2 * gridSize), (2 * gy + 1) * imageSize.height / (2 * gridSize));
+            entry.iou = 0;
+            entry.isValid = false;
+        }
+    }
+
+    const Point center(imageSize.width / 2, imageSize.height / 2);
+    auto distance = [&](int i)
+    {
+        Point d = mEntries[i].point - center;
+        return (int64_t)d.x * d.x + (int64_t)d.y * d.y;
+    };
+    for (int i = 0; i < (int)mOrder.size(); i++) mOrder[i] = i;
+    stable_sort(mOrder.begin(), mOrder.end(), [&](int a, int b) { return distance(a) < distance(b); });
+}
+
+void ClickMap::store(int order, const Mat& lowResLogits, float iou)
+{
+    ClickMapEntry& entry = mEntries[mOrder[order]];
+    entry.mask = BitMask::fromLogits(lowResLogits);
+    entry.iou = iou;
+    entry.isValid = true;
+}
+
+const ClickMapEntry* ClickMap::find(Point point, double maxDistance) const
+{
+    if (mGridSize == 0) return nullptr;
+
+    // Only the cell of the point and its neighbours can hold the nearest candidate
+    const int cx = min(max(point.x * mGridSize / max(mImageSize.width, 1), 0), mGridSize - 1);
+    const int cy = min(max(point.y * mGridSize / max(mImageSize.height, 1), 0), mGridSize - 1);
+
+    const ClickMapEntry* nearest = nullptr;
+    double nearestDistance = maxDistance;
+    for (int gy = max(cy - 1, 0); gy <= min(cy + 1, mGridSize - 1); gy++)
+    {
+        for (int gx = max(cx - 1, 0); gx <= min(cx + 1, mGridSize - 1); gx++)
+        {
+            const ClickMapEntry& entry = mEntries[gy * mGridSize + gx];
+            if (!entry.isValid) continue;
+
+            double distance = norm(entry.point - point);
+            if (distance <= nearestDistance)
+            {
+                nearest = &entry;
+                nearestDistance = distance;
+            }
+        }
+    }
+    return nearest;
+}
+
+double ClickMap::getDefaultDistance() const
+{
+    if (mGridSize == 0) return 0;
+    return 0.25 * max(mImageSize.width, mImageSize.height) / mGridSize;
+}
+
+size_t ClickMap::memoryBytes() const
+{
+    size_t bytes = mEntries.capacity() * sizeof(ClickMapEntry) + mOrder.capacity() * sizeof(int);
+    for (auto& entry : mEntries)
+        bytes += entry.mask.memoryBytes();
+    return bytes;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "bitmask.h"
+
+// Decoded mask of one candidate click
+struct ClickMapEntry
+{
+    Point point;                        //!< Grid point in image coordinates
+    float iou;                          //!< Predicted IoU of the mask
+    BitMask mask;                       //!< Thresholded low resolution logits, bounded to the content
+    bool isValid;                       //!< Decoded for the current image
+};
+
+// Masks of a regular grid of candidate clicks over one image, precomputed while the user is idle.
+// A click close to a decoded grid point is answered with its mask without running the decoder.
+class ClickMap
+{
+
+public:
+
+    ClickMap() : mGridSize(0) {}
+
+    // Lay out gridSize x gridSize candidates at the cell centers of the image and drop all masks
+    void reset(int gridSize, Size imageSize);
+
+    void clear() { reset(0, Size()); }
+
+    int size() const { return (int)mEntries.size(); }
+
+    int getGridSize() const { return mGridSize; }
+
+    // Candidates are decoded from the image center outwards, where most clicks land
+    Point getPoint(int order) const { return mEntries[mOrder[order]].point; }
+
+    void store(int order, const Mat& lowResLogits, float iou);
+
+    // Nearest decoded candidate within maxDistance image pixels, nullptr if there is none
+    const ClickMapEntry* find(Point point, double maxDistance) const;
+
+    // Default snapping distance, a quarter of the grid spacing
+    double getDefaultDistance() const;
+
+    size_t memoryBytes() const;
+
+private:
+
+    int mGridSize;
+    Size mImageSize;
+    vector<ClickMapEntry> mEntries;     //!< Row-major over the grid
+    vector<int> mOrder;                 //!< Decode order, indices into mEntries
+};
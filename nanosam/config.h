@@ -4,10 +4,10 @@
 
 #define MAX_NUM_PROMPTS		1
 
-// Model Params
-#define MODEL_INPUT_WIDTH	1024.0f
-#define MODEL_INPUT_HEIGHT	1024.0f
-#define HIDDEN_DIM			256
-#define NUM_LABELS			4
-#define FEATURE_WIDTH		64
-#define FEATURE_HEIGHT		64
+#define ENABLE_METRICS  // per-stage latency histograms and counters, comment out to compile them out
+#define ENABLE_TRACING  // per-request trace spans, recorded only after Tracer::enable()
+
+// The mask decoder normalizes prompt coordinates by the SAM input size, which is
+// baked into the decoder graph rather than exposed through its bindings.
+// All other model dimensions are read from the engine bindings at load time.
+#define PROMPT_COORD_SPACE	1024.0f
@@ -0,0 +1,169 @@
+#include "contours.h"
+#include "image_ops.h"
+
+// Cell sides in clockwise order: top, right, bottom, left
+static const int SIDE_FROM[4][2] = { {0, 0}, {1, 0}, {1, 1}, {0, 1} };
+static const int SIDE_TO[4][2] = { {1, 0}, {1, 1}, {0, 1}, {0, 0} };
+
+vector<vector<Point2f>> marchingSquares(const float* data, int width, int height, size_t stride, float threshold)
+{
+    // Nodes are padded by one sample on every side so that contours touching the border close
+    const int nx = width + 2;
+    const int ny = height + 2;
+    const int numHorizontalEdges = nx * ny;
+
+    auto isValid = [&](int i, int j) { return i >= 1 && j >= 1 && i <= width && j <= height; };
+    auto value = [&](int i, int j) { return data[(j - 1) * stride + (i - 1)]; };
+    auto isInside = [&](int i, int j) { return isValid(i, j) && value(i, j) > threshold; };
+
+    // Edge ids of the side k of cell (i, j)
+    auto sideEdge = [&](int i, int j, int k)
+    {
+        int fi = i + SIDE_FROM[k][0], fj = j + SIDE_FROM[k][1];
+        int ti = i + SIDE_TO[k][0], tj = j + SIDE_TO[k][1];
+        if (fj == tj) return min(fj, tj) * nx + min(fi, ti);
+        return numHorizontalEdges + min(fj, tj) * nx + min(fi, ti);
+    };
+
+    // Sub-pixel crossing position on an edge
+    auto crossing = [&](int edge)
+    {
+        bool horizontal = edge < numHorizontalEdges;
+        int id = horizontal ? edge : edge - numHorizontalEdges;
+        int i0 = id % nx, j0 = id / nx;
+        int i1 = horizontal ? i0 + 1 : i0;
+        int j1 = horizontal ? j0 : j0 + 1;
+
+        float t = 0.5f;
+        if (isValid(i0, j0) && isValid(i1, j1))
+        {
+            float v0 = value(i0, j0), v1 = value(i1, j1);
+            t = (threshold - v0) / (v1 - v0);
+        }
+        return Point2f(i0 - 1 + t * (i1 - i0), j0 - 1 + t * (j1 - j0));
+    };
+
+    // Link every exit crossing of a cell to its enter crossing; foreground stays on the right
+    vector<int> next(2 * numHorizontalEdges, -1);
+    for (int j = 0; j < ny - 1; j++)
+    {
+        for (int i = 0; i < nx - 1; i++)
+        {
+            bool inside[4];
+            for (int k = 0; k < 4; k++)
+                inside[k] = isInside(i + SIDE_FROM[k][0], j + SIDE_FROM[k][1]);
+
+            int numInside = inside[0] + inside[1] + inside[2] + inside[3];
+            if (numInside == 0 || numInside == 4) continue;
+
+            // Saddle: decide the connectivity from the cell center
+            bool centerInside = false;
+            if (numInside == 2 && inside[0] == inside[2])
+            {
+                bool allValid = isValid(i, j) && isValid(i + 1, j) && isValid(i + 1, j + 1) && isValid(i, j + 1);
+                centerInside = allValid &&
+                    (value(i, j) + value(i + 1, j) + value(i + 1, j + 1) + value(i, j + 1)) * 0.25f > threshold;
+            }
+
+            for (int k = 0; k < 4; k++)
+            {
+                bool isExit = inside[k] && !inside[(k + 1) % 4];
+                if (!isExit) continue;
+
+                int step = centerInside ? 1 : 3;
+                for (int s = 1; s < 4; s++)
+                {
+                    int m = (k + s * step) % 4;
+                    bool isEnter = !inside[m] && inside[(m + 1) % 4];
+                    if (isEnter)
+                    {
+                        next[sideEdge(i, j, k)] = sideEdge(i, j, m);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // Follow the links into closed loops
+    vector<vector<Point2f>> contours;
+    for (int start = 0; start < (int)next.size(); start++)
+    {
+        if (next[start] < 0) continue;
+
+        vector<Point2f> contour;
+        int edge = start;
+        while (edge >= 0 && next[edge] >= 0)
+        {
+            contour.push_back(crossing(edge));
+            int following = next[edge];
+            next[edge] = -1;
+            edge = following;
+        }
+        contours.push_back(contour);
+    }
+
+    return contours;
+}
+
+static double signedArea(const vector<Point2f>& polygon)
+{
+    double area = 0;
+    for (size_t i = 0; i < polygon.size(); i++)
+    {
+        const Point2f& p = polygon[i];
+        const Point2f& q = polygon[(i + 1) % polygon.size()];
+        area += (double)p.x * q.y - (double)q.x * p.y;
+    }
+    return 0.5 * area;
+}
+
+// Map pixel centers of the traced grid onto pixel centers of the image and simplify
+static vector<MaskContour> toMaskContours(vector<vector<Point2f>>& loops, float scaleX, float scaleY, double tolerance)
+{
+    vector<MaskContour> contours;
+    contours.reserve(loops.size());
+    for (auto& loop : loops)
+    {
+        for (auto& p : loop)
+        {
+            p.x = (p.x + 0.5f) * scaleX - 0.5f;
+            p.y = (p.y + 0.5f) * scaleY - 0.5f;
+        }
+
+        MaskContour contour;
+        if (tolerance > 0)
+            approxPolyDP(loop, contour.points, tolerance, true);
+        else
+            contour.points = loop;
+
+        if (contour.points.size() < 3) continue;
+
+        // Outer boundaries run clockwise in image coordinates, holes counter-clockwise
+        contour.isHole = signedArea(loop) < 0;
+        contours.push_back(contour);
+    }
+
+    return contours;
+}
+
+vector<MaskContour> extractContours(const Mat& lowResLogits, int imageWidth, int imageHeight, double tolerance, float threshold)
+{
+    CV_Assert(lowResLogits.type() == CV_32FC1);
+
+    // Letterboxed region of the logits, same crop as upscaleMask
+    Rect crop = letterboxMaskRect(lowResLogits.cols, lowResLogits.rows, imageWidth, imageHeight);
+    const int limX = crop.width;
+    const int limY = crop.height;
+
+    auto loops = marchingSquares(lowResLogits.ptr<float>(), limX, limY, lowResLogits.step / sizeof(float), threshold);
+    return toMaskContours(loops, (float)imageWidth / limX, (float)imageHeight / limY, tolerance);
+}
+
+vector<MaskContour> traceContours(const Mat& mask, double tolerance, float threshold)
+{
+    CV_Assert(mask.type() == CV_32FC1);
+
+    auto loops = marchingSquares(mask.ptr<float>(), mask.cols, mask.rows, mask.step / sizeof(float), threshold);
+    return toMaskContours(loops, 1.0f, 1.0f, tolerance);
+}
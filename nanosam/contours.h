@@ -0,0 +1,26 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+// A closed polygon in original image coordinates
+struct MaskContour
+{
+    vector<Point2f> points;
+    bool isHole;                        //!< True if the polygon bounds a background region inside the mask
+};
+
+// Extract mask polygons from the low resolution decoder logits.
+// The contours are traced with sub-pixel marching squares on the letterboxed part of the
+// logits, mapped into image coordinates and simplified with the given tolerance (in image pixels).
+vector<MaskContour> extractContours(const Mat& lowResLogits, int imageWidth, int imageHeight, double tolerance = 1.0, float threshold = 0.0f);
+
+// Extract polygons from a mask at the image size, e.g. the upscaled mask. Sharper than
+// extractContours, at the cost of tracing every pixel.
+vector<MaskContour> traceContours(const Mat& mask, double tolerance = 1.0, float threshold = 0.0f);
+
+// Trace iso-contours of a float grid with marching squares. Points are in grid (pixel center) coordinates.
+// Samples outside the grid are treated as background, so every contour is closed.
+vector<vector<Point2f>> marchingSquares(const float* data, int width, int height, size_t stride, float threshold);
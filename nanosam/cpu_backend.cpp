@@ -0,0 +1,284 @@
+#include "cpu_backend.h"
+#include "metrics.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <opencv2/dnn/shape_utils.hpp>
+
+static dnn::Net readModel(const string& path)
+{
+    dnn::Net net = dnn::readNetFromONNX(path);
+    net.setPreferableBackend(dnn::DNN_BACKEND_OPENCV);
+    net.setPreferableTarget(dnn::DNN_TARGET_CPU);
+    return net;
+}
+
+// N-dimensional blob over caller memory, without a copy
+static Mat blob(const vector<int>& dims, const float* data)
+{
+    return Mat((int)dims.size(), dims.data(), CV_32F, (void*)data);
+}
+
+CPUBackend::CPUBackend(vector<string> encoderPaths, string decoderPath, const CPUBackendOptions& options)
+    : mOptions(options), mEncoderPaths(encoderPaths), mDecoderPath(decoderPath), mSharedInput(-1), mIsPinned(false), mHasTask(false)
+{
+    assert(!encoderPaths.empty());
+
+    promise<void> ready;
+    mReady = ready.get_future().share();
+    mThread = thread(&CPUBackend::run, this, std::move(ready));
+}
+
+CPUBackend::~CPUBackend()
+{
+    // Let loading finish before stopping the inference thread, which has already ended if it failed
+    try
+    {
+        mReady.get();
+    }
+    catch (const exception&)
+    {
+        mThread.join();
+        return;
+    }
+
+    Task stop = {};
+    stop.type = Task::Stop;
+    execute(stop);
+    mThread.join();
+}
+
+// The inference thread: pinned before anything is loaded or allocated, so first touch places
+// the weights and buffers on the node of the placement. Ends if loading fails.
+void CPUBackend::run(promise<void> ready)
+{
+    mIsPinned = pinCurrentThread(mOptions.placement.cores);
+    setNumThreads(max(mOptions.placement.threads, 1));
+
+    try
+    {
+        load();
+    }
+    catch (...)
+    {
+        ready.set_exception(current_exception());
+        return;
+    }
+    ready.set_value();
+
+    unique_lock<mutex> lock(mMutex);
+    for (;;)
+    {
+        mCondition.wait(lock, [this]() { return mHasTask; });
+
+        const Task task = mTask;
+        if (task.type == Task::Encode)
+            runEncode(task.encoder, task.features);
+        else if (task.type == Task::Decode)
+            runDecode(task);
+
+        mHasTask = false;
+        mCondition.notify_all();
+        if (task.type == Task::Stop) return;
+    }
+}
+
+void CPUBackend::load()
+{
+    mLoadReports.resize(mEncoderPaths.size() + 1);
+    const int warmupRuns = max(mOptions.warmupRuns, 1);
+
+    for (int i = 0; i < (int)mEncoderPaths.size(); i++)
+    {
+        ModelLoadReport& report = mLoadReports[i];
+        report.path = mEncoderPaths[i];
+
+        auto start = chrono::steady_clock::now();
+        mEncoders.push_back(readModel(mEncoderPaths[i]));
+        report.loadTime = elapsedMs(start);
+
+        start = chrono::steady_clock::now();
+        const Size inputSize = i < (int)mOptions.inputSizes.size() ? mOptions.inputSizes[i] : Size(1024, 1024);
+        ModelGeometry geometry = {};
+        geometry.inputWidth = inputSize.width;
+        geometry.inputHeight = inputSize.height;
+        geometry.isByteInput = false;
+        mGeometries.push_back(geometry);
+        mEncoderInputs.emplace_back(3 * (size_t)inputSize.area(), 0.0f);
+        report.initializeTime = elapsedMs(start);
+
+        // OpenCV does not report the output shape up front, so the first run measures it
+        start = chrono::steady_clock::now();
+        Mat output;
+        for (int run = 0; run < warmupRuns; run++)
+        {
+            mEncoders[i].setInput(blob({ 1, 3, inputSize.height, inputSize.width }, mEncoderInputs[i].data()), "image");
+            output = mEncoders[i].forward("image_embeddings");
+        }
+        dnn::MatShape shape = dnn::shape(output);
+        mGeometries[i].embeddingDim = shape[1];
+        mGeometries[i].featureHeight = shape[2];
+        mGeometries[i].featureWidth = shape[3];
+        report.warmupTime = elapsedMs(start);
+    }
+
+    ModelLoadReport& report = mLoadReports.back();
+    report.path = mDecoderPath;
+
+    auto start = chrono::steady_clock::now();
+    mDecoder = readModel(mDecoderPath);
+    report.loadTime = elapsedMs(start);
+    report.initializeTime = 0;
+
+    // The mask input is 4x the embeddings, as in SAM, and has to match the low resolution masks
+    start = chrono::steady_clock::now();
+    ModelGeometry& first = mGeometries[0];
+    vector<float> features(first.embeddingSize(), 0.0f);
+    vector<float> maskInput(16 * (size_t)first.featureWidth * first.featureHeight, 0.0f);
+    float pointCoords[2] = { 0.0f, 0.0f };
+    float pointLabels[1] = { 1.0f };
+    float hasMaskInput = 0.0f;
+
+    vector<Mat> outputs;
+    for (int run = 0; run < warmupRuns; run++)
+    {
+        mDecoder.setInput(blob({ 1, first.embeddingDim, first.featureHeight, first.featureWidth }, features.data()), "image_embeddings");
+        mDecoder.setInput(blob({ 1, 1, 2 }, pointCoords), "point_coords");
+        mDecoder.setInput(blob({ 1, 1 }, pointLabels), "point_labels");
+        mDecoder.setInput(blob({ 1, 1, 4 * first.featureHeight, 4 * first.featureWidth }, maskInput.data()), "mask_input");
+        mDecoder.setInput(blob({ 1 }, &hasMaskInput), "has_mask_input");
+        mDecoder.forward(outputs, vector<String>{ "iou_predictions", "low_res_masks" });
+    }
+    report.warmupTime = elapsedMs(start);
+
+    dnn::MatShape masks = dnn::shape(outputs[1]);
+    if (masks[2] != 4 * first.featureHeight || masks[3] != 4 * first.featureWidth)
+        throw runtime_error(mDecoderPath + ": low_res_masks is not 4x the size of the image embeddings");
+
+    for (auto& geometry : mGeometries)
+    {
+        // Every encoder variant has to feed the same decoder
+        if (geometry.embeddingSize() != first.embeddingSize())
+            throw runtime_error("Encoder output does not match the decoder image_embeddings input of " + mDecoderPath);
+        geometry.numMasks = max(masks[1], 1);
+        geometry.maskHeight = masks[2];
+        geometry.maskWidth = masks[3];
+    }
+}
+
+// Throws the load error instead of waiting for a thread that has ended
+void CPUBackend::execute(const Task& task)
+{
+    mReady.get();
+
+    unique_lock<mutex> lock(mMutex);
+    mTask = task;
+    mHasTask = true;
+    mCondition.notify_all();
+    mCondition.wait(lock, [this]() { return !mHasTask; });
+}
+
+void CPUBackend::runEncode(int encoder, float* features)
+{
+    METRICS_SCOPE(Stage::Execute);
+
+    const ModelGeometry& geometry = mGeometries[encoder];
+    mEncoders[encoder].setInput(blob({ 1, 3, geometry.inputHeight, geometry.inputWidth }, getEncoderInput(encoder)), "image");
+    Mat output = mEncoders[encoder].forward("image_embeddings");
+    memcpy(features, output.ptr<float>(), geometry.embeddingSize() * sizeof(float));
+}
+
+void CPUBackend::runDecode(const Task& task)
+{
+    METRICS_SCOPE(Stage::Execute);
+
+    const ModelGeometry& geometry = mGeometries[0];
+    const int n = task.numPoints;
+    mDecoder.setInput(blob({ 1, geometry.embeddingDim, geometry.featureHeight, geometry.featureWidth }, task.decoderFeatures), "image_embeddings");
+    mDecoder.setInput(blob({ 1, n, 2 }, task.pointCoords), "point_coords");
+    mDecoder.setInput(blob({ 1, n }, task.pointLabels), "point_labels");
+    mDecoder.setInput(blob({ 1, 1, geometry.maskHeight, geometry.maskWidth }, task.maskInput), "mask_input");
+    mDecoder.setInput(blob({ 1 }, task.hasMaskInput), "has_mask_input");
+
+    vector<Mat> outputs;
+    mDecoder.forward(outputs, vector<String>{ "iou_predictions", "low_res_masks" });
+    memcpy(task.iouPredictions, outputs[0].ptr<float>(), geometry.numMasks * sizeof(float));
+    memcpy(task.lowResMasks, outputs[1].ptr<float>(), (size_t)geometry.numMasks * geometry.maskWidth * geometry.maskHeight * sizeof(float));
+}
+
+bool CPUBackend::isPinned() const
+{
+    mReady.wait();
+    return mIsPinned;
+}
+
+const ModelGeometry& CPUBackend::getGeometry(int encoder) const
+{
+    mReady.get();
+    return mGeometries[encoder];
+}
+
+vector<ModelLoadReport> CPUBackend::getLoadReports() const
+{
+    mReady.get();
+    return mLoadReports;
+}
+
+float* CPUBackend::getEncoderInput(int encoder)
+{
+    return mEncoderInputs[mSharedInput >= 0 ? mSharedInput : encoder].data();
+}
+
+void CPUBackend::encode(int encoder, float* features)
+{
+    Task task = {};
+    task.type = Task::Encode;
+    task.encoder = encoder;
+    task.features = features;
+    execute(task);
+}
+
+void CPUBackend::decode(const float* features, const float* pointCoords, const float* pointLabels, int numPoints,
+    const float* maskInput, const float* hasMaskInput, float* iouPredictions, float* lowResMasks)
+{
+    Task task = {};
+    task.type = Task::Decode;
+    task.decoderFeatures = features;
+    task.pointCoords = pointCoords;
+    task.pointLabels = pointLabels;
+    task.numPoints = numPoints;
+    task.maskInput = maskInput;
+    task.hasMaskInput = hasMaskInput;
+    task.iouPredictions = iouPredictions;
+    task.lowResMasks = lowResMasks;
+    execute(task);
+}
+
+vector<MemoryUsage> CPUBackend::getMemoryUsage() const
+{
+    mReady.get();
+
+    size_t bytes = 0;
+    for (auto& input : mEncoderInputs)
+        bytes += input.capacity() * sizeof(float);
+    return { { "encoder_input", bytes, 0 } };
+}
+
+void CPUBackend::setLowMemory()
+{
+    mReady.get();
+    if (mSharedInput >= 0) return;
+
+    int largest = 0;
+    for (int i = 1; i < (int)mEncoderInputs.size(); i++)
+        if (mEncoderInputs[i].size() > mEncoderInputs[largest].size()) largest = i;
+    for (int i = 0; i < (int)mEncoderInputs.size(); i++)
+    {
+        if (i == largest) continue;
+        mEncoderInputs[i].clear();
+        mEncoderInputs[i].shrink_to_fit();
+    }
+    mSharedInput = largest;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "backend.h"
+#include "cpu_placement.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <opencv2/dnn.hpp>
+
+struct CPUBackendOptions
+{
+    CpuPlacement placement;             //!< Cores of the inference thread and threads per request
+    vector<Size> inputSizes;            //!< Encoder input sizes, 1024 x 1024 for any not given
+    int warmupRuns = 1;
+};
+
+// Runs the ONNX encoders and decoder on the CPU with OpenCV DNN, for inference nodes without a
+// GPU. Inference runs on a thread of the backend pinned to the cores of the placement; it also
+// loads the models and allocates the buffers, so on a single node placement they are node-local.
+// Pin the threads calling NanoSam to the same cores to keep the embeddings local as well.
+//
+// OpenCV's thread count and thread pool are process wide, and the count is set from the
+// placement, so all CPU backends of a process should come from one planCpuWorkers plan. In
+// throughput mode the count is 1, so OpenCV runs every request inline on the pinned inference
+// thread of its worker, on that core alone. The KernelConfig threads should stay at 1 too.
+class CPUBackend : public InferenceBackend
+{
+
+public:
+
+    // The models are loaded and warmed up on the inference thread in the background.
+    // Inference calls block until loading has finished and throw its error if it failed.
+    CPUBackend(vector<string> encoderPaths, string decoderPath, const CPUBackendOptions& options = CPUBackendOptions());
+
+    ~CPUBackend();
+
+    int getNumEncoders() const override { return (int)mEncoderPaths.size(); }
+
+    const ModelGeometry& getGeometry(int encoder) const override;
+
+    shared_future<void> getReadyFuture() const override { return mReady; }
+
+    // Load timings of the encoders followed by the decoder
+    vector<ModelLoadReport> getLoadReports() const override;
+
+    float* getEncoderInput(int encoder) override;
+
+    uchar* getEncoderByteInput(int encoder) override { return nullptr; }
+
+    void encode(int encoder, float* features) override;
+
+    void decode(const float* features, const float* pointCoords, const float* pointLabels, int numPoints,
+        const float* maskInput, const float* hasMaskInput, float* iouPredictions, float* lowResMasks) override;
+
+    // Host bytes of the input buffers; the network weights and activations are OpenCV's
+    vector<MemoryUsage> getMemoryUsage() const override;
+
+    // The encoder variants share the input buffer of the largest one
+    void setLowMemory() override;
+
+    const CpuPlacement& getPlacement() const { return mOptions.placement; }
+
+    // False if the inference thread could not be pinned to the cores of the placement, e.g. when
+    // they are outside the affinity mask of the process. It then runs wherever it is scheduled.
+    bool isPinned() const;
+
+private:
+
+    // One call handed to the inference thread
+    struct Task
+    {
+        enum Type { Encode, Decode, Stop } type;
+        int encoder;
+        float* features;
+        const float* decoderFeatures;
+        const float* pointCoords;
+        const float* pointLabels;
+        int numPoints;
+        const float* maskInput;
+        const float* hasMaskInput;
+        float* iouPredictions;
+        float* lowResMasks;
+    };
+
+    CPUBackendOptions mOptions;
+    vector<string> mEncoderPaths;
+    string mDecoderPath;
+
+    vector<dnn::Net> mEncoders;
+    dnn::Net mDecoder;
+    vector<ModelGeometry> mGeometries;
+    vector<vector<float>> mEncoderInputs;
+    int mSharedInput;                   //!< Encoder whose input buffer every variant uses, -1 if each has its own
+    bool mIsPinned;                     //!< Set by the inference thread before it signals ready
+
+    shared_future<void> mReady;
+    vector<ModelLoadReport> mLoadReports;
+
+    thread mThread;
+    mutex mMutex;
+    condition_variable mCondition;
+    Task mTask;
+    bool mHasTask;
+
+    void run(promise<void> ready);
+    void load();
+    void execute(const Task& task);
+    void runEncode(int encoder, float* features);
+    void runDecode(const Task& task);
+};
@@ -0,0 +1,204 @@
+#include "cpu_placement.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifndef _WIN32
+// Parse a kernel CPU list such as "0-3,8-11"
+static vector<int> parseCpuList(const string& text)
+{
+    vector<int> cores;
+    istringstream in(text);
+    string range;
+    while (getline(in, range, ','))
+    {
+        int first = 0, last = 0;
+        const size_t dash = range.find('-');
+        try
+        {
+            first = stoi(range.substr(0, dash));
+            last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+        }
+        catch (const exception&)
+        {
+            continue;
+        }
+        for (int core = first; core <= last; core++) cores.push_back(core);
+    }
+    return cores;
+}
+#endif
+
+// Processors the process may run on, empty if unknown
+static vector<int> allowedCores()
+{
+    vector<int> cores;
+#ifdef _WIN32
+    // The process mask covers its primary group only, so it applies to single group hosts
+    DWORD_PTR processMask = 0, systemMask = 0;
+    if (GetActiveProcessorGroupCount() == 1 && GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+    {
+        for (int bit = 0; bit < 64; bit++)
+            if (processMask & ((DWORD_PTR)1 << bit)) cores.push_back(bit);
+    }
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int core = 0; core < CPU_SETSIZE; core++)
+            if (CPU_ISSET(core, &set)) cores.push_back(core);
+    }
+#endif
+    return cores;
+}
+
+CpuTopology CpuTopology::detect()
+{
+    CpuTopology topology;
+
+#ifdef _WIN32
+    ULONG highestNode = 0;
+    if (GetNumaHighestNodeNumber(&highestNode))
+    {
+        for (ULONG node = 0; node <= highestNode; node++)
+        {
+            GROUP_AFFINITY affinity = {};
+            if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity)) continue;
+
+            vector<int> cores;
+            for (int bit = 0; bit < 64; bit++)
+                if (affinity.Mask & ((KAFFINITY)1 << bit)) cores.push_back(affinity.Group * 64 + bit);
+            if (!cores.empty()) topology.nodes.push_back(cores);
+        }
+    }
+#else
+    // Node directories may be sparse, e.g. node0 and node2
+    for (int node = 0, missing = 0; missing < 8; node++)
+    {
+        ifstream file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        string text;
+        if (!file || !getline(file, text))
+        {
+            missing++;
+            continue;
+        }
+        missing = 0;
+
+        vector<int> cores = parseCpuList(text);
+        if (!cores.empty()) topology.nodes.push_back(cores);
+    }
+#endif
+
+    // Drop the processors outside the affinity mask and the nodes left without any
+    const vector<int> allowed = allowedCores();
+    if (!allowed.empty())
+    {
+        vector<vector<int>> nodes;
+        for (auto& cores : topology.nodes)
+        {
+            vector<int> kept;
+            for (int core : cores)
+                if (binary_search(allowed.begin(), allowed.end(), core)) kept.push_back(core);
+            if (!kept.empty()) nodes.push_back(kept);
+        }
+        topology.nodes = nodes;
+    }
+
+    if (topology.nodes.empty())
+    {
+        vector<int> cores = allowed;
+        if (cores.empty())
+        {
+            cores.resize(max((int)thread::hardware_concurrency(), 1));
+            for (int i = 0; i < (int)cores.size(); i++) cores[i] = i;
+        }
+        topology.nodes.push_back(cores);
+    }
+    return topology;
+}
+
+int CpuTopology::numCores() const
+{
+    int count = 0;
+    for (auto& cores : nodes) count += (int)cores.size();
+    return count;
+}
+
+const char* cpuExecutionModeName(CpuExecutionMode mode)
+{
+    return mode == CpuExecutionMode::Latency ? "latency" : "throughput";
+}
+
+bool parseCpuExecutionMode(const string& name, CpuExecutionMode& mode)
+{
+    if (name == "latency") mode = CpuExecutionMode::Latency;
+    else if (name == "throughput") mode = CpuExecutionMode::Throughput;
+    else return false;
+    return true;
+}
+
+vector<CpuPlacement> planCpuWorkers(const CpuTopology& topology, CpuExecutionMode mode, int numWorkers)
+{
+    if (mode == CpuExecutionMode::Latency)
+    {
+        CpuPlacement placement;
+        placement.node = topology.nodes.size() == 1 ? 0 : -1;
+        for (auto& cores : topology.nodes)
+            placement.cores.insert(placement.cores.end(), cores.begin(), cores.end());
+        placement.threads = (int)placement.cores.size();
+        return { placement };
+    }
+
+    // Cores interleaved across the nodes, so consecutive workers land on different nodes
+    vector<CpuPlacement> order;
+    size_t largestNode = 0;
+    for (auto& cores : topology.nodes) largestNode = max(largestNode, cores.size());
+    for (size_t i = 0; i < largestNode; i++)
+    {
+        for (int node = 0; node < (int)topology.nodes.size(); node++)
+        {
+            if (i >= topology.nodes[node].size()) continue;
+            CpuPlacement placement;
+            placement.node = node;
+            placement.cores = { topology.nodes[node][i] };
+            order.push_back(placement);
+        }
+    }
+
+    // More workers than cores share them
+    vector<CpuPlacement> placements;
+    const int count = numWorkers > 0 ? numWorkers : (int)order.size();
+    for (int i = 0; i < count; i++) placements.push_back(order[i % order.size()]);
+    return placements;
+}
+
+bool pinCurrentThread(const vector<int>& cores)
+{
+    if (cores.empty()) return false;
+
+#ifdef _WIN32
+    // A thread runs in one processor group, the one of the first core
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = (WORD)(cores[0] / 64);
+    for (int core : cores)
+        if (core / 64 == affinity.Group) affinity.Mask |= (KAFFINITY)1 << (core % 64);
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int core : cores)
+        if (core >= 0 && core < CPU_SETSIZE) CPU_SET(core, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
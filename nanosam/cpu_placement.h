@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// How a CPU backend spends the cores of the host
+enum class CpuExecutionMode
+{
+    Latency,                            //!< One request at a time on all cores
+    Throughput                          //!< Many requests at once, each on one core of its own
+};
+
+// Cores of one inference worker
+struct CpuPlacement
+{
+    int node = -1;                      //!< NUMA node of the cores, -1 if they span several
+    vector<int> cores;                  //!< Logical processors, empty for no pinning
+    int threads = 1;                    //!< Threads a request runs on
+};
+
+// Logical processors of the host by NUMA node, read from /sys/devices/system/node on Linux and
+// the NUMA node masks on Windows. Only the processors the process may run on are listed, so a
+// cgroup cpuset, taskset or a Windows process affinity mask narrows the plan. Hosts without NUMA
+// information are one node of all allowed threads.
+struct CpuTopology
+{
+    vector<vector<int>> nodes;
+
+    static CpuTopology detect();
+
+    int numCores() const;
+};
+
+const char* cpuExecutionModeName(CpuExecutionMode mode);
+
+bool parseCpuExecutionMode(const string& name, CpuExecutionMode& mode);
+
+// Worker placements for a mode. Latency is a single worker with every core. Throughput is
+// numWorkers single-threaded workers, one per core if 0, spread round robin over the nodes and
+// pinned to one core each, so the nodes are loaded evenly and no worker crosses a node.
+// Throughput workers stay single-threaded because OpenCV has one thread pool per process: its
+// threads would neither follow the pinning of a worker nor run two workers' jobs at once.
+vector<CpuPlacement> planCpuWorkers(const CpuTopology& topology, CpuExecutionMode mode, int numWorkers = 0);
+
+// Restrict the calling thread to the cores. Threads it starts afterwards inherit the mask, and
+// memory it touches first is placed on their node by the default first-touch policy.
+// False if the cores are empty or the mask could not be set, e.g. none of them is allowed.
+bool pinCurrentThread(const vector<int>& cores);
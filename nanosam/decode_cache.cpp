@@ -0,0 +1,125 @@
+#include "decode_cache.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+DecodeCache::DecodeCache(size_t capacity, float tolerance)
+    : mCapacity(capacity), mTolerance(max(tolerance, 1.0f))
+{
+    mEntries.reserve(capacity);
+}
+
+int32_t DecodeCache::quantize(float coord) const
+{
+    return (int32_t)floor(coord / mTolerance + 0.5f);
+}
+
+uint64_t DecodeCache::hashPrompt(const float* pointCoords, const float* pointLabels, int numPoints) const
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < numPoints; i++)
+    {
+        const uint64_t x = (uint32_t)quantize(pointCoords[2 * i]);
+        const uint64_t y = (uint32_t)quantize(pointCoords[2 * i + 1]);
+        const uint64_t label = (uint32_t)lround(pointLabels[i]);
+        hash = (hash ^ (x << 32 | y)) * 0xC2B2AE3D27D4EB4Full;
+        hash = (hash ^ label) * 0x9E3779B185EBCA87ull;
+    }
+    return hash ^ (uint64_t)numPoints;
+}
+
+bool DecodeCache::matches(const Entry& entry, const float* pointCoords, const float* pointLabels, int numPoints) const
+{
+    if (entry.prompt.size() != 3 * (size_t)numPoints) return false;
+    for (int i = 0; i < numPoints; i++)
+    {
+        if (entry.prompt[3 * i] != quantize(pointCoords[2 * i]) ||
+            entry.prompt[3 * i + 1] != quantize(pointCoords[2 * i + 1]) ||
+            entry.prompt[3 * i + 2] != (int32_t)lround(pointLabels[i]))
+            return false;
+    }
+    return true;
+}
+
+bool DecodeCache::find(uint64_t imageHash, int encoder, const float* pointCoords, const float* pointLabels, int numPoints,
+    float* iouPredictions, int numMasks, float* lowResMasks, int maskSize)
+{
+    if (mCapacity == 0) return false;
+
+    const uint64_t promptHash = hashPrompt(pointCoords, pointLabels, numPoints);
+    for (auto it = mEntries.begin(); it != mEntries.end(); ++it)
+    {
+        if (it->imageHash != imageHash || it->encoder != encoder || it->promptHash != promptHash ||
+            (int)it->iouPredictions.size() != numMasks || it->lowResMasks.size() != (size_t)numMasks * maskSize ||
+            !matches(*it, pointCoords, pointLabels, numPoints))
+            continue;
+
+        rotate(mEntries.begin(), it, it + 1);
+        const Entry& entry = mEntries.front();
+        copy(entry.iouPredictions.begin(), entry.iouPredictions.end(), iouPredictions);
+        copy(entry.lowResMasks.begin(), entry.lowResMasks.end(), lowResMasks);
+
+        METRICS_COUNT(Counter::DecodeCacheHits, 1);
+        return true;
+    }
+
+    METRICS_COUNT(Counter::DecodeCacheMisses, 1);
+    return false;
+}
+
+void DecodeCache::insert(uint64_t imageHash, int encoder, const float* pointCoords, const float* pointLabels, int numPoints,
+    const float* iouPredictions, int numMasks, const float* lowResMasks, int maskSize)
+{
+    if (mCapacity == 0) return;
+
+    // Reuse the buffers of the least recently used entry
+    if (mEntries.size() >= mCapacity)
+        rotate(mEntries.begin(), mEntries.end() - 1, mEntries.end());
+    else
+        mEntries.insert(mEntries.begin(), Entry());
+
+    Entry& entry = mEntries.front();
+    entry.imageHash = imageHash;
+    entry.encoder = encoder;
+    entry.promptHash = hashPrompt(pointCoords, pointLabels, numPoints);
+
+    entry.prompt.resize(3 * (size_t)numPoints);
+    for (int i = 0; i < numPoints; i++)
+    {
+        entry.prompt[3 * i] = quantize(pointCoords[2 * i]);
+        entry.prompt[3 * i + 1] = quantize(pointCoords[2 * i + 1]);
+        entry.prompt[3 * i + 2] = (int32_t)lround(pointLabels[i]);
+    }
+
+    entry.iouPredictions.assign(iouPredictions, iouPredictions + numMasks);
+    entry.lowResMasks.assign(lowResMasks, lowResMasks + (size_t)numMasks * maskSize);
+}
+
+void DecodeCache::setCapacity(size_t capacity)
+{
+    mCapacity = capacity;
+    if (mEntries.size() > mCapacity)
+        mEntries.resize(mCapacity);
+    mEntries.reserve(mCapacity);
+}
+
+void DecodeCache::setTolerance(float tolerance)
+{
+    tolerance = max(tolerance, 1.0f);
+    if (tolerance != mTolerance) mEntries.clear();
+    mTolerance = tolerance;
+}
+
+size_t DecodeCache::getBytes() const
+{
+    size_t bytes = 0;
+    for (auto& entry : mEntries)
+        bytes += entry.prompt.capacity() * sizeof(int32_t) + (entry.iouPredictions.capacity() + entry.lowResMasks.capacity()) * sizeof(float);
+    return bytes;
+}
+
+size_t DecodeCache::getEntryBytes(int numPoints, int numMasks, int maskSize)
+{
+    return 3 * (size_t)numPoints * sizeof(int32_t) + ((size_t)numMasks + (size_t)numMasks * maskSize) * sizeof(float);
+}
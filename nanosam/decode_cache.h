@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Least recently used decoder results, keyed by the embeddings they were decoded against (image
+// content hash and encoder variant) and the prompts. Prompt coordinates are quantized in the
+// decoder coordinate space with a tolerance, so clicks and boxes within about that many decoder
+// pixels of a cached prompt share its result. Points that straddle a quantization step still miss.
+//
+// Entries hold the predicted IoUs and every low resolution mask as the decoder left them, so a
+// hit gives exactly the output of the decode it replaces. Evicted entries are recycled, so a
+// full cache inserts without heap allocations.
+class DecodeCache
+{
+
+public:
+
+    DecodeCache(size_t capacity = 0, float tolerance = 1.0f);
+
+    // Point coordinates are in the decoder coordinate space, as prepared for the decoder.
+    // The masks are numMasks consecutive blocks of maskSize logits.
+    // On a hit, copies the IoUs and all masks out and returns true.
+    bool find(uint64_t imageHash, int encoder, const float* pointCoords, const float* pointLabels, int numPoints,
+        float* iouPredictions, int numMasks, float* lowResMasks, int maskSize);
+
+    void insert(uint64_t imageHash, int encoder, const float* pointCoords, const float* pointLabels, int numPoints,
+        const float* iouPredictions, int numMasks, const float* lowResMasks, int maskSize);
+
+    // A capacity of 0 disables caching
+    void setCapacity(size_t capacity);
+
+    size_t getCapacity() const { return mCapacity; }
+
+    // Decoder pixels per quantization step, at least 1. Clears the cache when it changes.
+    void setTolerance(float tolerance);
+
+    float getTolerance() const { return mTolerance; }
+
+    size_t size() const { return mEntries.size(); }
+
+    // Held by the cached results
+    size_t getBytes() const;
+
+    // Bytes of one entry at the given prompt and mask sizes
+    static size_t getEntryBytes(int numPoints, int numMasks, int maskSize);
+
+    void clear() { mEntries.clear(); }
+
+private:
+
+    struct Entry
+    {
+        uint64_t imageHash;
+        int encoder;
+        uint64_t promptHash;
+        vector<int32_t> prompt;         //!< Quantized x, y and label of each point
+        vector<float> iouPredictions;
+        vector<float> lowResMasks;
+    };
+
+    vector<Entry> mEntries;             //!< Most recently used first
+    size_t mCapacity;
+    float mTolerance;
+
+    int32_t quantize(float coord) const;
+    uint64_t hashPrompt(const float* pointCoords, const float* pointLabels, int numPoints) const;
+    bool matches(const Entry& entry, const float* pointCoords, const float* pointLabels, int numPoints) const;
+};
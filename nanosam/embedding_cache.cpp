@@ -0,0 +1,55 @@
+#include "embedding_cache.h"
+#include "metrics.h"
+
+#include <algorithm>
+
+shared_ptr<vector<float>> EmbeddingCache::find(uint64_t imageHash, int encoder)
+{
+    for (auto it = mEntries.begin(); it != mEntries.end(); ++it)
+    {
+        if (it->imageHash == imageHash && it->encoder == encoder)
+        {
+            rotate(mEntries.begin(), it, it + 1);
+            METRICS_COUNT(Counter::CacheHits, 1);
+            return mEntries.front().embedding;
+        }
+    }
+
+    METRICS_COUNT(Counter::CacheMisses, 1);
+    return nullptr;
+}
+
+void EmbeddingCache::insert(uint64_t imageHash, int encoder, shared_ptr<vector<float>> embedding)
+{
+    if (mCapacity == 0) return;
+
+    if (mEntries.size() >= mCapacity)
+        mEntries.pop_back();
+    mEntries.push_back({ imageHash, encoder, embedding });
+    rotate(mEntries.begin(), mEntries.end() - 1, mEntries.end());
+}
+
+shared_ptr<vector<float>> EmbeddingCache::recycle()
+{
+    if (mCapacity == 0 || mEntries.size() < mCapacity) return nullptr;
+
+    shared_ptr<vector<float>> embedding = std::move(mEntries.back().embedding);
+    mEntries.pop_back();
+    return embedding.use_count() == 1 ? embedding : nullptr;
+}
+
+void EmbeddingCache::setCapacity(size_t capacity)
+{
+    mCapacity = capacity;
+    if (mEntries.size() > mCapacity)
+        mEntries.resize(mCapacity);
+    mEntries.reserve(mCapacity);
+}
+
+size_t EmbeddingCache::getBytes() const
+{
+    size_t bytes = 0;
+    for (auto& entry : mEntries)
+        bytes += entry.embedding->capacity() * sizeof(float);
+    return bytes;
+}
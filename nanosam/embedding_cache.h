@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// Least recently used image embeddings, keyed by image content hash and encoder variant.
+// Entries are shared, so an embedding in use stays valid after it is evicted.
+// Entries live in a small vector and evicted buffers are recycled, so a full cache
+// serves new images without heap allocations.
+class EmbeddingCache
+{
+
+public:
+
+    EmbeddingCache(size_t capacity = 4) : mCapacity(capacity) { mEntries.reserve(capacity); }
+
+    // Returns nullptr on a miss
+    shared_ptr<vector<float>> find(uint64_t imageHash, int encoder);
+
+    void insert(uint64_t imageHash, int encoder, shared_ptr<vector<float>> embedding);
+
+    // Once the cache is full, evicts the least recently used entry ahead of an insert and
+    // returns its buffer if nobody else holds it. Returns nullptr otherwise.
+    shared_ptr<vector<float>> recycle();
+
+    // A capacity of 0 disables caching
+    void setCapacity(size_t capacity);
+
+    size_t getCapacity() const { return mCapacity; }
+
+    size_t size() const { return mEntries.size(); }
+
+    // Held by the cached embeddings
+    size_t getBytes() const;
+
+    void clear() { mEntries.clear(); }
+
+private:
+
+    struct Entry
+    {
+        uint64_t imageHash;
+        int encoder;
+        shared_ptr<vector<float>> embedding;
+    };
+
+    vector<Entry> mEntries;             //!< Most recently used first
+    size_t mCapacity;
+};
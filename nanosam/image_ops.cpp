@@ -0,0 +1,637 @@
+#include "image_ops.h"
+#include "config.h"
+#include "arena.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+
+static atomic<int> gResizeKernel((int)ResizeKernel::Separable);
+static atomic<int> gLetterboxKernel((int)ResizeKernel::Separable);
+static atomic<int> gUpscaleKernel((int)UpscaleKernel::Separable);
+static atomic<int> gThreads(1);
+
+void setKernelConfig(const KernelConfig& config)
+{
+    gResizeKernel = (int)config.resize;
+    gLetterboxKernel = (int)config.letterbox;
+    gUpscaleKernel = (int)config.upscale;
+    gThreads = max(config.threads, 1);
+    setNumThreads(max(config.threads, 1));
+}
+
+KernelConfig getKernelConfig()
+{
+    KernelConfig config;
+    config.resize = (ResizeKernel)gResizeKernel.load();
+    config.letterbox = (ResizeKernel)gLetterboxKernel.load();
+    config.upscale = (UpscaleKernel)gUpscaleKernel.load();
+    config.threads = gThreads;
+    return config;
+}
+
+const char* resizeKernelName(ResizeKernel kernel)
+{
+    static const char* names[] = { "separable", "opencv", "opencv_area" };
+    return names[(int)kernel];
+}
+
+const char* upscaleKernelName(UpscaleKernel kernel)
+{
+    static const char* names[] = { "separable", "opencv", "nearest" };
+    return names[(int)kernel];
+}
+
+// Runs body(begin, end) over stripes of the rows, on OpenCV's thread pool if more than one
+// thread is configured. Single-threaded calls stay on the calling thread and do not allocate.
+template <typename Body>
+static void forRowStripes(int rows, const Body& body)
+{
+    const int stripes = min(gThreads.load(), rows);
+    if (stripes <= 1)
+    {
+        body(0, rows);
+        return;
+    }
+
+    parallel_for_(Range(0, stripes), [&](const Range& range)
+    {
+        for (int s = range.start; s < range.end; s++)
+            body((int)((int64_t)rows * s / stripes), (int)((int64_t)rows * (s + 1) / stripes));
+    }, stripes);
+}
+
+// Source coordinates of the destination pixel centers, the same mapping as cv::resize
+static void linearCoefficients(int srcSize, int dstSize, int* index0, int* index1, float* alpha)
+{
+    const double scale = (double)srcSize / dstSize;
+    for (int d = 0; d < dstSize; d++)
+    {
+        double f = (d + 0.5) * scale - 0.5;
+        int s = (int)floor(f);
+        float a = (float)(f - s);
+        if (s < 0) { s = 0; a = 0; }
+        if (s >= srcSize - 1) { s = srcSize - 1; a = 0; }
+
+        index0[d] = s;
+        index1[d] = min(s + 1, srcSize - 1);
+        alpha[d] = a;
+    }
+}
+
+static inline void storePixel(uchar& out, float v) { out = (uchar)(v + 0.5f); }
+static inline void storePixel(float& out, float v) { out = v; }
+
+// Separable bilinear resize into a preallocated dst. Every source row is interpolated
+// horizontally at most once per row stripe, and the vertical pass blends the two cached rows.
+// Coefficients and row buffers come from the scratch arenas of the threads.
+template <typename T, int CN>
+static void resizeLinear(const Mat& src, Mat& dst)
+{
+    ArenaScope scope;
+    ScratchArena& arena = scope.arena();
+
+    const int sw = src.cols, sh = src.rows, dw = dst.cols, dh = dst.rows;
+    int* x0 = arena.allocate<int>(dw);
+    int* x1 = arena.allocate<int>(dw);
+    float* xAlpha = arena.allocate<float>(dw);
+    int* y0 = arena.allocate<int>(dh);
+    int* y1 = arena.allocate<int>(dh);
+    float* yAlpha = arena.allocate<float>(dh);
+    linearCoefficients(sw, dw, x0, x1, xAlpha);
+    linearCoefficients(sh, dh, y0, y1, yAlpha);
+
+    auto horizontal = [&](int sy, float* out)
+    {
+        const T* row = src.ptr<T>(sy);
+        for (int x = 0; x < dw; x++)
+        {
+            const T* p0 = row + x0[x] * CN;
+            const T* p1 = row + x1[x] * CN;
+            for (int c = 0; c < CN; c++)
+                out[x * CN + c] = p0[c] + (p1[c] - (float)p0[c]) * xAlpha[x];
+        }
+    };
+
+    forRowStripes(dh, [&](int begin, int end)
+    {
+        ArenaScope stripeScope;
+        float* rows[2] = { stripeScope.arena().allocate<float>(dw * CN), stripeScope.arena().allocate<float>(dw * CN) };
+        int rowIndex[2] = { -1, -1 };
+
+        for (int dy = begin; dy < end; dy++)
+        {
+            if (rowIndex[0] != y0[dy])
+            {
+                if (rowIndex[1] == y0[dy])
+                {
+                    swap(rows[0], rows[1]);
+                    swap(rowIndex[0], rowIndex[1]);
+                }
+                else
+                {
+                    horizontal(y0[dy], rows[0]);
+                    rowIndex[0] = y0[dy];
+                }
+            }
+            if (rowIndex[1] != y1[dy])
+            {
+                horizontal(y1[dy], rows[1]);
+                rowIndex[1] = y1[dy];
+            }
+
+            const float a = yAlpha[dy];
+            const float* r0 = rows[0];
+            const float* r1 = rows[1];
+            T* out = dst.ptr<T>(dy);
+            for (int i = 0; i < dw * CN; i++)
+                storePixel(out[i], r0[i] + (r1[i] - r0[i]) * a);
+        }
+    });
+}
+
+// Resize into a preallocated dst with the chosen kernel
+template <typename T, int CN>
+static void resizeWith(ResizeKernel kernel, const Mat& src, Mat& dst)
+{
+    if (kernel == ResizeKernel::Separable)
+        resizeLinear<T, CN>(src, dst);
+    else
+        resize(src, dst, dst.size(), 0, 0, kernel == ResizeKernel::OpenCVArea ? INTER_AREA : INTER_LINEAR);
+}
+
+Mat resizeImage(const Mat& img, int inputWidth, int inputHeight)
+{
+    Mat out;
+    resizeImage(img, out, inputWidth, inputHeight);
+    return out;
+}
+
+// True if the image fills the width of the input before its height, when scaled uniformly
+static bool fillsInputWidth(int imageWidth, int imageHeight, int inputWidth, int inputHeight)
+{
+    return (int64_t)imageWidth * inputHeight >= (int64_t)imageHeight * inputWidth;
+}
+
+Rect letterboxImageRect(int imageWidth, int imageHeight, int inputWidth, int inputHeight)
+{
+    if (fillsInputWidth(imageWidth, imageHeight, inputWidth, inputHeight))
+        return Rect(0, 0, inputWidth, (int)((int64_t)imageHeight * inputWidth / imageWidth));
+    else
+        return Rect(0, 0, (int)((int64_t)imageWidth * inputHeight / imageHeight), inputHeight);
+}
+
+void resizeImage(const Mat& img, Mat& out, int inputWidth, int inputHeight)
+{
+    CV_Assert(img.type() == CV_8UC3);
+
+    Rect content = letterboxImageRect(img.cols, img.rows, inputWidth, inputHeight);
+    out.create(inputHeight, inputWidth, CV_8UC3);
+
+    Mat resized = out(content);
+    resizeWith<uchar, 3>((ResizeKernel)gResizeKernel.load(), img, resized);
+
+    // Black padding right of and below the image
+    if (content.width < inputWidth)
+        out(Rect(content.width, 0, inputWidth - content.width, content.height)).setTo(Scalar::all(0));
+    if (content.height < inputHeight)
+        out(Rect(0, content.height, inputWidth, inputHeight - content.height)).setTo(Scalar::all(0));
+}
+
+void normalizeImage(const Mat& image, float* output)
+{
+    const int planeSize = image.rows * image.cols;
+
+    int i = 0;
+    for (int row = 0; row < image.rows; ++row)
+    {
+        const uchar* uc_pixel = image.data + row * image.step;
+        for (int col = 0; col < image.cols; ++col)
+        {
+            output[i] = ((float)uc_pixel[2] / 255.0f - 0.485f) / 0.229f;
+            output[i + planeSize] = ((float)uc_pixel[1] / 255.0f - 0.456f) / 0.224f;
+            output[i + 2 * planeSize] = ((float)uc_pixel[0] / 255.0f - 0.406f) / 0.225f;
+            uc_pixel += 3;
+            ++i;
+        }
+    }
+}
+
+ImageFrame ImageFrame::fromMat(const Mat& image)
+{
+    CV_Assert(image.type() == CV_8UC3 || image.type() == CV_8UC1);
+
+    ImageFrame frame = { image.type() == CV_8UC3 ? PixelFormat::BGR : PixelFormat::Gray, image.cols, image.rows,
+        { image.data, nullptr }, { image.step, 0 } };
+    return frame;
+}
+
+ImageFrame ImageFrame::gray(const uchar* data, int width, int height, size_t stride)
+{
+    ImageFrame frame = { PixelFormat::Gray, width, height, { data, nullptr }, { stride, 0 } };
+    return frame;
+}
+
+ImageFrame ImageFrame::nv12(const uchar* y, size_t yStride, const uchar* uv, size_t uvStride, int width, int height)
+{
+    CV_Assert(width % 2 == 0 && height % 2 == 0);
+
+    ImageFrame frame = { PixelFormat::NV12, width, height, { y, uv }, { yStride, uvStride } };
+    return frame;
+}
+
+ImageFrame ImageFrame::yuyv(const uchar* data, int width, int height, size_t stride)
+{
+    CV_Assert(width % 2 == 0);
+
+    ImageFrame frame = { PixelFormat::YUYV, width, height, { data, nullptr }, { stride, 0 } };
+    return frame;
+}
+
+// Horizontal interpolation of one source row into CN floats per destination pixel:
+// B, G, R for BGR, Y for Gray and Y, U, V for the YUV formats. Chroma is taken from the
+// 2x1 or 2x2 block of each tap, like the OpenCV conversions do.
+template <PixelFormat F>
+static void interpolateRow(const ImageFrame& frame, int sy, const int* x0, const int* x1, const float* alpha, int dw, float* out)
+{
+    const uchar* row = frame.planes[0] + sy * frame.strides[0];
+
+    for (int x = 0; x < dw; x++)
+    {
+        const int a = x0[x], b = x1[x];
+        const float t = alpha[x];
+
+        if (F == PixelFormat::BGR)
+        {
+            const uchar* p0 = row + a * 3;
+            const uchar* p1 = row + b * 3;
+            for (int c = 0; c < 3; c++)
+                out[x * 3 + c] = p0[c] + (p1[c] - (float)p0[c]) * t;
+        }
+        else if (F == PixelFormat::Gray)
+        {
+            out[x] = row[a] + (row[b] - (float)row[a]) * t;
+        }
+        else if (F == PixelFormat::NV12)
+        {
+            const uchar* uv = frame.planes[1] + (sy >> 1) * frame.strides[1];
+            const uchar* c0 = uv + (a & ~1);
+            const uchar* c1 = uv + (b & ~1);
+            out[x * 3] = row[a] + (row[b] - (float)row[a]) * t;
+            out[x * 3 + 1] = c0[0] + (c1[0] - (float)c0[0]) * t;
+            out[x * 3 + 2] = c0[1] + (c1[1] - (float)c0[1]) * t;
+        }
+        else
+        {
+            const uchar* c0 = row + (a & ~1) * 2;
+            const uchar* c1 = row + (b & ~1) * 2;
+            out[x * 3] = row[a * 2] + (row[b * 2] - (float)row[a * 2]) * t;
+            out[x * 3 + 1] = c0[1] + (c1[1] - (float)c0[1]) * t;
+            out[x * 3 + 2] = c0[3] + (c1[3] - (float)c0[3]) * t;
+        }
+    }
+}
+
+// ImageNet mean and std of the R, G and B planes, folded into one multiply-add
+const float kNormScale[3] = { 1 / (255.0f * 0.229f), 1 / (255.0f * 0.224f), 1 / (255.0f * 0.225f) };
+const float kNormBias[3] = { -0.485f / 0.229f, -0.456f / 0.224f, -0.406f / 0.225f };
+
+static inline float clampPixel(float v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// Write pixel i of the input as normalized planar RGB floats
+static inline void storePixel(float* output, size_t planeSize, size_t i, float r, float g, float b)
+{
+    output[i] = r * kNormScale[0] + kNormBias[0];
+    output[i + planeSize] = g * kNormScale[1] + kNormBias[1];
+    output[i + 2 * planeSize] = b * kNormScale[2] + kNormBias[2];
+}
+
+// Or as packed 8-bit BGR, for encoders that normalize in the model
+static inline void storePixel(uchar* output, size_t planeSize, size_t i, float r, float g, float b)
+{
+    uchar* pixel = output + i * 3;
+    pixel[0] = saturate_cast<uchar>(b);
+    pixel[1] = saturate_cast<uchar>(g);
+    pixel[2] = saturate_cast<uchar>(r);
+}
+
+// Padding right of and below the image is black before normalization
+static void fillLetterboxPadding(float* output, int dw, int dh, int inputWidth, size_t planeSize)
+{
+    for (int c = 0; c < 3; c++)
+    {
+        float* plane = output + c * planeSize;
+        for (int dy = 0; dy < dh; dy++)
+            fill(plane + (size_t)dy * inputWidth + dw, plane + (size_t)(dy + 1) * inputWidth, kNormBias[c]);
+        fill(plane + (size_t)dh * inputWidth, plane + planeSize, kNormBias[c]);
+    }
+}
+
+static void fillLetterboxPadding(uchar* output, int dw, int dh, int inputWidth, size_t planeSize)
+{
+    for (int dy = 0; dy < dh; dy++)
+        memset(output + ((size_t)dy * inputWidth + dw) * 3, 0, (size_t)(inputWidth - dw) * 3);
+    memset(output + (size_t)dh * inputWidth * 3, 0, (planeSize - (size_t)dh * inputWidth) * 3);
+}
+
+// Same row caching as resizeLinear, with the color conversion and normalization applied
+// to the blended rows while they are written into the output
+template <PixelFormat F, typename T>
+static void letterboxNormalizeLinear(const ImageFrame& frame, T* output, int inputWidth, int inputHeight)
+{
+    constexpr int CN = F == PixelFormat::Gray ? 1 : 3;
+
+    ArenaScope scope;
+    ScratchArena& arena = scope.arena();
+
+    Rect content = letterboxImageRect(frame.width, frame.height, inputWidth, inputHeight);
+    const int dw = content.width, dh = content.height;
+    const size_t planeSize = (size_t)inputWidth * inputHeight;
+
+    int* x0 = arena.allocate<int>(dw);
+    int* x1 = arena.allocate<int>(dw);
+    float* xAlpha = arena.allocate<float>(dw);
+    int* y0 = arena.allocate<int>(dh);
+    int* y1 = arena.allocate<int>(dh);
+    float* yAlpha = arena.allocate<float>(dh);
+    linearCoefficients(frame.width, dw, x0, x1, xAlpha);
+    linearCoefficients(frame.height, dh, y0, y1, yAlpha);
+
+    forRowStripes(dh, [&](int begin, int end)
+    {
+        ArenaScope stripeScope;
+        float* rows[2] = { stripeScope.arena().allocate<float>(dw * CN), stripeScope.arena().allocate<float>(dw * CN) };
+        int rowIndex[2] = { -1, -1 };
+
+        for (int dy = begin; dy < end; dy++)
+        {
+            if (rowIndex[0] != y0[dy])
+            {
+                if (rowIndex[1] == y0[dy])
+                {
+                    swap(rows[0], rows[1]);
+                    swap(rowIndex[0], rowIndex[1]);
+                }
+                else
+                {
+                    interpolateRow<F>(frame, y0[dy], x0, x1, xAlpha, dw, rows[0]);
+                    rowIndex[0] = y0[dy];
+                }
+            }
+            if (rowIndex[1] != y1[dy])
+            {
+                interpolateRow<F>(frame, y1[dy], x0, x1, xAlpha, dw, rows[1]);
+                rowIndex[1] = y1[dy];
+            }
+
+            const float a = yAlpha[dy];
+            const float* r0 = rows[0];
+            const float* r1 = rows[1];
+            const size_t rowStart = (size_t)dy * inputWidth;
+
+            for (int x = 0; x < dw; x++)
+            {
+                float r, g, b;
+                if (F == PixelFormat::Gray)
+                {
+                    r = g = b = r0[x] + (r1[x] - r0[x]) * a;
+                }
+                else if (F == PixelFormat::BGR)
+                {
+                    const int i = x * 3;
+                    b = r0[i] + (r1[i] - r0[i]) * a;
+                    g = r0[i + 1] + (r1[i + 1] - r0[i + 1]) * a;
+                    r = r0[i + 2] + (r1[i + 2] - r0[i + 2]) * a;
+                }
+                else
+                {
+                    // BT.601 limited range
+                    const int i = x * 3;
+                    const float luma = 1.164f * (r0[i] + (r1[i] - r0[i]) * a - 16);
+                    const float u = r0[i + 1] + (r1[i + 1] - r0[i + 1]) * a - 128;
+                    const float v = r0[i + 2] + (r1[i + 2] - r0[i + 2]) * a - 128;
+                    r = clampPixel(luma + 1.596f * v);
+                    g = clampPixel(luma - 0.813f * v - 0.391f * u);
+                    b = clampPixel(luma + 2.018f * u);
+                }
+
+                storePixel(output, planeSize, rowStart + x, r, g, b);
+            }
+        }
+    });
+
+    fillLetterboxPadding(output, dw, dh, inputWidth, planeSize);
+}
+
+// BGR and gray frames resized by OpenCV into 8-bit scratch, then normalized. Rounds the
+// resized pixels, but can be faster where OpenCV has SIMD resize code for the host.
+// BGR frames into 8-bit output are resized in place, without scratch.
+template <typename T>
+static void letterboxNormalizeResized(const ImageFrame& frame, ResizeKernel kernel, T* output, int inputWidth, int inputHeight)
+{
+    ArenaScope scope;
+
+    const bool isGray = frame.format == PixelFormat::Gray;
+    const int type = isGray ? CV_8UC1 : CV_8UC3;
+    const int interpolation = kernel == ResizeKernel::OpenCVArea ? INTER_AREA : INTER_LINEAR;
+    Rect content = letterboxImageRect(frame.width, frame.height, inputWidth, inputHeight);
+    const int dw = content.width, dh = content.height;
+    const size_t planeSize = (size_t)inputWidth * inputHeight;
+
+    Mat source(frame.height, frame.width, type, (void*)frame.planes[0], frame.strides[0]);
+    if (is_same<T, uchar>::value && !isGray)
+    {
+        Mat resized = Mat(inputHeight, inputWidth, CV_8UC3, (void*)output)(content);
+        resize(source, resized, resized.size(), 0, 0, interpolation);
+        fillLetterboxPadding(output, dw, dh, inputWidth, planeSize);
+        return;
+    }
+
+    Mat resized = scope.arena().mat(dh, dw, type);
+    resize(source, resized, resized.size(), 0, 0, interpolation);
+
+    forRowStripes(dh, [&](int begin, int end)
+    {
+        for (int dy = begin; dy < end; dy++)
+        {
+            const uchar* row = resized.ptr<uchar>(dy);
+            const size_t rowStart = (size_t)dy * inputWidth;
+            for (int x = 0; x < dw; x++)
+            {
+                const uchar* p = isGray ? row + x : row + x * 3;
+                storePixel(output, planeSize, rowStart + x, p[isGray ? 0 : 2], p[isGray ? 0 : 1], p[0]);
+            }
+        }
+    });
+
+    fillLetterboxPadding(output, dw, dh, inputWidth, planeSize);
+}
+
+template <typename T>
+static void letterboxInto(const ImageFrame& frame, T* output, int inputWidth, int inputHeight)
+{
+    const ResizeKernel kernel = (ResizeKernel)gLetterboxKernel.load();
+    if (kernel != ResizeKernel::Separable && (frame.format == PixelFormat::BGR || frame.format == PixelFormat::Gray))
+    {
+        letterboxNormalizeResized(frame, kernel, output, inputWidth, inputHeight);
+        return;
+    }
+
+    switch (frame.format)
+    {
+    case PixelFormat::BGR:  letterboxNormalizeLinear<PixelFormat::BGR>(frame, output, inputWidth, inputHeight); break;
+    case PixelFormat::Gray: letterboxNormalizeLinear<PixelFormat::Gray>(frame, output, inputWidth, inputHeight); break;
+    case PixelFormat::NV12: letterboxNormalizeLinear<PixelFormat::NV12>(frame, output, inputWidth, inputHeight); break;
+    case PixelFormat::YUYV: letterboxNormalizeLinear<PixelFormat::YUYV>(frame, output, inputWidth, inputHeight); break;
+    }
+}
+
+void letterboxNormalize(const ImageFrame& frame, float* output, int inputWidth, int inputHeight)
+{
+    letterboxInto(frame, output, inputWidth, inputHeight);
+}
+
+void letterboxImage(const ImageFrame& frame, uchar* output, int inputWidth, int inputHeight)
+{
+    letterboxInto(frame, output, inputWidth, inputHeight);
+}
+
+static inline uint64_t rotateLeft(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hashRound(uint64_t state, uint64_t word)
+{
+    return rotateLeft(state + word * 0xC2B2AE3D27D4EB4FULL, 31) * 0x9E3779B185EBCA87ULL;
+}
+
+// Four independent lanes over 8-byte words keep the multiplies pipelined
+struct HashState
+{
+    uint64_t lanes[4] = { 0x9E3779B97F4A7C15ULL, 0xBF58476D1CE4E5B9ULL, 0x94D049BB133111EBULL, 0x2545F4914F6CDD1DULL };
+
+    // Row by row whatever the stride, so an ROI or a padded frame hashes like its compact copy
+    void addPlane(const uchar* data, size_t rowBytes, int rows, size_t stride)
+    {
+        const size_t bytes = rowBytes;
+        for (int row = 0; row < rows; row++, data += stride)
+        {
+            size_t i = 0;
+            for (; i + 32 <= bytes; i += 32)
+            {
+                uint64_t words[4];
+                memcpy(words, data + i, 32);
+                for (int k = 0; k < 4; k++)
+                    lanes[k] = hashRound(lanes[k], words[k]);
+            }
+
+            uint64_t tail[4] = { 0, 0, 0, 0 };
+            memcpy(tail, data + i, bytes - i);
+            for (int k = 0; k < 4; k++)
+                lanes[k] = hashRound(lanes[k], tail[k] ^ row);
+        }
+    }
+
+    uint64_t finish(int width, int height, int type) const
+    {
+        uint64_t hash = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+        hash = hashRound(hash, ((uint64_t)width << 32) | (uint32_t)height);
+        hash = hashRound(hash, type);
+
+        // Final avalanche
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+};
+
+uint64_t hashImage(const Mat& image)
+{
+    HashState state;
+    const size_t rowBytes = image.cols * image.elemSize();
+    state.addPlane(image.data, rowBytes, image.rows, image.rows > 1 ? image.step[0] : rowBytes);
+    return state.finish(image.cols, image.rows, image.type());
+}
+
+uint64_t hashFrame(const ImageFrame& frame)
+{
+    HashState state;
+    const int w = frame.width, h = frame.height;
+
+    // BGR and gray frames hash like the equivalent Mat
+    switch (frame.format)
+    {
+    case PixelFormat::BGR:
+        state.addPlane(frame.planes[0], w * 3, h, frame.strides[0]);
+        return state.finish(w, h, CV_8UC3);
+    case PixelFormat::Gray:
+        state.addPlane(frame.planes[0], w, h, frame.strides[0]);
+        return state.finish(w, h, CV_8UC1);
+    case PixelFormat::NV12:
+        state.addPlane(frame.planes[0], w, h, frame.strides[0]);
+        state.addPlane(frame.planes[1], w, h / 2, frame.strides[1]);
+        return state.finish(w, h, 0x3231564E);
+    case PixelFormat::YUYV:
+    default:
+        state.addPlane(frame.planes[0], w * 2, h, frame.strides[0]);
+        return state.finish(w, h, 0x56595559);
+    }
+}
+
+void scalePoints(const vector<Point>& points, float* pointData, int imageWidth, int imageHeight, int inputWidth, int inputHeight)
+{
+    // Image pixels to encoder input pixels, the scale of letterboxImageRect
+    const float inputScale = fillsInputWidth(imageWidth, imageHeight, inputWidth, inputHeight) ?
+        (float)inputWidth / imageWidth : (float)inputHeight / imageHeight;
+
+    // Prompts live in the decoder coordinate space regardless of the encoder resolution
+    const float scaleX = inputScale * PROMPT_COORD_SPACE / inputWidth;
+    const float scaleY = inputScale * PROMPT_COORD_SPACE / inputHeight;
+
+    for (int i = 0; i < points.size(); i++)
+    {
+        pointData[i * 2] = (float)points[i].x * scaleX;
+        pointData[i * 2 + 1] = (float)points[i].y * scaleY;
+    }
+}
+
+Rect letterboxMaskRect(int maskWidth, int maskHeight, int imageWidth, int imageHeight)
+{
+    // The mask spans the encoder input at a fixed ratio, so the image covers the same region of it
+    return letterboxImageRect(imageWidth, imageHeight, maskWidth, maskHeight);
+}
+
+void upscaleMask(Mat& mask, int targetWidth, int targetHeight)
+{
+    Mat upscaled;
+    upscaleMask(mask, upscaled, targetWidth, targetHeight);
+    mask = upscaled;
+}
+
+void upscaleMask(const Mat& lowResMask, Mat& mask, int targetWidth, int targetHeight)
+{
+    CV_Assert(lowResMask.type() == CV_32FC1 && lowResMask.data != mask.data);
+
+    Rect crop = letterboxMaskRect(lowResMask.cols, lowResMask.rows, targetWidth, targetHeight);
+    mask.create(targetHeight, targetWidth, CV_32FC1);
+    switch ((UpscaleKernel)gUpscaleKernel.load())
+    {
+    case UpscaleKernel::Separable: resizeLinear<float, 1>(lowResMask(crop), mask); break;
+    case UpscaleKernel::OpenCV:    resize(lowResMask(crop), mask, mask.size(), 0, 0, INTER_LINEAR); break;
+    case UpscaleKernel::Nearest:   resize(lowResMask(crop), mask, mask.size(), 0, 0, INTER_NEAREST); break;
+    }
+}
+
+void upscaleMaskNearest(const Mat& lowResMask, Mat& mask, int targetWidth, int targetHeight)
+{
+    CV_Assert(lowResMask.type() == CV_32FC1 && lowResMask.data != mask.data);
+
+    Rect crop = letterboxMaskRect(lowResMask.cols, lowResMask.rows, targetWidth, targetHeight);
+    resize(lowResMask(crop), mask, Size(targetWidth, targetHeight), 0, 0, INTER_NEAREST);
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+// CPU-side pre- and postprocessing shared by NanoSam and TRTModule
+
+enum class PixelFormat
+{
+    BGR,                                //!< Packed 8-bit BGR
+    Gray,                               //!< 8-bit luma
+    NV12,                               //!< Y plane followed by an interleaved UV plane at half resolution
+    YUYV                                //!< Packed Y0 U Y1 V for every pair of pixels
+};
+
+// Non-owning view of an image or camera frame; strides are in bytes.
+// YUV formats use BT.601 limited range, like cv::COLOR_YUV2BGR_NV12 and COLOR_YUV2BGR_YUYV.
+struct ImageFrame
+{
+    PixelFormat format;
+    int width;
+    int height;
+    const uchar* planes[2];
+    size_t strides[2];
+
+    Size size() const { return Size(width, height); }
+
+    // CV_8UC3 as BGR or CV_8UC1 as grayscale
+    static ImageFrame fromMat(const Mat& image);
+
+    static ImageFrame gray(const uchar* data, int width, int height, size_t stride);
+
+    static ImageFrame nv12(const uchar* y, size_t yStride, const uchar* uv, size_t uvStride, int width, int height);
+
+    static ImageFrame yuyv(const uchar* data, int width, int height, size_t stride);
+};
+
+// Implementations of resizeImage and of the resize in letterboxNormalize
+enum class ResizeKernel
+{
+    Separable,                          //!< Row-cached bilinear resize of image_ops.cpp, the reference
+    OpenCV,                             //!< cv::resize bilinear, on OpenCV's SIMD code paths for the host
+    OpenCVArea                          //!< cv::resize pixel area averaging, less aliasing when shrinking a lot
+};
+
+// Implementations of upscaleMask
+enum class UpscaleKernel
+{
+    Separable,                          //!< The reference
+    OpenCV,
+    Nearest                             //!< Like upscaleMaskNearest
+};
+
+// CPU kernel variants, process wide. The defaults are the reference kernels on the calling
+// thread; the Autotuner picks the fastest variants for the host that stay close to them.
+struct KernelConfig
+{
+    ResizeKernel resize = ResizeKernel::Separable;      //!< resizeImage
+    ResizeKernel letterbox = ResizeKernel::Separable;   //!< letterboxNormalize of BGR and gray frames, other formats stay fused
+    UpscaleKernel upscale = UpscaleKernel::Separable;   //!< upscaleMask
+    int threads = 1;                    //!< Row stripes of the separable kernels, also passed to cv::setNumThreads
+};
+
+// Meant for startup, kernels already running keep the variants they started with
+void setKernelConfig(const KernelConfig& config);
+
+KernelConfig getKernelConfig();
+
+const char* resizeKernelName(ResizeKernel kernel);
+
+const char* upscaleKernelName(UpscaleKernel kernel);
+
+// Resize keeping the aspect ratio into the top-left corner of a black inputWidth x inputHeight image
+Mat resizeImage(const Mat& img, int inputWidth, int inputHeight);
+
+// Same into out, which is only reallocated if its size or type differ
+void resizeImage(const Mat& img, Mat& out, int inputWidth, int inputHeight);
+
+// Region of the encoder input covered by the letterboxed image, scaled uniformly into its
+// top-left corner. scalePoints and letterboxMaskRect map prompts and masks through the same region.
+Rect letterboxImageRect(int imageWidth, int imageHeight, int inputWidth, int inputHeight);
+
+// Convert a BGR image into normalized planar RGB floats (ImageNet mean/std)
+void normalizeImage(const Mat& image, float* output);
+
+// resizeImage and normalizeImage in one pass, reading the frame in its own pixel format.
+// Color conversion happens on the resized samples, so no full-size BGR copy is made.
+void letterboxNormalize(const ImageFrame& frame, float* output, int inputWidth, int inputHeight);
+
+// Same resize and color conversion into packed 8-bit BGR with black padding, for encoders that
+// normalize in the model. A quarter of the bytes of letterboxNormalize, without its arithmetic.
+void letterboxImage(const ImageFrame& frame, uchar* output, int inputWidth, int inputHeight);
+
+// ImageNet normalization of 8-bit R, G and B values as value * kNormScale + kNormBias
+extern const float kNormScale[3];
+extern const float kNormBias[3];
+
+// 64-bit hash of the size, type and pixels of an image, to recognize repeated frames
+uint64_t hashImage(const Mat& image);
+
+uint64_t hashFrame(const ImageFrame& frame);
+
+// Scale prompt points from image pixels into the decoder coordinate space, which spans the
+// encoder input with PROMPT_COORD_SPACE along each side, through the letterbox of an
+// inputWidth x inputHeight encoder
+void scalePoints(const vector<Point>& points, float* pointData, int imageWidth, int imageHeight, int inputWidth, int inputHeight);
+
+// Region of a low resolution mask that covers the letterboxed image. The mask spans the encoder
+// input, e.g. 256 x 192 for a 1024 x 768 encoder, so this is letterboxImageRect at the mask size.
+Rect letterboxMaskRect(int maskWidth, int maskHeight, int imageWidth, int imageHeight);
+
+// Crop the letterboxed region of a low resolution mask and resize it to the image size
+void upscaleMask(Mat& mask, int targetWidth, int targetHeight);
+
+// Same into mask, which is only reallocated if its size or type differ
+void upscaleMask(const Mat& lowResMask, Mat& mask, int targetWidth, int targetHeight);
+
+// Nearest-neighbour version for previews, blocky but several times cheaper at large sizes
+void upscaleMaskNearest(const Mat& lowResMask, Mat& mask, int targetWidth, int targetHeight);
@@ -0,0 +1,285 @@
+#include "interactive_segmenter.h"
+#include "metrics.h"
+#include "trace.h"
+
+InteractiveSegmenter::InteractiveSegmenter(NanoSam& nanosam, int encoder)
+    : mNanoSam(nanosam), mEncoder(encoder), mHasPendingImage(false), mHasPendingPrompt(false), mIsRunning(false),
+      mStop(false), mHasResult(false), mIsProgressive(false), mLatestPromptId(0), mSpeculationGrid(0), mSnapDistance(0),
+      mNextSpeculation(0), mClickMapGeneration(0)
+{
+    mWorker = thread(&InteractiveSegmenter::run, this);
+}
+
+InteractiveSegmenter::~InteractiveSegmenter()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStop = true;
+    }
+    mCondition.notify_one();
+    mWorker.join();
+}
+
+void InteractiveSegmenter::setImage(const Mat& image)
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mPendingImage = image.clone();
+        mHasPendingImage = true;
+
+        // A decode still running belongs to the previous image, so its result is stale as well
+        if (mHasPendingPrompt) METRICS_COUNT(Counter::PromptsSuperseded, 1);
+        mHasPendingPrompt = false;
+        mHasResult = false;
+        mLatestPromptId++;
+
+        mImageSize = image.size();
+        mClickMap.reset(mSpeculationGrid, mImageSize);
+        mNextSpeculation = 0;
+        mClickMapGeneration++;
+    }
+    mCondition.notify_one();
+}
+
+uint64_t InteractiveSegmenter::prompt(const vector<Point>& points, const vector<float>& labels)
+{
+    uint64_t id;
+    SegmentationResult speculative;
+    bool isHit;
+    function<void()> callback;
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (mHasPendingPrompt) METRICS_COUNT(Counter::PromptsSuperseded, 1);
+
+        id = ++mLatestPromptId;
+        mPendingPrompt.id = id;
+        mPendingPrompt.points = points;
+        mPendingPrompt.labels = labels;
+        mPendingPrompt.submitted = Clock::now();
+        mHasPendingPrompt = true;
+
+        isHit = findSpeculative(id, points, labels, speculative);
+        if (isHit)
+        {
+            swap(mResult, speculative);
+            mHasResult = true;
+            callback = mResultCallback;
+        }
+    }
+    mCondition.notify_one();
+
+    if (callback) callback();
+    return id;
+}
+
+bool InteractiveSegmenter::findSpeculative(uint64_t promptId, const vector<Point>& points, const vector<float>& labels,
+    SegmentationResult& result)
+{
+    if (points.size() != 1 || labels.size() != 1 || labels[0] != 1.0f) return false;
+
+    auto start = Clock::now();
+    const double distance = mSnapDistance > 0 ? mSnapDistance : mClickMap.getDefaultDistance();
+    const ClickMapEntry* entry = mClickMap.find(points[0], distance);
+    if (!entry) return false;
+
+    METRICS_COUNT(Counter::ClickMapHits, 1);
+
+    // Logits of +1 and -1 keep the zero crossing on the mask boundary
+    Mat binary;
+    entry->mask.toMat(binary);
+    binary.convertTo(result.lowResLogits, CV_32FC1, 2.0 / 255, -1);
+
+    const double tolerance = (double)max(mImageSize.width, mImageSize.height) / result.lowResLogits.cols;
+    result.contours = extractContours(result.lowResLogits, mImageSize.width, mImageSize.height, tolerance);
+    result.promptId = promptId;
+    result.points = points;
+    result.labels = labels;
+    result.isPreview = true;
+    result.isSpeculative = true;
+    result.mask = Mat();
+    result.latency = chrono::duration<double, milli>(Clock::now() - start).count();
+    return true;
+}
+
+bool InteractiveSegmenter::poll(SegmentationResult& result)
+{
+    lock_guard<mutex> lock(mMutex);
+    if (!mHasResult) return false;
+
+    swap(result, mResult);
+    mHasResult = false;
+    return true;
+}
+
+void InteractiveSegmenter::setResultCallback(function<void()> callback)
+{
+    lock_guard<mutex> lock(mMutex);
+    mResultCallback = callback;
+}
+
+void InteractiveSegmenter::setProgressive(bool enabled)
+{
+    lock_guard<mutex> lock(mMutex);
+    mIsProgressive = enabled;
+}
+
+void InteractiveSegmenter::setSpeculation(int gridSize, double snapDistance)
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mSpeculationGrid = gridSize;
+        mSnapDistance = snapDistance;
+        mClickMap.reset(gridSize, mImageSize);
+        mNextSpeculation = 0;
+        mClickMapGeneration++;
+    }
+    mCondition.notify_one();
+}
+
+size_t InteractiveSegmenter::getClickMapSize() const
+{
+    lock_guard<mutex> lock(mMutex);
+    return min(mNextSpeculation, mClickMap.size());
+}
+
+void InteractiveSegmenter::cancel()
+{
+    lock_guard<mutex> lock(mMutex);
+    if (mHasPendingPrompt) METRICS_COUNT(Counter::PromptsSuperseded, 1);
+    mHasPendingPrompt = false;
+    mHasResult = false;
+    mLatestPromptId++;
+}
+
+bool InteractiveSegmenter::isBusy() const
+{
+    lock_guard<mutex> lock(mMutex);
+    return mIsRunning || mHasPendingImage || mHasPendingPrompt;
+}
+
+void InteractiveSegmenter::run()
+{
+    Tracer::setThreadName("interactive segmenter");
+
+    bool hasImage = false;
+    Size imageSize;
+    Mat speculativeLogits;
+    unique_lock<mutex> lock(mMutex);
+
+    while (true)
+    {
+        mCondition.wait(lock, [&]()
+        {
+            return mStop || mHasPendingImage || mHasPendingPrompt || (hasImage && mNextSpeculation < mClickMap.size());
+        });
+        if (mStop) break;
+
+        // A new image takes precedence, prompts queued after it wait for its embeddings
+        if (mHasPendingImage)
+        {
+            Mat image = mPendingImage;
+            mPendingImage = Mat();
+            mHasPendingImage = false;
+            mIsRunning = true;
+
+            lock.unlock();
+            mNanoSam.setImage(image, mEncoder);
+            lock.lock();
+
+            mIsRunning = false;
+            hasImage = true;
+            imageSize = image.size();
+            continue;
+        }
+
+        // Idle: decode the next candidate click, then look for real work again
+        if (!mHasPendingPrompt)
+        {
+            const int order = mNextSpeculation++;
+            const Point point = mClickMap.getPoint(order);
+            const uint64_t generation = mClickMapGeneration;
+
+            lock.unlock();
+            mNanoSam.decodePreview({ point }, { 1.0f }, speculativeLogits);
+            const float iou = mNanoSam.getIouPrediction();
+            METRICS_COUNT(Counter::SpeculativeDecodes, 1);
+            lock.lock();
+
+            if (generation == mClickMapGeneration)
+                mClickMap.store(order, speculativeLogits, iou);
+            continue;
+        }
+
+        Prompt prompt = std::move(mPendingPrompt);
+        mHasPendingPrompt = false;
+        if (!hasImage) continue;
+        mIsRunning = true;
+        bool isProgressive = mIsProgressive;
+
+        SegmentationResult result;
+        result.promptId = prompt.id;
+        result.points = prompt.points;
+        result.labels = prompt.labels;
+        result.isSpeculative = false;
+
+        lock.unlock();
+        if (isProgressive)
+        {
+            // Preview: the outline of the logits, cheap at any image size
+            mNanoSam.decodePreview(prompt.points, prompt.labels, result.lowResLogits);
+            const double tolerance = (double)max(imageSize.width, imageSize.height) / result.lowResLogits.cols;
+            result.contours = extractContours(result.lowResLogits, imageSize.width, imageSize.height, tolerance);
+            result.isPreview = true;
+            result.latency = chrono::duration<double, milli>(Clock::now() - prompt.submitted).count();
+
+            lock.lock();
+            SegmentationResult preview = result;
+            if (!deliver(preview, lock))
+            {
+                mIsRunning = false;
+                continue;
+            }
+            if (mHasPendingPrompt)
+            {
+                METRICS_COUNT(Counter::RefinementsSkipped, 1);
+                mIsRunning = false;
+                continue;
+            }
+            lock.unlock();
+
+            mNanoSam.refinePreview(result.mask);
+            result.contours = traceContours(result.mask);
+        }
+        else
+        {
+            mNanoSam.decode(prompt.points, prompt.labels, result.mask);
+        }
+        result.isPreview = false;
+        result.latency = chrono::duration<double, milli>(Clock::now() - prompt.submitted).count();
+        lock.lock();
+
+        mIsRunning = false;
+        deliver(result, lock);
+    }
+}
+
+bool InteractiveSegmenter::deliver(SegmentationResult& result, unique_lock<mutex>& lock)
+{
+    if (isSuperseded(result.promptId))
+    {
+        METRICS_COUNT(Counter::PromptsSuperseded, 1);
+        return false;
+    }
+
+    swap(mResult, result);
+    mHasResult = true;
+
+    if (mResultCallback)
+    {
+        auto callback = mResultCallback;
+        lock.unlock();
+        callback();
+        lock.lock();
+    }
+    return true;
+}
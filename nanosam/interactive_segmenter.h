@@ -0,0 +1,127 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "click_map.h"
+#include "nanosam.h"
+
+// Mask of one prompt, delivered to the UI thread
+struct SegmentationResult
+{
+    uint64_t promptId;
+    vector<Point> points;
+    vector<float> labels;
+    bool isPreview;                     //!< Coarse result, the full resolution one follows
+    bool isSpeculative;                 //!< Preview served from the click map of the nearest grid point
+    Mat mask;                           //!< Logits at the image size, foreground > 0. Empty for previews.
+    Mat lowResLogits;                   //!< Decoder logits, set in progressive mode
+    vector<MaskContour> contours;       //!< Outline in image coordinates, set in progressive mode
+    double latency;                     //!< Milliseconds from prompt to completion
+};
+
+// Runs NanoSam on a worker thread for interactive viewers, so the UI thread never waits on
+// inference. The image is encoded as soon as it is set, and prompts are latest-wins: a prompt
+// that has not started when a newer one arrives is dropped, as is a finished mask that a newer
+// prompt already superseded. While the segmenter exists, only its worker may use the NanoSam.
+//
+// In progressive mode a prompt is delivered twice: first a preview with the low resolution logits
+// and their outline right after decoding, then the upscaled mask with contours traced at full
+// resolution. The refinement is skipped when a newer prompt arrives in between.
+//
+// With speculation enabled, the idle worker decodes a grid of candidate clicks after encoding,
+// one decode at a time so real prompts wait for at most one of them. A single foreground click
+// near a decoded candidate is answered at once with a speculative preview from its mask, and
+// the exact decode follows as usual.
+class InteractiveSegmenter
+{
+
+public:
+
+    InteractiveSegmenter(NanoSam& nanosam, int encoder = 0);
+
+    ~InteractiveSegmenter();
+
+    // Start encoding a copy of the image. Pending prompts for the previous image are dropped.
+    void setImage(const Mat& image);
+
+    // Queue a prompt against the current image, replacing any prompt that has not started.
+    // Returns the id of the prompt.
+    uint64_t prompt(const vector<Point>& points, const vector<float>& labels);
+
+    // Take the result of the newest completed prompt, if there is one. Called from the UI loop.
+    bool poll(SegmentationResult& result);
+
+    // Deliver a preview ahead of every full resolution result, off by default
+    void setProgressive(bool enabled);
+
+    // Decode a gridSize x gridSize grid of candidate clicks while idle, 0 disables it.
+    // Clicks within snapDistance image pixels of a candidate hit the click map, by default a
+    // quarter of the grid spacing. Hits arrive as previews, even outside of progressive mode.
+    void setSpeculation(int gridSize, double snapDistance = 0);
+
+    // Decoded candidates of the current image
+    size_t getClickMapSize() const;
+
+    // Called when a result is ready, e.g. to wake up a UI event loop. Runs on the worker thread,
+    // or on the prompting thread for click map hits.
+    void setResultCallback(function<void()> callback);
+
+    // Drop the pending prompt and any result not yet polled
+    void cancel();
+
+    // True while an image is being encoded or a prompt is pending or running
+    bool isBusy() const;
+
+private:
+
+    typedef chrono::steady_clock Clock;
+
+    struct Prompt
+    {
+        uint64_t id;
+        vector<Point> points;
+        vector<float> labels;
+        Clock::time_point submitted;
+    };
+
+    NanoSam& mNanoSam;
+    int mEncoder;
+
+    mutable mutex mMutex;
+    condition_variable mCondition;
+    Mat mPendingImage;
+    bool mHasPendingImage;
+    Prompt mPendingPrompt;
+    bool mHasPendingPrompt;
+    bool mIsRunning;                    //!< The worker is encoding or decoding
+    bool mStop;
+
+    SegmentationResult mResult;
+    bool mHasResult;
+    bool mIsProgressive;
+    uint64_t mLatestPromptId;
+    function<void()> mResultCallback;
+
+    ClickMap mClickMap;
+    int mSpeculationGrid;
+    double mSnapDistance;
+    int mNextSpeculation;               //!< Decode order of the next candidate
+    uint64_t mClickMapGeneration;       //!< Changes whenever the click map is reset
+    Size mImageSize;
+
+    thread mWorker;
+
+    void run();
+
+    // Answer a single foreground click from the click map, called with the lock held
+    bool findSpeculative(uint64_t promptId, const vector<Point>& points, const vector<float>& labels,
+        SegmentationResult& result);
+
+    // Publish a result unless its prompt is superseded, returns false if it is
+    bool deliver(SegmentationResult& result, unique_lock<mutex>& lock);
+
+    bool isSuperseded(uint64_t promptId) const { return promptId != mLatestPromptId || mHasPendingImage; }
+};
@@ -0,0 +1,143 @@
+#include "mask_cleanup.h"
+#include "arena.h"
+
+#include <cmath>
+
+// Runs of one color in row-major order. Run indices double as union-find nodes.
+struct RunTable
+{
+    int* start;                         //!< First column
+    int* end;                           //!< One past the last column
+    int* parent;
+    int* area;                          //!< Region area, valid at the roots
+    bool* isBorder;                     //!< Region touches the edge of the mask, valid at the roots
+    int* rowFirst;                      //!< Index of the first run of each row, and the total at the end
+};
+
+static int findRoot(int* parent, int i)
+{
+    // Path halving
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static void unite(int* parent, int a, int b)
+{
+    a = findRoot(parent, a);
+    b = findRoot(parent, b);
+    if (a != b) parent[max(a, b)] = min(a, b);
+}
+
+static inline bool isForeground(float value, float threshold) { return value > threshold; }
+
+// Labels the regions of one color and flips the small ones: holes that do not touch the edge,
+// or islands, keeping the largest if all are small. Returns the number of regions flipped.
+static int flipSmallRegions(Mat& mask, float threshold, bool foreground, int maxArea)
+{
+    ArenaScope scope;
+    ScratchArena& arena = scope.arena();
+
+    const int w = mask.cols, h = mask.rows;
+    const size_t maxRuns = (size_t)h * ((w + 1) / 2) + 1;
+    RunTable runs = { arena.allocate<int>(maxRuns), arena.allocate<int>(maxRuns), arena.allocate<int>(maxRuns),
+        arena.allocate<int>(maxRuns), arena.allocate<bool>(maxRuns), arena.allocate<int>(h + 1) };
+
+    // Foreground is 8-connected, so runs touching diagonally join; background is 4-connected
+    const int reach = foreground ? 1 : 0;
+
+    int count = 0;
+    for (int y = 0; y < h; y++)
+    {
+        runs.rowFirst[y] = count;
+        const float* row = mask.ptr<float>(y);
+        for (int x = 0; x < w;)
+        {
+            if (isForeground(row[x], threshold) != foreground)
+            {
+                x++;
+                continue;
+            }
+            const int start = x;
+            while (x < w && isForeground(row[x], threshold) == foreground) x++;
+
+            runs.start[count] = start;
+            runs.end[count] = x;
+            runs.parent[count] = count;
+            runs.area[count] = 0;
+            runs.isBorder[count] = false;
+            count++;
+        }
+
+        if (y == 0) continue;
+
+        // Join with the overlapping runs of the previous row, both rows are sorted by column
+        int previous = runs.rowFirst[y - 1];
+        const int previousEnd = runs.rowFirst[y];
+        for (int i = runs.rowFirst[y]; i < count; i++)
+        {
+            while (previous < previousEnd && runs.end[previous] + reach <= runs.start[i]) previous++;
+            for (int j = previous; j < previousEnd && runs.start[j] < runs.end[i] + reach; j++)
+                unite(runs.parent, i, j);
+        }
+    }
+    runs.rowFirst[h] = count;
+
+    for (int y = 0; y < h; y++)
+    {
+        for (int i = runs.rowFirst[y]; i < runs.rowFirst[y + 1]; i++)
+        {
+            const int root = findRoot(runs.parent, i);
+            runs.area[root] += runs.end[i] - runs.start[i];
+            runs.isBorder[root] = runs.isBorder[root] || y == 0 || y == h - 1 || runs.start[i] == 0 || runs.end[i] == w;
+        }
+    }
+
+    // Roots are the first run of their region, so each region is decided once
+    int largest = -1, numFlipped = 0, numRegions = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (runs.parent[i] != i) continue;
+        numRegions++;
+        if (largest < 0 || runs.area[i] > runs.area[largest]) largest = i;
+
+        const bool isSmall = runs.area[i] < maxArea && (foreground || !runs.isBorder[i]);
+        runs.isBorder[i] = isSmall;     // Reused as the flip flag
+        numFlipped += isSmall;
+    }
+    if (foreground && numFlipped == numRegions && largest >= 0)
+    {
+        runs.isBorder[largest] = false;
+        numFlipped--;
+    }
+    if (numFlipped == 0) return 0;
+
+    // Mirror across the threshold, nudging holes at exactly the threshold into the foreground
+    const float aboveThreshold = nextafter(threshold, INFINITY);
+    for (int y = 0; y < h; y++)
+    {
+        float* row = mask.ptr<float>(y);
+        for (int i = runs.rowFirst[y]; i < runs.rowFirst[y + 1]; i++)
+        {
+            if (!runs.isBorder[findRoot(runs.parent, i)]) continue;
+            for (int x = runs.start[i]; x < runs.end[i]; x++)
+                row[x] = foreground ? 2 * threshold - row[x] : max(2 * threshold - row[x], aboveThreshold);
+        }
+    }
+    return numFlipped;
+}
+
+int cleanupMask(Mat& mask, int minIslandArea, int maxHoleArea, float threshold)
+{
+    CV_Assert(mask.type() == CV_32FC1);
+    if (mask.empty()) return 0;
+
+    // Holes first, so islands inside filled holes join the surrounding region
+    int numChanged = 0;
+    if (maxHoleArea > 0) numChanged += flipSmallRegions(mask, threshold, false, maxHoleArea);
+    if (minIslandArea > 0) numChanged += flipSmallRegions(mask, threshold, true, minIslandArea);
+    return numChanged;
+}
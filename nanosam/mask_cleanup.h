@@ -0,0 +1,18 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+// Fill holes, background regions enclosed by the mask, smaller than maxHoleArea, then remove
+// foreground islands smaller than minIslandArea, in place on a CV_32FC1 mask such as the low
+// resolution decoder logits. Areas are in pixels of the mask, 0 disables either step. If every
+// island is below the minimum, the largest one is kept.
+//
+// Regions are found by connected component labeling on the runs of each row, joined with
+// union-find: foreground is 8-connected and background 4-connected, so they do not cross.
+// Background touching the edge of the mask is never a hole. Changed pixels are mirrored across
+// the threshold, so upscaling and contour tracing see the cleaned mask with smooth edges.
+// Scratch memory comes from the thread's arena. Returns the number of regions changed.
+int cleanupMask(Mat& mask, int minIslandArea, int maxHoleArea, float threshold = 0.0f);
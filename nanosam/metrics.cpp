@@ -0,0 +1,356 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+// Log-linear buckets: values below 64 ns get their own bucket, above that every
+// power of two is split into 32 sub-buckets
+static const int SUB_BUCKET_BITS = 5;
+static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+static const int MAX_MSB = 42;
+static const int NUM_BUCKETS = (MAX_MSB - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+static const int NUM_STAGES = (int)Stage::Count;
+static const int NUM_COUNTERS = (int)Counter::Count;
+static const int NUM_GAUGES = (int)Gauge::Count;
+
+// Fixed upper bounds exported as Prometheus buckets, in seconds
+static const double EXPORT_BOUNDS[] = { 50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3, 25e-3, 50e-3, 100e-3, 250e-3, 500e-3, 1.0 };
+
+static int highestBit(uint64_t v)
+{
+    int index = 0;
+    while (v >>= 1) index++;
+    return index;
+}
+
+static int bucketIndex(uint64_t value)
+{
+    value = min<uint64_t>(value, (1ULL << (MAX_MSB + 1)) - 1);
+    if (value < 2 * SUB_BUCKETS) return (int)value;
+
+    int shift = highestBit(value) - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) - SUB_BUCKETS);
+}
+
+static uint64_t bucketLower(int index)
+{
+    if (index < 2 * SUB_BUCKETS) return index;
+
+    int shift = index / SUB_BUCKETS - 1;
+    return (uint64_t)(index % SUB_BUCKETS + SUB_BUCKETS) << shift;
+}
+
+static uint64_t bucketUpper(int index)
+{
+    if (index < 2 * SUB_BUCKETS) return index;
+
+    int shift = index / SUB_BUCKETS - 1;
+    return ((uint64_t)(index % SUB_BUCKETS + SUB_BUCKETS + 1) << shift) - 1;
+}
+
+// Histograms of one thread. Only the owning thread writes, so updates are plain relaxed stores.
+struct ThreadMetrics
+{
+    atomic<uint64_t> buckets[NUM_STAGES][NUM_BUCKETS];
+    atomic<uint64_t> sums[NUM_STAGES];
+    atomic<uint64_t> mins[NUM_STAGES];
+    atomic<uint64_t> maxs[NUM_STAGES];
+    atomic<uint64_t> counters[NUM_COUNTERS];
+    bool inUse;
+
+    ThreadMetrics() : inUse(false) { clear(); }
+
+    void clear()
+    {
+        for (int s = 0; s < NUM_STAGES; s++)
+        {
+            for (int b = 0; b < NUM_BUCKETS; b++)
+                buckets[s][b].store(0, memory_order_relaxed);
+            sums[s].store(0, memory_order_relaxed);
+            mins[s].store(UINT64_MAX, memory_order_relaxed);
+            maxs[s].store(0, memory_order_relaxed);
+        }
+        for (int c = 0; c < NUM_COUNTERS; c++)
+            counters[c].store(0, memory_order_relaxed);
+    }
+};
+
+static inline void add(atomic<uint64_t>& value, uint64_t amount)
+{
+    value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Per-thread histograms are kept after their thread exits and handed to the next new thread
+static mutex gRegistryMutex;
+static vector<unique_ptr<ThreadMetrics>>* gRegistry = new vector<unique_ptr<ThreadMetrics>>();
+
+struct ThreadSlot
+{
+    ThreadMetrics* metrics;
+
+    ThreadSlot() : metrics(nullptr)
+    {
+        lock_guard<mutex> lock(gRegistryMutex);
+        for (auto& entry : *gRegistry)
+        {
+            if (!entry->inUse)
+            {
+                metrics = entry.get();
+                break;
+            }
+        }
+        if (!metrics)
+        {
+            gRegistry->emplace_back(new ThreadMetrics());
+            metrics = gRegistry->back().get();
+        }
+        metrics->inUse = true;
+    }
+
+    ~ThreadSlot()
+    {
+        lock_guard<mutex> lock(gRegistryMutex);
+        metrics->inUse = false;
+    }
+};
+
+static ThreadMetrics& localMetrics()
+{
+    thread_local ThreadSlot slot;
+    return *slot.metrics;
+}
+
+// Gauges are rare writes of a current state, so they live outside the per-thread slots
+static atomic<double> gGauges[NUM_GAUGES];
+
+static thread_local StageCapture* tStageCapture = nullptr;
+
+StageCapture::StageCapture() : mPrevious(tStageCapture)
+{
+    for (auto& time : times) time = 0;
+    tStageCapture = this;
+}
+
+StageCapture::~StageCapture()
+{
+    tStageCapture = mPrevious;
+}
+
+StageCapture* StageCapture::current()
+{
+    return tStageCapture;
+}
+
+void Metrics::record(Stage stage, uint64_t nanoseconds)
+{
+    ThreadMetrics& metrics = localMetrics();
+    const int s = (int)stage;
+
+    add(metrics.buckets[s][bucketIndex(nanoseconds)], 1);
+    add(metrics.sums[s], nanoseconds);
+    if (nanoseconds < metrics.mins[s].load(memory_order_relaxed)) metrics.mins[s].store(nanoseconds, memory_order_relaxed);
+    if (nanoseconds > metrics.maxs[s].load(memory_order_relaxed)) metrics.maxs[s].store(nanoseconds, memory_order_relaxed);
+}
+
+void Metrics::increment(Counter counter, uint64_t value)
+{
+    add(localMetrics().counters[(int)counter], value);
+}
+
+void Metrics::set(Gauge gauge, double value)
+{
+    gGauges[(int)gauge].store(value, memory_order_relaxed);
+}
+
+void Metrics::reset()
+{
+    lock_guard<mutex> lock(gRegistryMutex);
+    for (auto& entry : *gRegistry)
+        entry->clear();
+}
+
+const char* Metrics::stageName(Stage stage)
+{
+    static const char* names[] = { "predict", "hash", "resize", "normalize", "encode", "host_to_device", "execute",
+        "device_to_host", "decoder_input", "decode", "upscale", "wait_interactive", "wait_standard", "wait_batch", "frame",
+        "mask_cleanup" };
+    return names[(int)stage];
+}
+
+const char* Metrics::counterName(Counter counter)
+{
+    static const char* names[] = { "cache_hits", "cache_misses", "allocations", "bytes_host_to_device", "bytes_device_to_host", "prompts_superseded",
+        "refinements_skipped", "speculative_decodes", "click_map_hits",
+        "requests_rejected", "requests_shed", "preemptions", "frames_over_budget", "encodes_skipped",
+        "quality_downgrades", "quality_upgrades", "shared_cache_hits", "shared_cache_misses", "shared_cache_evictions",
+        "router_locality_hits", "router_locality_misses", "router_overflows", "mask_regions_cleaned",
+        "decode_cache_hits", "decode_cache_misses" };
+    return names[(int)counter];
+}
+
+const char* Metrics::gaugeName(Gauge gauge)
+{
+    static const char* names[] = { "quality_level", "encode_interval", "mask_scale", "contours_enabled", "run_length_masks",
+        "slo_attainment" };
+    return names[(int)gauge];
+}
+
+MetricsSnapshot Metrics::snapshot()
+{
+    vector<uint64_t> buckets(NUM_STAGES * NUM_BUCKETS, 0);
+    vector<uint64_t> sums(NUM_STAGES, 0), mins(NUM_STAGES, UINT64_MAX), maxs(NUM_STAGES, 0);
+    vector<uint64_t> counters(NUM_COUNTERS, 0);
+
+    {
+        lock_guard<mutex> lock(gRegistryMutex);
+        for (auto& entry : *gRegistry)
+        {
+            for (int s = 0; s < NUM_STAGES; s++)
+            {
+                for (int b = 0; b < NUM_BUCKETS; b++)
+                    buckets[s * NUM_BUCKETS + b] += entry->buckets[s][b].load(memory_order_relaxed);
+                sums[s] += entry->sums[s].load(memory_order_relaxed);
+                mins[s] = min(mins[s], entry->mins[s].load(memory_order_relaxed));
+                maxs[s] = max(maxs[s], entry->maxs[s].load(memory_order_relaxed));
+            }
+            for (int c = 0; c < NUM_COUNTERS; c++)
+                counters[c] += entry->counters[c].load(memory_order_relaxed);
+        }
+    }
+
+    MetricsSnapshot snapshot;
+    for (int s = 0; s < NUM_STAGES; s++)
+    {
+        const uint64_t* stageBuckets = &buckets[s * NUM_BUCKETS];
+
+        StageSummary summary;
+        summary.name = stageName((Stage)s);
+        summary.count = 0;
+        for (int b = 0; b < NUM_BUCKETS; b++)
+            summary.count += stageBuckets[b];
+
+        summary.sum = sums[s] * 1e-9;
+        summary.min = summary.count ? mins[s] * 1e-9 : 0.0;
+        summary.max = maxs[s] * 1e-9;
+        summary.mean = summary.count ? summary.sum / summary.count : 0.0;
+
+        // Quantiles at the bucket midpoints, clamped to the observed range
+        auto quantile = [&](double q)
+        {
+            if (summary.count == 0) return 0.0;
+            uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(q * summary.count));
+            uint64_t cumulative = 0;
+            for (int b = 0; b < NUM_BUCKETS; b++)
+            {
+                cumulative += stageBuckets[b];
+                if (cumulative >= rank)
+                {
+                    double value = 0.5 * (bucketLower(b) + bucketUpper(b)) * 1e-9;
+                    return min(max(value, summary.min), summary.max);
+                }
+            }
+            return summary.max;
+        };
+        summary.p50 = quantile(0.5);
+        summary.p90 = quantile(0.9);
+        summary.p99 = quantile(0.99);
+        summary.p999 = quantile(0.999);
+
+        uint64_t cumulative = 0;
+        int b = 0;
+        for (double bound : EXPORT_BOUNDS)
+        {
+            for (; b < NUM_BUCKETS && bucketUpper(b) * 1e-9 <= bound; b++)
+                cumulative += stageBuckets[b];
+            summary.buckets.push_back({ bound, cumulative });
+        }
+
+        snapshot.stages.push_back(summary);
+    }
+
+    for (int c = 0; c < NUM_COUNTERS; c++)
+        snapshot.counters.push_back({ counterName((Counter)c), counters[c] });
+
+    for (int g = 0; g < NUM_GAUGES; g++)
+        snapshot.gauges.push_back({ gaugeName((Gauge)g), gGauges[g].load(memory_order_relaxed) });
+
+    return snapshot;
+}
+
+string Metrics::toPrometheus()
+{
+    MetricsSnapshot snap = snapshot();
+    ostringstream out;
+    out << setprecision(9);
+
+    out << "# HELP nanosam_stage_seconds Latency of the NanoSam pipeline stages.\n";
+    out << "# TYPE nanosam_stage_seconds histogram\n";
+    for (auto& stage : snap.stages)
+    {
+        for (auto& bucket : stage.buckets)
+            out << "nanosam_stage_seconds_bucket{stage=\"" << stage.name << "\",le=\"" << bucket.first << "\"} " << bucket.second << "\n";
+        out << "nanosam_stage_seconds_bucket{stage=\"" << stage.name << "\",le=\"+Inf\"} " << stage.count << "\n";
+        out << "nanosam_stage_seconds_sum{stage=\"" << stage.name << "\"} " << stage.sum << "\n";
+        out << "nanosam_stage_seconds_count{stage=\"" << stage.name << "\"} " << stage.count << "\n";
+    }
+
+    out << "# HELP nanosam_stage_quantile_seconds Latency quantiles of the NanoSam pipeline stages.\n";
+    out << "# TYPE nanosam_stage_quantile_seconds gauge\n";
+    for (auto& stage : snap.stages)
+    {
+        const pair<const char*, double> quantiles[] = { { "0.5", stage.p50 }, { "0.9", stage.p90 }, { "0.99", stage.p99 }, { "0.999", stage.p999 } };
+        for (auto& q : quantiles)
+            out << "nanosam_stage_quantile_seconds{stage=\"" << stage.name << "\",quantile=\"" << q.first << "\"} " << q.second << "\n";
+    }
+
+    for (auto& counter : snap.counters)
+    {
+        out << "# TYPE nanosam_" << counter.first << "_total counter\n";
+        out << "nanosam_" << counter.first << "_total " << counter.second << "\n";
+    }
+
+    for (auto& gauge : snap.gauges)
+    {
+        out << "# TYPE nanosam_" << gauge.first << " gauge\n";
+        out << "nanosam_" << gauge.first << " " << gauge.second << "\n";
+    }
+
+    return out.str();
+}
+
+string Metrics::toJson()
+{
+    MetricsSnapshot snap = snapshot();
+    ostringstream out;
+    out << setprecision(9);
+
+    out << "{\"stages\":{";
+    for (size_t i = 0; i < snap.stages.size(); i++)
+    {
+        auto& stage = snap.stages[i];
+        out << (i ? "," : "") << "\"" << stage.name << "\":{"
+            << "\"count\":" << stage.count
+            << ",\"sum\":" << stage.sum
+            << ",\"min\":" << stage.min
+            << ",\"max\":" << stage.max
+            << ",\"mean\":" << stage.mean
+            << ",\"p50\":" << stage.p50
+            << ",\"p90\":" << stage.p90
+            << ",\"p99\":" << stage.p99
+            << ",\"p999\":" << stage.p999 << "}";
+    }
+    out << "},\"counters\":{";
+    for (size_t i = 0; i < snap.counters.size(); i++)
+        out << (i ? "," : "") << "\"" << snap.counters[i].first << "\":" << snap.counters[i].second;
+    out << "},\"gauges\":{";
+    for (size_t i = 0; i < snap.gauges.size(); i++)
+        out << (i ? "," : "") << "\"" << snap.gauges[i].first << "\":" << snap.gauges[i].second;
+    out << "}}";
+
+    return out.str();
+}
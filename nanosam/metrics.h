@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "trace.h"
+
+using namespace std;
+
+// Instrumented stages of NanoSam::predict
+enum class Stage
+{
+    Predict,                            //!< Whole predict or decode call
+    Hash,                               //!< Content hash of the input image for the embedding cache
+    Resize,                             //!< Letterbox resize, color conversion and normalization into the encoder input
+    Normalize,                          //!< Normalization of a BGR image by TRTModule::setInput
+    Encode,                             //!< Encoder inference including copies
+    HostToDevice,                       //!< Input copies of a TRTModule
+    Execute,                            //!< executeV2 of a TRTModule
+    DeviceToHost,                       //!< Output copies of a TRTModule
+    DecoderInput,                       //!< Prompt and mask input preparation
+    Decode,                             //!< Decoder inference including copies
+    Upscale,                            //!< Upscaling the mask to the image size
+    WaitInteractive,                    //!< Queueing time of interactive requests in a RequestScheduler
+    WaitStandard,                       //!< Queueing time of standard requests
+    WaitBatch,                          //!< Queueing time of batch requests
+    Frame,                              //!< Whole frame of a StreamSegmenter
+    MaskCleanup,                        //!< Hole filling and small region removal on the low resolution mask
+    Count
+};
+
+enum class Counter
+{
+    CacheHits,
+    CacheMisses,
+    Allocations,                        //!< Heap allocations of requests, reported by tools that install the allocation counter
+    BytesHostToDevice,
+    BytesDeviceToHost,
+    PromptsSuperseded,                  //!< Interactive prompts dropped for a newer one
+    RefinementsSkipped,                 //!< Progressive previews not refined because a newer prompt arrived
+    SpeculativeDecodes,                 //!< Candidate clicks decoded while idle
+    ClickMapHits,                       //!< Clicks answered from the speculative click map
+    RequestsRejected,                   //!< Scheduler requests refused at admission for their deadline
+    RequestsShed,                       //!< Scheduler requests dropped when picked, past saving
+    Preemptions,                        //!< Encoded scheduler requests put back for a higher class
+    FramesOverBudget,                   //!< Stream frames that took longer than their budget
+    EncodesSkipped,                     //!< Stream frames decoded against the embeddings of an earlier frame
+    QualityDowngrades,                  //!< Stream quality level changes towards cheaper settings
+    QualityUpgrades,
+    SharedCacheHits,                    //!< Embeddings found in the cross-process cache
+    SharedCacheMisses,
+    SharedCacheEvictions,               //!< Cross-process cache slots reused for another image
+    RouterLocalityHits,                 //!< Routed requests for an image sent where it was sent before
+    RouterLocalityMisses,
+    RouterOverflows,                    //!< Routed requests passed on from a full home instance
+    MaskRegionsCleaned,                 //!< Holes filled and islands removed by the mask cleanup
+    DecodeCacheHits,                    //!< Prompts answered from the decode cache without decoding
+    DecodeCacheMisses,
+    Count
+};
+
+// Last set values, process wide
+enum class Gauge
+{
+    QualityLevel,                       //!< Stream quality level, 0 is full quality
+    EncodeInterval,                     //!< Stream frames per encoder run
+    MaskScale,                          //!< Stream mask resolution relative to the frame
+    ContoursEnabled,                    //!< 1 if stream frames trace contours
+    RunLengthMasks,                     //!< 1 if stream masks are run-length encoded instead of dense
+    SloAttainment,                      //!< Share of recent stream frames within their budget
+    Count
+};
+
+// Latency distribution of one stage
+struct StageSummary
+{
+    string name;
+    uint64_t count;
+    double sum;                         //!< Seconds
+    double min;
+    double max;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+    vector<pair<double, uint64_t>> buckets; //!< Cumulative counts for fixed upper bounds in seconds
+};
+
+struct MetricsSnapshot
+{
+    vector<StageSummary> stages;
+    vector<pair<string, uint64_t>> counters;
+    vector<pair<string, double>> gauges;
+};
+
+// Process wide latency histograms and counters.
+// Every thread records into its own log-linear (HDR style, ~3% precision) histograms with
+// relaxed atomic stores, so recording never takes a lock. Snapshots merge all threads.
+class Metrics
+{
+
+public:
+
+    static void record(Stage stage, uint64_t nanoseconds);
+
+    static void increment(Counter counter, uint64_t value = 1);
+
+    static void set(Gauge gauge, double value);
+
+    static MetricsSnapshot snapshot();
+
+    // Prometheus text exposition format
+    static string toPrometheus();
+
+    static string toJson();
+
+    static void reset();
+
+    static const char* stageName(Stage stage);
+
+    static const char* counterName(Counter counter);
+
+    static const char* gaugeName(Gauge gauge);
+};
+
+// Sums the stage times of the calling thread while in scope, e.g. to log them per call.
+// Captures nest, only the innermost one receives the times.
+class StageCapture
+{
+
+public:
+
+    StageCapture();
+
+    ~StageCapture();
+
+    int64_t times[(int)Stage::Count];   //!< Nanoseconds
+
+    // Innermost capture of the calling thread, nullptr if there is none
+    static StageCapture* current();
+
+private:
+
+    StageCapture* mPrevious;
+};
+
+// Records a stage time measured elsewhere, e.g. with device events, like ScopedStageTimer does
+inline void recordStageTime(Stage stage, int64_t start, int64_t elapsed)
+{
+    if (StageCapture* capture = StageCapture::current()) capture->times[(int)stage] += elapsed;
+#ifdef ENABLE_METRICS
+    Metrics::record(stage, (uint64_t)elapsed);
+#endif
+#ifdef ENABLE_TRACING
+    if (Tracer::isEnabled()) Tracer::record(Metrics::stageName(stage), start, elapsed);
+#endif
+}
+
+// Records the lifetime of the scope into a stage histogram and, while tracing is enabled, as a trace span
+class ScopedStageTimer
+{
+
+public:
+
+    ScopedStageTimer(Stage stage) : mStage(stage), mStart(Tracer::now()) {}
+
+    ~ScopedStageTimer()
+    {
+        recordStageTime(mStage, mStart, Tracer::now() - mStart);
+    }
+
+private:
+
+    Stage mStage;
+    int64_t mStart;
+};
+
+#define METRICS_CONCAT_INNER(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT_INNER(a, b)
+
+#if defined(ENABLE_METRICS) || defined(ENABLE_TRACING)
+#define METRICS_SCOPE(stage) ScopedStageTimer METRICS_CONCAT(stageTimer, __LINE__)(stage)
+#else
+#define METRICS_SCOPE(stage) ((void)0)
+#endif
+
+#ifdef ENABLE_METRICS
+#define METRICS_COUNT(counter, value) Metrics::increment(counter, value)
+#define METRICS_GAUGE(gauge, value) Metrics::set(gauge, value)
+#else
+// Statements, so an if with a compiled-out body is still well formed. The value is not
+// evaluated, only named, so variables computed for it do not become unused.
+#define METRICS_COUNT(counter, value) ((void)sizeof(value))
+#define METRICS_GAUGE(gauge, value) ((void)sizeof(value))
+#endif
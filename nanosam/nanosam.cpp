@@ -1,123 +1,518 @@
 #include "nanosam.h"
 #include "config.h"
+#include "arena.h"
+#include "image_ops.h"
+#include "mask_cleanup.h"
+#include "metrics.h"
+#include "session_log.h"
+#include "trt_backend.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <optional>
 
 using namespace std;
 
 // Constructor
-NanoSam::NanoSam(string encoderPath, string decoderPath)
+NanoSam::NanoSam(string encoderPath, string decoderPath, int warmupRuns)
+    : NanoSam(make_shared<TRTBackend>(vector<string>{ encoderPath }, decoderPath, warmupRuns))
 {
-    mImageEncoder = new TRTModule(encoderPath,
-        { "image" },
-        { "image_embeddings" }, false, true);
+}
 
-    mMaskDecoder = new TRTModule(decoderPath,
-        { "image_embeddings", "point_coords", "point_labels", "mask_input", "has_mask_input" },
-        { "iou_predictions", "low_res_masks" }, true, false);
+NanoSam::NanoSam(vector<string> encoderPaths, string decoderPath, int warmupRuns)
+    : NanoSam(make_shared<TRTBackend>(encoderPaths, decoderPath, warmupRuns))
+{
+}
 
-    mFeatures = new float[HIDDEN_DIM * FEATURE_WIDTH * FEATURE_HEIGHT];
-    mMaskInput = new float[HIDDEN_DIM * HIDDEN_DIM];
-    mHasMaskInput = new float;
-    mIouPrediction = new float[NUM_LABELS];
-    mLowResMasks = new float[NUM_LABELS * HIDDEN_DIM * HIDDEN_DIM];
+NanoSam::NanoSam(shared_ptr<InferenceBackend> backend)
+    : mMaskInput(nullptr), mHasMaskInput(nullptr), mIouPrediction(nullptr), mLowResMasks(nullptr),
+      mBackend(backend), mEmbeddingCacheLimit(SIZE_MAX), mDecodeCacheLimit(SIZE_MAX), mFeatures(nullptr), mEncoder(0), mImageHash(0), mWasEncoded(false),
+      mMinRegionArea(0), mMaxHoleArea(0), mRecorderInstance(0)
+{
 }
 
 // Deconstructor
 NanoSam::~NanoSam()
 {
-    if (mFeatures)      delete[] mFeatures;
     if (mMaskInput)     delete[] mMaskInput;
+    if (mHasMaskInput)  delete mHasMaskInput;
     if (mIouPrediction) delete[] mIouPrediction;
     if (mLowResMasks)   delete[] mLowResMasks;
+}
+
+// Allocate the host buffers once the geometry is known
+void NanoSam::setup()
+{
+    const ModelGeometry& geometry = mBackend->getGeometry(0);
+
+    mMaskInput = new float[geometry.maskWidth * geometry.maskHeight];
+    mHasMaskInput = new float;
+    mIouPrediction = new float[geometry.numMasks];
+    mLowResMasks = new float[geometry.numMasks * geometry.maskWidth * geometry.maskHeight];
+}
+
+vector<MemoryUsage> NanoSam::getMemoryUsage()
+{
+    vector<MemoryUsage> usage = mBackend->getMemoryUsage();
+
+    if (mMaskInput)
+    {
+        const ModelGeometry& geometry = mBackend->getGeometry(0);
+        const size_t maskSize = (size_t)geometry.maskWidth * geometry.maskHeight;
+        usage.push_back({ "decoder_io", (maskSize * (1 + geometry.numMasks) + 1 + geometry.numMasks) * sizeof(float), 0 });
+    }
+
+    // The current embeddings count here as well once they are no longer cached
+    size_t embeddingBytes = mEmbeddingCache.getBytes();
+    if (mEmbedding && mEmbedding.use_count() == 1) embeddingBytes += mEmbedding->capacity() * sizeof(float);
+    usage.push_back({ "embedding_cache", embeddingBytes, 0 });
+    usage.push_back({ "decode_cache", mDecodeCache.getBytes(), 0 });
+
+    if (mSharedCache) usage.push_back({ "shared_embedding_cache", mSharedCache->getMappedBytes(), 0 });
+    usage.push_back({ "arenas", ScratchArena::getTotalBytes(), 0 });
+    return usage;
+}
+
+// Footprint with the caches at full capacity and without the arenas, which get the remainder
+size_t NanoSam::getProjectedMemory()
+{
+    size_t total = 0;
+    for (auto& usage : getMemoryUsage())
+        if (usage.component != "embedding_cache" && usage.component != "decode_cache" && usage.component != "arenas")
+            total += usage.hostBytes + usage.deviceBytes;
+
+    // Encoding into a full cache reuses the buffer it evicts, without a cache one buffer is kept
+    const ModelGeometry& geometry = mBackend->getGeometry(0);
+    const size_t embeddingBytes = geometry.embeddingSize() * sizeof(float);
+    total += max<size_t>(mEmbeddingCache.getCapacity(), 1) * embeddingBytes;
+
+    // Decode cache entries counted with a box prompt
+    const size_t decodeBytes = DecodeCache::getEntryBytes(2, geometry.numMasks, geometry.maskWidth * geometry.maskHeight);
+    return total + mDecodeCache.getCapacity() * decodeBytes;
+}
+
+bool NanoSam::setMemoryBudget(size_t bytes)
+{
+    waitUntilReady();
+    call_once(mSetupFlag, [this]() { setup(); });
+
+    if (getProjectedMemory() > bytes)
+        mBackend->setLowMemory();
+
+    while (getProjectedMemory() > bytes && mDecodeCache.getCapacity() > 0)
+        mDecodeCache.setCapacity(mDecodeCache.getCapacity() - 1);
+    mDecodeCacheLimit = mDecodeCache.getCapacity();
+
+    while (getProjectedMemory() > bytes && mEmbeddingCache.getCapacity() > 0)
+        mEmbeddingCache.setCapacity(mEmbeddingCache.getCapacity() - 1);
+    mEmbeddingCacheLimit = mEmbeddingCache.getCapacity();
+
+    // The arena limit is process-wide, so the tightest budget of all instances holds
+    const size_t projected = getProjectedMemory();
+    const size_t arenaBytes = projected < bytes ? bytes - projected : 0;
+    ScratchArena::setCapacityLimit(min(arenaBytes, ScratchArena::getCapacityLimit()));
+    return projected <= bytes;
+}
+
+// Logs one public call to the recorder of the instance, if any, with the stage times of its scope
+class NanoSam::RecordedCall
+{
+
+public:
+
+    RecordedCall(NanoSam& nanosam, SessionCallType type, const ImageFrame* frame = nullptr,
+        const vector<Point>& points = {}, const vector<float>& labels = {}, int encoder = 0)
+        : mNanoSam(nanosam), mFrame(frame), mStart(0)
+    {
+        if (!mNanoSam.mRecorder) return;
+
+        mCall.type = type;
+        mCall.instance = mNanoSam.mRecorderInstance;
+        mCall.timestamp = 0;
+        mCall.encoder = encoder;
+        mCall.points = points;
+        mCall.labels = labels;
+
+        if (mFrame) mNanoSam.mImageHash = 0;
+        mCapture.emplace();
+        mStart = Tracer::now();
+    }
+
+    ~RecordedCall()
+    {
+        if (!mCapture) return;
+
+        mCall.duration = (Tracer::now() - mStart) / 1e6;
+        for (int s = 0; s < (int)Stage::Count; s++)
+            mCall.stageTimes[s] = mCapture->times[s] / 1e6;
+        mCapture.reset();
+
+        // Hashed after the call, so the timings are those of an unrecorded session
+        if (mFrame)
+        {
+            if (!mNanoSam.mImageHash) mNanoSam.mImageHash = hashFrame(*mFrame);
+            mCall.width = mFrame->width;
+            mCall.height = mFrame->height;
+            mCall.format = mFrame->format;
+        }
+        else
+        {
+            mCall.width = mNanoSam.mImageSize.width;
+            mCall.height = mNanoSam.mImageSize.height;
+            mCall.format = PixelFormat::BGR;
+            mCall.encoder = mNanoSam.mEncoder;
+        }
+        mCall.imageHash = mNanoSam.mImageHash;
+
+        mNanoSam.mRecorder->record(mCall, mFrame);
+    }
+
+private:
+
+    NanoSam& mNanoSam;
+    const ImageFrame* mFrame;
+    SessionCall mCall;
+    int64_t mStart;
+    optional<StageCapture> mCapture;
+};
+
+bool NanoSam::isReady() const
+{
+    shared_future<void> ready = getReadyFuture();
+    if (ready.wait_for(chrono::seconds(0)) != future_status::ready) return false;
+
+    try
+    {
+        ready.get();
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
 
-    if (mImageEncoder)  delete mImageEncoder;
-    if (mMaskDecoder)   delete mMaskDecoder;
+void NanoSam::waitUntilReady() const
+{
+    getReadyFuture().get();
 }
 
 // Perform inference using NanoSam models
-Mat NanoSam::predict(Mat& image, vector<Point> points, vector<float> labels)
+Mat NanoSam::predict(Mat& image, const vector<Point>& points, const vector<float>& labels, int encoder)
 {
-    if (points.size() == 0) return cv::Mat(image.rows, image.cols, CV_32FC1);
+    Mat mask;
+    predict(image, points, labels, mask, encoder);
+    return mask;
+}
 
-    // Preprocess encoder input
-    auto resizedImage = resizeImage(image, MODEL_INPUT_WIDTH, MODEL_INPUT_HEIGHT);
+void NanoSam::predict(Mat& image, const vector<Point>& points, const vector<float>& labels, Mat& mask, int encoder)
+{
+    predict(ImageFrame::fromMat(image), points, labels, mask, encoder);
+}
 
-    // Encoder Inference
-    mImageEncoder->setInput(resizedImage);
-    mImageEncoder->infer();
-    mImageEncoder->getOutput(mFeatures);
+Mat NanoSam::predict(const ImageFrame& frame, const vector<Point>& points, const vector<float>& labels, int encoder)
+{
+    Mat mask;
+    predict(frame, points, labels, mask, encoder);
+    return mask;
+}
 
-    // Preprocess decoder input
-    auto pointData = new float[2 * points.size()];
-    prepareDecoderInput(points, pointData, points.size(), image.cols, image.rows);
+void NanoSam::predict(const ImageFrame& frame, const vector<Point>& points, const vector<float>& labels, Mat& mask, int encoder)
+{
+    RecordedCall record(*this, SessionCallType::Predict, &frame, points, labels, encoder);
+    TRACE_REQUEST("request");
+    METRICS_SCOPE(Stage::Predict);
 
-    // Decoder Inference
-    mMaskDecoder->setInput(mFeatures, pointData, labels.data(), mMaskInput, mHasMaskInput, points.size());
-    mMaskDecoder->infer();
-    mMaskDecoder->getOutput(mIouPrediction, mLowResMasks);
+    if (points.size() == 0)
+    {
+        mask.create(frame.height, frame.width, CV_32FC1);
+        return;
+    }
+
+    encodeImage(frame, encoder);
+    decodeLowRes(points, labels);
+    upscaleLowRes(mask);
+}
+
+// Extract the mask polygons without upscaling the mask to the image size
+vector<MaskContour> NanoSam::predictContours(Mat& image, const vector<Point>& points, const vector<float>& labels, double tolerance, int encoder)
+{
+    const ImageFrame frame = ImageFrame::fromMat(image);
+    RecordedCall record(*this, SessionCallType::PredictContours, &frame, points, labels, encoder);
+    TRACE_REQUEST("request");
 
-    // Postprocessing
-    Mat imgMask(HIDDEN_DIM, HIDDEN_DIM, CV_32FC1, mLowResMasks);
-    upscaleMask(imgMask, image.cols, image.rows);
+    if (points.size() == 0) return {};
 
-    delete[] pointData;
+    encodeImage(frame, encoder);
+    decodeLowRes(points, labels);
 
-    return imgMask;
+    const ModelGeometry& geometry = mBackend->getGeometry(encoder);
+    Mat lowResMask(geometry.maskHeight, geometry.maskWidth, CV_32FC1, mLowResMasks);
+
+    TRACE_SCOPE("contours");
+    return extractContours(lowResMask, image.cols, image.rows, tolerance);
 }
 
-void NanoSam::prepareDecoderInput(vector<Point>& points, float* pointData, int numPoints, int imageWidth, int imageHeight)
+void NanoSam::setImage(Mat& image, int encoder)
 {
-    float scale = MODEL_INPUT_WIDTH / max(imageWidth, imageHeight);
+    setImage(ImageFrame::fromMat(image), encoder);
+}
+
+void NanoSam::setImage(const ImageFrame& frame, int encoder)
+{
+    RecordedCall record(*this, SessionCallType::SetImage, &frame, {}, {}, encoder);
+    TRACE_REQUEST("set_image");
+    encodeImage(frame, encoder);
+}
 
-    for (int i = 0; i < numPoints; i++)
+void NanoSam::setImage(const ImageFrame& frame, int encoder, uint64_t imageHash)
+{
+    if (imageHash != 0 && imageHash == mImageHash && encoder == mEncoder && mFeatures && frame.size() == mImageSize)
     {
-        pointData[i * 2] = (float)points[i].x * scale;
-        pointData[i * 2 + 1] = (float)points[i].y * scale;
+        mWasEncoded = false;
+        return;
     }
 
-    for (int i = 0; i < HIDDEN_DIM * HIDDEN_DIM; i++)
+    RecordedCall record(*this, SessionCallType::SetImage, &frame, {}, {}, encoder);
+    TRACE_REQUEST("set_image");
+    encodeImage(frame, encoder, imageHash);
+}
+
+Mat NanoSam::decode(const vector<Point>& points, const vector<float>& labels)
+{
+    Mat mask;
+    decode(points, labels, mask);
+    return mask;
+}
+
+void NanoSam::decode(const vector<Point>& points, const vector<float>& labels, Mat& mask)
+{
+    RecordedCall record(*this, SessionCallType::Decode, nullptr, points, labels);
+    TRACE_REQUEST("request");
+    METRICS_SCOPE(Stage::Predict);
+
+    if (points.size() == 0)
     {
-        mMaskInput[i] = 0;
+        mask.create(mImageSize.height, mImageSize.width, CV_32FC1);
+        return;
     }
-    *mHasMaskInput = 0;
+
+    decodeLowRes(points, labels);
+    upscaleLowRes(mask);
+}
+
+vector<MaskContour> NanoSam::decodeContours(const vector<Point>& points, const vector<float>& labels, double tolerance)
+{
+    RecordedCall record(*this, SessionCallType::DecodeContours, nullptr, points, labels);
+    TRACE_REQUEST("request");
+
+    if (points.size() == 0) return {};
+
+    decodeLowRes(points, labels);
+
+    const ModelGeometry& geometry = mBackend->getGeometry(mEncoder);
+    Mat lowResMask(geometry.maskHeight, geometry.maskWidth, CV_32FC1, mLowResMasks);
+
+    TRACE_SCOPE("contours");
+    return extractContours(lowResMask, mImageSize.width, mImageSize.height, tolerance);
+}
+
+void NanoSam::decodePreview(const vector<Point>& points, const vector<float>& labels, Mat& lowResLogits)
+{
+    RecordedCall record(*this, SessionCallType::DecodePreview, nullptr, points, labels);
+    TRACE_REQUEST("preview");
+
+    const ModelGeometry& geometry = mBackend->getGeometry(mEncoder);
+    lowResLogits.create(geometry.maskHeight, geometry.maskWidth, CV_32FC1);
+
+    if (points.size() == 0)
+    {
+        lowResLogits.setTo(Scalar::all(-1));
+
+        // Refined to the same empty mask
+        if (mLowResMasks)
+        {
+            fill(mLowResMasks, mLowResMasks + (size_t)geometry.numMasks * geometry.maskWidth * geometry.maskHeight, -1.0f);
+            fill(mIouPrediction, mIouPrediction + geometry.numMasks, 0.0f);
+        }
+        return;
+    }
+
+    decodeLowRes(points, labels);
+    Mat(geometry.maskHeight, geometry.maskWidth, CV_32FC1, mLowResMasks).copyTo(lowResLogits);
 }
 
-Mat NanoSam::resizeImage(Mat& img, int inputWidth, int inputHeight)
+void NanoSam::refinePreview(Mat& mask)
 {
-    int w, h;
-    float aspectRatio = (float)img.cols / (float)img.rows;
+    RecordedCall record(*this, SessionCallType::RefinePreview);
+    TRACE_REQUEST("refine");
+    upscaleLowRes(mask);
+}
+
+// Make the embeddings of the image current, running the encoder unless they are cached.
+// A known content hash is used instead of hashing the frame.
+void NanoSam::encodeImage(const ImageFrame& frame, int encoder, uint64_t imageHash)
+{
+    waitUntilReady();
+    call_once(mSetupFlag, [this]() { setup(); });
+
+    assert(encoder >= 0 && encoder < mBackend->getNumEncoders());
+    const ModelGeometry& geometry = mBackend->getGeometry(encoder);
 
-    if (aspectRatio >= 1)
+    mEncoder = encoder;
+    mImageSize = frame.size();
+    mWasEncoded = false;
+
+    mImageHash = imageHash;
+    const bool isShared = mSharedCache && mSharedCache->isOpen() && mSharedCache->getSlotFloats() >= geometry.embeddingSize();
+    if (mEmbeddingCache.getCapacity() > 0 || mDecodeCache.getCapacity() > 0 || isShared)
     {
-        w = inputWidth;
-        h = int(inputHeight / aspectRatio);
+        if (!imageHash)
+        {
+            METRICS_SCOPE(Stage::Hash);
+            imageHash = hashFrame(frame);
+            mImageHash = imageHash;
+        }
+        auto shared = isShared ? mSharedCache->find(imageHash, encoder) : SharedEmbeddingCache::Handle();
+        if (shared)
+        {
+            mSharedEmbedding = move(shared);
+            mFeatures = mSharedEmbedding.data();
+            return;
+        }
+
+        auto cached = mEmbeddingCache.getCapacity() > 0 ? mEmbeddingCache.find(imageHash, encoder) : nullptr;
+        if (cached)
+        {
+            mEmbedding = cached;
+            mFeatures = mEmbedding->data();
+            mSharedEmbedding.release();
+            return;
+        }
     }
-    else
+
+    // Preprocess straight into the encoder input, only letterboxed if the model normalizes
     {
-        w = int(inputWidth * aspectRatio);
-        h = inputHeight;
+        METRICS_SCOPE(Stage::Resize);
+        if (geometry.isByteInput)
+            letterboxImage(frame, mBackend->getEncoderByteInput(encoder), geometry.inputWidth, geometry.inputHeight);
+        else
+            letterboxNormalize(frame, mBackend->getEncoderInput(encoder), geometry.inputWidth, geometry.inputHeight);
     }
 
-    Mat re(h, w, CV_8UC3);
-    cv::resize(img, re, re.size(), 0, 0, INTER_LINEAR);
-    Mat out(inputHeight, inputWidth, CV_8UC3, 0.0);
-    re.copyTo(out(Rect(0, 0, re.cols, re.rows)));
+    // Encode straight into a shared slot, published for other processes once complete
+    mWasEncoded = true;
+    if (isShared)
+    {
+        auto shared = mSharedCache->allocate(imageHash, encoder);
+        if (shared)
+        {
+            {
+                METRICS_SCOPE(Stage::Encode);
+                mBackend->encode(encoder, shared.data());
+            }
+            mSharedCache->publish(shared);
+            mSharedEmbedding = move(shared);
+            mFeatures = mSharedEmbedding.data();
+            return;
+        }
+    }
+    mSharedEmbedding.release();
+
+    // Reuse the buffer of an evicted or no longer cached embedding
+    auto embedding = mEmbeddingCache.recycle();
+    if (!embedding && mEmbedding.use_count() == 1)
+        embedding = mEmbedding;
+    if (!embedding)
+        embedding = make_shared<vector<float>>();
+    embedding->resize(geometry.embeddingSize());
+
+    // Encoder Inference
+    {
+        METRICS_SCOPE(Stage::Encode);
+        mBackend->encode(encoder, embedding->data());
+    }
 
-    return out;
+    mEmbedding = embedding;
+    mFeatures = mEmbedding->data();
+    mEmbeddingCache.insert(imageHash, encoder, mEmbedding);
 }
 
-void NanoSam::upscaleMask(Mat& mask, int targetWidth, int targetHeight, int size)
+// Decode against the current embeddings, leaving the low resolution masks in mLowResMasks
+void NanoSam::decodeLowRes(const vector<Point>& points, const vector<float>& labels)
 {
-    int limX, limY;
-    if (targetWidth > targetHeight)
+    assert(mFeatures && "setImage has to be called before decode");
+
+    ArenaScope scope;
+
+    // Preprocess decoder input
+    auto pointData = scope.arena().allocate<float>(2 * points.size());
     {
-        limX = size;
-        limY = size * targetHeight / targetWidth;
+        METRICS_SCOPE(Stage::DecoderInput);
+        prepareDecoderInput(points, pointData, points.size(), mImageSize.width, mImageSize.height);
     }
-    else
+
+    // Repeated prompts skip the decoder; the image hash identifies the embeddings
+    const ModelGeometry& geometry = mBackend->getGeometry(mEncoder);
+    const int maskSize = geometry.maskWidth * geometry.maskHeight;
+    const bool isCached = mDecodeCache.getCapacity() > 0 && mImageHash != 0;
+    if (isCached && mDecodeCache.find(mImageHash, mEncoder, pointData, labels.data(), points.size(),
+        mIouPrediction, geometry.numMasks, mLowResMasks, maskSize))
+        return;
+
+    // Decoder Inference
     {
-        limX = size * targetWidth / targetHeight;
-        limY = size;
+        METRICS_SCOPE(Stage::Decode);
+        mBackend->decode(mFeatures, pointData, labels.data(), points.size(), mMaskInput, mHasMaskInput,
+            mIouPrediction, mLowResMasks);
     }
 
-    cv::resize(mask(Rect(0, 0, limX, limY)), mask, Size(targetWidth, targetHeight));
+    if (mMinRegionArea > 0 || mMaxHoleArea > 0) cleanupLowRes();
+
+    if (isCached)
+        mDecodeCache.insert(mImageHash, mEncoder, pointData, labels.data(), points.size(),
+            mIouPrediction, geometry.numMasks, mLowResMasks, maskSize);
+}
+
+// Clean up the part of the first low resolution mask that covers the image
+void NanoSam::cleanupLowRes()
+{
+    METRICS_SCOPE(Stage::MaskCleanup);
+
+    const ModelGeometry& geometry = mBackend->getGeometry(mEncoder);
+    Mat lowResMask(geometry.maskHeight, geometry.maskWidth, CV_32FC1, mLowResMasks);
+    Mat cropped = lowResMask(letterboxMaskRect(geometry.maskWidth, geometry.maskHeight, mImageSize.width, mImageSize.height));
+
+    // Image pixels per mask pixel, to convert the areas
+    const double pixelArea = ((double)mImageSize.width / cropped.cols) * ((double)mImageSize.height / cropped.rows);
+    const int minIslandArea = mMinRegionArea > 0 ? (int)ceil(mMinRegionArea / pixelArea) : 0;
+    const int maxHoleArea = mMaxHoleArea > 0 ? (int)ceil(mMaxHoleArea / pixelArea) : 0;
+
+    const int numCleaned = cleanupMask(cropped, minIslandArea, maxHoleArea);
+    METRICS_COUNT(Counter::MaskRegionsCleaned, numCleaned);
+}
+
+// Upscale the first low resolution mask to the size of the current image
+void NanoSam::upscaleLowRes(Mat& mask)
+{
+    METRICS_SCOPE(Stage::Upscale);
+
+    const ModelGeometry& geometry = mBackend->getGeometry(mEncoder);
+    Mat lowResMask(geometry.maskHeight, geometry.maskWidth, CV_32FC1, mLowResMasks);
+
+    upscaleMask(lowResMask, mask, mImageSize.width, mImageSize.height);
+}
+
+void NanoSam::prepareDecoderInput(const vector<Point>& points, float* pointData, int numPoints, int imageWidth, int imageHeight)
+{
+    const ModelGeometry& geometry = mBackend->getGeometry(mEncoder);
+    scalePoints(points, pointData, imageWidth, imageHeight, geometry.inputWidth, geometry.inputHeight);
+
+    const int maskInputSize = geometry.maskWidth * geometry.maskHeight;
+    for (int i = 0; i < maskInputSize; i++)
+    {
+        mMaskInput[i] = 0;
+    }
+    *mHasMaskInput = 0;
 }
@@ -1,34 +1,183 @@
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <string>
-#include "trt_module.h"
+#include "backend.h"
+#include "contours.h"
+#include "decode_cache.h"
+#include "embedding_cache.h"
+#include "image_ops.h"
+#include "shared_embedding_cache.h"
+
+class SessionRecorder;
 
 class NanoSam
 {
 
 public:
 
-    NanoSam(string encoderPath, string decoderPath);
+    // The models are loaded concurrently on background threads and warmed up with
+    // warmupRuns inferences each. Inference calls block until loading has finished, and throw
+    // if it failed.
+    NanoSam(string encoderPath, string decoderPath, int warmupRuns = 1);
+
+    // Load several encoder variants, e.g. 1024 and 512 px inputs, sharing one decoder
+    NanoSam(vector<string> encoderPaths, string decoderPath, int warmupRuns = 1);
+
+    // Run on another backend, e.g. a SimulatedBackend on machines without a GPU
+    NanoSam(shared_ptr<InferenceBackend> backend);
 
     ~NanoSam();
 
-    Mat predict(Mat& image, vector<Point> points, vector<float> labels);
+    // The encoder argument selects one of the loaded encoder variants
+    Mat predict(Mat& image, const vector<Point>& points, const vector<float>& labels, int encoder = 0);
+
+    // Predict into a caller-owned mask, reallocated only if its size differs from the image.
+    // Scratch memory comes from a per-thread arena, so repeated calls do not allocate.
+    void predict(Mat& image, const vector<Point>& points, const vector<float>& labels, Mat& mask, int encoder = 0);
+
+    // Predict on a camera frame in its native pixel format, e.g. NV12 or YUYV with explicit strides.
+    // The frame is read in place; color conversion is fused into the encoder preprocessing.
+    Mat predict(const ImageFrame& frame, const vector<Point>& points, const vector<float>& labels, int encoder = 0);
+
+    void predict(const ImageFrame& frame, const vector<Point>& points, const vector<float>& labels, Mat& mask, int encoder = 0);
+
+    // Predict the mask outline as polygons, traced on the low resolution logits
+    vector<MaskContour> predictContours(Mat& image, const vector<Point>& points, const vector<float>& labels, double tolerance = 1.0, int encoder = 0);
+
+    // Encode the image for the following decode calls. Embeddings of recently encoded
+    // images are cached by content hash, so prompting the same image again skips the encoder.
+    void setImage(Mat& image, int encoder = 0);
+
+    void setImage(const ImageFrame& frame, int encoder = 0);
+
+    // With the content hash of the image already known, as computed by hashFrame, or 0 to hash it.
+    // Nothing is done if the image is the current one.
+    void setImage(const ImageFrame& frame, int encoder, uint64_t imageHash);
+
+    // Decode prompts against the image of the last setImage or predict call
+    Mat decode(const vector<Point>& points, const vector<float>& labels);
+
+    void decode(const vector<Point>& points, const vector<float>& labels, Mat& mask);
+
+    vector<MaskContour> decodeContours(const vector<Point>& points, const vector<float>& labels, double tolerance = 1.0);
+
+    // Decode into the low resolution logits only, a preview available within the decoder time.
+    // Use upscaleMaskNearest or extractContours on it, and refinePreview for the full resolution mask.
+    void decodePreview(const vector<Point>& points, const vector<float>& labels, Mat& lowResLogits);
+
+    // Upscale the masks of the last decode to the image size
+    void refinePreview(Mat& mask);
+
+    // Fill holes smaller than maxHoleArea and remove islands smaller than minRegionArea in the
+    // low resolution mask after each decode, before upscaling or tracing contours. Areas are in
+    // image pixels, 0 disables either step. Off by default.
+    void setMaskCleanup(int minRegionArea, int maxHoleArea)
+    {
+        mMinRegionArea = max(minRegionArea, 0);
+        mMaxHoleArea = max(maxHoleArea, 0);
+        mDecodeCache.clear();
+    }
+
+    // True if the last setImage or predict ran the encoder, false if the embeddings were cached
+    bool wasImageEncoded() const { return mWasEncoded; }
+
+    // Predicted IoU of the first mask of the last decode
+    float getIouPrediction() const { return mIouPrediction ? mIouPrediction[0] : 0; }
+
+    // Number of cached image embeddings, 0 disables the cache. Capped by a memory budget.
+    void setEmbeddingCacheCapacity(size_t capacity) { mEmbeddingCache.setCapacity(min(capacity, mEmbeddingCacheLimit)); }
+
+    size_t getEmbeddingCacheCapacity() const { return mEmbeddingCache.getCapacity(); }
+
+    // Number of cached decoder results, 0 disables the cache, which is the default. Prompts on the
+    // same image whose points lie within about tolerance decoder pixels of a cached prompt, with
+    // the same labels, reuse its masks without running the decoder. The decoder coordinate space
+    // is PROMPT_COORD_SPACE wide. Capped by a memory budget.
+    void setDecodeCache(size_t capacity, float tolerance = 1.0f)
+    {
+        mDecodeCache.setCapacity(min(capacity, mDecodeCacheLimit));
+        mDecodeCache.setTolerance(tolerance);
+    }
+
+    size_t getDecodeCacheCapacity() const { return mDecodeCache.getCapacity(); }
+
+    // Look up embeddings in a cache shared with other processes ahead of the own cache, and encode
+    // new images into it. Shared embeddings are decoded in place from the region. Embeddings larger
+    // than its slots, or images encoded while every slot is in use, go to the own cache.
+    void setSharedEmbeddingCache(shared_ptr<SharedEmbeddingCache> cache) { mSharedCache = cache; }
+
+    // Log every public call with its prompts and stage times, e.g. to replay a labeling session
+    // offline. Images are logged by content hash, which costs a hash per image without a cache.
+    // Instances sharing a recorder pass distinct ids, so a replay can run each one separately.
+    void setRecorder(shared_ptr<SessionRecorder> recorder, int instance = 0) { mRecorder = recorder; mRecorderInstance = instance; }
+
+    // Host and device bytes of the models, the own buffers, the embedding caches and the scratch
+    // arenas of all threads. The shared cache counts in full, though every process maps it.
+    vector<MemoryUsage> getMemoryUsage();
+
+    // Fit the footprint, counting the embedding cache at full capacity, into a budget of host plus
+    // device bytes. In turn, the backend drops the host buffers it does not strictly need, the
+    // decode cache and then the embedding cache shrink, and each scratch arena keeps at most what
+    // is left between requests. The arenas are shared by all instances of the process, so their
+    // limit is the smallest that any instance set, see ScratchArena::setCapacityLimit.
+    // Returns false if the budget cannot be met even so.
+    bool setMemoryBudget(size_t bytes);
+
+    int getNumEncoders() const { return mBackend->getNumEncoders(); }
+
+    const ModelGeometry& getGeometry(int encoder = 0) const { return mBackend->getGeometry(encoder); }
+
+    // True once all models are loaded and warmed up, false while loading or if loading failed
+    bool isReady() const;
+
+    // Throws the load error if a model failed to load
+    void waitUntilReady() const;
+
+    // Becomes ready when loading has finished, e.g. to report readiness from a server
+    shared_future<void> getReadyFuture() const { return mBackend->getReadyFuture(); }
+
+    // Load timings of the encoders followed by the decoder, complete once ready
+    vector<ModelLoadReport> getLoadReports() const { return mBackend->getLoadReports(); }
 
 private:
 
     // Variables
-    float* mFeatures;
     float* mMaskInput;
     float* mHasMaskInput;
     float* mIouPrediction;
     float* mLowResMasks;
 
-    TRTModule* mImageEncoder;
-    TRTModule* mMaskDecoder;
+    shared_ptr<InferenceBackend> mBackend;
+    once_flag mSetupFlag;
 
-    void upscaleMask(Mat& mask, int targetWidth, int targetHeight, int size = 256);
-    Mat resizeImage(Mat& img, int modelWidth, int modelHeight);
-    void prepareDecoderInput(vector<Point>& points, float* pointData, int numPoints, int imageWidth, int imageHeight);
+    EmbeddingCache mEmbeddingCache;
+    size_t mEmbeddingCacheLimit;        //!< Highest capacity the memory budget allows
+    DecodeCache mDecodeCache;
+    size_t mDecodeCacheLimit;
+    shared_ptr<vector<float>> mEmbedding; //!< Embeddings of the current image
+    shared_ptr<SharedEmbeddingCache> mSharedCache;
+    SharedEmbeddingCache::Handle mSharedEmbedding; //!< Pins the current embeddings if they are shared
+    const float* mFeatures;             //!< Current embeddings, in mEmbedding or the shared region
+    int mEncoder;
+    Size mImageSize;
+    uint64_t mImageHash;                //!< Content hash of the current image, 0 if not computed
+    bool mWasEncoded;                   //!< The current embeddings come from the encoder, not a cache
+    int mMinRegionArea;                 //!< Mask cleanup thresholds in image pixels, 0 if disabled
+    int mMaxHoleArea;
 
-};
+    shared_ptr<SessionRecorder> mRecorder;
+    int mRecorderInstance;
+
+    class RecordedCall;
 
+    void setup();
+    void encodeImage(const ImageFrame& frame, int encoder, uint64_t imageHash = 0);
+    size_t getProjectedMemory();
+    void decodeLowRes(const vector<Point>& points, const vector<float>& labels);
+    void cleanupLowRes();
+    void upscaleLowRes(Mat& mask);
+    void prepareDecoderInput(const vector<Point>& points, float* pointData, int numPoints, int imageWidth, int imageHeight);
+
+};
@@ -0,0 +1,204 @@
+#include "request_router.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+// Keys may be small ids rather than content hashes, so they are mixed before placing them
+static uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+RequestRouter::RequestRouter(double loadFactor, int virtualNodes, size_t trackedKeys)
+    : mLoadFactor(max(loadFactor, 1.0)), mVirtualNodes(max(virtualNodes, 1)), mTotalLoad(0), mTrackedCapacity(trackedKeys), mStats()
+{
+}
+
+bool RequestRouter::addInstance(int id, double weight)
+{
+    lock_guard<mutex> lock(mMutex);
+    if (findInstance(id) >= 0 || weight <= 0) return false;
+
+    mInstances.push_back({ id, weight, 0 });
+    rebuildRing();
+    return true;
+}
+
+bool RequestRouter::removeInstance(int id)
+{
+    lock_guard<mutex> lock(mMutex);
+    const int index = findInstance(id);
+    if (index < 0) return false;
+
+    mTotalLoad -= mInstances[index].load;
+    mInstances.erase(mInstances.begin() + index);
+    rebuildRing();
+
+    // The embeddings cached there are gone with it
+    for (auto& tracked : mTracked)
+        if (tracked.second.instance == id) tracked.second.instance = -1;
+    return true;
+}
+
+vector<int> RequestRouter::getInstances() const
+{
+    lock_guard<mutex> lock(mMutex);
+    vector<int> ids;
+    for (auto& instance : mInstances) ids.push_back(instance.id);
+    return ids;
+}
+
+int RequestRouter::route(uint64_t key)
+{
+    lock_guard<mutex> lock(mMutex);
+    if (mRing.empty()) return -1;
+
+    // Bound of each instance, counting the request being placed
+    double totalWeight = 0;
+    for (auto& instance : mInstances) totalWeight += instance.weight;
+    const double boundPerWeight = mLoadFactor * (mTotalLoad + 1) / totalWeight;
+
+    // Walk the ring from the home point to the first instance below its bound. The bounds add
+    // up to more than the load, so one always is.
+    const size_t home = homePoint(key);
+    int chosen = mRing[home].instance;
+    for (size_t i = 0; i < mRing.size(); i++)
+    {
+        const int candidate = mRing[(home + i) % mRing.size()].instance;
+        if (mInstances[candidate].load < ceil(boundPerWeight * mInstances[candidate].weight))
+        {
+            chosen = candidate;
+            break;
+        }
+    }
+
+    mStats.routed++;
+    if (chosen != mRing[home].instance)
+    {
+        mStats.overflows++;
+        METRICS_COUNT(Counter::RouterOverflows, 1);
+    }
+
+    Instance& instance = mInstances[chosen];
+    instance.load++;
+    mTotalLoad++;
+    track(key, instance.id);
+    return instance.id;
+}
+
+void RequestRouter::complete(int id)
+{
+    lock_guard<mutex> lock(mMutex);
+    const int index = findInstance(id);
+    if (index < 0 || mInstances[index].load == 0) return;
+
+    mInstances[index].load--;
+    mTotalLoad--;
+}
+
+int RequestRouter::lookup(uint64_t key) const
+{
+    lock_guard<mutex> lock(mMutex);
+    return mRing.empty() ? -1 : mInstances[mRing[homePoint(key)].instance].id;
+}
+
+int RequestRouter::getLoad(int id) const
+{
+    lock_guard<mutex> lock(mMutex);
+    const int index = findInstance(id);
+    return index < 0 ? 0 : mInstances[index].load;
+}
+
+RouterStats RequestRouter::getStats() const
+{
+    lock_guard<mutex> lock(mMutex);
+    RouterStats stats = mStats;
+    stats.instances = mInstances.size();
+    const uint64_t known = stats.localityHits + stats.localityMisses;
+    stats.hitRate = known ? (double)stats.localityHits / known : 0;
+    return stats;
+}
+
+string RequestRouter::statsToJson() const
+{
+    RouterStats stats = getStats();
+    ostringstream out;
+    out << "{\"instances\":" << stats.instances << ",\"routed\":" << stats.routed << ",\"locality_hits\":" << stats.localityHits
+        << ",\"locality_misses\":" << stats.localityMisses << ",\"hit_rate\":" << stats.hitRate
+        << ",\"overflows\":" << stats.overflows << ",\"moved\":" << stats.moved << "}";
+    return out.str();
+}
+
+void RequestRouter::rebuildRing()
+{
+    // Home hashes of the tracked keys before the change, to count the keys that move. The ring
+    // points of an instance only depend on its id, so the others' points stay where they were.
+    vector<uint64_t> previousHomes;
+    previousHomes.reserve(mTracked.size());
+    for (uint64_t key : mTrackedOrder)
+        previousHomes.push_back(mRing.empty() ? 0 : mRing[homePoint(key)].hash);
+
+    mRing.clear();
+    for (size_t i = 0; i < mInstances.size(); i++)
+    {
+        const int points = max(1, (int)lround(mVirtualNodes * mInstances[i].weight));
+        for (int p = 0; p < points; p++)
+            mRing.push_back({ mix(mix((uint64_t)(uint32_t)mInstances[i].id) + (uint64_t)p), (int)i });
+    }
+    sort(mRing.begin(), mRing.end(), [](const RingPoint& a, const RingPoint& b) { return a.hash < b.hash; });
+
+    size_t k = 0;
+    for (uint64_t key : mTrackedOrder)
+    {
+        const uint64_t home = mRing.empty() ? 0 : mRing[homePoint(key)].hash;
+        if (previousHomes[k++] != home) mStats.moved++;
+    }
+}
+
+int RequestRouter::findInstance(int id) const
+{
+    for (size_t i = 0; i < mInstances.size(); i++)
+        if (mInstances[i].id == id) return (int)i;
+    return -1;
+}
+
+size_t RequestRouter::homePoint(uint64_t key) const
+{
+    const uint64_t hash = mix(key);
+    auto it = lower_bound(mRing.begin(), mRing.end(), hash, [](const RingPoint& point, uint64_t value) { return point.hash < value; });
+    return it == mRing.end() ? 0 : it - mRing.begin();
+}
+
+void RequestRouter::track(uint64_t key, int id)
+{
+    auto it = mTracked.find(key);
+    if (it != mTracked.end())
+    {
+        if (it->second.instance == id)
+        {
+            mStats.localityHits++;
+            METRICS_COUNT(Counter::RouterLocalityHits, 1);
+        }
+        else
+        {
+            mStats.localityMisses++;
+            METRICS_COUNT(Counter::RouterLocalityMisses, 1);
+        }
+        it->second.instance = id;
+        mTrackedOrder.splice(mTrackedOrder.begin(), mTrackedOrder, it->second.order);
+        return;
+    }
+
+    if (mTrackedCapacity == 0) return;
+    if (mTracked.size() >= mTrackedCapacity)
+    {
+        mTracked.erase(mTrackedOrder.back());
+        mTrackedOrder.pop_back();
+    }
+    mTrackedOrder.push_front(key);
+    mTracked[key] = { id, mTrackedOrder.begin() };
+}
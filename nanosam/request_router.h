@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+struct RouterStats
+{
+    size_t instances;
+    uint64_t routed;
+    uint64_t localityHits;              //!< Keys routed to the instance that served them last, whose cache has them
+    uint64_t localityMisses;            //!< Known keys routed elsewhere, by load or a membership change
+    uint64_t overflows;                 //!< Requests passed on from their home instance because it was full
+    uint64_t moved;                     //!< Tracked keys whose home instance changed with the membership
+    double hitRate;                     //!< Hits over requests for known keys
+};
+
+// Routes requests for an image to the same one of several NanoSam instances or services, so
+// re-prompts find its embeddings in that instance's cache instead of encoding it again.
+//
+// Keys, usually image content hashes, are consistently hashed onto a ring with a number of
+// virtual nodes per instance, so adding or removing an instance moves only the keys of the
+// ring arcs it gains or loses. Loads are bounded: an instance takes at most loadFactor times
+// the mean number of requests in flight, and requests for a key whose home instance is full
+// go to the next instance on the ring that is not, so one hot image cannot swamp its instance.
+//
+// The router remembers where recently routed keys went to report the cache locality hit rate.
+// Instance ids are chosen by the caller, clients of the same services have to agree on them.
+// All methods are thread safe.
+class RequestRouter
+{
+
+public:
+
+    RequestRouter(double loadFactor = 1.25, int virtualNodes = 128, size_t trackedKeys = 4096);
+
+    // Returns false if the id is already a member. Weight scales the share of keys and load.
+    bool addInstance(int id, double weight = 1);
+
+    // Requests in flight on the instance still have to be completed
+    bool removeInstance(int id);
+
+    vector<int> getInstances() const;
+
+    // Picks the instance for the key and counts the request against its load until complete().
+    // Returns -1 if there are no instances.
+    int route(uint64_t key);
+
+    void complete(int id);
+
+    // Home instance of the key on the ring, regardless of load, or -1
+    int lookup(uint64_t key) const;
+
+    // Requests in flight on the instance
+    int getLoad(int id) const;
+
+    RouterStats getStats() const;
+
+    string statsToJson() const;
+
+private:
+
+    struct Instance
+    {
+        int id;
+        double weight;
+        int load;
+    };
+
+    struct RingPoint
+    {
+        uint64_t hash;
+        int instance;                   //!< Index into mInstances
+    };
+
+    struct TrackedKey
+    {
+        int instance;                   //!< Id, -1 once its instance has been removed
+        list<uint64_t>::iterator order;
+    };
+
+    mutable mutex mMutex;
+    double mLoadFactor;
+    int mVirtualNodes;
+    vector<Instance> mInstances;
+    vector<RingPoint> mRing;            //!< Sorted by hash
+    int mTotalLoad;
+
+    size_t mTrackedCapacity;
+    unordered_map<uint64_t, TrackedKey> mTracked;
+    list<uint64_t> mTrackedOrder;       //!< Most recently routed first
+
+    RouterStats mStats;
+
+    void rebuildRing();
+
+    int findInstance(int id) const;
+
+    // First ring point at or after the hash of the key. Called with the lock held.
+    size_t homePoint(uint64_t key) const;
+
+    void track(uint64_t key, int id);
+};
@@ -0,0 +1,270 @@
+#include "request_scheduler.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <sstream>
+
+// Weight of the newest sample in the service time estimates
+static const double ESTIMATE_WEIGHT = 0.1;
+
+static Stage waitStage(Priority priority)
+{
+    switch (priority)
+    {
+    case Priority::Interactive: return Stage::WaitInteractive;
+    case Priority::Standard:    return Stage::WaitStandard;
+    default:                    return Stage::WaitBatch;
+    }
+}
+
+RequestScheduler::RequestScheduler(vector<shared_ptr<NanoSam>> instances)
+    : mInstances(instances), mNextSequence(0), mEncodeEstimate(0), mDecodeEstimate(0), mStop(false)
+{
+    for (int i = 0; i < NUM_PRIORITIES; i++)
+    {
+        mStats[i] = PriorityClassStats();
+        mTotalWait[i] = 0;
+    }
+
+    for (int i = 0; i < (int)mInstances.size(); i++)
+        mWorkers.emplace_back(&RequestScheduler::run, this, i);
+}
+
+RequestScheduler::~RequestScheduler()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStop = true;
+    }
+    mCondition.notify_all();
+    for (auto& worker : mWorkers) worker.join();
+
+    for (auto& queue : mQueues)
+        for (auto& task : queue)
+            complete(std::move(task), RequestStatus::Shed, Mat());
+}
+
+const char* RequestScheduler::priorityName(Priority priority)
+{
+    static const char* names[] = { "interactive", "standard", "batch" };
+    return names[(int)priority];
+}
+
+void RequestScheduler::submit(SchedulerRequest request, function<void(const SchedulerResult&)> onComplete)
+{
+    unique_ptr<Task> task(new Task());
+    task->request = std::move(request);
+    task->onComplete = std::move(onComplete);
+    task->enqueued = Clock::now();
+    task->waitTime = 0;
+    task->serviceTime = 0;
+    task->preemptions = 0;
+    task->isEncoded = false;
+
+    const int priority = (int)task->request.priority;
+    {
+        lock_guard<mutex> lock(mMutex);
+        PriorityClassStats& stats = mStats[priority];
+        stats.submitted++;
+
+        // Work queued in this and higher classes runs first, spread over the workers
+        double queuedWork = 0;
+        for (int i = 0; i <= priority; i++)
+            for (auto& queued : mQueues[i])
+                queuedWork += estimateService(*queued);
+        const double expected = queuedWork / mInstances.size() + estimateService(*task);
+
+        if (task->request.deadline != Clock::time_point::max() &&
+            task->enqueued + chrono::duration_cast<Clock::duration>(chrono::duration<double, milli>(expected)) > task->request.deadline)
+        {
+            stats.rejected++;
+            METRICS_COUNT(Counter::RequestsRejected, 1);
+        }
+        else
+        {
+            task->sequence = mNextSequence++;
+            mQueues[priority].push_back(std::move(task));
+            stats.queueDepth++;
+            stats.maxQueueDepth = max(stats.maxQueueDepth, stats.queueDepth);
+        }
+    }
+
+    if (task)
+    {
+        complete(std::move(task), RequestStatus::Rejected, Mat());
+        return;
+    }
+    mCondition.notify_one();
+}
+
+vector<PriorityClassStats> RequestScheduler::getStats() const
+{
+    lock_guard<mutex> lock(mMutex);
+
+    vector<PriorityClassStats> stats(mStats, mStats + NUM_PRIORITIES);
+    for (int i = 0; i < NUM_PRIORITIES; i++)
+        stats[i].meanWait = stats[i].completed ? mTotalWait[i] / stats[i].completed : 0;
+    return stats;
+}
+
+string RequestScheduler::statsToJson() const
+{
+    auto stats = getStats();
+
+    ostringstream out;
+    out << "{";
+    for (int i = 0; i < NUM_PRIORITIES; i++)
+    {
+        const PriorityClassStats& s = stats[i];
+        out << (i ? "," : "") << "\"" << priorityName((Priority)i) << "\":{\"queue_depth\":" << s.queueDepth
+            << ",\"max_queue_depth\":" << s.maxQueueDepth << ",\"submitted\":" << s.submitted
+            << ",\"completed\":" << s.completed << ",\"rejected\":" << s.rejected << ",\"shed\":" << s.shed
+            << ",\"preempted\":" << s.preempted << ",\"mean_wait_ms\":" << s.meanWait << ",\"max_wait_ms\":" << s.maxWait << "}";
+    }
+    out << "}";
+    return out.str();
+}
+
+unique_ptr<RequestScheduler::Task> RequestScheduler::pop()
+{
+    for (auto& queue : mQueues)
+    {
+        if (queue.empty()) continue;
+
+        auto first = queue.begin();
+        for (auto it = queue.begin() + 1; it != queue.end(); ++it)
+        {
+            const Task& a = **it;
+            const Task& b = **first;
+            if (a.request.deadline < b.request.deadline || (a.request.deadline == b.request.deadline && a.sequence < b.sequence))
+                first = it;
+        }
+
+        unique_ptr<Task> task = std::move(*first);
+        queue.erase(first);
+        mStats[(int)task->request.priority].queueDepth--;
+        return task;
+    }
+    return nullptr;
+}
+
+bool RequestScheduler::hasWaiting(Priority above) const
+{
+    for (int i = 0; i < (int)above; i++)
+        if (!mQueues[i].empty()) return true;
+    return false;
+}
+
+double RequestScheduler::estimateService(const Task& task) const
+{
+    return (task.isEncoded ? 0 : mEncodeEstimate) + (task.request.points.empty() ? 0 : mDecodeEstimate);
+}
+
+void RequestScheduler::complete(unique_ptr<Task> task, RequestStatus status, Mat mask)
+{
+    SchedulerResult result;
+    result.status = status;
+    result.mask = mask;
+    result.waitTime = task->waitTime;
+    result.serviceTime = task->serviceTime;
+    result.preemptions = task->preemptions;
+
+    if (task->onComplete) task->onComplete(result);
+}
+
+void RequestScheduler::run(int index)
+{
+    Tracer::setThreadName("scheduler worker " + to_string(index));
+    NanoSam& nanosam = *mInstances[index];
+
+    unique_lock<mutex> lock(mMutex);
+    while (true)
+    {
+        mCondition.wait(lock, [this]()
+        {
+            if (mStop) return true;
+            for (auto& queue : mQueues)
+                if (!queue.empty()) return true;
+            return false;
+        });
+        if (mStop) break;
+
+        unique_ptr<Task> task = pop();
+        const int priority = (int)task->request.priority;
+        PriorityClassStats& stats = mStats[priority];
+
+        const Clock::time_point now = Clock::now();
+        const double waited = milliseconds(now - task->enqueued);
+        task->waitTime += waited;
+#ifdef ENABLE_METRICS
+        Metrics::record(waitStage(task->request.priority), (uint64_t)(waited * 1e6));
+#endif
+
+        // Shed requests that would finish too late anyway, before spending any work on them
+        const double remaining = estimateService(*task);
+        if (now + chrono::duration_cast<Clock::duration>(chrono::duration<double, milli>(remaining)) > task->request.deadline)
+        {
+            stats.shed++;
+            METRICS_COUNT(Counter::RequestsShed, 1);
+            lock.unlock();
+            complete(std::move(task), RequestStatus::Shed, Mat());
+            lock.lock();
+            continue;
+        }
+
+        lock.unlock();
+
+        // A resumed request only hashes its image, its embeddings are still cached unless
+        // another instance picked it up
+        auto encodeStart = Clock::now();
+        nanosam.setImage(ImageFrame::fromMat(task->request.image), task->request.encoder, task->request.imageHash);
+        const double encodeTime = milliseconds(Clock::now() - encodeStart);
+        task->serviceTime += encodeTime;
+
+        lock.lock();
+        if (!task->isEncoded)
+            mEncodeEstimate += ESTIMATE_WEIGHT * (encodeTime - mEncodeEstimate);
+        task->isEncoded = true;
+
+        // Encode-only requests are done here
+        if (task->request.points.empty())
+        {
+            stats.completed++;
+            mTotalWait[priority] += task->waitTime;
+            stats.maxWait = max(stats.maxWait, task->waitTime);
+            lock.unlock();
+            complete(std::move(task), RequestStatus::Completed, Mat());
+            lock.lock();
+            continue;
+        }
+
+        // Stage boundary: make way for a higher class
+        if (hasWaiting(task->request.priority))
+        {
+            task->preemptions++;
+            task->enqueued = Clock::now();
+            stats.preempted++;
+            stats.queueDepth++;
+            METRICS_COUNT(Counter::Preemptions, 1);
+            mQueues[priority].push_back(std::move(task));
+            continue;
+        }
+        lock.unlock();
+
+        auto start = Clock::now();
+        Mat mask;
+        nanosam.decode(task->request.points, task->request.labels, mask);
+        const double decodeTime = milliseconds(Clock::now() - start);
+        task->serviceTime += decodeTime;
+
+        lock.lock();
+        mDecodeEstimate += ESTIMATE_WEIGHT * (decodeTime - mDecodeEstimate);
+        stats.completed++;
+        mTotalWait[priority] += task->waitTime;
+        stats.maxWait = max(stats.maxWait, task->waitTime);
+        lock.unlock();
+
+        complete(std::move(task), RequestStatus::Completed, mask);
+        lock.lock();
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "nanosam.h"
+
+enum class Priority
+{
+    Interactive,                        //!< Clicks of a waiting user
+    Standard,
+    Batch,                              //!< Bulk jobs, served when nothing else waits
+    Count
+};
+
+const int NUM_PRIORITIES = (int)Priority::Count;
+
+enum class RequestStatus
+{
+    Completed,
+    Rejected,                           //!< Could not meet its deadline at admission
+    Shed                                //!< Could no longer meet its deadline when its turn came
+};
+
+struct SchedulerRequest
+{
+    Mat image;
+    uint64_t imageHash = 0;             //!< Content hash of the image if known, see hashFrame, spares hashing it per request
+    vector<Point> points;               //!< None to only encode the image, e.g. ahead of its prompts
+    vector<float> labels;
+    int encoder = 0;
+    Priority priority = Priority::Standard;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+};
+
+struct SchedulerResult
+{
+    RequestStatus status;
+    Mat mask;                           //!< Empty unless completed with points
+    double waitTime;                    //!< Milliseconds queued, including time spent preempted
+    double serviceTime;                 //!< Milliseconds of encoding and decoding
+    int preemptions;
+};
+
+struct PriorityClassStats
+{
+    size_t queueDepth;
+    size_t maxQueueDepth;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t rejected;
+    uint64_t shed;
+    uint64_t preempted;                 //!< Encoded requests put back for a higher class
+    double meanWait;                    //!< Milliseconds, completed requests
+    double maxWait;
+};
+
+// Serves requests of several priority classes on a pool of NanoSam instances, one worker each.
+// The highest non-empty class goes first, earliest deadline first within a class. A request
+// that has been encoded is put back before decoding if a higher class is waiting, so a burst of
+// batch work delays a click by at most one stage. Its embeddings stay in the instance's cache,
+// so resuming it there skips the encoder; the instances need an embedding cache capacity of at
+// least two for that.
+//
+// Deadlines are checked against moving averages of the encode and decode times: at submission
+// against the queued work of the same and higher classes, and again when the request is picked.
+// Requests that cannot make it are completed as Rejected or Shed without running.
+class RequestScheduler
+{
+
+public:
+
+    RequestScheduler(vector<shared_ptr<NanoSam>> instances);
+
+    // Requests still queued are completed as Shed
+    ~RequestScheduler();
+
+    // onComplete is called exactly once, on a worker thread or, for rejected requests, right away
+    void submit(SchedulerRequest request, function<void(const SchedulerResult&)> onComplete);
+
+    vector<PriorityClassStats> getStats() const;
+
+    string statsToJson() const;
+
+    static const char* priorityName(Priority priority);
+
+private:
+
+    typedef chrono::steady_clock Clock;
+
+    struct Task
+    {
+        SchedulerRequest request;
+        function<void(const SchedulerResult&)> onComplete;
+        uint64_t sequence;
+        Clock::time_point enqueued;
+        double waitTime;
+        double serviceTime;
+        int preemptions;
+        bool isEncoded;
+    };
+
+    vector<shared_ptr<NanoSam>> mInstances;
+    vector<thread> mWorkers;
+
+    mutable mutex mMutex;
+    condition_variable mCondition;
+    vector<unique_ptr<Task>> mQueues[NUM_PRIORITIES];
+    PriorityClassStats mStats[NUM_PRIORITIES];
+    double mTotalWait[NUM_PRIORITIES];
+    uint64_t mNextSequence;
+    double mEncodeEstimate;             //!< Milliseconds, moving average
+    double mDecodeEstimate;
+    bool mStop;
+
+    void run(int index);
+
+    // Highest class first, then earliest deadline, then arrival order. Called with the lock held.
+    unique_ptr<Task> pop();
+
+    bool hasWaiting(Priority above) const;
+
+    double estimateService(const Task& task) const;
+
+    void complete(unique_ptr<Task> task, RequestStatus status, Mat mask);
+};
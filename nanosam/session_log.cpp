@@ -0,0 +1,202 @@
+#include "session_log.h"
+#include "trace.h"
+
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+static const uint32_t LOG_MAGIC = 0x4C53534E;  // "NSSL"
+static const uint32_t LOG_VERSION = 2;   // 2 adds the stage timer flag and the instance of each call
+static const uint8_t LOG_HAS_STAGE_TIMES = 1;
+static const size_t MAX_PENDING_IMAGES = 16;
+
+// Durations are stored in whole microseconds
+static uint32_t toMicroseconds(double milliseconds)
+{
+    return (uint32_t)min(max(llround(milliseconds * 1000), 0LL), (long long)UINT32_MAX);
+}
+
+template <typename T>
+static void writeValue(ofstream& file, T value)
+{
+    file.write((const char*)&value, sizeof(value));
+}
+
+template <typename T>
+static bool readValue(ifstream& file, T& value)
+{
+    return (bool)file.read((char*)&value, sizeof(value));
+}
+
+const char* SessionCall::typeName(SessionCallType type)
+{
+    static const char* names[] = { "predict", "predict_contours", "set_image", "decode", "decode_contours", "decode_preview", "refine_preview" };
+    return names[(int)type];
+}
+
+SessionRecorder::SessionRecorder(const string& path, const string& imageDirectory)
+    : mFile(path, ios::binary), mImageDirectory(imageDirectory), mStart(Tracer::now()), mIsWriting(false), mIsStopping(false)
+{
+#if defined(ENABLE_METRICS) || defined(ENABLE_TRACING)
+    const uint8_t flags = LOG_HAS_STAGE_TIMES;
+#else
+    const uint8_t flags = 0;
+#endif
+    writeValue(mFile, LOG_MAGIC);
+    writeValue(mFile, LOG_VERSION);
+    writeValue(mFile, (uint8_t)Stage::Count);
+    writeValue(mFile, flags);
+
+    if (!mImageDirectory.empty()) mWriter = thread(&SessionRecorder::writeImages, this);
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    flush();
+
+    {
+        lock_guard<mutex> lock(mMutex);
+        mIsStopping = true;
+    }
+    mCondition.notify_all();
+    if (mWriter.joinable()) mWriter.join();
+}
+
+string SessionRecorder::imagePath(const string& imageDirectory, uint64_t imageHash)
+{
+    ostringstream path;
+    path << imageDirectory << "/" << hex << setw(16) << setfill('0') << imageHash << ".png";
+    return path.str();
+}
+
+void SessionRecorder::record(SessionCall& call, const ImageFrame* frame)
+{
+    lock_guard<mutex> lock(mMutex);
+    if (!mFile.is_open()) return;
+
+    if (call.timestamp == 0) call.timestamp = Tracer::now() - mStart;
+
+    const int numPoints = (int)min(call.points.size(), (size_t)UINT8_MAX);
+    int numStages = 0;
+    for (double time : call.stageTimes)
+        if (time > 0) numStages++;
+
+    writeValue(mFile, (uint8_t)call.type);
+    writeValue(mFile, (uint16_t)call.instance);
+    writeValue(mFile, (uint8_t)call.format);
+    writeValue(mFile, (uint8_t)call.encoder);
+    writeValue(mFile, (uint8_t)numPoints);
+    writeValue(mFile, call.timestamp);
+    writeValue(mFile, call.imageHash);
+    writeValue(mFile, (int32_t)call.width);
+    writeValue(mFile, (int32_t)call.height);
+    for (int i = 0; i < numPoints; i++)
+    {
+        writeValue(mFile, (int32_t)call.points[i].x);
+        writeValue(mFile, (int32_t)call.points[i].y);
+        writeValue(mFile, i < (int)call.labels.size() ? call.labels[i] : 0.0f);
+    }
+    writeValue(mFile, toMicroseconds(call.duration));
+    writeValue(mFile, (uint8_t)numStages);
+    for (int s = 0; s < (int)Stage::Count; s++)
+    {
+        if (call.stageTimes[s] <= 0) continue;
+        writeValue(mFile, (uint8_t)s);
+        writeValue(mFile, toMicroseconds(call.stageTimes[s]));
+    }
+
+    // Each distinct image is written once, formats imwrite cannot take are left to the replay.
+    // The caller owns the pixels, so they are copied here and encoded on the writer thread.
+    // Images beyond a full queue are not saved and are synthesized by the replay.
+    if (frame && !mImageDirectory.empty() && call.imageHash != 0 &&
+        (frame->format == PixelFormat::BGR || frame->format == PixelFormat::Gray) &&
+        mPendingImages.size() < MAX_PENDING_IMAGES && mSavedImages.insert(call.imageHash).second)
+    {
+        Mat image(frame->height, frame->width, frame->format == PixelFormat::BGR ? CV_8UC3 : CV_8UC1,
+            (void*)frame->planes[0], frame->strides[0]);
+        mPendingImages.push_back({ imagePath(mImageDirectory, call.imageHash), image.clone() });
+        mCondition.notify_all();
+    }
+}
+
+void SessionRecorder::flush()
+{
+    unique_lock<mutex> lock(mMutex);
+    mFile.flush();
+    mCondition.wait(lock, [&]() { return mPendingImages.empty() && !mIsWriting; });
+}
+
+void SessionRecorder::writeImages()
+{
+    unique_lock<mutex> lock(mMutex);
+    while (true)
+    {
+        mCondition.wait(lock, [&]() { return !mPendingImages.empty() || mIsStopping; });
+        if (mPendingImages.empty()) return;
+
+        PendingImage pending = move(mPendingImages.front());
+        mPendingImages.pop_front();
+        mIsWriting = true;
+
+        lock.unlock();
+        imwrite(pending.path, pending.image);
+        lock.lock();
+
+        mIsWriting = false;
+        mCondition.notify_all();
+    }
+}
+
+SessionReader::SessionReader(const string& path) : mFile(path, ios::binary), mVersion(0), mIsValid(false), mHasStageTimes(true)
+{
+    uint32_t magic;
+    uint8_t numStages, flags = LOG_HAS_STAGE_TIMES;
+
+    // Stages are only ever appended, so logs of older builds remain readable
+    mIsValid = readValue(mFile, magic) && readValue(mFile, mVersion) && readValue(mFile, numStages) &&
+        magic == LOG_MAGIC && mVersion >= 1 && mVersion <= LOG_VERSION && numStages <= (uint8_t)Stage::Count &&
+        (mVersion < 2 || readValue(mFile, flags));
+    mHasStageTimes = (flags & LOG_HAS_STAGE_TIMES) != 0;
+}
+
+bool SessionReader::next(SessionCall& call)
+{
+    if (!mIsValid) return false;
+
+    uint8_t type, format, encoder, numPoints, numStages;
+    uint16_t instance = 0;
+    int32_t width, height;
+    uint32_t duration;
+    if (!readValue(mFile, type) || (mVersion >= 2 && !readValue(mFile, instance)) || !readValue(mFile, format) || !readValue(mFile, encoder) || !readValue(mFile, numPoints) ||
+        !readValue(mFile, call.timestamp) || !readValue(mFile, call.imageHash) || !readValue(mFile, width) || !readValue(mFile, height))
+        return false;
+
+    call.type = (SessionCallType)type;
+    call.instance = instance;
+    call.format = (PixelFormat)format;
+    call.encoder = encoder;
+    call.width = width;
+    call.height = height;
+
+    call.points.resize(numPoints);
+    call.labels.resize(numPoints);
+    for (int i = 0; i < numPoints; i++)
+    {
+        int32_t x, y;
+        if (!readValue(mFile, x) || !readValue(mFile, y) || !readValue(mFile, call.labels[i])) return false;
+        call.points[i] = Point(x, y);
+    }
+
+    if (!readValue(mFile, duration) || !readValue(mFile, numStages)) return false;
+    call.duration = duration / 1000.0;
+
+    for (auto& time : call.stageTimes) time = 0;
+    for (int i = 0; i < numStages; i++)
+    {
+        uint8_t stage;
+        uint32_t time;
+        if (!readValue(mFile, stage) || !readValue(mFile, time) || stage >= (int)Stage::Count) return false;
+        call.stageTimes[stage] = time / 1000.0;
+    }
+    return true;
+}
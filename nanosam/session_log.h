@@ -0,0 +1,125 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include "image_ops.h"
+#include "metrics.h"
+
+// Public NanoSam calls captured in a session log
+enum class SessionCallType : uint8_t
+{
+    Predict,
+    PredictContours,
+    SetImage,
+    Decode,
+    DecodeContours,
+    DecodePreview,
+    RefinePreview
+};
+
+// One logged call. Images are identified by their content hash, decode calls carry the hash
+// of the image they decode against.
+struct SessionCall
+{
+    SessionCallType type;
+    int instance;                       //!< Instance that served the call, as given to setRecorder
+    int64_t timestamp;                  //!< Nanoseconds since the start of the recording
+    uint64_t imageHash;
+    int width;                          //!< Image size
+    int height;
+    PixelFormat format;                 //!< BGR for calls without an image
+    int encoder;
+    vector<Point> points;
+    vector<float> labels;
+    double duration;                    //!< Milliseconds
+    double stageTimes[(int)Stage::Count]; //!< Milliseconds, 0 for stages the call did not run or were not timed
+
+    static const char* typeName(SessionCallType type);
+};
+
+// Appends calls to a compact binary log: a header, then one variable length record per call
+// with the prompts and the stages the call ran, well under 100 bytes for a single click.
+// Optionally stores every distinct BGR or gray image once as <imageDirectory>/<hash>.png,
+// so a replay can run on the original pixels; without it the replay synthesizes images. Images
+// are copied on the calling thread and encoded on a writer thread of the recorder.
+// Recording is thread-safe, records of several instances sharing one recorder interleave and
+// are told apart by their instance id.
+//
+// Stage times come from the stage timers, which are compiled out with both ENABLE_METRICS and
+// ENABLE_TRACING undefined. Such builds log only the call durations and mark the log as having
+// no stage times.
+class SessionRecorder
+{
+
+public:
+
+    SessionRecorder(const string& path, const string& imageDirectory = "");
+
+    ~SessionRecorder();
+
+    bool isOpen() const { return mFile.is_open(); }
+
+    // The timestamp is assigned here unless set
+    void record(SessionCall& call, const ImageFrame* frame = nullptr);
+
+    // Flushes the records and waits for the pending images to be written
+    void flush();
+
+    // Start of the recording on the Tracer clock, in nanoseconds
+    int64_t getStart() const { return mStart; }
+
+    static string imagePath(const string& imageDirectory, uint64_t imageHash);
+
+private:
+
+    struct PendingImage
+    {
+        string path;
+        Mat image;
+    };
+
+    mutex mMutex;
+    ofstream mFile;
+    string mImageDirectory;
+    unordered_set<uint64_t> mSavedImages;
+    int64_t mStart;
+
+    condition_variable mCondition;
+    deque<PendingImage> mPendingImages;
+    bool mIsWriting;
+    bool mIsStopping;
+    thread mWriter;
+
+    void writeImages();
+};
+
+// Reads a log written by a SessionRecorder
+class SessionReader
+{
+
+public:
+
+    SessionReader(const string& path);
+
+    // False if the file is missing or not a session log of this or an earlier version
+    bool isOpen() const { return mIsValid; }
+
+    // False if the recording build had the stage timers compiled out
+    bool hasStageTimes() const { return mHasStageTimes; }
+
+    // False at the end of the log or on a truncated record
+    bool next(SessionCall& call);
+
+private:
+
+    ifstream mFile;
+    uint32_t mVersion;
+    bool mIsValid;
+    bool mHasStageTimes;
+};
@@ -0,0 +1,365 @@
+#include "shared_embedding_cache.h"
+#include "metrics.h"
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const uint32_t REGION_MAGIC = 0x4345534E;  // "NSEC"
+static const uint32_t REGION_VERSION = 1;
+
+// How long to wait for the creating process to initialize the region
+static const auto INITIALIZE_TIMEOUT = chrono::seconds(5);
+
+// Slot states, in the upper half of the control word above the reference count
+enum SlotState : uint64_t { SLOT_FREE = 0, SLOT_WRITING = 1, SLOT_READY = 2 };
+
+// Index entries hold the slot + 1
+static const uint64_t INDEX_EMPTY = 0;
+static const uint64_t INDEX_TOMBSTONE = UINT64_MAX;
+
+// Cross-process atomics must not fall back to a lock
+static_assert(atomic<uint64_t>::is_always_lock_free, "64 bit atomics are not lock-free");
+
+static uint64_t controlWord(uint64_t state, uint64_t references) { return state << 32 | references; }
+static uint64_t slotState(uint64_t control) { return control >> 32; }
+static uint64_t slotReferences(uint64_t control) { return control & 0xFFFFFFFF; }
+
+// Per-slot bookkeeping, one cache line each
+struct alignas(64) SharedSlot
+{
+    atomic<uint64_t> control;           //!< State and reference count
+    atomic<uint64_t> key;               //!< Of the image in the slot
+    atomic<uint32_t> referenced;        //!< CLOCK bit, set by lookups
+};
+
+// Header at the start of the mapping, followed by the slots, the index and the page aligned slab
+struct SharedCacheRegion
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t numSlots;
+    uint64_t slotFloats;
+    uint64_t indexSize;                 //!< Power of two of at least twice the slots
+    atomic<uint32_t> isInitialized;
+    atomic<uint64_t> clockHand;
+
+    SharedSlot* slots() { return (SharedSlot*)((char*)this + slotsOffset()); }
+
+    atomic<uint64_t>* index() { return (atomic<uint64_t>*)((char*)slots() + numSlots * sizeof(SharedSlot)); }
+
+    static size_t slotsOffset() { return (sizeof(SharedCacheRegion) + 63) / 64 * 64; }
+};
+
+static size_t indexSizeFor(size_t numSlots)
+{
+    size_t size = 1;
+    while (size < 2 * numSlots) size <<= 1;
+    return size;
+}
+
+static size_t slabOffset(size_t numSlots)
+{
+    const size_t end = SharedCacheRegion::slotsOffset() + numSlots * sizeof(SharedSlot) + indexSizeFor(numSlots) * sizeof(uint64_t);
+    return (end + 4095) / 4096 * 4096;
+}
+
+// Image hashes are already well mixed, the encoder is folded in
+static uint64_t makeKey(uint64_t imageHash, int encoder)
+{
+    const uint64_t key = imageHash ^ (uint64_t)(encoder + 1) * 0x9E3779B97F4A7C15ull;
+    return key ? key : 1;
+}
+
+SharedEmbeddingCache::SharedEmbeddingCache(const string& name, size_t numSlots, size_t slotFloats)
+    : mRegion(nullptr), mMapping(nullptr), mMappedBytes(0), mNumSlots(numSlots), mSlotFloats(slotFloats), mSlotData(nullptr)
+{
+    if (numSlots == 0 || numSlots > UINT32_MAX || slotFloats == 0) return;
+
+    const size_t bytes = slabOffset(numSlots) + numSlots * slotFloats * sizeof(float);
+    bool isCreator = false;
+    void* address = nullptr;
+
+#ifdef _WIN32
+    // Pagefile backed, zero filled, and gone with the last handle
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)bytes >> 32),
+        (DWORD)bytes, ("Local\\" + name).c_str());
+    if (!mapping) return;
+    isCreator = GetLastError() != ERROR_ALREADY_EXISTS;
+
+    // Fails if an existing region is smaller than this geometry needs
+    address = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+    if (!address)
+    {
+        CloseHandle(mapping);
+        return;
+    }
+    mMapping = mapping;
+#else
+    const string path = "/" + name;
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+    isCreator = fd >= 0;
+    if (isCreator)
+    {
+        if (ftruncate(fd, bytes) != 0)
+        {
+            close(fd);
+            shm_unlink(path.c_str());
+            return;
+        }
+    }
+    else
+    {
+        fd = shm_open(path.c_str(), O_RDWR, 0666);
+        if (fd < 0) return;
+
+        // The creator sizes the region right after creating it
+        struct stat status;
+        const auto deadline = chrono::steady_clock::now() + INITIALIZE_TIMEOUT;
+        while (fstat(fd, &status) == 0 && status.st_size == 0 && chrono::steady_clock::now() < deadline)
+            this_thread::sleep_for(chrono::milliseconds(1));
+        if (fstat(fd, &status) != 0 || (size_t)status.st_size != bytes)
+        {
+            close(fd);
+            return;
+        }
+    }
+
+    address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) return;
+#endif
+
+    mMappedBytes = bytes;
+    SharedCacheRegion* region = (SharedCacheRegion*)address;
+
+    if (isCreator)
+    {
+        region->magic = REGION_MAGIC;
+        region->version = REGION_VERSION;
+        region->numSlots = numSlots;
+        region->slotFloats = slotFloats;
+        region->indexSize = indexSizeFor(numSlots);
+        new (&region->clockHand) atomic<uint64_t>(0);
+        for (size_t i = 0; i < numSlots; i++)
+        {
+            SharedSlot* slot = &region->slots()[i];
+            new (&slot->control) atomic<uint64_t>(controlWord(SLOT_FREE, 0));
+            new (&slot->key) atomic<uint64_t>(0);
+            new (&slot->referenced) atomic<uint32_t>(0);
+        }
+        for (size_t i = 0; i < region->indexSize; i++)
+            new (&region->index()[i]) atomic<uint64_t>(INDEX_EMPTY);
+        region->isInitialized.store(1, memory_order_release);
+    }
+    else
+    {
+        const auto deadline = chrono::steady_clock::now() + INITIALIZE_TIMEOUT;
+        while (!region->isInitialized.load(memory_order_acquire) && chrono::steady_clock::now() < deadline)
+            this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    if (!region->isInitialized.load(memory_order_acquire) || region->magic != REGION_MAGIC || region->version != REGION_VERSION ||
+        region->numSlots != numSlots || region->slotFloats != slotFloats)
+    {
+        mRegion = region;
+        unmap();
+        return;
+    }
+
+    mRegion = region;
+    mSlotData = (float*)((char*)address + slabOffset(numSlots));
+}
+
+SharedEmbeddingCache::~SharedEmbeddingCache()
+{
+    unmap();
+}
+
+void SharedEmbeddingCache::unmap()
+{
+    if (!mRegion) return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(mRegion);
+    CloseHandle((HANDLE)mMapping);
+#else
+    munmap(mRegion, mMappedBytes);
+#endif
+    mRegion = nullptr;
+}
+
+void SharedEmbeddingCache::remove(const string& name)
+{
+#ifndef _WIN32
+    shm_unlink(("/" + name).c_str());
+#endif
+}
+
+SharedEmbeddingCache::Handle SharedEmbeddingCache::find(uint64_t imageHash, int encoder)
+{
+    if (!mRegion) return Handle();
+
+    const uint64_t key = makeKey(imageHash, encoder);
+    const uint64_t mask = mRegion->indexSize - 1;
+    atomic<uint64_t>* index = mRegion->index();
+
+    for (uint64_t probe = 0; probe <= mask; probe++)
+    {
+        const uint64_t entry = index[(key + probe) & mask].load(memory_order_acquire);
+        if (entry == INDEX_EMPTY) break;
+        if (entry == INDEX_TOMBSTONE) continue;
+
+        const uint32_t slotIndex = (uint32_t)(entry - 1);
+        SharedSlot& slot = mRegion->slots()[slotIndex];
+        if (slot.key.load(memory_order_relaxed) != key) continue;
+
+        // Pin the slot while it is ready, then make sure it was not reused for another image meanwhile
+        uint64_t control = slot.control.load(memory_order_relaxed);
+        bool isPinned = false;
+        while (slotState(control) == SLOT_READY && !isPinned)
+            isPinned = slot.control.compare_exchange_weak(control, control + 1, memory_order_acquire, memory_order_relaxed);
+        if (!isPinned) continue;
+
+        if (slot.key.load(memory_order_acquire) != key)
+        {
+            releaseSlot(slotIndex, false);
+            continue;
+        }
+
+        slot.referenced.store(1, memory_order_relaxed);
+        METRICS_COUNT(Counter::SharedCacheHits, 1);
+        return Handle(this, slotIndex, false);
+    }
+
+    METRICS_COUNT(Counter::SharedCacheMisses, 1);
+    return Handle();
+}
+
+SharedEmbeddingCache::Handle SharedEmbeddingCache::allocate(uint64_t imageHash, int encoder)
+{
+    if (!mRegion) return Handle();
+
+    const uint64_t key = makeKey(imageHash, encoder);
+
+    // Two sweeps clear every CLOCK bit, the third covers slots released meanwhile
+    for (size_t attempt = 0; attempt < 3 * mNumSlots; attempt++)
+    {
+        const uint32_t slotIndex = (uint32_t)(mRegion->clockHand.fetch_add(1, memory_order_relaxed) % mNumSlots);
+        SharedSlot& slot = mRegion->slots()[slotIndex];
+
+        uint64_t control = slot.control.load(memory_order_relaxed);
+        if (slotReferences(control) != 0 || slotState(control) == SLOT_WRITING) continue;
+
+        const bool isReady = slotState(control) == SLOT_READY;
+        if (isReady && slot.referenced.exchange(0, memory_order_relaxed)) continue;
+
+        if (!slot.control.compare_exchange_strong(control, controlWord(SLOT_WRITING, 0), memory_order_acq_rel, memory_order_relaxed))
+            continue;
+
+        if (isReady)
+        {
+            removeIndex(slot.key.load(memory_order_relaxed), slotIndex);
+            METRICS_COUNT(Counter::SharedCacheEvictions, 1);
+        }
+        slot.key.store(key, memory_order_relaxed);
+        return Handle(this, slotIndex, true);
+    }
+    return Handle();
+}
+
+void SharedEmbeddingCache::publish(Handle& handle)
+{
+    if (!handle || !handle.mIsWriter) return;
+
+    // Ready with the reference of the handle, so the slot cannot be evicted before it is indexed
+    SharedSlot& slot = mRegion->slots()[handle.mSlot];
+    slot.referenced.store(1, memory_order_relaxed);
+    slot.control.store(controlWord(SLOT_READY, 1), memory_order_release);
+    insertIndex(slot.key.load(memory_order_relaxed), handle.mSlot);
+    handle.mIsWriter = false;
+}
+
+void SharedEmbeddingCache::insertIndex(uint64_t key, uint32_t slot)
+{
+    const uint64_t mask = mRegion->indexSize - 1;
+    atomic<uint64_t>* index = mRegion->index();
+
+    // The index has room for twice the slots, so a free entry is always found
+    for (uint64_t probe = 0; probe <= mask; probe++)
+    {
+        atomic<uint64_t>& entry = index[(key + probe) & mask];
+        uint64_t value = entry.load(memory_order_relaxed);
+        while (value == INDEX_EMPTY || value == INDEX_TOMBSTONE)
+            if (entry.compare_exchange_weak(value, (uint64_t)slot + 1, memory_order_release, memory_order_relaxed))
+                return;
+    }
+}
+
+void SharedEmbeddingCache::removeIndex(uint64_t key, uint32_t slot)
+{
+    const uint64_t mask = mRegion->indexSize - 1;
+    atomic<uint64_t>* index = mRegion->index();
+
+    for (uint64_t probe = 0; probe <= mask; probe++)
+    {
+        atomic<uint64_t>& entry = index[(key + probe) & mask];
+        uint64_t value = entry.load(memory_order_relaxed);
+        if (value == INDEX_EMPTY) return;
+        if (value == (uint64_t)slot + 1 && entry.compare_exchange_strong(value, INDEX_TOMBSTONE, memory_order_relaxed))
+            return;
+    }
+}
+
+void SharedEmbeddingCache::releaseSlot(uint32_t slot, bool isWriter)
+{
+    atomic<uint64_t>& control = mRegion->slots()[slot].control;
+
+    // An unpublished slot goes back to the free ones
+    if (isWriter)
+        control.store(controlWord(SLOT_FREE, 0), memory_order_release);
+    else
+        control.fetch_sub(1, memory_order_release);
+}
+
+SharedEmbeddingCache::Handle::Handle(Handle&& other) noexcept
+    : mCache(other.mCache), mSlot(other.mSlot), mIsWriter(other.mIsWriter)
+{
+    other.mCache = nullptr;
+}
+
+SharedEmbeddingCache::Handle& SharedEmbeddingCache::Handle::operator=(Handle&& other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        mCache = other.mCache;
+        mSlot = other.mSlot;
+        mIsWriter = other.mIsWriter;
+        other.mCache = nullptr;
+    }
+    return *this;
+}
+
+float* SharedEmbeddingCache::Handle::data() const
+{
+    return mCache ? mCache->mSlotData + (size_t)mSlot * mCache->mSlotFloats : nullptr;
+}
+
+void SharedEmbeddingCache::Handle::release()
+{
+    if (!mCache) return;
+    mCache->releaseSlot(mSlot, mIsWriter);
+    mCache = nullptr;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+struct SharedCacheRegion;
+
+// Image embeddings shared by all processes of a host through a named shared memory region,
+// so one process can decode against the encoder output of another without encoding again.
+//
+// The region is a slab of fixed-size slots, 256x64x64 floats by default, with a lock-free open
+// addressing index from image hash and encoder to slot. Every slot carries a reference count;
+// readers pin a slot while they decode from it in place, and slots no process references are
+// reused in CLOCK order. Slots are written by the one process that allocated them and become
+// visible to lookups once published.
+//
+// A process that dies while holding a slot leaves it pinned until the region is recreated.
+// The region lives while any process maps it; on POSIX its name persists until remove().
+class SharedEmbeddingCache
+{
+
+public:
+
+    // Opens the region of the name, creating it if no process has yet. Processes opening the
+    // same name have to agree on the slot geometry, otherwise isOpen() is false.
+    SharedEmbeddingCache(const string& name, size_t numSlots = 32, size_t slotFloats = 256 * 64 * 64);
+
+    ~SharedEmbeddingCache();
+
+    SharedEmbeddingCache(const SharedEmbeddingCache&) = delete;
+    SharedEmbeddingCache& operator=(const SharedEmbeddingCache&) = delete;
+
+    // Reference to one slot, released when destroyed
+    class Handle
+    {
+
+    public:
+
+        Handle() : mCache(nullptr), mSlot(0), mIsWriter(false) {}
+
+        Handle(Handle&& other) noexcept;
+
+        Handle& operator=(Handle&& other) noexcept;
+
+        ~Handle() { release(); }
+
+        explicit operator bool() const { return mCache != nullptr; }
+
+        // Embeddings in the shared region, writable only before the handle is published
+        float* data() const;
+
+        void release();
+
+    private:
+
+        friend class SharedEmbeddingCache;
+
+        Handle(SharedEmbeddingCache* cache, uint32_t slot, bool isWriter) : mCache(cache), mSlot(slot), mIsWriter(isWriter) {}
+
+        SharedEmbeddingCache* mCache;
+        uint32_t mSlot;
+        bool mIsWriter;
+    };
+
+    bool isOpen() const { return mRegion != nullptr; }
+
+    // Pins the published slot of the image, or returns an empty handle on a miss
+    Handle find(uint64_t imageHash, int encoder);
+
+    // Claims a slot to encode the image into, reusing the least recently found unreferenced one.
+    // Returns an empty handle if every slot is referenced.
+    Handle allocate(uint64_t imageHash, int encoder);
+
+    // Makes an allocated slot visible to find() in all processes, the handle stays a reference
+    void publish(Handle& handle);
+
+    size_t getNumSlots() const { return mNumSlots; }
+
+    size_t getSlotFloats() const { return mSlotFloats; }
+
+    size_t getMappedBytes() const { return mMappedBytes; }
+
+    // Deletes the name of a region, mapped regions stay valid. No-op on Windows.
+    static void remove(const string& name);
+
+private:
+
+    SharedCacheRegion* mRegion;
+    void* mMapping;                     //!< Platform handle of the mapping
+    size_t mMappedBytes;
+    size_t mNumSlots;
+    size_t mSlotFloats;
+    float* mSlotData;                   //!< Start of the slab inside the region
+
+    void unmap();
+    void releaseSlot(uint32_t slot, bool isWriter);
+    void insertIndex(uint64_t key, uint32_t slot);
+    void removeIndex(uint64_t key, uint32_t slot);
+};
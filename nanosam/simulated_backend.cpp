@@ -0,0 +1,195 @@
+#include "simulated_backend.h"
+#include "config.h"
+#include "image_ops.h"
+
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include <thread>
+
+bool LatencyDistribution::parse(const string& text, LatencyDistribution& distribution)
+{
+    size_t colon = text.find(':');
+    if (colon == string::npos) return false;
+
+    string name = text.substr(0, colon);
+    string parameters = text.substr(colon + 1);
+    for (auto& c : parameters)
+        if (c == ',') c = ' ';
+
+    istringstream in(parameters);
+    double a = 0, b = 0;
+    if (!(in >> a)) return false;
+    in >> b;
+
+    if (name == "const") distribution = LatencyDistribution(Constant, a);
+    else if (name == "uniform") distribution = LatencyDistribution(Uniform, a, b);
+    else if (name == "normal") distribution = LatencyDistribution(Normal, a, b);
+    else if (name == "lognormal") distribution = LatencyDistribution(LogNormal, a, b);
+    else return false;
+
+    return a >= 0 && b >= 0;
+}
+
+double LatencyDistribution::sample(mt19937_64& generator) const
+{
+    switch (type)
+    {
+    case Uniform:
+        return uniform_real_distribution<double>(a, max(a, b))(generator);
+    case Normal:
+        return max(0.0, normal_distribution<double>(a, b)(generator));
+    case LogNormal:
+    {
+        // Parameters of the underlying normal distribution for the given mean and deviation
+        if (a <= 0) return 0;
+        double sigma2 = log(1 + (b * b) / (a * a));
+        return lognormal_distribution<double>(log(a) - 0.5 * sigma2, sqrt(sigma2))(generator);
+    }
+    default:
+        return a;
+    }
+}
+
+string LatencyDistribution::toString() const
+{
+    ostringstream out;
+    switch (type)
+    {
+    case Uniform:   out << "uniform:" << a << "," << b; break;
+    case Normal:    out << "normal:" << a << "," << b; break;
+    case LogNormal: out << "lognormal:" << a << "," << b; break;
+    default:        out << "const:" << a; break;
+    }
+    return out.str();
+}
+
+SimulatedBackendOptions::SimulatedBackendOptions()
+    : encoderLatency(LatencyDistribution::Constant, 10), decoderLatency(LatencyDistribution::Constant, 2),
+      numEncoders(1), seed(0)
+{
+    geometry.inputWidth = 1024;
+    geometry.inputHeight = 1024;
+    geometry.embeddingDim = 256;
+    geometry.featureWidth = 64;
+    geometry.featureHeight = 64;
+    geometry.maskWidth = 256;
+    geometry.maskHeight = 256;
+    geometry.numMasks = 1;
+    geometry.isByteInput = false;
+}
+
+SimulatedBackend::SimulatedBackend(const SimulatedBackendOptions& options)
+    : mOptions(options), mGenerator(options.seed)
+{
+    const ModelGeometry& geometry = mOptions.geometry;
+    const size_t inputSize = 3 * (size_t)geometry.inputWidth * geometry.inputHeight;
+    if (geometry.isByteInput)
+        mEncoderByteInputs.resize(mOptions.numEncoders, vector<uchar>(inputSize));
+    else
+        mEncoderInputs.resize(mOptions.numEncoders, vector<float>(inputSize));
+
+    promise<void> ready;
+    ready.set_value();
+    mReady = ready.get_future().share();
+}
+
+// Hold the device for the sampled latency. Sleeping alone overshoots by up to a scheduler
+// tick, so the last two milliseconds are spent yielding.
+void SimulatedBackend::execute(const LatencyDistribution& latency)
+{
+    auto duration = chrono::duration<double, milli>(latency.sample(mGenerator));
+
+    unique_lock<mutex> lock;
+    if (mOptions.device) lock = unique_lock<mutex>(*mOptions.device);
+
+    auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(duration);
+    this_thread::sleep_until(deadline - chrono::milliseconds(2));
+    while (chrono::steady_clock::now() < deadline)
+        this_thread::yield();
+}
+
+float* SimulatedBackend::getEncoderInput(int encoder)
+{
+    if (mOptions.geometry.isByteInput) return nullptr;
+    return mEncoderInputs[min(encoder, (int)mEncoderInputs.size() - 1)].data();
+}
+
+uchar* SimulatedBackend::getEncoderByteInput(int encoder)
+{
+    if (!mOptions.geometry.isByteInput) return nullptr;
+    return mEncoderByteInputs[min(encoder, (int)mEncoderByteInputs.size() - 1)].data();
+}
+
+// Normalized value of channel c, 0 to 2 for R, G and B, of input pixel i
+float SimulatedBackend::getInputValue(int encoder, size_t i, int c)
+{
+    const ModelGeometry& geometry = mOptions.geometry;
+    if (geometry.isByteInput)
+        return getEncoderByteInput(encoder)[i * 3 + 2 - c] * kNormScale[c] + kNormBias[c];
+    return getEncoderInput(encoder)[c * (size_t)geometry.inputWidth * geometry.inputHeight + i];
+}
+
+void SimulatedBackend::encode(int encoder, float* features)
+{
+    const ModelGeometry& geometry = mOptions.geometry;
+
+    // Embeddings follow the image content, so identical images encode identically
+    const int planeSize = geometry.featureWidth * geometry.featureHeight;
+    for (int y = 0; y < geometry.featureHeight; y++)
+    {
+        const size_t row = (size_t)((2 * y + 1) * geometry.inputHeight / (2 * geometry.featureHeight)) * geometry.inputWidth;
+        for (int x = 0; x < geometry.featureWidth; x++)
+        {
+            const size_t pixel = row + (2 * x + 1) * geometry.inputWidth / (2 * geometry.featureWidth);
+            for (int c = 0; c < geometry.embeddingDim; c++)
+                features[(size_t)c * planeSize + y * geometry.featureWidth + x] = getInputValue(encoder, pixel, c % 3);
+        }
+    }
+
+    execute(mOptions.encoderLatency);
+}
+
+void SimulatedBackend::decode(const float* features, const float* pointCoords, const float* pointLabels, int numPoints,
+    const float* maskInput, const float* hasMaskInput, float* iouPredictions, float* lowResMasks)
+{
+    const ModelGeometry& geometry = mOptions.geometry;
+
+    // A disc around the first point, growing with the mask index
+    const float cx = pointCoords[0] * geometry.maskWidth / PROMPT_COORD_SPACE;
+    const float cy = pointCoords[1] * geometry.maskHeight / PROMPT_COORD_SPACE;
+    const float sign = pointLabels[0] > 0 ? 1.0f : -1.0f;
+
+    for (int m = 0; m < geometry.numMasks; m++)
+    {
+        const float radius = geometry.maskWidth * (0.08f + 0.04f * m);
+        float* mask = lowResMasks + (size_t)m * geometry.maskWidth * geometry.maskHeight;
+        for (int y = 0; y < geometry.maskHeight; y++)
+        {
+            for (int x = 0; x < geometry.maskWidth; x++)
+            {
+                float dx = x - cx, dy = y - cy;
+                mask[y * geometry.maskWidth + x] = sign * (radius - sqrt(dx * dx + dy * dy));
+            }
+        }
+        iouPredictions[m] = 0.9f - 0.05f * m;
+    }
+
+    execute(mOptions.decoderLatency);
+}
+
+vector<MemoryUsage> SimulatedBackend::getMemoryUsage() const
+{
+    size_t bytes = 0;
+    for (auto& input : mEncoderInputs)
+        bytes += input.capacity() * sizeof(float);
+    for (auto& input : mEncoderByteInputs)
+        bytes += input.capacity();
+    return { { "encoder_input", bytes, 0 } };
+}
+
+void SimulatedBackend::setLowMemory()
+{
+    mEncoderInputs.resize(min(mEncoderInputs.size(), (size_t)1));
+    mEncoderByteInputs.resize(min(mEncoderByteInputs.size(), (size_t)1));
+}
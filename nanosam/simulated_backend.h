@@ -0,0 +1,82 @@
+#pragma once
+
+#include "backend.h"
+
+#include <memory>
+#include <mutex>
+#include <random>
+
+// Latency distribution in milliseconds, parsed from "const:<ms>", "uniform:<min>,<max>",
+// "normal:<mean>,<stddev>" or "lognormal:<mean>,<stddev>"
+struct LatencyDistribution
+{
+    enum Type { Constant, Uniform, Normal, LogNormal };
+
+    Type type;
+    double a;                           //!< Constant value, minimum or mean
+    double b;                           //!< Maximum or standard deviation
+
+    LatencyDistribution(Type type = Constant, double a = 0, double b = 0) : type(type), a(a), b(b) {}
+
+    static bool parse(const string& text, LatencyDistribution& distribution);
+
+    double sample(mt19937_64& generator) const;
+
+    string toString() const;
+};
+
+struct SimulatedBackendOptions
+{
+    LatencyDistribution encoderLatency;
+    LatencyDistribution decoderLatency;
+    ModelGeometry geometry;             //!< Defaults to the NanoSam 1024 px encoder with float input
+    int numEncoders;
+    shared_ptr<mutex> device;           //!< Backends sharing a device run one model at a time, like a single GPU
+    uint64_t seed;
+
+    SimulatedBackendOptions();
+};
+
+// Stands in for the TensorRT models on machines without a GPU, so scheduling and caching can be
+// evaluated end to end. Encoding and decoding sleep for a sampled latency; the decoder outputs
+// a disc around the first prompt point and the embeddings are derived from the image content.
+class SimulatedBackend : public InferenceBackend
+{
+
+public:
+
+    SimulatedBackend(const SimulatedBackendOptions& options = SimulatedBackendOptions());
+
+    int getNumEncoders() const override { return mOptions.numEncoders; }
+
+    const ModelGeometry& getGeometry(int encoder) const override { return mOptions.geometry; }
+
+    shared_future<void> getReadyFuture() const override { return mReady; }
+
+    vector<ModelLoadReport> getLoadReports() const override { return {}; }
+
+    float* getEncoderInput(int encoder) override;
+
+    uchar* getEncoderByteInput(int encoder) override;
+
+    void encode(int encoder, float* features) override;
+
+    void decode(const float* features, const float* pointCoords, const float* pointLabels, int numPoints,
+        const float* maskInput, const float* hasMaskInput, float* iouPredictions, float* lowResMasks) override;
+
+    vector<MemoryUsage> getMemoryUsage() const override;
+
+    // The encoder variants share one input buffer
+    void setLowMemory() override;
+
+private:
+
+    SimulatedBackendOptions mOptions;
+    mt19937_64 mGenerator;
+    vector<vector<float>> mEncoderInputs;
+    vector<vector<uchar>> mEncoderByteInputs; //!< Instead of mEncoderInputs if the geometry has isByteInput
+    shared_future<void> mReady;
+
+    void execute(const LatencyDistribution& latency);
+    float getInputValue(int encoder, size_t i, int c);
+};
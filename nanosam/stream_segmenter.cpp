@@ -0,0 +1,219 @@
+#include "stream_segmenter.h"
+#include "bitmask.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <sstream>
+
+// Weight of the newest sample in the moving averages
+static const double ESTIMATE_WEIGHT = 0.2;
+
+// The budget is threatened above this share of it, and a level fits below the lower share
+static const double HIGH_WATER = 0.9;
+static const double LOW_WATER = 0.7;
+
+// Frames a better level has to be predicted to fit before stepping up to it
+static const int UPGRADE_FRAMES = 30;
+
+// Frames the SLO attainment is measured over
+static const size_t ATTAINMENT_WINDOW = 100;
+
+// The first sample seeds the average
+static void updateEstimate(double& estimate, double sample)
+{
+    estimate = estimate == 0 ? sample : estimate + ESTIMATE_WEIGHT * (sample - estimate);
+}
+
+StreamSegmenter::StreamSegmenter(NanoSam& nanosam, double budgetMs, int encoder)
+    : mNanoSam(nanosam), mEncoder(encoder), mBudget(budgetMs), mLevels(defaultLevels()), mLevel(0), mFrameTime(0),
+      mEncodeTime(0), mDecodeTime(0), mUpscaleTime(0), mContourTime(0), mRunLengthTime(0), mFrameIndex(0),
+      mFramesSinceEncode(0), mFramesFitting(0), mRecentFrames(ATTAINMENT_WINDOW, true), mRecentIndex(0),
+      mRecentWithinBudget(0), mFramesOverBudget(0)
+{
+}
+
+vector<QualitySettings> StreamSegmenter::defaultLevels()
+{
+    return {
+        { 1, 1.0,  true,  false },
+        { 1, 0.5,  true,  false },
+        { 2, 0.5,  true,  true },
+        { 4, 0.5,  false, true },
+        { 8, 0.25, false, true },
+    };
+}
+
+void StreamSegmenter::setLevels(const vector<QualitySettings>& levels)
+{
+    CV_Assert(!levels.empty());
+    mLevels = levels;
+    mFramesFitting = 0;
+    setLevel(0);
+}
+
+void StreamSegmenter::process(Mat& frame, const vector<Point>& points, const vector<float>& labels, StreamResult& result)
+{
+    process(ImageFrame::fromMat(frame), points, labels, result);
+}
+
+void StreamSegmenter::process(const ImageFrame& frame, const vector<Point>& points, const vector<float>& labels, StreamResult& result)
+{
+    TRACE_REQUEST("frame");
+    METRICS_SCOPE(Stage::Frame);
+
+    const auto start = Clock::now();
+    const QualitySettings& settings = mLevels[mLevel];
+    result.frameIndex = mFrameIndex++;
+    result.level = mLevel;
+    mFrameSize = frame.size();
+
+    // Reuse the embeddings of an earlier frame of the same size while the interval allows
+    result.isEncoded = mEncodedSize != frame.size() || mFramesSinceEncode + 1 >= settings.encodeInterval;
+    if (result.isEncoded)
+    {
+        auto encodeStart = Clock::now();
+        mNanoSam.setImage(frame, mEncoder);
+        updateEstimate(mEncodeTime, milliseconds(Clock::now() - encodeStart));
+        mEncodedSize = frame.size();
+        mFramesSinceEncode = 0;
+    }
+    else
+    {
+        mFramesSinceEncode++;
+        METRICS_COUNT(Counter::EncodesSkipped, 1);
+    }
+
+    auto decodeStart = Clock::now();
+    mNanoSam.decodePreview(points, labels, mLowResLogits);
+    updateEstimate(mDecodeTime, milliseconds(Clock::now() - decodeStart));
+
+    result.maskSize = Size(max(1, cvRound(frame.width * settings.maskScale)), max(1, cvRound(frame.height * settings.maskScale)));
+    const double megapixels = result.maskSize.area() * 1e-6;
+    {
+        METRICS_SCOPE(Stage::Upscale);
+        auto upscaleStart = Clock::now();
+        upscaleMask(mLowResLogits, settings.runLengths ? mMask : result.mask, result.maskSize.width, result.maskSize.height);
+        updateEstimate(mUpscaleTime, milliseconds(Clock::now() - upscaleStart) / megapixels);
+    }
+
+    if (settings.runLengths)
+    {
+        auto encodeStart = Clock::now();
+        BitMask::fromLogits(mMask).toRunLengths(result.runLengths);
+        result.mask.release();
+        updateEstimate(mRunLengthTime, milliseconds(Clock::now() - encodeStart) / megapixels);
+    }
+    else
+    {
+        result.runLengths.clear();
+    }
+
+    if (settings.contours)
+    {
+        // Traced on the logits, with a tolerance matching the mask resolution
+        auto contourStart = Clock::now();
+        result.contours = extractContours(mLowResLogits, frame.width, frame.height, max(1.0, 1.0 / settings.maskScale));
+        updateEstimate(mContourTime, milliseconds(Clock::now() - contourStart));
+    }
+    else
+    {
+        result.contours.clear();
+    }
+
+    result.latency = milliseconds(Clock::now() - start);
+    adapt(result.latency);
+}
+
+double StreamSegmenter::predictFrameTime(int level) const
+{
+    const QualitySettings& settings = mLevels[level];
+    const double megapixels = mFrameSize.area() * settings.maskScale * settings.maskScale * 1e-6;
+
+    return mEncodeTime / max(settings.encodeInterval, 1) + mDecodeTime + mUpscaleTime * megapixels +
+        (settings.contours ? mContourTime : 0) + (settings.runLengths ? mRunLengthTime * megapixels : 0);
+}
+
+void StreamSegmenter::adapt(double frameTime)
+{
+    updateEstimate(mFrameTime, frameTime);
+
+    const bool isWithinBudget = frameTime <= mBudget;
+    if (!isWithinBudget)
+    {
+        mFramesOverBudget++;
+        METRICS_COUNT(Counter::FramesOverBudget, 1);
+    }
+    if (mFrameIndex > ATTAINMENT_WINDOW) mRecentWithinBudget -= mRecentFrames[mRecentIndex];
+    mRecentFrames[mRecentIndex] = isWithinBudget;
+    mRecentWithinBudget += isWithinBudget;
+    mRecentIndex = (mRecentIndex + 1) % ATTAINMENT_WINDOW;
+
+    const int numLevels = (int)mLevels.size();
+    if (mFrameTime > HIGH_WATER * mBudget && mLevel + 1 < numLevels)
+    {
+        // Drop straight to the best level that fits with headroom
+        int level = mLevel + 1;
+        while (level + 1 < numLevels && predictFrameTime(level) > LOW_WATER * mBudget) level++;
+
+        METRICS_COUNT(Counter::QualityDowngrades, 1);
+        setLevel(level);
+    }
+    else if (mLevel > 0 && predictFrameTime(mLevel - 1) <= LOW_WATER * mBudget)
+    {
+        if (++mFramesFitting >= UPGRADE_FRAMES)
+        {
+            METRICS_COUNT(Counter::QualityUpgrades, 1);
+            setLevel(mLevel - 1);
+        }
+    }
+    else
+    {
+        mFramesFitting = 0;
+    }
+
+    publish();
+}
+
+void StreamSegmenter::setLevel(int level)
+{
+    mLevel = level;
+    mFramesFitting = 0;
+
+    // Judge the new level by its own cost rather than by the frames of the previous one
+    if (mFrameTime > 0) mFrameTime = predictFrameTime(level);
+}
+
+double StreamSegmenter::getSloAttainment() const
+{
+    const size_t frames = min<uint64_t>(mFrameIndex, ATTAINMENT_WINDOW);
+    return frames ? (double)mRecentWithinBudget / frames : 1.0;
+}
+
+void StreamSegmenter::publish() const
+{
+    const QualitySettings& settings = mLevels[mLevel];
+    METRICS_GAUGE(Gauge::QualityLevel, mLevel);
+    METRICS_GAUGE(Gauge::EncodeInterval, settings.encodeInterval);
+    METRICS_GAUGE(Gauge::MaskScale, settings.maskScale);
+    METRICS_GAUGE(Gauge::ContoursEnabled, settings.contours ? 1 : 0);
+    METRICS_GAUGE(Gauge::RunLengthMasks, settings.runLengths ? 1 : 0);
+    METRICS_GAUGE(Gauge::SloAttainment, getSloAttainment());
+}
+
+string StreamSegmenter::statsToJson() const
+{
+    const QualitySettings& settings = mLevels[mLevel];
+
+    ostringstream out;
+    out << "{\"budget_ms\":" << mBudget << ",\"level\":" << mLevel << ",\"encode_interval\":" << settings.encodeInterval
+        << ",\"mask_scale\":" << settings.maskScale << ",\"contours\":" << (settings.contours ? "true" : "false")
+        << ",\"run_lengths\":" << (settings.runLengths ? "true" : "false") << ",\"frames\":" << mFrameIndex
+        << ",\"frames_over_budget\":" << mFramesOverBudget << ",\"slo_attainment\":" << getSloAttainment()
+        << ",\"frame_ms\":" << mFrameTime << ",\"encode_ms\":" << mEncodeTime << ",\"decode_ms\":" << mDecodeTime
+        << ",\"upscale_ms_per_mp\":" << mUpscaleTime << ",\"contours_ms\":" << mContourTime
+        << ",\"run_lengths_ms_per_mp\":" << mRunLengthTime << ",\"predicted_ms\":[";
+    for (int i = 0; i < (int)mLevels.size(); i++)
+        out << (i ? "," : "") << predictFrameTime(i);
+    out << "]}";
+    return out.str();
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <chrono>
+#include "nanosam.h"
+
+// Output settings of one quality level
+struct QualitySettings
+{
+    int encodeInterval;                 //!< Run the encoder on every n-th frame, decode the others against the last embeddings
+    double maskScale;                   //!< Mask size relative to the frame
+    bool contours;                      //!< Trace the mask outline
+    bool runLengths;                    //!< Return the thresholded mask run-length encoded instead of dense
+};
+
+struct StreamResult
+{
+    uint64_t frameIndex;
+    int level;                          //!< Quality level the frame was processed at
+    bool isEncoded;                     //!< Decoded against the embeddings of this frame
+    Size maskSize;
+    Mat mask;                           //!< CV_32FC1 logits of maskSize, empty if run-length encoded
+    vector<uint32_t> runLengths;        //!< Of the mask, see BitMask::toRunLengths
+    vector<MaskContour> contours;       //!< In frame coordinates
+    double latency;                     //!< Milliseconds
+};
+
+// Segments a live stream within a per-frame latency budget by trading output quality for time.
+// The quality levels go from full quality down to the cheapest settings; see defaultLevels.
+//
+// The time of every part of a frame is tracked as a moving average, so the cost of any level
+// can be predicted, including levels not currently in use. When the average frame time nears
+// the budget, the controller drops to the best level predicted to fit with headroom. It steps
+// back up one level once that level has been predicted to fit for a number of frames in a row.
+// The chosen settings and the share of recent frames within budget are published as gauges.
+// Frames are processed on the calling thread, one stream per instance.
+class StreamSegmenter
+{
+
+public:
+
+    StreamSegmenter(NanoSam& nanosam, double budgetMs, int encoder = 0);
+
+    void process(const ImageFrame& frame, const vector<Point>& points, const vector<float>& labels, StreamResult& result);
+
+    void process(Mat& frame, const vector<Point>& points, const vector<float>& labels, StreamResult& result);
+
+    // Ordered from the best quality, which the stream starts at
+    void setLevels(const vector<QualitySettings>& levels);
+
+    static vector<QualitySettings> defaultLevels();
+
+    void setBudget(double budgetMs) { mBudget = budgetMs; }
+
+    double getBudget() const { return mBudget; }
+
+    int getLevel() const { return mLevel; }
+
+    const QualitySettings& getSettings() const { return mLevels[mLevel]; }
+
+    // Share of the recent frames within budget
+    double getSloAttainment() const;
+
+    // Predicted mean frame time of a level in milliseconds
+    double predictFrameTime(int level) const;
+
+    string statsToJson() const;
+
+private:
+
+    typedef chrono::steady_clock Clock;
+
+    NanoSam& mNanoSam;
+    int mEncoder;
+    double mBudget;                     //!< Milliseconds
+    vector<QualitySettings> mLevels;
+    int mLevel;
+
+    // Moving averages of the frame parts, in milliseconds
+    double mFrameTime;
+    double mEncodeTime;
+    double mDecodeTime;
+    double mUpscaleTime;                //!< Per megapixel of mask
+    double mContourTime;
+    double mRunLengthTime;              //!< Per megapixel of mask
+
+    uint64_t mFrameIndex;
+    Size mFrameSize;
+    int mFramesSinceEncode;
+    Size mEncodedSize;
+    int mFramesFitting;                 //!< Consecutive frames the next better level was predicted to fit
+
+    vector<bool> mRecentFrames;         //!< Ring of the latest frames, true if within budget
+    size_t mRecentIndex;
+    size_t mRecentWithinBudget;
+
+    uint64_t mFramesOverBudget;
+
+    Mat mLowResLogits;
+    Mat mMask;                          //!< Dense mask before run-length encoding
+
+    void adapt(double frameTime);
+
+    void setLevel(int level);
+
+    void publish() const;
+};
@@ -0,0 +1,285 @@
+#include "trace.h"
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+static const size_t MAX_PENDING_DUMPS = 64;
+
+// Ring buffer slot. The sequence number is cleared while the span is written,
+// so readers can skip slots that are being overwritten.
+struct TraceSlot
+{
+    atomic<uint64_t> sequence;
+    TraceSpan span;
+};
+
+atomic<bool> Tracer::sEnabled(false);
+
+static atomic<TraceSlot*> gSlots(nullptr);
+static size_t gCapacity = 0;
+static atomic<uint64_t> gWriteIndex(0);
+static atomic<uint64_t> gNextRequestId(1);
+static atomic<uint32_t> gNextThreadId(1);
+static atomic<int64_t> gSlowThreshold(0);
+
+static mutex gTraceMutex;
+static string gDumpDirectory = ".";
+static map<uint32_t, string> gThreadNames;
+
+static thread_local uint64_t tCurrentRequest = 0;
+
+static uint32_t currentThreadId()
+{
+    static thread_local uint32_t id = gNextThreadId.fetch_add(1);
+    return id;
+}
+
+// Slow request whose spans are waiting to be written
+struct PendingDump
+{
+    string path;
+    int64_t start;
+    int64_t end;
+};
+
+// Writes the slow-request dumps off the request threads. Created on the first dump and never
+// destroyed, so it outlives the threads that hand it work during static destruction.
+class DumpWriter
+{
+
+public:
+
+    static DumpWriter& instance()
+    {
+        static DumpWriter* writer = new DumpWriter();
+        return *writer;
+    }
+
+    void push(PendingDump dump)
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (mPending.size() >= MAX_PENDING_DUMPS) return;
+        mPending.push_back(std::move(dump));
+        mCondition.notify_all();
+    }
+
+    void flush()
+    {
+        unique_lock<mutex> lock(mMutex);
+        mCondition.wait(lock, [this]() { return mPending.empty() && !mIsWriting; });
+    }
+
+private:
+
+    mutex mMutex;
+    condition_variable mCondition;
+    deque<PendingDump> mPending;
+    bool mIsWriting;
+
+    DumpWriter() : mIsWriting(false)
+    {
+        thread(&DumpWriter::run, this).detach();
+    }
+
+    void run()
+    {
+        unique_lock<mutex> lock(mMutex);
+        for (;;)
+        {
+            mCondition.wait(lock, [this]() { return !mPending.empty(); });
+            PendingDump dump = std::move(mPending.front());
+            mPending.pop_front();
+            mIsWriting = true;
+            lock.unlock();
+
+            ofstream file(dump.path);
+            file << Tracer::toChromeJson(dump.start, dump.end);
+            file.close();
+
+            lock.lock();
+            mIsWriting = false;
+            mCondition.notify_all();
+        }
+    }
+};
+
+static void appendJsonString(ostringstream& out, const string& text)
+{
+    out << '"';
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\') out << '\\' << c;
+        else if ((unsigned char)c < 0x20) out << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec << setfill(' ');
+        else out << c;
+    }
+    out << '"';
+}
+
+void Tracer::enable(size_t capacity)
+{
+    lock_guard<mutex> lock(gTraceMutex);
+
+    // The buffer is allocated once and kept, writers may still hold a pointer to it
+    if (!gSlots.load())
+    {
+        gCapacity = max<size_t>(capacity, 1);
+        TraceSlot* slots = new TraceSlot[gCapacity];
+        for (size_t i = 0; i < gCapacity; i++)
+            slots[i].sequence.store(0, memory_order_relaxed);
+        gSlots.store(slots, memory_order_release);
+    }
+
+    sEnabled.store(true, memory_order_release);
+}
+
+void Tracer::disable()
+{
+    sEnabled.store(false, memory_order_release);
+}
+
+void Tracer::setSlowRequestDump(double thresholdMs, const string& directory)
+{
+    lock_guard<mutex> lock(gTraceMutex);
+    gDumpDirectory = directory;
+    gSlowThreshold.store((int64_t)(thresholdMs * 1e6), memory_order_relaxed);
+}
+
+void Tracer::flushSlowRequestDumps()
+{
+    DumpWriter::instance().flush();
+}
+
+void Tracer::record(const char* name, int64_t start, int64_t duration)
+{
+    TraceSlot* slots = gSlots.load(memory_order_acquire);
+    if (!slots) return;
+
+    uint64_t index = gWriteIndex.fetch_add(1, memory_order_relaxed);
+    TraceSlot& slot = slots[index % gCapacity];
+
+    slot.sequence.store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot.span.name = name;
+    slot.span.requestId = tCurrentRequest;
+    slot.span.threadId = currentThreadId();
+    slot.span.start = start;
+    slot.span.duration = duration;
+    slot.sequence.store(index + 1, memory_order_release);
+}
+
+uint64_t Tracer::getCurrentRequest()
+{
+    return tCurrentRequest;
+}
+
+void Tracer::setCurrentRequest(uint64_t requestId)
+{
+    tCurrentRequest = requestId;
+}
+
+void Tracer::setThreadName(const string& name)
+{
+    lock_guard<mutex> lock(gTraceMutex);
+    gThreadNames[currentThreadId()] = name;
+}
+
+string Tracer::toChromeJson(int64_t start, int64_t end)
+{
+    vector<TraceSpan> spans;
+
+    TraceSlot* slots = gSlots.load(memory_order_acquire);
+    if (slots)
+    {
+        uint64_t written = gWriteIndex.load(memory_order_acquire);
+        uint64_t first = written > gCapacity ? written - gCapacity : 0;
+        for (uint64_t index = first; index < written; index++)
+        {
+            TraceSlot& slot = slots[index % gCapacity];
+            if (slot.sequence.load(memory_order_acquire) != index + 1) continue;
+
+            TraceSpan span = slot.span;
+            atomic_thread_fence(memory_order_acquire);
+            if (slot.sequence.load(memory_order_relaxed) != index + 1) continue;
+
+            if (span.start <= end && span.start + span.duration >= start)
+                spans.push_back(span);
+        }
+    }
+
+    ostringstream out;
+    out << fixed << setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    bool isFirst = true;
+    {
+        lock_guard<mutex> lock(gTraceMutex);
+        for (auto& thread : gThreadNames)
+        {
+            out << (isFirst ? "" : ",") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread.first
+                << ",\"args\":{\"name\":";
+            appendJsonString(out, thread.second);
+            out << "}}";
+            isFirst = false;
+        }
+    }
+
+    for (auto& span : spans)
+    {
+        out << (isFirst ? "" : ",") << "{\"name\":";
+        appendJsonString(out, span.name);
+        out << ",\"cat\":\"nanosam\",\"ph\":\"X\""
+            << ",\"ts\":" << span.start / 1000.0 << ",\"dur\":" << span.duration / 1000.0
+            << ",\"pid\":1,\"tid\":" << span.threadId
+            << ",\"args\":{\"request\":" << span.requestId << "}}";
+        isFirst = false;
+    }
+
+    out << "]}";
+    return out.str();
+}
+
+bool Tracer::dump(const string& path)
+{
+    ofstream file(path);
+    if (!file.good()) return false;
+    file << toChromeJson();
+    return file.good();
+}
+
+TraceRequestScope::TraceRequestScope(const char* name)
+    : mName(name), mRequestId(0), mStart(0), mIsOwner(false)
+{
+    if (!Tracer::isEnabled() || Tracer::getCurrentRequest() != 0) return;
+
+    mIsOwner = true;
+    mRequestId = gNextRequestId.fetch_add(1, memory_order_relaxed);
+    mStart = Tracer::now();
+    Tracer::setCurrentRequest(mRequestId);
+}
+
+TraceRequestScope::~TraceRequestScope()
+{
+    if (!mIsOwner) return;
+
+    int64_t duration = Tracer::now() - mStart;
+    Tracer::record(mName, mStart, duration);
+    Tracer::setCurrentRequest(0);
+
+    int64_t threshold = gSlowThreshold.load(memory_order_relaxed);
+    if (threshold > 0 && duration > threshold)
+    {
+        string directory;
+        {
+            lock_guard<mutex> lock(gTraceMutex);
+            directory = gDumpDirectory;
+        }
+
+        DumpWriter::instance().push({ directory + "/nanosam_trace_" + to_string(mRequestId) + ".json", mStart, mStart + duration });
+    }
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "config.h"
+
+using namespace std;
+
+// A completed span on the trace timeline
+struct TraceSpan
+{
+    const char* name;                   //!< Static string, not copied
+    uint64_t requestId;                 //!< 0 outside of a request
+    uint32_t threadId;
+    int64_t start;                      //!< Nanoseconds on the steady clock
+    int64_t duration;                   //!< Nanoseconds
+};
+
+// Per-request span recorder with Chrome/Perfetto trace-event JSON export.
+// Spans go into a preallocated ring buffer with a lock-free write index, so the oldest
+// spans are overwritten once the buffer is full. Tracing is off until enable() is called.
+class Tracer
+{
+
+public:
+
+    static void enable(size_t capacity = 1 << 16);
+
+    static void disable();
+
+    static bool isEnabled() { return sEnabled.load(memory_order_relaxed); }
+
+    // Dump every request slower than the threshold to <directory>/nanosam_trace_<request>.json,
+    // including the spans of other threads that overlap it. A threshold <= 0 disables it.
+    // Dumps are written by a background thread, so the slow request does not wait for the file;
+    // the spans have to stay in the ring buffer until then. Dumps beyond 64 pending are dropped.
+    static void setSlowRequestDump(double thresholdMs, const string& directory = ".");
+
+    // Wait until the pending slow-request dumps are written, e.g. before exiting
+    static void flushSlowRequestDumps();
+
+    static void record(const char* name, int64_t start, int64_t duration);
+
+    // Request the spans of this thread are attributed to, e.g. when handing work to another thread
+    static uint64_t getCurrentRequest();
+
+    static void setCurrentRequest(uint64_t requestId);
+
+    // Shown as the thread name in the trace viewer
+    static void setThreadName(const string& name);
+
+    // Spans overlapping [start, end] in nanoseconds, all spans by default
+    static string toChromeJson(int64_t start = INT64_MIN, int64_t end = INT64_MAX);
+
+    static bool dump(const string& path);
+
+    static int64_t now()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+
+    friend class TraceRequestScope;
+
+    static atomic<bool> sEnabled;
+};
+
+// Records the lifetime of the scope as a span
+class ScopedTraceSpan
+{
+
+public:
+
+    ScopedTraceSpan(const char* name) : mName(name), mStart(Tracer::isEnabled() ? Tracer::now() : 0) {}
+
+    ~ScopedTraceSpan()
+    {
+        if (mStart && Tracer::isEnabled()) Tracer::record(mName, mStart, Tracer::now() - mStart);
+    }
+
+private:
+
+    const char* mName;
+    int64_t mStart;
+};
+
+// Starts a new request on the calling thread unless one is already active.
+// Spans recorded on this thread until the scope ends carry the request id.
+class TraceRequestScope
+{
+
+public:
+
+    TraceRequestScope(const char* name);
+
+    ~TraceRequestScope();
+
+private:
+
+    const char* mName;
+    uint64_t mRequestId;
+    int64_t mStart;
+    bool mIsOwner;
+};
+
+#ifdef ENABLE_TRACING
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) ScopedTraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#define TRACE_REQUEST(name) TraceRequestScope TRACE_CONCAT(traceRequest, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_REQUEST(name) ((void)0)
+#endif
@@ -0,0 +1,232 @@
+#include "trt_backend.h"
+
+#include <cassert>
+#include <chrono>
+#include <stdexcept>
+
+static int volume(const Dims& dims)
+{
+    int size = 1;
+    for (int i = 0; i < dims.nbDims; i++)
+        size *= max(dims.d[i], 1);
+    return size;
+}
+
+static void warmupEncoder(TRTModule* encoder, int runs)
+{
+    Mat blank(encoder->getInputImageSize(), CV_8UC3, Scalar(0, 0, 0));
+
+    for (int i = 0; i < runs; i++)
+    {
+        encoder->setInput(blank);
+        encoder->infer();
+    }
+}
+
+static void warmupDecoder(TRTModule* decoder, int runs)
+{
+    vector<float> features(volume(decoder->getBindingDims("image_embeddings")), 0.0f);
+    vector<float> maskInput(volume(decoder->getBindingDims("mask_input")), 0.0f);
+    float pointCoords[2] = { 0.0f, 0.0f };
+    float pointLabels[1] = { 1.0f };
+    float hasMaskInput = 0.0f;
+
+    for (int i = 0; i < runs; i++)
+    {
+        decoder->setInput(features.data(), pointCoords, pointLabels, maskInput.data(), &hasMaskInput, 1);
+        decoder->infer();
+    }
+}
+
+TRTBackend::TRTBackend(vector<string> encoderPaths, string decoderPath, int warmupRuns, bool isByteInput)
+    : mMaskDecoder(nullptr), mIsLowMemory(false)
+{
+    assert(!encoderPaths.empty());
+
+    mImageEncoders.resize(encoderPaths.size(), nullptr);
+    mLoadReports.resize(encoderPaths.size() + 1);
+
+    // Every model is built or deserialized and warmed up on its own thread
+    auto loadModel = [this, warmupRuns, isByteInput](int index, string path, bool isDecoder)
+    {
+        auto model = isDecoder ?
+            new TRTModule(path,
+                { "image_embeddings", "point_coords", "point_labels", "mask_input", "has_mask_input" },
+                { "iou_predictions", "low_res_masks" }, true, false) :
+            new TRTModule(path,
+                { "image" },
+                { "image_embeddings" }, false, true, isByteInput);
+
+        auto start = chrono::steady_clock::now();
+        if (isDecoder)
+            warmupDecoder(model, warmupRuns);
+        else
+            warmupEncoder(model, warmupRuns);
+
+        ModelLoadReport& report = mLoadReports[index];
+        report.path = path;
+        report.loadTime = model->getLoadTime();
+        report.initializeTime = model->getInitializeTime();
+        report.warmupTime = elapsedMs(start);
+
+        return model;
+    };
+
+    vector<future<TRTModule*>> tasks;
+    for (int i = 0; i < encoderPaths.size(); i++)
+        tasks.push_back(async(launch::async, loadModel, i, encoderPaths[i], false));
+    tasks.push_back(async(launch::async, loadModel, (int)encoderPaths.size(), decoderPath, true));
+
+    // Every model is collected, so the destructor frees those that loaded, before the first
+    // error is passed on through the ready future
+    auto tasksPtr = make_shared<vector<future<TRTModule*>>>(std::move(tasks));
+    mReady = async(launch::async, [this, tasksPtr]()
+    {
+        auto& tasks = *tasksPtr;
+        exception_ptr error;
+        for (int i = 0; i < tasks.size(); i++)
+        {
+            try
+            {
+                TRTModule* model = tasks[i].get();
+                if (i + 1 < tasks.size()) mImageEncoders[i] = model;
+                else mMaskDecoder = model;
+            }
+            catch (...)
+            {
+                if (!error) error = current_exception();
+            }
+        }
+        if (error) rethrow_exception(error);
+
+        setup();
+    }).share();
+}
+
+TRTBackend::~TRTBackend()
+{
+    // Let background loading finish before releasing the models
+    if (mReady.valid()) mReady.wait();
+
+    for (auto encoder : mImageEncoders)
+        if (encoder) delete encoder;
+    if (mMaskDecoder)   delete mMaskDecoder;
+}
+
+// Read the model geometry from the bindings
+void TRTBackend::setup()
+{
+    // Decoder geometry, NCHW
+    Dims embeddingDims = mMaskDecoder->getBindingDims("image_embeddings");
+    Dims maskDims = mMaskDecoder->getBindingDims("low_res_masks");
+    Dims maskInputDims = mMaskDecoder->getBindingDims("mask_input");
+
+    ModelGeometry decoderGeometry;
+    decoderGeometry.embeddingDim = embeddingDims.d[1];
+    decoderGeometry.featureHeight = embeddingDims.d[2];
+    decoderGeometry.featureWidth = embeddingDims.d[3];
+    decoderGeometry.numMasks = max(maskDims.d[1], 1);
+    decoderGeometry.maskHeight = maskDims.d[2];
+    decoderGeometry.maskWidth = maskDims.d[3];
+    decoderGeometry.isByteInput = false;
+
+    // The mask input is the low resolution mask of a previous prediction
+    if (volume(maskInputDims) != decoderGeometry.maskWidth * decoderGeometry.maskHeight)
+        throw runtime_error("Decoder mask_input does not match the size of low_res_masks");
+
+    for (auto encoder : mImageEncoders)
+    {
+        Size inputSize = encoder->getInputImageSize();
+        Dims outputDims = encoder->getBindingDims("image_embeddings");
+
+        ModelGeometry geometry = decoderGeometry;
+        geometry.inputHeight = inputSize.height;
+        geometry.inputWidth = inputSize.width;
+        geometry.isByteInput = encoder->isByteInput();
+
+        // Every encoder variant has to feed the same decoder
+        if (volume(outputDims) != volume(embeddingDims))
+            throw runtime_error("Encoder output does not match the decoder image_embeddings input");
+
+        mGeometries.push_back(geometry);
+    }
+
+    // The decoder reads the embeddings from the caller's buffer, see TRTModule::setInput
+    mMaskDecoder->releaseHostBuffer("image_embeddings");
+}
+
+vector<ModelLoadReport> TRTBackend::getLoadReports() const
+{
+    mReady.get();
+    return mLoadReports;
+}
+
+const ModelGeometry& TRTBackend::getGeometry(int encoder) const
+{
+    mReady.get();
+    return mGeometries[encoder];
+}
+
+float* TRTBackend::getEncoderInput(int encoder)
+{
+    return mImageEncoders[encoder]->isByteInput() ? nullptr : mImageEncoders[encoder]->getInputBuffer();
+}
+
+uchar* TRTBackend::getEncoderByteInput(int encoder)
+{
+    return mImageEncoders[encoder]->isByteInput() ? mImageEncoders[encoder]->getByteInputBuffer() : nullptr;
+}
+
+void TRTBackend::encode(int encoder, float* features)
+{
+    mReady.get();
+
+    if (mIsLowMemory)
+    {
+        mImageEncoders[encoder]->setOutput(features);
+        mImageEncoders[encoder]->infer();
+        return;
+    }
+
+    mImageEncoders[encoder]->infer();
+    mImageEncoders[encoder]->getOutput(features);
+}
+
+void TRTBackend::decode(const float* features, const float* pointCoords, const float* pointLabels, int numPoints,
+    const float* maskInput, const float* hasMaskInput, float* iouPredictions, float* lowResMasks)
+{
+    mReady.get();
+
+    mMaskDecoder->setInput(features, pointCoords, pointLabels, maskInput, hasMaskInput, numPoints);
+    mMaskDecoder->infer();
+    mMaskDecoder->getOutput(iouPredictions, lowResMasks);
+}
+
+vector<MemoryUsage> TRTBackend::getMemoryUsage() const
+{
+    mReady.get();
+
+    vector<MemoryUsage> usage;
+    for (int i = 0; i < mImageEncoders.size(); i++)
+        usage.push_back({ "encoder_" + to_string(i), mImageEncoders[i]->getHostBytes(), mImageEncoders[i]->getDeviceBytes() });
+    usage.push_back({ "decoder", mMaskDecoder->getHostBytes(), mMaskDecoder->getDeviceBytes() });
+    return usage;
+}
+
+void TRTBackend::setLowMemory()
+{
+    mReady.get();
+    if (mIsLowMemory) return;
+
+    // Encodes run one at a time, so one input buffer of the largest size serves every variant
+    int largest = 0;
+    for (int i = 1; i < mImageEncoders.size(); i++)
+        if (mImageEncoders[i]->getInputBytes() > mImageEncoders[largest]->getInputBytes())
+            largest = i;
+    for (int i = 0; i < mImageEncoders.size(); i++)
+    {
+        if (i != largest) mImageEncoders[i]->shareInputBuffer(*mImageEncoders[largest]);
+        mImageEncoders[i]->releaseHostBuffer("image_embeddings");
+    }
+    mIsLowMemory = true;
+}
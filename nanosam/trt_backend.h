@@ -0,0 +1,56 @@
+#pragma once
+
+#include "backend.h"
+#include "trt_module.h"
+
+// TensorRT engines for one or more encoder variants and the shared mask decoder
+class TRTBackend : public InferenceBackend
+{
+
+public:
+
+    // The models are loaded concurrently on background threads and warmed up with
+    // warmupRuns inferences each. Inference calls block until loading has finished, and throw
+    // the error of the first model that failed to load.
+    // isByteInput builds encoders from ONNX files with 8-bit input and the normalization in the
+    // model; engine files keep the input they were built with.
+    TRTBackend(vector<string> encoderPaths, string decoderPath, int warmupRuns = 1, bool isByteInput = false);
+
+    ~TRTBackend();
+
+    int getNumEncoders() const override { return (int)mImageEncoders.size(); }
+
+    const ModelGeometry& getGeometry(int encoder) const override;
+
+    shared_future<void> getReadyFuture() const override { return mReady; }
+
+    // Load timings of the encoders followed by the decoder
+    vector<ModelLoadReport> getLoadReports() const override;
+
+    float* getEncoderInput(int encoder) override;
+
+    uchar* getEncoderByteInput(int encoder) override;
+
+    void encode(int encoder, float* features) override;
+
+    void decode(const float* features, const float* pointCoords, const float* pointLabels, int numPoints,
+        const float* maskInput, const float* hasMaskInput, float* iouPredictions, float* lowResMasks) override;
+
+    vector<MemoryUsage> getMemoryUsage() const override;
+
+    // The encoder variants share the input buffer of the largest one, and the embeddings are
+    // copied from the device straight into the caller's buffer
+    void setLowMemory() override;
+
+private:
+
+    vector<TRTModule*> mImageEncoders;
+    vector<ModelGeometry> mGeometries;
+    TRTModule* mMaskDecoder;
+    bool mIsLowMemory;
+
+    shared_future<void> mReady;
+    vector<ModelLoadReport> mLoadReports;
+
+    void setup();
+};
@@ -1,11 +1,16 @@
 #include "trt_module.h"
+#include "backend.h"
 #include "logging.h"
 #include "cuda_utils.h"
 #include "config.h"
 #include "macros.h"
+#include "image_ops.h"
+#include "metrics.h"
 
+#include <chrono>
 #include <cstdlib>
 #include <fstream>
+#include <stdexcept>
 #include <iostream>
 #include <sstream>
 #include <NvOnnxParser.h>
@@ -22,28 +27,35 @@ std::string getFileExtension(const std::string& filePath) {
     return ""; // No extension found
 }
 
-TRTModule::TRTModule(string modelPath, vector<string> inputNames, vector<string> outputNames, bool isDynamicShape, bool isFP16)
+TRTModule::TRTModule(string modelPath, vector<string> inputNames, vector<string> outputNames, bool isDynamicShape, bool isFP16, bool isByteInput)
+    : mLoadTime(0), mInitializeTime(0)
 {
+    auto start = chrono::steady_clock::now();
+
     if (getFileExtension(modelPath) == "onnx")
     {
         cout << "Building Engine from " << modelPath << endl;
-        build(modelPath, inputNames, outputNames, isDynamicShape, isFP16);
+        build(modelPath, inputNames, outputNames, isDynamicShape, isFP16, isByteInput);
     }
     else
     {
         cout << "Deserializing Engine." << endl;
         deserializeEngine(modelPath, inputNames, outputNames);
     }
+
+    mLoadTime = elapsedMs(start) - mInitializeTime;
 }
 
 TRTModule::~TRTModule()
 {
     // Release stream and buffers
+    for (auto event : mStageEvents)
+        cudaEventDestroy(event);
     cudaStreamDestroy(mCudaStream);
     for (int i = 0; i < mGpuBuffers.size(); i++)
         CUDA_CHECK(cudaFree(mGpuBuffers[i]));
     for (int i = 0; i < mCpuBuffers.size(); i++)    
-        delete[] mCpuBuffers[i];
+        if (!mIsCpuBufferShared[i]) delete[] mCpuBuffers[i];
     
     // Destroy the engine
     delete mContext;
@@ -51,7 +63,45 @@ TRTModule::~TRTModule()
     delete mRuntime;
 }
 
-void TRTModule::build(string onnxPath, vector<string> inputNames, vector<string> outputNames, bool isDynamicShape, bool isFP16)
+// Replace the NCHW float image input of a parsed encoder by an NHWC uint8 BGR input of the same
+// name, converted, reordered to RGB and normalized by the first layers. The host then copies a
+// quarter of the bytes and skips the normalization. uint8 inputs need TensorRT 8.5 or newer.
+static void addByteInput(INetworkDefinition* network)
+{
+    ITensor* input = network->getInput(0);
+    const Dims dims = input->getDimensions();
+    const string name = input->getName();
+    const int numLayers = network->getNbLayers();
+    input->setName((name + "_float").c_str());
+
+    ITensor* bytes = network->addInput(name.c_str(), DataType::kUINT8, Dims4{ dims.d[0], dims.d[2], dims.d[3], 3 });
+
+    IIdentityLayer* cast = network->addIdentity(*bytes);
+    cast->setOutputType(0, DataType::kFLOAT);
+
+    IShuffleLayer* toPlanar = network->addShuffle(*cast->getOutput(0));
+    toPlanar->setFirstTranspose(Permutation{ { 0, 3, 1, 2 } });
+
+    // BGR to RGB by walking the channels backwards
+    ISliceLayer* toRgb = network->addSlice(*toPlanar->getOutput(0), Dims4{ 0, 2, 0, 0 },
+        Dims4{ dims.d[0], 3, dims.d[2], dims.d[3] }, Dims4{ 1, -1, 1, 1 });
+
+    // The weights have to outlive the build, kNormBias and kNormScale are static
+    IScaleLayer* normalize = network->addScale(*toRgb->getOutput(0), ScaleMode::kCHANNEL,
+        Weights{ DataType::kFLOAT, kNormBias, 3 }, Weights{ DataType::kFLOAT, kNormScale, 3 }, Weights{ DataType::kFLOAT, nullptr, 0 });
+    normalize->setName("normalize_input");
+
+    // Feed the layers of the model from the normalized tensor, leaving the float input unused
+    for (int i = 0; i < numLayers; i++)
+    {
+        ILayer* layer = network->getLayer(i);
+        for (int j = 0; j < layer->getNbInputs(); j++)
+            if (layer->getInput(j) == input) layer->setInput(j, *normalize->getOutput(0));
+    }
+    network->removeTensor(*input);
+}
+
+void TRTModule::build(string onnxPath, vector<string> inputNames, vector<string> outputNames, bool isDynamicShape, bool isFP16, bool isByteInput)
 {
     auto builder = createInferBuilder(gLogger);
     assert(builder != nullptr);
@@ -87,20 +137,25 @@ void TRTModule::build(string onnxPath, vector<string> inputNames, vector<string>
     assert(parser != nullptr);
 
     bool parsed = parser->parseFromFile(onnxPath.c_str(), static_cast<int>(gLogger.getReportableSeverity()));
-    assert(parsed != nullptrt);
+    if (!parsed) throw runtime_error("Cannot parse " + onnxPath);
+
+    if (isByteInput)
+    {
+        addByteInput(network);
+    }
 
 
     // CUDA stream used for profiling by the builder.
     assert(mCudaStream != nullptr);
 
     IHostMemory* plan{ builder->buildSerializedNetwork(*network, *config) };
-    assert(plan != nullptr);
+    if (!plan) throw runtime_error("Cannot build an engine from " + onnxPath);
 
     mRuntime = createInferRuntime(gLogger);
     assert(mRuntime != nullptr);
 
     mEngine = mRuntime->deserializeCudaEngine(plan->data(), plan->size(), nullptr);
-    assert(mEngine != nullptr);
+    if (!mEngine) throw runtime_error("Cannot deserialize the engine built from " + onnxPath);
 
     mContext = mEngine->createExecutionContext();
     assert(mContext != nullptr);
@@ -116,10 +171,7 @@ void TRTModule::build(string onnxPath, vector<string> inputNames, vector<string>
 void TRTModule::deserializeEngine(string engine_name, vector<string> inputNames, vector<string> outputNames)
 {
     std::ifstream file(engine_name, std::ios::binary);
-    if (!file.good()) {
-        std::cerr << "read " << engine_name << " error!" << std::endl;
-        assert(false);
-    }
+    if (!file.good()) throw runtime_error("Cannot read " + engine_name);
     size_t size = 0;
     file.seekg(0, file.end);
     size = file.tellg();
@@ -132,7 +184,11 @@ void TRTModule::deserializeEngine(string engine_name, vector<string> inputNames,
     mRuntime = createInferRuntime(gLogger);
     assert(mRuntime);
     mEngine = mRuntime->deserializeCudaEngine(serializedEngine, size);
-    assert(*mEngine);
+    if (!mEngine)
+    {
+        delete[] serializedEngine;
+        throw runtime_error("Cannot deserialize " + engine_name);
+    }
     mContext = mEngine->createExecutionContext();
     assert(*mContext);
     delete[] serializedEngine;
@@ -144,40 +200,49 @@ void TRTModule::deserializeEngine(string engine_name, vector<string> inputNames,
 
 void TRTModule::initialize(vector<string> inputNames, vector<string> outputNames)
 {
+    auto start = chrono::steady_clock::now();
+
     for (int i = 0; i < inputNames.size(); i++)
     {
         const int inputIndex = mEngine->getBindingIndex(inputNames[i].c_str());
+        if (inputIndex < 0) throw runtime_error("The engine has no input " + inputNames[i]);
+        mInputIndices.push_back(inputIndex);
+        mInputDims.push_back(mEngine->getBindingDimensions(inputIndex));
     }
 
     for (int i = 0; i < outputNames.size(); i++)
     {
         const int outputIndex = mEngine->getBindingIndex(outputNames[i].c_str());
+        if (outputIndex < 0) throw runtime_error("The engine has no output " + outputNames[i]);
+        mOutputIndices.push_back(outputIndex);
+        mOutputDims.push_back(mEngine->getBindingDimensions(outputIndex));
     }
 
     mGpuBuffers.resize(mEngine->getNbBindings());
     mCpuBuffers.resize(mEngine->getNbBindings());
+    mIsCpuBufferShared.resize(mEngine->getNbBindings(), false);
+    mHostInputs.resize(mEngine->getNbBindings(), nullptr);
+    mHostOutputs.resize(mEngine->getNbBindings(), nullptr);
 
     for (size_t i = 0; i < mEngine->getNbBindings(); ++i)
     {
         size_t binding_size = getSizeByDim(mEngine->getBindingDimensions(i));
+        size_t elementBytes = mEngine->getBindingDataType(i) == DataType::kUINT8 ? 1 : sizeof(float);
         mBufferBindingSizes.push_back(binding_size);
-        mBufferBindingBytes.push_back(binding_size * sizeof(float));
+        mBufferElementBytes.push_back(elementBytes);
+        mBufferBindingBytes.push_back(binding_size * elementBytes);
 
-        mCpuBuffers[i] = new float[binding_size];
+        // Byte inputs still live in a float array, rounded up
+        mCpuBuffers[i] = new float[(mBufferBindingBytes[i] + sizeof(float) - 1) / sizeof(float)];
 
         cudaMalloc(&mGpuBuffers[i], mBufferBindingBytes[i]);
-
-        if (mEngine->bindingIsInput(i))
-        {
-            mInputDims.push_back(mEngine->getBindingDimensions(i));
-        }
-        else
-        {
-            mOutputDims.push_back(mEngine->getBindingDimensions(i));
-        }
     }
 
     CUDA_CHECK(cudaStreamCreate(&mCudaStream));
+    for (auto& event : mStageEvents)
+        CUDA_CHECK(cudaEventCreate(&event));
+
+    mInitializeTime = elapsedMs(start);
 }
 
 //!
@@ -188,10 +253,19 @@ void TRTModule::initialize(vector<string> inputNames, vector<string> outputNames
 //!
 bool TRTModule::infer()
 {
+    TRACE_SCOPE("infer");
+    const int64_t start = Tracer::now();
+
+    // The stages are timed with events between them on the stream, so the copy to the device
+    // overlaps with the launch of the execution rather than being waited for to measure it
+    CUDA_CHECK(cudaEventRecord(mStageEvents[0], mCudaStream));
+
     // Memcpy from host input buffers to device input buffers
     copyInputToDeviceAsync(mCudaStream);
+    CUDA_CHECK(cudaEventRecord(mStageEvents[1], mCudaStream));
 
     bool status = mContext->executeV2(mGpuBuffers.data());
+    CUDA_CHECK(cudaEventRecord(mStageEvents[2], mCudaStream));
 
     if (!status)
     {
@@ -201,6 +275,19 @@ bool TRTModule::infer()
 
     // Memcpy from device output buffers to host output buffers
     copyOutputToHostAsync(mCudaStream);
+    CUDA_CHECK(cudaEventRecord(mStageEvents[3], mCudaStream));
+    CUDA_CHECK(cudaStreamSynchronize(mCudaStream));
+
+    const Stage stages[] = { Stage::HostToDevice, Stage::Execute, Stage::DeviceToHost };
+    int64_t stageStart = start;
+    for (int i = 0; i < 3; i++)
+    {
+        float ms = 0;
+        CUDA_CHECK(cudaEventElapsedTime(&ms, mStageEvents[i], mStageEvents[i + 1]));
+        const int64_t elapsed = (int64_t)(ms * 1e6);
+        recordStageTime(stages[i], stageStart, elapsed);
+        stageStart += elapsed;
+    }
 
     return true;
 }
@@ -225,13 +312,15 @@ void TRTModule::memcpyBuffers(const bool copyInput, const bool deviceToHost, con
 {
     for (int i = 0; i < mEngine->getNbBindings(); i++)
     {
-        void* dstPtr = deviceToHost ? mCpuBuffers[i] : mGpuBuffers[i];
-        const void* srcPtr = deviceToHost ? mGpuBuffers[i] : mCpuBuffers[i];
+        void* dstPtr = deviceToHost ? mHostOutputs[i] ? mHostOutputs[i] : mCpuBuffers[i] : mGpuBuffers[i];
+        const void* srcPtr = deviceToHost ? mGpuBuffers[i] : mHostInputs[i] ? mHostInputs[i] : mCpuBuffers[i];
         const size_t byteSize = mBufferBindingBytes[i];
         const cudaMemcpyKind memcpyType = deviceToHost ? cudaMemcpyDeviceToHost : cudaMemcpyHostToDevice;
 
         if ((copyInput && mEngine->bindingIsInput(i)) || (!copyInput && !mEngine->bindingIsInput(i)))
         {
+            METRICS_COUNT(deviceToHost ? Counter::BytesDeviceToHost : Counter::BytesHostToDevice, byteSize);
+
             if (async)
             {
                 CUDA_CHECK(cudaMemcpyAsync(dstPtr, srcPtr, byteSize, memcpyType, stream));
@@ -259,59 +348,138 @@ size_t TRTModule::getSizeByDim(const Dims& dims)
     return size;
 }
 
+Dims TRTModule::getBindingDims(const string& name) const
+{
+    const int index = mEngine->getBindingIndex(name.c_str());
+    assert(index >= 0);
+    return mEngine->getBindingDimensions(index);
+}
+
+Size TRTModule::getInputImageSize() const
+{
+    const Dims& dims = mInputDims[0];
+    return isByteInput() ? Size(dims.d[2], dims.d[1]) : Size(dims.d[3], dims.d[2]);
+}
+
 void TRTModule::setInput(Mat& image)
 {
-    const int inputH = mInputDims[0].d[2];
-    const int inputW = mInputDims[0].d[3];
-    
-    int i = 0;
-    for (int row = 0; row < image.rows; ++row)
+    METRICS_SCOPE(Stage::Normalize);
+
+    const Size inputSize = getInputImageSize();
+    assert(image.type() == CV_8UC3 && image.size() == inputSize);
+
+    if (isByteInput())
     {
-        uchar* uc_pixel = image.data + row * image.step;
-        for (int col = 0; col < image.cols; ++col)
-        {
-            mCpuBuffers[0][i] = ((float)uc_pixel[2] / 255.0f - 0.485f) / 0.229f;
-            mCpuBuffers[0][i + image.rows * image.cols] = ((float)uc_pixel[1] / 255.0f - 0.456f) / 0.224f;
-            mCpuBuffers[0][i + 2 * image.rows * image.cols] = ((float)uc_pixel[0] / 255.0f - 0.406f) / 0.225f;
-            uc_pixel += 3;
-            ++i;
-        }
+        // Already in the input layout, only the rows are copied
+        uchar* input = getByteInputBuffer();
+        const size_t rowBytes = (size_t)inputSize.width * 3;
+        for (int row = 0; row < image.rows; row++)
+            memcpy(input + row * rowBytes, image.ptr<uchar>(row), rowBytes);
+        return;
     }
+
+    normalizeImage(image, mCpuBuffers[mInputIndices[0]]);
 }
 
 // Set dynamic input
-void TRTModule::setInput(float* features, float* imagePointCoords, float* imagePointLabels, float* maskInput, float* hasMaskInput, int numPoints)
+void TRTModule::setInput(const float* features, const float* imagePointCoords, const float* imagePointLabels, const float* maskInput, const float* hasMaskInput, int numPoints)
 {
-    delete[]  mCpuBuffers[1];
-    delete[]  mCpuBuffers[2];
-    mCpuBuffers[1] = new float[numPoints * 2];
-    mCpuBuffers[2] = new float[numPoints];
+    TRACE_SCOPE("set_input");
 
-    cudaMalloc(&mGpuBuffers[1], sizeof(float) * numPoints * 2);
-    cudaMalloc(&mGpuBuffers[2], sizeof(float) * numPoints);
+    const int featuresIndex = mInputIndices[0];
+    const int coordsIndex = mInputIndices[1];
+    const int labelsIndex = mInputIndices[2];
+    const int maskInputIndex = mInputIndices[3];
+    const int hasMaskInputIndex = mInputIndices[4];
 
-    mBufferBindingBytes[1] = sizeof(float) * numPoints * 2;
-    mBufferBindingBytes[2] = sizeof(float) * numPoints;
+    // Prompt buffers only grow, so repeated requests with up to as many points reuse them
+    if (numPoints > mBufferBindingSizes[labelsIndex])
+    {
+        delete[] mCpuBuffers[coordsIndex];
+        delete[] mCpuBuffers[labelsIndex];
+        CUDA_CHECK(cudaFree(mGpuBuffers[coordsIndex]));
+        CUDA_CHECK(cudaFree(mGpuBuffers[labelsIndex]));
+
+        mCpuBuffers[coordsIndex] = new float[numPoints * 2];
+        mCpuBuffers[labelsIndex] = new float[numPoints];
+        cudaMalloc(&mGpuBuffers[coordsIndex], sizeof(float) * numPoints * 2);
+        cudaMalloc(&mGpuBuffers[labelsIndex], sizeof(float) * numPoints);
+
+        mBufferBindingSizes[coordsIndex] = numPoints * 2;
+        mBufferBindingSizes[labelsIndex] = numPoints;
+    }
 
-    memcpy(mCpuBuffers[0], features, mBufferBindingBytes[0]);
-    memcpy(mCpuBuffers[1], imagePointCoords, sizeof(float) * numPoints * 2);
-    memcpy(mCpuBuffers[2], imagePointLabels, sizeof(float) * numPoints);
-    memcpy(mCpuBuffers[3], maskInput, mBufferBindingBytes[3]);
-    memcpy(mCpuBuffers[4], hasMaskInput, mBufferBindingBytes[4]);
+    mBufferBindingBytes[coordsIndex] = sizeof(float) * numPoints * 2;
+    mBufferBindingBytes[labelsIndex] = sizeof(float) * numPoints;
+
+    // The embeddings are copied to the device straight from the caller, e.g. a shared cache slot,
+    // which has to stay valid until infer returns
+    mHostInputs[featuresIndex] = features;
+    memcpy(mCpuBuffers[coordsIndex], imagePointCoords, sizeof(float) * numPoints * 2);
+    memcpy(mCpuBuffers[labelsIndex], imagePointLabels, sizeof(float) * numPoints);
+    memcpy(mCpuBuffers[maskInputIndex], maskInput, mBufferBindingBytes[maskInputIndex]);
+    memcpy(mCpuBuffers[hasMaskInputIndex], hasMaskInput, mBufferBindingBytes[hasMaskInputIndex]);
 
     // Setting Dynamic Input Shape in TensorRT
     mContext->setOptimizationProfileAsync(0, mCudaStream);
-    mContext->setBindingDimensions(1, Dims3{ 1, numPoints, 2 });
-    mContext->setBindingDimensions(2, Dims2{ 1, numPoints });
+    mContext->setBindingDimensions(coordsIndex, Dims3{ 1, numPoints, 2 });
+    mContext->setBindingDimensions(labelsIndex, Dims2{ 1, numPoints });
 }
 
 void TRTModule::getOutput(float* features)
 {
-    memcpy(features, mCpuBuffers[1], mBufferBindingBytes[1]);
+    TRACE_SCOPE("get_output");
+    memcpy(features, mCpuBuffers[mOutputIndices[0]], mBufferBindingBytes[mOutputIndices[0]]);
+}
+
+void TRTModule::setOutput(float* features)
+{
+    assert(mOutputIndices.size() == 1);
+    mHostOutputs[mOutputIndices[0]] = features;
+}
+
+void TRTModule::releaseHostBuffer(const string& name)
+{
+    const int index = mEngine->getBindingIndex(name.c_str());
+    assert(index >= 0);
+    if (!mIsCpuBufferShared[index]) delete[] mCpuBuffers[index];
+    mCpuBuffers[index] = nullptr;
+    mIsCpuBufferShared[index] = false;
+}
+
+void TRTModule::shareInputBuffer(TRTModule& other)
+{
+    const int index = mInputIndices[0];
+    const int otherIndex = other.mInputIndices[0];
+    assert(other.mBufferBindingBytes[otherIndex] >= mBufferBindingBytes[index]);
+
+    if (!mIsCpuBufferShared[index]) delete[] mCpuBuffers[index];
+    mCpuBuffers[index] = other.mCpuBuffers[otherIndex];
+    mIsCpuBufferShared[index] = true;
+}
+
+// Buffers are allocated for the binding sizes, prompt buffers for the most points seen so far
+size_t TRTModule::getHostBytes() const
+{
+    size_t bytes = 0;
+    for (int i = 0; i < mCpuBuffers.size(); i++)
+        if (mCpuBuffers[i] && !mIsCpuBufferShared[i]) bytes += mBufferBindingSizes[i] * mBufferElementBytes[i];
+    return bytes;
+}
+
+// Binding buffers plus the activation memory of the execution context, which for the encoders
+// is often larger than the bindings. The weights of the engine are not included.
+size_t TRTModule::getDeviceBytes() const
+{
+    size_t bytes = mEngine->getDeviceMemorySize();
+    for (size_t i = 0; i < mBufferBindingSizes.size(); i++)
+        bytes += mBufferBindingSizes[i] * mBufferElementBytes[i];
+    return bytes;
 }
 
 void TRTModule::getOutput(float* iouPrediction, float* lowResolutionMasks)
 {    
-    memcpy(lowResolutionMasks, mCpuBuffers[5], mBufferBindingBytes[5]);
-    memcpy(iouPrediction, mCpuBuffers[6], mBufferBindingBytes[6]);
-}
+    TRACE_SCOPE("get_output");
+    memcpy(iouPrediction, mCpuBuffers[mOutputIndices[0]], mBufferBindingBytes[mOutputIndices[0]]);
+    memcpy(lowResolutionMasks, mCpuBuffers[mOutputIndices[1]], mBufferBindingBytes[mOutputIndices[1]]);
+}
\ No newline at end of file
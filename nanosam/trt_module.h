@@ -12,23 +12,62 @@ class TRTModule
 
 public:
 
-    TRTModule(string modelPath, vector<string> inputNames, vector<string> outputNames, bool isDynamicShape, bool isFP16);
+    // isByteInput builds image encoders from ONNX with packed 8-bit BGR input, see addByteInput.
+    // Engines take the input type they were built with.
+    TRTModule(string modelPath, vector<string> inputNames, vector<string> outputNames, bool isDynamicShape, bool isFP16, bool isByteInput = false);
 
     bool infer();
 
     void setInput(Mat& image);
 
-    void setInput(float* features, float* imagePointCoords, float* imagePointLabels, float* maskInput, float* hasHaskInput, int numPoints);
+    void setInput(const float* features, const float* imagePointCoords, const float* imagePointLabels, const float* maskInput, const float* hasMaskInput, int numPoints);
 
     void getOutput(float* iouPrediction, float* lowResolutionMasks);
 
     void getOutput(float* features);
 
+    // Copy the output of single output models straight into caller memory from the next infer on,
+    // the pointer has to stay valid until infer returns
+    void setOutput(float* features);
+
+    // Free the host buffer of a binding that is only ever read from or written to caller memory
+    void releaseHostBuffer(const string& name);
+
+    // Use the first input buffer of another module, at least as large, instead of an own one.
+    // Both modules must not be fed concurrently.
+    void shareInputBuffer(TRTModule& other);
+
+    size_t getHostBytes() const;
+
+    size_t getDeviceBytes() const;
+
+    // Host buffer of the first input, copied to the device by infer
+    float* getInputBuffer() { return mCpuBuffers[mInputIndices[0]]; }
+
+    uchar* getByteInputBuffer() { return (uchar*)mCpuBuffers[mInputIndices[0]]; }
+
+    // True if the first input is packed 8-bit NHWC, normalized by the first layers of the model
+    bool isByteInput() const { return mEngine->getBindingDataType(mInputIndices[0]) == DataType::kUINT8; }
+
+    // Width and height of the first input, NCHW floats or NHWC bytes
+    Size getInputImageSize() const;
+
+    size_t getInputBytes() const { return mBufferBindingBytes[mInputIndices[0]]; }
+
+    // Binding dimensions as reported by the engine, -1 for dynamic axes
+    Dims getBindingDims(const string& name) const;
+
+    // Time spent building or deserializing the engine, in milliseconds
+    double getLoadTime() const { return mLoadTime; }
+
+    // Time spent allocating buffers and the stream, in milliseconds
+    double getInitializeTime() const { return mInitializeTime; }
+
     ~TRTModule();
 
 private:
 
-    void build(string onnxPath, vector<string> inputNames, vector<string> outputNames, bool isDynamicShape = false, bool isFP16 = false);
+    void build(string onnxPath, vector<string> inputNames, vector<string> outputNames, bool isDynamicShape = false, bool isFP16 = false, bool isByteInput = false);
 
     void deserializeEngine(string engineName, vector<string> inputNames, vector<string> outputNames);
 
@@ -43,13 +82,22 @@ private:
     void copyOutputToHostAsync(const cudaStream_t& stream = 0);
 
 
+    vector<int> mInputIndices;          //!< Binding indices of the inputs, in the order of the given input names
+    vector<int> mOutputIndices;         //!< Binding indices of the outputs, in the order of the given output names
     vector<Dims> mInputDims;            //!< The dimensions of the input to the network.
     vector<Dims> mOutputDims;           //!< The dimensions of the output to the network.
     vector<void*> mGpuBuffers;          //!< The vector of device buffers needed for engine execution
     vector<float*> mCpuBuffers;
+    vector<bool> mIsCpuBufferShared;    //!< Host buffer owned by another module
+    vector<const void*> mHostInputs;    //!< Caller memory copied to the device instead of the host buffer, nullptr if none
+    vector<void*> mHostOutputs;         //!< Caller memory the device output is copied to instead of the host buffer
     vector<size_t> mBufferBindingBytes;
     vector<size_t> mBufferBindingSizes;
+    vector<size_t> mBufferElementBytes; //!< 4 for floats, 1 for byte inputs
     cudaStream_t mCudaStream;
+    cudaEvent_t mStageEvents[4];        //!< Before and after the copy to the device, the execution and the copy back
+    double mLoadTime;
+    double mInitializeTime;
 
     IRuntime* mRuntime;                 //!< The TensorRT runtime used to deserialize the engine
     ICudaEngine* mEngine;               //!< The TensorRT engine used to run the network
@@ -0,0 +1,439 @@
+// Replays a session log written by a SessionRecorder and compares its latencies with the recording.
+//
+// The calls of each recorded instance are issued in their recorded order on a NanoSam instance of
+// their own, concurrently with the other instances, at the recorded pacing divided by the speed
+// factor, or back to back with a speed of 0. Images are loaded from the directory the
+// recorder saved them to; images that were not saved are synthesized from their hash, so calls on
+// the same image still hit the embedding cache as they did in the session.
+//
+// The report lists, per call type and per stage, the recorded and replayed latency distributions
+// and the change of the median and p99. Response times are measured from the paced start of each
+// call, so a replay that falls behind shows the queueing a user would have seen.
+//
+// Usage: replay --log <path> [options]
+//   --images <dir>               Images saved by the recorder (default none, synthesized)
+//   --speed <factor>             Pacing relative to the recording, 0 for back to back (default 1)
+//   --encoder <path> --decoder <path>   Engines or ONNX models, otherwise the simulated backend is used
+//   --encoder-latency <dist>     Simulated encoder latency in ms (default lognormal:12,3)
+//   --decoder-latency <dist>     Simulated decoder latency in ms (default lognormal:3,0.5)
+//   --cache <n>                  Embedding cache capacity (default 4)
+//   --seed <n>                   Random seed of the simulated backend (default 1)
+//   --output <path>              Write the comparison as JSON
+//
+// Distributions: const:<ms>, uniform:<min>,<max>, normal:<mean>,<stddev>, lognormal:<mean>,<stddev>
+
+#include "../nanosam/nanosam.h"
+#include "../nanosam/metrics.h"
+#include "../nanosam/session_log.h"
+#include "../nanosam/simulated_backend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+struct ReplayOptions
+{
+    string logPath;
+    string imageDirectory;
+    double speed = 1;
+    string encoderPath;
+    string decoderPath;
+    LatencyDistribution encoderLatency = LatencyDistribution(LatencyDistribution::LogNormal, 12, 3);
+    LatencyDistribution decoderLatency = LatencyDistribution(LatencyDistribution::LogNormal, 3, 0.5);
+    int cacheCapacity = 4;
+    uint64_t seed = 1;
+    string outputPath;
+};
+
+// Pixels of one logged image in its recorded format
+struct ReplayImage
+{
+    Mat data;
+    ImageFrame frame;
+    bool isSynthesized;
+};
+
+struct LatencySummary
+{
+    size_t count;
+    double mean;                        //!< Milliseconds
+    double p50;
+    double p99;
+    double max;
+};
+
+// Recorded and replayed latencies of one call type or stage
+struct LatencyComparison
+{
+    vector<double> recorded;
+    vector<double> replayed;
+};
+
+// Latencies of the calls of one recorded instance
+struct InstanceReplay
+{
+    map<string, LatencyComparison> callLatencies;
+    LatencyComparison stageLatencies[(int)Stage::Count];
+    vector<double> response;
+    size_t skipped = 0;
+};
+
+static void append(LatencyComparison& to, const LatencyComparison& from)
+{
+    to.recorded.insert(to.recorded.end(), from.recorded.begin(), from.recorded.end());
+    to.replayed.insert(to.replayed.end(), from.replayed.begin(), from.replayed.end());
+}
+
+static bool parseArguments(int argc, char** argv, ReplayOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        auto value = [&]() { return string(argv[++i]); };
+
+        if (arg == "--log") options.logPath = value();
+        else if (arg == "--images") options.imageDirectory = value();
+        else if (arg == "--speed") options.speed = stod(value());
+        else if (arg == "--encoder") options.encoderPath = value();
+        else if (arg == "--decoder") options.decoderPath = value();
+        else if (arg == "--encoder-latency") { if (!LatencyDistribution::parse(value(), options.encoderLatency)) return false; }
+        else if (arg == "--decoder-latency") { if (!LatencyDistribution::parse(value(), options.decoderLatency)) return false; }
+        else if (arg == "--cache") options.cacheCapacity = stoi(value());
+        else if (arg == "--seed") options.seed = stoull(value());
+        else if (arg == "--output") options.outputPath = value();
+        else return false;
+    }
+
+    return !options.logPath.empty() && options.speed >= 0 && options.encoderPath.empty() == options.decoderPath.empty();
+}
+
+static LatencySummary summarize(vector<double> latencies)
+{
+    LatencySummary summary = {};
+    summary.count = latencies.size();
+    if (latencies.empty()) return summary;
+
+    sort(latencies.begin(), latencies.end());
+    for (double latency : latencies) summary.mean += latency;
+    summary.mean /= latencies.size();
+
+    // Nearest rank
+    auto quantile = [&](double q)
+    {
+        size_t rank = (size_t)ceil(q * latencies.size());
+        return latencies[min(latencies.size(), max<size_t>(rank, 1)) - 1];
+    };
+    summary.p50 = quantile(0.5);
+    summary.p99 = quantile(0.99);
+    summary.max = latencies.back();
+    return summary;
+}
+
+static string toJson(const LatencySummary& s)
+{
+    ostringstream out;
+    out << "{\"count\":" << s.count << ",\"mean_ms\":" << s.mean << ",\"p50_ms\":" << s.p50 << ",\"p99_ms\":" << s.p99
+        << ",\"max_ms\":" << s.max << "}";
+    return out.str();
+}
+
+static double relativeChange(double recorded, double replayed)
+{
+    return recorded > 0 ? 100.0 * (replayed - recorded) / recorded : 0;
+}
+
+static void printComparison(const string& name, const LatencyComparison& comparison)
+{
+    LatencySummary a = summarize(comparison.recorded), b = summarize(comparison.replayed);
+    cout << "  " << name << ": n=" << a.count << "/" << b.count
+        << " p50 " << a.p50 << " -> " << b.p50 << " ms (" << showpos << relativeChange(a.p50, b.p50) << noshowpos << "%)"
+        << ", p99 " << a.p99 << " -> " << b.p99 << " ms (" << showpos << relativeChange(a.p99, b.p99) << noshowpos << "%)"
+        << ", max " << a.max << " -> " << b.max << " ms" << endl;
+}
+
+static string toJson(const LatencyComparison& comparison)
+{
+    LatencySummary a = summarize(comparison.recorded), b = summarize(comparison.replayed);
+    ostringstream out;
+    out << "{\"recorded\":" << toJson(a) << ",\"replayed\":" << toJson(b)
+        << ",\"p50_change_pct\":" << relativeChange(a.p50, b.p50) << ",\"p99_change_pct\":" << relativeChange(a.p99, b.p99) << "}";
+    return out.str();
+}
+
+// The saved image if there is one, otherwise noise seeded by the hash in the recorded format
+static void loadImage(const ReplayOptions& options, const SessionCall& call, ReplayImage& image)
+{
+    const int w = call.width, h = call.height;
+    image.isSynthesized = true;
+
+    if (!options.imageDirectory.empty() && (call.format == PixelFormat::BGR || call.format == PixelFormat::Gray))
+    {
+        image.data = imread(SessionRecorder::imagePath(options.imageDirectory, call.imageHash),
+            call.format == PixelFormat::BGR ? IMREAD_COLOR : IMREAD_GRAYSCALE);
+        image.isSynthesized = image.data.empty() || image.data.cols != w || image.data.rows != h;
+    }
+
+    if (image.isSynthesized)
+    {
+        switch (call.format)
+        {
+        case PixelFormat::BGR:  image.data.create(h, w, CV_8UC3); break;
+        case PixelFormat::Gray: image.data.create(h, w, CV_8UC1); break;
+        case PixelFormat::NV12: image.data.create(h * 3 / 2, w, CV_8UC1); break;
+        case PixelFormat::YUYV: image.data.create(h, w, CV_8UC2); break;
+        }
+        RNG rng(call.imageHash);
+        rng.fill(image.data, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+    }
+
+    switch (call.format)
+    {
+    case PixelFormat::NV12:
+        image.frame = ImageFrame::nv12(image.data.data, image.data.step, image.data.ptr<uchar>(h), image.data.step, w, h);
+        break;
+    case PixelFormat::YUYV:
+        image.frame = ImageFrame::yuyv(image.data.data, w, h, image.data.step);
+        break;
+    default:
+        image.frame = ImageFrame::fromMat(image.data);
+        break;
+    }
+}
+
+static shared_ptr<NanoSam> makeNanoSam(const ReplayOptions& options, int index, shared_ptr<mutex> device)
+{
+    shared_ptr<NanoSam> nanosam;
+    if (options.encoderPath.empty())
+    {
+        SimulatedBackendOptions backendOptions;
+        backendOptions.encoderLatency = options.encoderLatency;
+        backendOptions.decoderLatency = options.decoderLatency;
+        backendOptions.device = device;
+        backendOptions.seed = options.seed + index;
+        nanosam = make_shared<NanoSam>(make_shared<SimulatedBackend>(backendOptions));
+    }
+    else
+    {
+        nanosam = make_shared<NanoSam>(options.encoderPath, options.decoderPath);
+    }
+    nanosam->setEmbeddingCacheCapacity(options.cacheCapacity);
+    try
+    {
+        nanosam->waitUntilReady();
+    }
+    catch (const exception& e)
+    {
+        cerr << "Cannot load the models: " << e.what() << endl;
+        exit(1);
+    }
+    if (index == 0 && !options.encoderPath.empty()) printLoadReports(nanosam->getLoadReports(), cout);
+    return nanosam;
+}
+
+// Issues the calls of one recorded instance at their recorded pacing
+static void replayInstance(const ReplayOptions& options, NanoSam& nanosam, const vector<const SessionCall*>& calls,
+    const map<uint64_t, ReplayImage>& images, bool hasStageTimes, int64_t start, int64_t recordedStart, InstanceReplay& result)
+{
+    Mat mask, lowResLogits;
+    bool hasImage = false;
+
+    for (const SessionCall* call : calls)
+    {
+        const SessionCall& recorded = *call;
+        int64_t scheduled = Tracer::now();
+        if (options.speed > 0)
+        {
+            scheduled = start + (int64_t)((recorded.timestamp - recordedStart) / options.speed);
+            this_thread::sleep_until(chrono::steady_clock::time_point(chrono::duration_cast<chrono::steady_clock::duration>(chrono::nanoseconds(scheduled))));
+        }
+
+        const int encoder = min(recorded.encoder, nanosam.getNumEncoders() - 1);
+        auto image = images.find(recorded.imageHash);
+        const ImageFrame* frame = image != images.end() ? &image->second.frame : nullptr;
+
+        // A log started in the middle of a session may decode before its first image
+        if (!frame && !hasImage)
+        {
+            result.skipped++;
+            continue;
+        }
+        hasImage = true;
+
+        StageCapture capture;
+        const int64_t callStart = Tracer::now();
+        switch (recorded.type)
+        {
+        case SessionCallType::Predict:
+            nanosam.predict(*frame, recorded.points, recorded.labels, mask, encoder);
+            break;
+        case SessionCallType::PredictContours:
+        {
+            Mat data = image->second.data;
+            nanosam.predictContours(data, recorded.points, recorded.labels, 1.0, encoder);
+            break;
+        }
+        case SessionCallType::SetImage:
+            nanosam.setImage(*frame, encoder);
+            break;
+        case SessionCallType::Decode:
+            nanosam.decode(recorded.points, recorded.labels, mask);
+            break;
+        case SessionCallType::DecodeContours:
+            nanosam.decodeContours(recorded.points, recorded.labels);
+            break;
+        case SessionCallType::DecodePreview:
+            nanosam.decodePreview(recorded.points, recorded.labels, lowResLogits);
+            break;
+        case SessionCallType::RefinePreview:
+            nanosam.refinePreview(mask);
+            break;
+        }
+        const int64_t callEnd = Tracer::now();
+
+        LatencyComparison& latencies = result.callLatencies[SessionCall::typeName(recorded.type)];
+        latencies.recorded.push_back(recorded.duration);
+        latencies.replayed.push_back((callEnd - callStart) * 1e-6);
+        result.response.push_back((callEnd - scheduled) * 1e-6);
+
+        for (int s = 0; s < (int)Stage::Count; s++)
+        {
+            if (hasStageTimes && recorded.stageTimes[s] > 0) result.stageLatencies[s].recorded.push_back(recorded.stageTimes[s]);
+            if (capture.times[s] > 0) result.stageLatencies[s].replayed.push_back(capture.times[s] * 1e-6);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    ReplayOptions options;
+    if (!parseArguments(argc, argv, options))
+    {
+        cerr << "Usage: replay --log <path> [--images <dir>] [--speed <factor>] [--encoder <path> --decoder <path>]" << endl
+             << "       [--encoder-latency <dist>] [--decoder-latency <dist>] [--cache <n>] [--seed <n>] [--output <path>]" << endl;
+        return 1;
+    }
+
+    SessionReader reader(options.logPath);
+    if (!reader.isOpen())
+    {
+        cerr << "Cannot read session log " << options.logPath << endl;
+        return 1;
+    }
+
+    vector<SessionCall> calls;
+    SessionCall call;
+    while (reader.next(call)) calls.push_back(call);
+    if (calls.empty())
+    {
+        cerr << "Session log " << options.logPath << " has no calls" << endl;
+        return 1;
+    }
+
+    // Images are prepared up front so loading them is not part of the replayed latencies
+    map<uint64_t, ReplayImage> images;
+    size_t synthesized = 0;
+    for (auto& recorded : calls)
+    {
+        bool hasImage = recorded.type == SessionCallType::Predict || recorded.type == SessionCallType::PredictContours ||
+            recorded.type == SessionCallType::SetImage;
+        if (!hasImage || images.count(recorded.imageHash)) continue;
+
+        loadImage(options, recorded, images[recorded.imageHash]);
+        synthesized += images[recorded.imageHash].isSynthesized;
+    }
+
+    // Each recorded instance is replayed in its recorded order on an instance of its own
+    map<int, vector<const SessionCall*>> instanceCalls;
+    for (auto& recorded : calls)
+        instanceCalls[recorded.instance].push_back(&recorded);
+
+    auto device = make_shared<mutex>();
+    vector<shared_ptr<NanoSam>> instances;
+    for (size_t i = 0; i < instanceCalls.size(); i++)
+        instances.push_back(makeNanoSam(options, (int)i, device));
+
+    const bool isSimulated = options.encoderPath.empty();
+    cout << "Replaying " << calls.size() << " calls of " << instances.size() << " instances on " << images.size()
+         << " images (" << synthesized << " synthesized) ";
+    if (options.speed > 0) cout << "at " << options.speed << "x pacing";
+    else cout << "back to back";
+    cout << " on the " << (isSimulated ? "simulated" : "TensorRT") << " backend" << endl;
+    if (!reader.hasStageTimes())
+        cout << "The recording build had the stage timers compiled out, only call latencies are compared" << endl;
+
+    vector<InstanceReplay> results(instances.size());
+    vector<thread> threads;
+    const int64_t start = Tracer::now();
+    const int64_t recordedStart = calls[0].timestamp;
+    size_t index = 0;
+    for (auto& entry : instanceCalls)
+    {
+        threads.emplace_back(replayInstance, cref(options), ref(*instances[index]), cref(entry.second), cref(images),
+            reader.hasStageTimes(), start, recordedStart, ref(results[index]));
+        index++;
+    }
+    for (auto& thread : threads) thread.join();
+
+    map<string, LatencyComparison> callLatencies;
+    LatencyComparison stageLatencies[(int)Stage::Count];
+    vector<double> response;
+    size_t skipped = 0;
+    for (auto& result : results)
+    {
+        for (auto& entry : result.callLatencies)
+            append(callLatencies[entry.first], entry.second);
+        for (int s = 0; s < (int)Stage::Count; s++)
+            append(stageLatencies[s], result.stageLatencies[s]);
+        response.insert(response.end(), result.response.begin(), result.response.end());
+        skipped += result.skipped;
+    }
+
+    if (skipped) cout << "Skipped " << skipped << " decode calls logged before the first image" << endl;
+    cout << "Call latency, recorded -> replayed:" << endl;
+    for (auto& entry : callLatencies)
+        printComparison(entry.first, entry.second);
+    cout << "Stage latency, recorded -> replayed:" << endl;
+    for (int s = 0; s < (int)Stage::Count; s++)
+    {
+        if (stageLatencies[s].recorded.empty() && stageLatencies[s].replayed.empty()) continue;
+        printComparison(Metrics::stageName((Stage)s), stageLatencies[s]);
+    }
+    LatencySummary responseSummary = summarize(response);
+    cout << "Response time from paced start: p50 " << responseSummary.p50 << " ms, p99 " << responseSummary.p99
+         << " ms, max " << responseSummary.max << " ms" << endl;
+
+    if (!options.outputPath.empty())
+    {
+        ofstream file(options.outputPath);
+        file << "{\"log\":\"" << options.logPath << "\",\"calls\":" << calls.size() << ",\"images\":" << images.size()
+             << ",\"instances\":" << instances.size() << ",\"synthesized_images\":" << synthesized << ",\"speed\":" << options.speed
+             << ",\"simulated\":" << (isSimulated ? "true" : "false")
+             << ",\n \"response\":" << toJson(responseSummary) << ",\n \"calls_by_type\":{";
+        bool isFirst = true;
+        for (auto& entry : callLatencies)
+        {
+            file << (isFirst ? "" : ",") << "\n  \"" << entry.first << "\":" << toJson(entry.second);
+            isFirst = false;
+        }
+        file << "},\n \"stages\":{";
+        isFirst = true;
+        for (int s = 0; s < (int)Stage::Count; s++)
+        {
+            if (stageLatencies[s].recorded.empty() && stageLatencies[s].replayed.empty()) continue;
+            file << (isFirst ? "" : ",") << "\n  \"" << Metrics::stageName((Stage)s) << "\":" << toJson(stageLatencies[s]);
+            isFirst = false;
+        }
+        file << "}}\n";
+        cout << "Comparison written to " << options.outputPath << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,938 @@
+// Local segmentation service over HTTP/1.1, on a loopback TCP port or a Unix domain socket.
+//
+// Clients upload an image once and get a handle back, the content hash of the image. Prompts
+// refer to the handle, so re-prompting neither re-uploads nor re-encodes the image: requests of
+// a handle go to the same NanoSam instance, whose embedding cache keeps its embeddings, by
+// consistent hashing with bounded loads, so a single busy image spills over to other instances.
+// Every instance is served by its own RequestScheduler, so clicks go ahead of batch work.
+// Connections are kept alive, and pipelined requests run concurrently and are answered in order.
+//
+// Usage: server [options]
+//   --port <n>                   TCP port (default 8080), 0 for none
+//   --host <address>             TCP listen address (default 127.0.0.1)
+//   --unix <path>                Also listen on a Unix domain socket, not on Windows
+//   --instances <n>              NanoSam instances (default 1)
+//   --encoder <path> --decoder <path>   Engines or ONNX models, otherwise the simulated backend is used
+//   --encoder-latency <dist>     Simulated encoder latency in ms (default lognormal:12,3)
+//   --decoder-latency <dist>     Simulated decoder latency in ms (default lognormal:3,0.5)
+//   --cache <n>                  Embedding cache capacity per instance (default 8)
+//   --decode-cache <n>           Decoder results cached per instance, for repeated prompts (default 0)
+//   --decode-tolerance <px>      Prompt distance in decoder pixels within which results are reused (default 1)
+//   --max-images <n>             Uploaded images kept for their handles (default 64)
+//   --kernel-profile <path>      CPU kernel profile to load, autotuned and saved there first if missing
+//   --load-factor <f>            Requests in flight an instance takes relative to the mean before a handle
+//                                spills over to the next one (default 1.25)
+//
+// Endpoints:
+//   POST /v1/encode[?encoder=<n>]
+//       Body: a PNG or JPEG file, or raw pixels with Content-Type application/octet-stream and
+//       X-Width, X-Height and X-Format (bgr or gray) headers. Returns {"handle":"<16 hex digits>",...}
+//   POST /v1/decode?handle=<h>[&points=<x>,<y>,<label>;...][&deadline_ms=<ms>]
+//       Body: one prompt set, unless the points are given in the query. Returns one mask.
+//   POST /v1/decode_batch?handle=<h>
+//       Body: prompt sets back to back. Returns a mask per set, in order.
+//   POST /v1/segment_all?handle=<h>[&grid=<n>][&iou=<threshold>][&min_area=<share>]
+//       Masks of an n x n grid of foreground clicks (default 16), duplicates and specks removed.
+//   DELETE /v1/handle?handle=<h>
+//   GET /v1/health, GET /metrics (Prometheus text format)
+//
+// Prompt sets are little-endian: uint32 point count, then float32 x, y and label per point, in
+// image pixels. Masks are returned as application/x-nanosam-rle, little-endian: uint32 mask count,
+// then per mask uint32 width, height and run count, followed by the runs of BitMask::toRunLengths.
+// Unknown or evicted handles answer 404, requests the scheduler rejects or sheds 503.
+//
+// Distributions: const:<ms>, uniform:<min>,<max>, normal:<mean>,<stddev>, lognormal:<mean>,<stddev>
+
+#include "../nanosam/autotuner.h"
+#include "../nanosam/bitmask.h"
+#include "../nanosam/metrics.h"
+#include "../nanosam/nanosam.h"
+#include "../nanosam/request_router.h"
+#include "../nanosam/request_scheduler.h"
+#include "../nanosam/simulated_backend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET Socket;
+static const int SEND_FLAGS = 0;
+static void closeSocket(Socket socket) { closesocket(socket); }
+static int pollSockets(pollfd* sockets, unsigned long count, int timeout) { return WSAPoll(sockets, count, timeout); }
+#else
+#include <arpa/inet.h>
+#include <csignal>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int Socket;
+static const Socket INVALID_SOCKET = -1;
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+static void closeSocket(Socket socket) { close(socket); }
+static int pollSockets(pollfd* sockets, nfds_t count, int timeout) { return poll(sockets, count, timeout); }
+#endif
+
+static const size_t MAX_HEADER_BYTES = 16 << 10;
+static const size_t MAX_BODY_BYTES = 256 << 20;
+static const uint32_t MAX_PROMPT_POINTS = 256;
+static const int MAX_GRID = 64;
+
+struct ServerOptions
+{
+    int port = 8080;
+    string host = "127.0.0.1";
+    string unixPath;
+    int instances = 1;
+    string encoderPath;
+    string decoderPath;
+    LatencyDistribution encoderLatency = LatencyDistribution(LatencyDistribution::LogNormal, 12, 3);
+    LatencyDistribution decoderLatency = LatencyDistribution(LatencyDistribution::LogNormal, 3, 0.5);
+    int cacheCapacity = 8;
+    int decodeCacheCapacity = 0;
+    float decodeTolerance = 1.0f;
+    int maxImages = 64;
+    double loadFactor = 1.25;
+    string kernelProfilePath;
+};
+
+struct HttpRequest
+{
+    string method;
+    string path;
+    map<string, string> query;
+    map<string, string> headers;        //!< Lower case names
+    string body;
+    bool keepAlive;
+
+    string header(const string& name) const
+    {
+        auto it = headers.find(name);
+        return it == headers.end() ? "" : it->second;
+    }
+
+    string parameter(const string& name, const string& fallback = "") const
+    {
+        auto it = query.find(name);
+        return it == query.end() ? fallback : it->second;
+    }
+};
+
+enum class ParseStatus { Complete, Incomplete, Invalid, TooLarge };
+
+static string toLower(string text)
+{
+    transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return (char)tolower(c); });
+    return text;
+}
+
+static string trim(const string& text)
+{
+    const size_t first = text.find_first_not_of(" \t");
+    if (first == string::npos) return "";
+    return text.substr(first, text.find_last_not_of(" \t") - first + 1);
+}
+
+static string urlDecode(const string& text)
+{
+    string decoded;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if (text[i] == '+') decoded += ' ';
+        else if (text[i] == '%' && i + 2 < text.size() && isxdigit((unsigned char)text[i + 1]) && isxdigit((unsigned char)text[i + 2]))
+        {
+            decoded += (char)stoi(text.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        }
+        else decoded += text[i];
+    }
+    return decoded;
+}
+
+// Takes one complete request off the front of the buffer. Chunked bodies are not supported.
+static ParseStatus parseRequest(string& buffer, HttpRequest& request)
+{
+    const size_t headerEnd = buffer.find("\r\n\r\n");
+    if (headerEnd == string::npos)
+        return buffer.size() > MAX_HEADER_BYTES ? ParseStatus::Invalid : ParseStatus::Incomplete;
+
+    istringstream lines(buffer.substr(0, headerEnd));
+    string line, target, version;
+    getline(lines, line);
+    istringstream requestLine(line);
+    if (!(requestLine >> request.method >> target >> version) || version.compare(0, 5, "HTTP/") != 0)
+        return ParseStatus::Invalid;
+
+    const size_t queryStart = target.find('?');
+    request.path = target.substr(0, queryStart);
+    request.query.clear();
+    if (queryStart != string::npos)
+    {
+        istringstream pairs(target.substr(queryStart + 1));
+        string pair;
+        while (getline(pairs, pair, '&'))
+        {
+            const size_t equals = pair.find('=');
+            request.query[urlDecode(pair.substr(0, equals))] = equals == string::npos ? "" : urlDecode(pair.substr(equals + 1));
+        }
+    }
+
+    request.headers.clear();
+    while (getline(lines, line))
+    {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        const size_t colon = line.find(':');
+        if (colon == string::npos) return ParseStatus::Invalid;
+        request.headers[toLower(trim(line.substr(0, colon)))] = trim(line.substr(colon + 1));
+    }
+
+    const string connection = toLower(request.header("connection"));
+    request.keepAlive = version == "HTTP/1.0" ? connection == "keep-alive" : connection != "close";
+    if (!request.header("transfer-encoding").empty()) return ParseStatus::Invalid;
+
+    size_t contentLength = 0;
+    const string length = request.header("content-length");
+    if (!length.empty())
+    {
+        char* end;
+        contentLength = strtoull(length.c_str(), &end, 10);
+        if (*end != 0) return ParseStatus::Invalid;
+    }
+    if (contentLength > MAX_BODY_BYTES) return ParseStatus::TooLarge;
+    if (buffer.size() < headerEnd + 4 + contentLength) return ParseStatus::Incomplete;
+
+    request.body = buffer.substr(headerEnd + 4, contentLength);
+    buffer.erase(0, headerEnd + 4 + contentLength);
+    return ParseStatus::Complete;
+}
+
+static const char* statusText(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
+
+static string httpResponse(int status, const string& contentType, const string& body, bool keepAlive, const string& extraHeaders = "")
+{
+    ostringstream out;
+    out << "HTTP/1.1 " << status << " " << statusText(status) << "\r\n"
+        << "Content-Length: " << body.size() << "\r\n"
+        << (contentType.empty() ? "" : "Content-Type: " + contentType + "\r\n")
+        << (keepAlive ? "" : "Connection: close\r\n")
+        << extraHeaders << "\r\n";
+    return out.str() + body;
+}
+
+static string errorResponse(int status, const string& message, bool keepAlive)
+{
+    return httpResponse(status, "application/json", "{\"error\":\"" + message + "\"}", keepAlive);
+}
+
+static future<string> ready(string response)
+{
+    promise<string> result;
+    result.set_value(std::move(response));
+    return result.get_future();
+}
+
+static string handleToString(uint64_t handle)
+{
+    ostringstream out;
+    out << hex << setw(16) << setfill('0') << handle;
+    return out.str();
+}
+
+static bool parseHandle(const string& text, uint64_t& handle)
+{
+    if (text.empty() || text.size() > 16 || text.find_first_not_of("0123456789abcdefABCDEF") != string::npos) return false;
+    handle = strtoull(text.c_str(), nullptr, 16);
+    return true;
+}
+
+static void appendValue(string& out, uint32_t value)
+{
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void appendMask(string& out, const BitMask& mask, vector<uint32_t>& runs)
+{
+    mask.toRunLengths(runs);
+    appendValue(out, (uint32_t)mask.width());
+    appendValue(out, (uint32_t)mask.height());
+    appendValue(out, (uint32_t)runs.size());
+    out.append((const char*)runs.data(), runs.size() * sizeof(uint32_t));
+}
+
+static string masksToBody(const vector<BitMask>& masks)
+{
+    string body;
+    vector<uint32_t> runs;
+    appendValue(body, (uint32_t)masks.size());
+    for (auto& mask : masks)
+        appendMask(body, mask, runs);
+    return body;
+}
+
+// One binary prompt set at the offset, advanced past it
+static bool readPromptSet(const string& body, size_t& offset, vector<Point>& points, vector<float>& labels)
+{
+    uint32_t count;
+    if (offset + sizeof(count) > body.size()) return false;
+    memcpy(&count, body.data() + offset, sizeof(count));
+    offset += sizeof(count);
+    if (count == 0 || count > MAX_PROMPT_POINTS || offset + count * 3 * sizeof(float) > body.size()) return false;
+
+    points.resize(count);
+    labels.resize(count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        float values[3];
+        memcpy(values, body.data() + offset, sizeof(values));
+        offset += sizeof(values);
+        points[i] = Point(cvRound(values[0]), cvRound(values[1]));
+        labels[i] = values[2];
+    }
+    return true;
+}
+
+// "x,y,label;x,y,label"
+static bool parsePoints(const string& text, vector<Point>& points, vector<float>& labels)
+{
+    istringstream items(text);
+    string item;
+    while (getline(items, item, ';'))
+    {
+        float x, y, label;
+        char comma1, comma2;
+        istringstream values(item);
+        if (!(values >> x >> comma1 >> y >> comma2 >> label) || comma1 != ',' || comma2 != ',') return false;
+        points.push_back(Point(cvRound(x), cvRound(y)));
+        labels.push_back(label);
+    }
+    return !points.empty() && points.size() <= MAX_PROMPT_POINTS;
+}
+
+// Uploaded images by handle, least recently used ones evicted
+class ImageStore
+{
+
+public:
+
+    ImageStore(size_t capacity) : mCapacity(capacity) {}
+
+    uint64_t add(const Mat& image, int encoder)
+    {
+        const uint64_t handle = hashFrame(ImageFrame::fromMat(image));
+
+        lock_guard<mutex> lock(mMutex);
+        auto it = mEntries.find(handle);
+        if (it != mEntries.end())
+        {
+            mOrder.erase(it->second.position);
+            mEntries.erase(it);
+        }
+        while (mEntries.size() >= mCapacity)
+        {
+            mEntries.erase(mOrder.back());
+            mOrder.pop_back();
+        }
+        mOrder.push_front(handle);
+        mEntries[handle] = { image, encoder, mOrder.begin() };
+        return handle;
+    }
+
+    bool find(uint64_t handle, Mat& image, int& encoder)
+    {
+        lock_guard<mutex> lock(mMutex);
+        auto it = mEntries.find(handle);
+        if (it == mEntries.end()) return false;
+
+        mOrder.splice(mOrder.begin(), mOrder, it->second.position);
+        image = it->second.image;
+        encoder = it->second.encoder;
+        return true;
+    }
+
+    bool remove(uint64_t handle)
+    {
+        lock_guard<mutex> lock(mMutex);
+        auto it = mEntries.find(handle);
+        if (it == mEntries.end()) return false;
+
+        mOrder.erase(it->second.position);
+        mEntries.erase(it);
+        return true;
+    }
+
+    size_t size()
+    {
+        lock_guard<mutex> lock(mMutex);
+        return mEntries.size();
+    }
+
+private:
+
+    struct Entry
+    {
+        Mat image;
+        int encoder;
+        list<uint64_t>::iterator position;
+    };
+
+    mutex mMutex;
+    size_t mCapacity;
+    list<uint64_t> mOrder;              //!< Most recently used first
+    unordered_map<uint64_t, Entry> mEntries;
+};
+
+// Masks of several scheduler requests, answered once the last one completes
+struct MaskBatch
+{
+    mutex lock;
+    vector<BitMask> masks;
+    size_t remaining;
+    bool isFailed = false;
+    promise<string> response;
+};
+
+class SegmentationServer
+{
+
+public:
+
+    SegmentationServer(const ServerOptions& options) : mRouter(options.loadFactor), mImages(options.maxImages)
+    {
+        for (int i = 0; i < options.instances; i++)
+        {
+            shared_ptr<NanoSam> nanosam;
+            if (options.encoderPath.empty())
+            {
+                SimulatedBackendOptions backendOptions;
+                backendOptions.encoderLatency = options.encoderLatency;
+                backendOptions.decoderLatency = options.decoderLatency;
+                backendOptions.seed = i + 1;
+                nanosam = make_shared<NanoSam>(make_shared<SimulatedBackend>(backendOptions));
+            }
+            else
+            {
+                nanosam = make_shared<NanoSam>(options.encoderPath, options.decoderPath);
+            }
+            nanosam->setEmbeddingCacheCapacity(options.cacheCapacity);
+            nanosam->setDecodeCache(options.decodeCacheCapacity, options.decodeTolerance);
+            nanosam->waitUntilReady();
+            if (i == 0 && !options.encoderPath.empty()) printLoadReports(nanosam->getLoadReports(), cout);
+
+            mNumEncoders = nanosam->getNumEncoders();
+            mSchedulers.emplace_back(new RequestScheduler({ nanosam }));
+            mRouter.addInstance(i);
+        }
+    }
+
+    future<string> handle(const HttpRequest& request)
+    {
+        const bool keepAlive = request.keepAlive;
+        try
+        {
+            if (request.path == "/v1/health" && request.method == "GET") return ready(health(keepAlive));
+            if (request.path == "/metrics" && request.method == "GET")
+            {
+#ifdef ENABLE_METRICS
+                return ready(httpResponse(200, "text/plain; version=0.0.4", Metrics::toPrometheus(), keepAlive));
+#else
+                return ready(errorResponse(404, "metrics are compiled out", keepAlive));
+#endif
+            }
+            if (request.path == "/v1/handle" && request.method == "DELETE")
+            {
+                uint64_t handle;
+                if (!parseHandle(request.parameter("handle"), handle)) return ready(errorResponse(400, "invalid handle", keepAlive));
+                return ready(mImages.remove(handle) ? httpResponse(204, "", "", keepAlive) : errorResponse(404, "unknown handle", keepAlive));
+            }
+
+            const bool isPost = request.method == "POST";
+            if (request.path == "/v1/encode") return isPost ? encode(request) : ready(errorResponse(405, "use POST", keepAlive));
+            if (request.path == "/v1/decode") return isPost ? decode(request) : ready(errorResponse(405, "use POST", keepAlive));
+            if (request.path == "/v1/decode_batch") return isPost ? decodeBatch(request) : ready(errorResponse(405, "use POST", keepAlive));
+            if (request.path == "/v1/segment_all") return isPost ? segmentAll(request) : ready(errorResponse(405, "use POST", keepAlive));
+            return ready(errorResponse(404, "unknown endpoint", keepAlive));
+        }
+        catch (const exception&)
+        {
+            // Malformed numbers in the query
+            return ready(errorResponse(400, "invalid parameter", keepAlive));
+        }
+    }
+
+private:
+
+    RequestRouter mRouter;              //!< Declared first, schedulers complete queued requests on destruction
+    vector<unique_ptr<RequestScheduler>> mSchedulers;
+    ImageStore mImages;
+    int mNumEncoders = 1;
+
+    // Session affinity: an image is encoded and decoded on the same instance unless it is full
+    void submit(uint64_t handle, SchedulerRequest request, function<void(const SchedulerResult&)> onComplete)
+    {
+        const int instance = mRouter.route(handle);
+        mSchedulers[instance]->submit(std::move(request), [this, instance, onComplete](const SchedulerResult& result)
+        {
+            mRouter.complete(instance);
+            onComplete(result);
+        });
+    }
+
+    string health(bool keepAlive)
+    {
+        ostringstream out;
+        out << "{\"status\":\"ready\",\"instances\":" << mSchedulers.size() << ",\"images\":" << mImages.size() << ",\"schedulers\":[";
+        for (size_t i = 0; i < mSchedulers.size(); i++)
+            out << (i ? "," : "") << mSchedulers[i]->statsToJson();
+        out << "],\"router\":" << mRouter.statsToJson() << "}";
+        return httpResponse(200, "application/json", out.str(), keepAlive);
+    }
+
+    future<string> encode(const HttpRequest& request)
+    {
+        const bool keepAlive = request.keepAlive;
+        const int encoder = stoi(request.parameter("encoder", "0"));
+        if (encoder < 0 || encoder >= mNumEncoders) return ready(errorResponse(400, "unknown encoder", keepAlive));
+
+        Mat image;
+        const string contentType = toLower(request.header("content-type"));
+        if (contentType.compare(0, 6, "image/") == 0)
+        {
+            image = imdecode(Mat(1, (int)request.body.size(), CV_8UC1, (void*)request.body.data()), IMREAD_COLOR);
+        }
+        else
+        {
+            const int width = stoi(request.header("x-width").empty() ? "0" : request.header("x-width"));
+            const int height = stoi(request.header("x-height").empty() ? "0" : request.header("x-height"));
+            const string format = toLower(request.header("x-format"));
+            const int type = format == "gray" ? CV_8UC1 : format == "bgr" || format.empty() ? CV_8UC3 : -1;
+            if (type >= 0 && width > 0 && height > 0 && request.body.size() == (size_t)width * height * CV_ELEM_SIZE(type))
+                Mat(height, width, type, (void*)request.body.data()).copyTo(image);
+        }
+        if (image.empty()) return ready(errorResponse(400, "undecodable image", keepAlive));
+
+        const uint64_t handle = mImages.add(image, encoder);
+
+        auto response = make_shared<promise<string>>();
+        auto result = response->get_future();
+        SchedulerRequest scheduled;
+        scheduled.image = image;
+        scheduled.imageHash = handle;
+        scheduled.encoder = encoder;
+        submit(handle, std::move(scheduled), [response, handle, image, keepAlive](const SchedulerResult& result)
+        {
+            if (result.status != RequestStatus::Completed)
+            {
+                response->set_value(errorResponse(503, "overloaded", keepAlive));
+                return;
+            }
+            ostringstream out;
+            out << "{\"handle\":\"" << handleToString(handle) << "\",\"width\":" << image.cols << ",\"height\":" << image.rows
+                << ",\"service_ms\":" << result.serviceTime << ",\"wait_ms\":" << result.waitTime << "}";
+            response->set_value(httpResponse(200, "application/json", out.str(), keepAlive));
+        });
+        return result;
+    }
+
+    future<string> decode(const HttpRequest& request)
+    {
+        const bool keepAlive = request.keepAlive;
+        uint64_t handle;
+        Mat image;
+        int encoder;
+        if (!parseHandle(request.parameter("handle"), handle)) return ready(errorResponse(400, "invalid handle", keepAlive));
+        if (!mImages.find(handle, image, encoder)) return ready(errorResponse(404, "unknown handle", keepAlive));
+
+        SchedulerRequest scheduled;
+        size_t offset = 0;
+        const bool isValid = request.query.count("points") ? parsePoints(request.parameter("points"), scheduled.points, scheduled.labels) :
+            readPromptSet(request.body, offset, scheduled.points, scheduled.labels) && offset == request.body.size();
+        if (!isValid) return ready(errorResponse(400, "invalid prompt", keepAlive));
+
+        scheduled.image = image;
+        scheduled.imageHash = handle;
+        scheduled.encoder = encoder;
+        scheduled.priority = Priority::Interactive;
+        if (request.query.count("deadline_ms"))
+            scheduled.deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+                chrono::duration<double, milli>(stod(request.parameter("deadline_ms"))));
+
+        auto response = make_shared<promise<string>>();
+        auto result = response->get_future();
+        submit(handle, std::move(scheduled), [response, keepAlive](const SchedulerResult& result)
+        {
+            if (result.status != RequestStatus::Completed)
+            {
+                response->set_value(errorResponse(503, "dropped for its deadline", keepAlive));
+                return;
+            }
+            ostringstream timing;
+            timing << "X-Service-Ms: " << result.serviceTime << "\r\nX-Wait-Ms: " << result.waitTime << "\r\n";
+            response->set_value(httpResponse(200, "application/x-nanosam-rle", masksToBody({ BitMask::fromLogits(result.mask) }),
+                keepAlive, timing.str()));
+        });
+        return result;
+    }
+
+    future<string> decodeBatch(const HttpRequest& request)
+    {
+        const bool keepAlive = request.keepAlive;
+        uint64_t handle;
+        Mat image;
+        int encoder;
+        if (!parseHandle(request.parameter("handle"), handle)) return ready(errorResponse(400, "invalid handle", keepAlive));
+        if (!mImages.find(handle, image, encoder)) return ready(errorResponse(404, "unknown handle", keepAlive));
+
+        vector<SchedulerRequest> prompts;
+        size_t offset = 0;
+        while (offset < request.body.size())
+        {
+            SchedulerRequest scheduled;
+            if (!readPromptSet(request.body, offset, scheduled.points, scheduled.labels)) return ready(errorResponse(400, "invalid prompt", keepAlive));
+            scheduled.image = image;
+            scheduled.imageHash = handle;
+            scheduled.encoder = encoder;
+            prompts.push_back(std::move(scheduled));
+        }
+        if (prompts.empty()) return ready(errorResponse(400, "no prompts", keepAlive));
+
+        return submitBatch(handle, std::move(prompts), [keepAlive](vector<BitMask>& masks)
+        {
+            return httpResponse(200, "application/x-nanosam-rle", masksToBody(masks), keepAlive);
+        }, keepAlive);
+    }
+
+    // Automatic segmentation: a foreground click per grid cell, then non-maximum suppression
+    future<string> segmentAll(const HttpRequest& request)
+    {
+        const bool keepAlive = request.keepAlive;
+        uint64_t handle;
+        Mat image;
+        int encoder;
+        if (!parseHandle(request.parameter("handle"), handle)) return ready(errorResponse(400, "invalid handle", keepAlive));
+        if (!mImages.find(handle, image, encoder)) return ready(errorResponse(404, "unknown handle", keepAlive));
+
+        const int grid = stoi(request.parameter("grid", "16"));
+        const float iouThreshold = stof(request.parameter("iou", "0.8"));
+        const double minArea = stod(request.parameter("min_area", "0.001")) * image.total();
+        if (grid < 1 || grid > MAX_GRID) return ready(errorResponse(400, "invalid grid", keepAlive));
+
+        vector<SchedulerRequest> prompts;
+        for (int y = 0; y < grid; y++)
+        {
+            for (int x = 0; x < grid; x++)
+            {
+                SchedulerRequest scheduled;
+                scheduled.image = image;
+                scheduled.imageHash = handle;
+                scheduled.encoder = encoder;
+                scheduled.priority = Priority::Batch;
+                scheduled.points = { Point((int)((x + 0.5) * image.cols / grid), (int)((y + 0.5) * image.rows / grid)) };
+                scheduled.labels = { 1.0f };
+                prompts.push_back(std::move(scheduled));
+            }
+        }
+
+        return submitBatch(handle, std::move(prompts), [keepAlive, iouThreshold, minArea](vector<BitMask>& candidates)
+        {
+            // Largest first, so an object wins over the parts some clicks segment on their own
+            sort(candidates.begin(), candidates.end(), [](const BitMask& a, const BitMask& b) { return a.area() > b.area(); });
+
+            vector<BitMask> masks;
+            for (auto& candidate : candidates)
+            {
+                if (candidate.area() < minArea) break;
+                bool isDuplicate = false;
+                for (auto& mask : masks)
+                    isDuplicate = isDuplicate || BitMask::iou(candidate, mask) > iouThreshold;
+                if (!isDuplicate) masks.push_back(std::move(candidate));
+            }
+            return httpResponse(200, "application/x-nanosam-rle", masksToBody(masks), keepAlive,
+                "X-Candidates: " + to_string(candidates.size()) + "\r\n");
+        }, keepAlive);
+    }
+
+    // Masks are thresholded on the scheduler workers as they complete
+    future<string> submitBatch(uint64_t handle, vector<SchedulerRequest> prompts, function<string(vector<BitMask>&)> respond, bool keepAlive)
+    {
+        auto batch = make_shared<MaskBatch>();
+        batch->masks.resize(prompts.size());
+        batch->remaining = prompts.size();
+        auto result = batch->response.get_future();
+
+        for (size_t i = 0; i < prompts.size(); i++)
+        {
+            submit(handle, std::move(prompts[i]), [batch, i, respond, keepAlive](const SchedulerResult& result)
+            {
+                BitMask mask;
+                if (result.status == RequestStatus::Completed) mask = BitMask::fromLogits(result.mask);
+
+                lock_guard<mutex> lock(batch->lock);
+                batch->masks[i] = std::move(mask);
+                batch->isFailed = batch->isFailed || result.status != RequestStatus::Completed;
+                if (--batch->remaining > 0) return;
+
+                batch->response.set_value(batch->isFailed ? errorResponse(503, "overloaded", keepAlive) : respond(batch->masks));
+            });
+        }
+        return result;
+    }
+};
+
+static bool sendAll(Socket socket, const string& data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        const int n = send(socket, data.data() + sent, (int)min<size_t>(data.size() - sent, 1 << 30), SEND_FLAGS);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// True if reading would not block. Polled rather than selected, so descriptors above
+// FD_SETSIZE work.
+static bool hasInput(Socket socket)
+{
+    pollfd readable = {};
+    readable.fd = socket;
+    readable.events = POLLIN;
+    return pollSockets(&readable, 1, 0) > 0;
+}
+
+// Requests already received are submitted before answering any of them, so a pipelined burst
+// runs concurrently. Responses are written in request order.
+static void serveConnection(Socket socket, SegmentationServer& server)
+{
+    string buffer;
+    deque<future<string>> pending;
+    char chunk[64 << 10];
+    bool isOpen = true;
+
+    while (isOpen)
+    {
+        HttpRequest request;
+        const ParseStatus status = parseRequest(buffer, request);
+        if (status == ParseStatus::Complete)
+        {
+            pending.push_back(server.handle(request));
+            if (!request.keepAlive) isOpen = false;
+            continue;
+        }
+        if (status != ParseStatus::Incomplete)
+        {
+            pending.push_back(ready(status == ParseStatus::TooLarge ? errorResponse(413, "body too large", false) :
+                errorResponse(400, "malformed request", false)));
+            break;
+        }
+
+        // Answer what is pending once the client has nothing more queued
+        if (!hasInput(socket))
+        {
+            while (!pending.empty())
+            {
+                if (!sendAll(socket, pending.front().get())) isOpen = false;
+                pending.pop_front();
+            }
+        }
+        if (!isOpen) break;
+
+        const int n = recv(socket, chunk, sizeof(chunk), 0);
+        if (n <= 0) break;
+        buffer.append(chunk, n);
+    }
+
+    // Requests still running complete before the connection goes away
+    while (!pending.empty())
+    {
+        sendAll(socket, pending.front().get());
+        pending.pop_front();
+    }
+    closeSocket(socket);
+}
+
+static void acceptConnections(Socket listener, SegmentationServer& server, bool isTcp)
+{
+    while (true)
+    {
+        Socket socket = accept(listener, nullptr, nullptr);
+        if (socket == INVALID_SOCKET) continue;
+
+        if (isTcp)
+        {
+            int noDelay = 1;
+            setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+        }
+        thread(serveConnection, socket, ref(server)).detach();
+    }
+}
+
+static Socket listenTcp(const string& host, int port)
+{
+    Socket listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) return INVALID_SOCKET;
+
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1 ||
+        ::bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        closeSocket(listener);
+        return INVALID_SOCKET;
+    }
+    return listener;
+}
+
+#ifndef _WIN32
+static Socket listenUnix(const string& path)
+{
+    sockaddr_un address = {};
+    if (path.size() >= sizeof(address.sun_path)) return INVALID_SOCKET;
+
+    Socket listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET) return INVALID_SOCKET;
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (::bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        closeSocket(listener);
+        return INVALID_SOCKET;
+    }
+    return listener;
+}
+#endif
+
+static bool parseArguments(int argc, char** argv, ServerOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        auto value = [&]() { return string(argv[++i]); };
+
+        if (!hasValue) return false;
+        else if (arg == "--port") options.port = stoi(value());
+        else if (arg == "--host") options.host = value();
+#ifndef _WIN32
+        else if (arg == "--unix") options.unixPath = value();
+#endif
+        else if (arg == "--instances") options.instances = stoi(value());
+        else if (arg == "--encoder") options.encoderPath = value();
+        else if (arg == "--decoder") options.decoderPath = value();
+        else if (arg == "--encoder-latency") { if (!LatencyDistribution::parse(value(), options.encoderLatency)) return false; }
+        else if (arg == "--decoder-latency") { if (!LatencyDistribution::parse(value(), options.decoderLatency)) return false; }
+        else if (arg == "--cache") options.cacheCapacity = stoi(value());
+        else if (arg == "--decode-cache") options.decodeCacheCapacity = stoi(value());
+        else if (arg == "--decode-tolerance") options.decodeTolerance = stof(value());
+        else if (arg == "--max-images") options.maxImages = stoi(value());
+        else if (arg == "--load-factor") options.loadFactor = stod(value());
+        else if (arg == "--kernel-profile") options.kernelProfilePath = value();
+        else return false;
+    }
+
+    return options.instances > 0 && options.maxImages > 0 && options.decodeCacheCapacity >= 0 && options.decodeTolerance >= 1 && options.loadFactor >= 1 && options.port >= 0 && options.port < 65536 &&
+        (options.port > 0 || !options.unixPath.empty()) && options.encoderPath.empty() == options.decoderPath.empty();
+}
+
+int main(int argc, char** argv)
+{
+    ServerOptions options;
+    if (!parseArguments(argc, argv, options))
+    {
+        cerr << "Usage: server [--port <n>] [--host <address>] [--unix <path>] [--instances <n>] [--encoder <path> --decoder <path>]" << endl
+            << "              [--encoder-latency <dist>] [--decoder-latency <dist>] [--cache <n>] [--max-images <n>]" << endl
+            << "              [--decode-cache <n>] [--decode-tolerance <px>] [--load-factor <f>] [--kernel-profile <path>]" << endl;
+        return 1;
+    }
+
+#ifdef _WIN32
+    WSADATA data;
+    WSAStartup(MAKEWORD(2, 2), &data);
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    if (!options.kernelProfilePath.empty())
+    {
+        KernelConfig config = Autotuner::loadOrTune(options.kernelProfilePath);
+        cout << "CPU kernels: resize " << resizeKernelName(config.resize) << ", letterbox " << resizeKernelName(config.letterbox)
+            << ", upscale " << upscaleKernelName(config.upscale) << ", " << config.threads << " threads" << endl;
+    }
+
+    // Throws if the models fail to load
+    unique_ptr<SegmentationServer> instances;
+    try
+    {
+        instances.reset(new SegmentationServer(options));
+    }
+    catch (const exception& e)
+    {
+        cerr << "Cannot load the models: " << e.what() << endl;
+        return 1;
+    }
+    SegmentationServer& server = *instances;
+    cout << "Serving " << options.instances << (options.encoderPath.empty() ? " simulated" : "") << " instance(s)" << endl;
+
+    vector<thread> listeners;
+    if (options.port > 0)
+    {
+        Socket listener = listenTcp(options.host, options.port);
+        if (listener == INVALID_SOCKET)
+        {
+            cerr << "Cannot listen on " << options.host << ":" << options.port << endl;
+            return 1;
+        }
+        cout << "Listening on http://" << options.host << ":" << options.port << endl;
+        listeners.emplace_back(acceptConnections, listener, ref(server), true);
+    }
+#ifndef _WIN32
+    if (!options.unixPath.empty())
+    {
+        Socket listener = listenUnix(options.unixPath);
+        if (listener == INVALID_SOCKET)
+        {
+            cerr << "Cannot listen on " << options.unixPath << endl;
+            return 1;
+        }
+        cout << "Listening on " << options.unixPath << endl;
+        listeners.emplace_back(acceptConnections, listener, ref(server), false);
+    }
+#endif
+
+    for (auto& listener : listeners)
+        listener.join();
+    return 0;
+}
@@ -33,11 +33,16 @@ struct PointData {
 };
 
 // Overlay mask on the image
-void overlay(Mat& image, Mat& mask, Scalar color = Scalar(128, 64, 128), float alpha = 0.8f, bool showEdge = true)
+// The blend reuses per-thread scratch images, so only the edge drawing allocates
+void overlay(Mat& image, const Mat& mask, Scalar color = Scalar(128, 64, 128), float alpha = 0.8f, bool showEdge = true)
 {
+    static thread_local Mat ucharMask, background;
+
     // Draw mask
-    Mat ucharMask(image.rows, image.cols, CV_8UC3, color);
-    image.copyTo(ucharMask, mask <= 0);
+    ucharMask.create(image.rows, image.cols, CV_8UC3);
+    ucharMask.setTo(color);
+    compare(mask, 0, background, CMP_LE);
+    image.copyTo(ucharMask, background);
     addWeighted(ucharMask, alpha, image, 1.0 - alpha, 0.0f, image);
 
     // Draw contour edge
@@ -45,7 +50,7 @@ void overlay(Mat& image, Mat& mask, Scalar color = Scalar(128, 64, 128), float a
     {
         vector<vector<Point>> contours;
         vector<Vec4i> hierarchy;
-        findContours(mask <= 0, contours, hierarchy, RETR_TREE, CHAIN_APPROX_NONE);
+        findContours(background, contours, hierarchy, RETR_TREE, CHAIN_APPROX_NONE);
         drawContours(image, contours, -1, Scalar(255, 255, 255), 2);
     }
 }